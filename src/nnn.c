@@ -37,13 +37,23 @@
 #endif
 #if defined(__linux__)
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #define LINUX_INOTIFY
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
 #endif
 #if !defined(__GLIBC__)
 #include <sys/types.h>
 #endif
 #endif
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#ifdef SPAWNHELPER
+#include <sys/socket.h>
+#endif
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__) || defined(__DragonFly__)
@@ -75,12 +85,14 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <fts.h>
 #include <libgen.h>
 #include <limits.h>
 #ifndef NOLC
 #include <locale.h>
 #endif
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #ifndef NORL
@@ -93,7 +105,15 @@
 #else
 #include <regex.h>
 #endif
+#ifdef LIBMAGIC
+#include <magic.h>
+#endif
+#ifdef LIBARCHIVE
+#include <archive.h>
+#include <archive_entry.h>
+#endif
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -172,6 +192,15 @@
 #define PATH_MAX 4096
 #endif
 
+/* A dir fd to look up names in, no read permission needed where supported */
+#if defined(O_PATH)
+#define O_DIRFD (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#elif defined(O_SEARCH)
+#define O_DIRFD (O_SEARCH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define O_DIRFD (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
 #define _ABSSUB(N, M)   (((N) <= (M)) ? ((M) - (N)) : ((N) - (M)))
 #define ELEMENTS(x)     (sizeof(x) / sizeof(*(x)))
 #undef MIN
@@ -214,8 +243,25 @@
 #define DOT_FILTER_LEN  7
 #define ASCII_MAX       128
 #define EXEC_ARGS_MAX   10
-#define LIST_FILES_MAX  (1 << 14) /* Support listing 16K files */
-#define LIST_INPUT_MAX  ((size_t)LIST_FILES_MAX * PATH_MAX)
+#define UTIL_CACHE_MAX  32
+#define DETACHED_MAX    64 /* Launched with F_NOWAIT, not reaped yet */
+#define LIST_CHUNK      (512UL * 1024) /* Ring buffer of list mode input */
+#define LIST_READ_MS    100 /* List mode input read at once */
+#define LIST_STAT_MIN   256 /* Entries in a dir to stat in threads */
+#define PLUG_VERSION    '1' /* Plugin control protocol version */
+#define PLUG_MSG_MAX    (1UL << 20) /* Largest plugin control message */
+#define DAEMON_MAX      4 /* Plugins run as daemons */
+#define PV_HEAD         (64UL * 1024) /* Head of a file read for preview */
+#define PV_LINES        256 /* Lines of a preview */
+#define PV_COLS         256 /* Columns of a preview line */
+#define PV_CACHE        64 /* Previews kept rendered */
+#define PV_POLL_MS      10 /* Check for a finished preview */
+#define PV_WAIT_MS      2000 /* Stop checking, the worker may be stuck */
+#define PV_QUIT_MS      100 /* Wait for the worker at exit */
+#define PV_DIR_NAMES    1024 /* Names sorted in a dir preview */
+#define PV_MIN_COLS     80 /* Too narrow for the preview pane */
+#define GIT_CACHE       4 /* Repos with the index kept in memory */
+#define GIT_IGN_MAX     (1L << 20) /* Largest .gitignore read */
 #define SCROLLOFF       3 /* Leave top 2 lines */
 #define ONSCREEN        (xlines - 4) /* Leave top 2 and bottom 2 lines */
 #define COLOR_256       256
@@ -225,6 +271,12 @@
 #define DBLCLK_INTERVAL_NS (400000000)
 #define XDELAY_INTERVAL_MS (350000) /* 350 ms delay */
 
+/* Plugin daemon events */
+#define DMN_EV_CD    0x01 /* Dir changed */
+#define DMN_EV_HOVER 0x02 /* Hovered file changed */
+#define DMN_EV_SEL   0x04 /* Selection changed */
+#define DMN_EV_ALL   0x07
+
 #ifndef CTX8
 #define CTX_MAX 4
 #else
@@ -323,13 +375,40 @@ typedef struct entry {
 	uid_t uid; /* 4 bytes */
 	gid_t gid; /* 4 bytes */
 #endif
+#ifdef GITSTATUS
+	char git;  /* 1 byte (status letter, '\0' if not in a repo) */
+#endif
 } *pEntry;
 
-/* Selection marker */
+/* Selection index slots, hashed over the paths in the selection buffer */
 typedef struct {
-	char *startpos;
-	size_t len;
-} selmark;
+	ullong_t hash;
+	uint_t off;   /* Offset of the path in pselbuf + 1, 0 if free */
+} selpath_t;
+
+typedef struct {
+	ullong_t hash; /* Of the dir path with a trailing '/' */
+	uint_t count;  /* Selected paths under the dir, 0 if free */
+} seldir_t;
+
+/* Entries selected as a range in a dir, see selrec_add() */
+typedef struct {
+	char *dir;       /* With a trailing '/' */
+	char *names;     /* NUL separated */
+	uint_t *slots;   /* Name offsets + 1 by hash, built on first lookup */
+	size_t dirlen;
+	size_t nameslen;
+	size_t synced;   /* Bytes of names in the selection file */
+	uint_t count;
+	uint_t cap;
+} selrec_t;
+
+/* Generation of the shared selection file last written or read */
+typedef struct {
+	ino_t ino;
+	off_t size;
+	struct timespec mtim;
+} selgen_t;
 
 /* Key-value pairs from env */
 typedef struct {
@@ -357,19 +436,19 @@ typedef struct {
 	uint_t blkorder   : 1;  /* Set to sort by blocks used (disk usage) */
 	uint_t extnorder  : 1;  /* Order by extension */
 	uint_t showhidden : 1;  /* Set to show hidden files */
-	uint_t reserved0  : 1;
+	uint_t listview   : 1;  /* Dir is shown from the list mode tree */
 	uint_t showdetail : 1;  /* Clear to show lesser file info */
 	uint_t ctxactive  : 1;  /* Context active or not */
 	uint_t reverse    : 1;  /* Reverse sort */
 	uint_t version    : 1;  /* Version sort */
-	uint_t reserved1  : 1;
+	uint_t listlast   : 1;  /* Last dir was shown from the list mode tree */
 	/* The following settings are global */
 	uint_t curctx     : 3;  /* Current context number */
 	uint_t prefersel  : 1;  /* Prefer selection over current, if exists */
 	uint_t fileinfo   : 1;  /* Show file information on hover */
 	uint_t nonavopen  : 1;  /* Open file on right arrow or `l` */
 	uint_t autoenter  : 1;  /* auto-enter dir in type-to-nav mode */
-	uint_t reserved2  : 1;
+	uint_t gitstatus  : 1;  /* Show git status in detail mode */
 	uint_t useeditor  : 1;  /* Use VISUAL to open text files */
 	uint_t reserved3  : 3;
 	uint_t regex      : 1;  /* Use regex filters */
@@ -395,7 +474,10 @@ typedef struct {
 	uint_t oldcolor   : 1;  /* Use older colorscheme */
 	uint_t picked     : 1;  /* Plugin has picked files */
 	uint_t picker     : 1;  /* Write selection to user-specified file */
+	uint_t plugfltr   : 1;  /* Plugin has set a filter */
+	uint_t plugrfsh   : 1;  /* Plugin has asked for a refresh */
 	uint_t pluginit   : 1;  /* Plugin framework initialized */
+	uint_t preview    : 1;  /* Show the preview pane */
 	uint_t prstssn    : 1;  /* Persistent session */
 	uint_t rangesel   : 1;  /* Range selection on */
 	uint_t runctx     : 3;  /* The context in which plugin is to be run */
@@ -407,7 +489,8 @@ typedef struct {
 	uint_t usebsdtar  : 1;  /* Use bsdtar as default archive utility */
 	uint_t xprompt    : 1;  /* Use native prompt instead of readline prompt */
 	uint_t showlines  : 1;  /* Show line numbers */
-	uint_t reserved   : 5;  /* Adjust when adding/removing a field */
+	uint_t extcpmv    : 1;  /* Use external cp, mv */
+	uint_t fsinfo     : 1;  /* Show free and used space */
 } runstate;
 
 /* Contexts or workspaces */
@@ -448,8 +531,24 @@ static int nselected;
 static int fifofd = -1;
 #endif
 static int devnullfd = -1;
+static pid_t detached[DETACHED_MAX];
+static uint_t ndetached;
+#ifdef SPAWNHELPER
+static int helperfd = -1;
+#endif
 static time_t gtimesecs;
 static uint_t idletimeout, selbufpos, selbuflen;
+static uint_t nselpaths, selpathcap, nseldirs, seldircap;
+static selpath_t *selpaths;
+static seldir_t *seldirs;
+static bool selindir; /* Set by scanselforpath() */
+static uint_t selsynced; /* Bytes of pselbuf in the selection file */
+static uint_t seldropped; /* Bytes of SEL_DROPPED paths in pselbuf */
+static bool selinfile; /* The selection file is the one last written or read */
+static selgen_t selgen;
+static selrec_t *selrecs;
+static uint_t nselrecs;
+static int selrec = -1; /* Record of the dir passed to scanselforpath() */
 static ushort_t xlines, xcols;
 static ushort_t idle;
 static uchar_t maxbm, maxplug, maxorder;
@@ -468,10 +567,9 @@ static char *home;
 static char *initpath;
 static char *cfgpath;
 static char *selpath;
-static char *listpath;
-static char *listroot;
+static char *listroot; /* Set if list mode paths are loaded */
 static char *plgpath;
-static char *pnamebuf, *pselbuf, *findselpos;
+static char *pnamebuf, *pselbuf;
 static char *mark;
 static char *trashcmd;
 #ifndef NOX11
@@ -479,6 +577,11 @@ static char hostname[_POSIX_HOST_NAME_MAX + 1];
 #endif
 #ifndef NOFIFO
 static char *fifopath;
+static long long fifo_due = -1; /* When to send a held hover notification */
+static ullong_t fifo_evid; /* Sequence number of the last notification */
+static uint_t fifo_ms; /* NNN_FIFO_MS, hover notifications wait for the cursor to rest */
+static bool fifo_seq; /* NNN_FIFO_SEQ, notifications are tagged with number and type */
+static bool fifo_retry; /* The pipe was full, resend the hover when idle */
 #endif
 static ullong_t *ihashbmp;
 static struct entry *pdents;
@@ -522,6 +625,356 @@ typedef struct {
 
 static thread_data *core_data;
 
+#ifdef __APPLE__
+#define FOP_ATIM(sb) ((sb)->st_atimespec)
+#define FOP_MTIM(sb) ((sb)->st_mtimespec)
+#else
+#define FOP_ATIM(sb) ((sb)->st_atim)
+#define FOP_MTIM(sb) ((sb)->st_mtim)
+#endif
+
+#ifndef NOFOPS
+/* Native copy/move/remove */
+#define FOP_WORKERS     (4)  /* Default worker threads per job, see NNN_WORKERS */
+#define FOP_WORKERS_MAX (64)
+#define FOP_QUEUE_MAX   (256)
+#define FOP_BUFSIZ      (1 << 17)
+#define FOP_CHUNK       (1 << 23) /* Progress and cancel granularity for in-kernel copies */
+#define FOP_ERRLOG_MAX  (1 << 14)
+#define FOP_RM_BATCH    (64) /* Removed entries counted locally before updating the job */
+#define FOP_XARC_CHUNKS (64) /* Extracted data blocks queued for the writers */
+#define FOP_REFRESH_MS  (200)
+#define FOP_JOBS_MAX    (8) /* Listed as 1-8 */
+#define FOP_DEV_JOBS    (1) /* Running jobs per device, the rest are queued */
+
+/* Job types */
+#define FOP_CP  0
+#define FOP_MV  1
+#define FOP_CMD 2
+#define FOP_RM  3
+#define FOP_XARC 4 /* Extract an archive (libarchive) */
+
+/* Job states */
+#define FOP_QUEUED  0
+#define FOP_RUNNING 1
+#define FOP_DONE    2 /* Finished with errors, kept till viewed */
+
+
+typedef struct {
+	char *src;
+	char *dst;
+	struct stat sb;
+	uint_t root; /* Index of the selected path it belongs to */
+} fop_task;
+
+typedef struct {
+	char *path;
+	struct stat sb;
+} fop_dir;
+
+/* A dir being emptied, removed when its last subdir is gone */
+typedef struct fop_rmdir {
+	struct fop_rmdir *parent;
+	struct fop_rmdir *next;   /* Work stack link */
+	uint_t pending;           /* Self + subdirs not removed yet */
+	uint_t root;
+	int fd;                   /* Open from the scan till the subdirs are gone */
+	bool failed;              /* Something in it remains, leave it */
+	char name[];              /* Selected path, else name in the parent */
+} fop_rmdir;
+
+typedef struct {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+	fop_task queue[FOP_QUEUE_MAX];
+	uint_t head;
+	uint_t count;
+	char *srcs;      /* NUL separated selection */
+	size_t srcslen;
+	uint_t nroots;
+	bool *rootdone;  /* Renamed, skipped or invalid */
+	bool *rootfail;
+	fop_dir *dirs;
+	size_t ndirs;
+	size_t dirslen;
+	fop_rmdir *rmstack;
+	uint_t rmbusy;   /* Workers scanning a dir */
+	ullong_t totbytes;
+	ullong_t totfiles;
+	ullong_t bytes;
+	ullong_t files;
+	ullong_t skipped;
+	ullong_t errors;
+	ullong_t removed;
+	time_t start;
+	time_t end;
+	dev_t dev;       /* Device the job is queued on */
+	pid_t pid;
+	char *cmd;       /* Command line split in argv */
+	char *arg;
+	char *argv[EXEC_ARGS_MAX];
+	size_t errlen;
+	char errlog[FOP_ERRLOG_MAX];
+	char dst[PATH_MAX];
+	char name[8];
+	uchar_t op;
+	uchar_t state;
+	bool srcdev;     /* Queue on the device of the selection, not dst */
+	bool overwrite;
+	volatile bool scanned;
+	volatile bool walked;
+	volatile bool cancel;
+	volatile bool done;
+} fop_job;
+
+static fop_job *fop_jobs[FOP_JOBS_MAX];
+static int fop_njobs;
+static uint_t fop_nworkers = FOP_WORKERS;
+#endif
+
+/* Disk usage breakdown by extension and age, one table per core + the listed dir */
+#define DU_AGES      4
+#define DU_EXT_LEN   16
+#define DU_EXT_SLOTS 256 /* Must be a power of 2 */
+#define DU_EXT_PROBE 16
+
+typedef struct {
+	char ext[DU_EXT_LEN];
+	ullong_t files;
+	blkcnt_t blocks;
+} du_ext;
+
+typedef struct {
+	ullong_t files[DU_AGES];
+	blkcnt_t blocks[DU_AGES];
+	du_ext noext;
+	du_ext other;
+	du_ext ext[DU_EXT_SLOTS];
+} du_brk;
+
+static du_brk *core_brk;
+
+/* File type descriptions */
+#define FTYPE_SLOTS    1024 /* Must be a power of 2 */
+#define FTYPE_LEN      128
+#define FTYPE_PREFETCH 6
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	char desc[FTYPE_LEN];
+} ftype_ent;
+
+static ftype_ent *ftypes;
+static pthread_mutex_t ftype_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ftype_cond = PTHREAD_COND_INITIALIZER;
+static char ftype_queue[FTYPE_PREFETCH][PATH_MAX];
+static int ftype_count, ftype_next;
+
+/* Opener rules */
+#define OPEN_EXT_BITS  8   /* 2^8 = 256 slots */
+#define OPEN_EXT_MAX   192 /* Keep the load factor under 75% */
+#define OPEN_EXT_LEN   16
+#define OPEN_MIME_LEN  64
+#define OPEN_RULES_MAX 64
+
+typedef struct {
+	char ext[OPEN_EXT_LEN]; /* Without the '.', free slot if empty */
+	uchar_t rule;
+} open_ext;
+
+typedef struct {
+	char mime[OPEN_MIME_LEN];
+	uchar_t len;
+	uchar_t rule;
+	bool prefix; /* Pattern ends with '/' or a star */
+} open_mime;
+
+typedef struct {
+	char *cmd;
+	ushort_t flag;
+} open_rule;
+
+static open_ext open_exts[1u << OPEN_EXT_BITS];
+static open_mime open_mimes[OPEN_RULES_MAX];
+static open_rule open_rules[OPEN_RULES_MAX];
+static uchar_t nopen_exts, nopen_mimes, nopen_rules;
+
+/* Pending mounts */
+#define MNT_JOBS_MAX 4
+#define MNT_TIMEOUT  30 /* Seconds */
+
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	bool mounted;
+	bool done;
+	bool orphan; /* The job ended, the worker frees it */
+	char path[PATH_MAX];
+} mnt_probe;
+
+typedef struct {
+	pid_t pid;   /* 0 once the mount command exits */
+	time_t start;
+	dev_t dev;   /* The empty mountpoint, to tell when it's mounted over */
+	ino_t ino;
+	mnt_probe *probe; /* stat(2) in flight, a dead mount can hang it */
+	char path[PATH_MAX]; /* Free slot if empty */
+} mnt_job;
+
+static mnt_job mnt_jobs[MNT_JOBS_MAX];
+static int mnt_njobs;
+static const char *mnt_err;
+static pthread_mutex_t mnt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Watchdog for calls that can hang on stale mounts */
+#define WD_TIMEOUT_MS 1000
+#define WD_POLL_MS    100
+#define WD_BACKOFF    30 /* Seconds to fail fast under a path the user backed out of */
+#define WD_SLOW_MAX   8
+
+typedef struct {
+	int ret;
+	int err;
+	bool done;
+	bool orphan; /* Caller gave up, the worker frees it */
+	char path[PATH_MAX];
+} wd_call;
+
+typedef struct {
+	time_t since;
+	char path[PATH_MAX]; /* Free slot if empty */
+} wd_slow;
+
+static wd_slow wd_slows[WD_SLOW_MAX];
+static char wd_cwd[PATH_MAX]; /* Last dir entered */
+static pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wd_cond = PTHREAD_COND_INITIALIZER;
+
+/* Filesystem stats */
+#define FS_STATS_MAX 8
+#define FS_TTL       5  /* Seconds */
+#define FS_WAIT_MS   50 /* Wait for the first stats of a path */
+
+typedef struct {
+	dev_t dev;
+	time_t stamp; /* 0 until fetched */
+	bool busy;    /* A refresh is running */
+	size_t vals[VFS_SIZE + 1];
+	char path[PATH_MAX]; /* Free slot if empty */
+} fs_stat;
+
+static fs_stat fs_stats[FS_STATS_MAX];
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fs_cond = PTHREAD_COND_INITIALIZER;
+
+/* Archive member index */
+#define ARC_CACHE_MAX   4
+#define ARC_ENT_INCR    4096
+#define ARC_BUFSIZ      (1 << 16)
+#define ARC_PREVIEW_MAX (16 << 20) /* Largest member copied out for previewers */
+
+/* Member flags */
+#define ARC_IMPLICIT 0x01 /* Parent dir not archived on its own */
+#define ARC_HARDLINK 0x02
+#define ARC_LINK     0x04 /* Link target in the name pool */
+#define ARC_PACKED   0x08 /* Compressed, streamed by libarchive or unzip */
+#define ARC_CRYPT    0x10 /* Encrypted or sparse, not readable */
+
+/* Index formats */
+#define ARC_TAR 0
+#define ARC_ZIP 1
+#define ARC_LA  2
+
+typedef struct {
+	size_t name;     /* Offset of the member path in the name pool */
+	size_t link;
+	off_t off;       /* Data (tar), local header (zip) or member number (libarchive) */
+	off_t size;
+	off_t csize;     /* Size in the archive */
+	time_t mtime;
+	mode_t mode;
+#ifndef NOUG
+	uid_t uid;
+	gid_t gid;
+#endif
+	ushort_t dlen;   /* Length of the parent dir in the path, 0 at the top */
+	ushort_t len;
+	uchar_t flags;
+} arc_ent;
+
+typedef struct {
+	char path[PATH_MAX];
+	size_t plen;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	time_t used;
+	arc_ent *ents;
+	uint_t nents;
+	uint_t entslen;
+	char *names;
+	size_t nameslen;
+	size_t namescap;
+	uchar_t fmt;
+} arc_index;
+
+typedef struct {
+	arc_index *arc;
+	int fd;
+#ifdef LIBARCHIVE
+	struct archive *a;
+#endif
+} arc_reader;
+
+#define LIST_INPUT 0x01 /* The path was in the input */
+
+/* List mode path component */
+typedef struct {
+	size_t name;   /* Offset of the NUL-terminated name in the name pool */
+	uint_t parent;
+	uint_t child;  /* First child + 1, 0 if none */
+	uint_t next;   /* Next sibling + 1, 0 if none */
+	uchar_t len;
+	uchar_t flags;
+} list_node;
+
+/* Prefix tree of the list mode paths, nodes[0] is / */
+typedef struct {
+	list_node *nodes;
+	uint_t *slots;   /* Node + 1 by (parent, name) hash */
+	char *names;
+	size_t nameslen;
+	size_t namescap;
+	uint_t nnodes;
+	uint_t cap;
+	uint_t nslots;
+	uint_t npaths;   /* Input paths, once each */
+} list_tree;
+
+/* List mode input still being read, see list_readchunk() */
+typedef struct {
+	char *buf;       /* Ring of LIST_CHUNK bytes */
+	size_t head;     /* Start of the partial path */
+	size_t len;      /* Bytes from head not added yet */
+	int fd;
+	bool skip;       /* Drop the bytes up to the next NUL */
+	char cwd[PATH_MAX];
+} list_reader;
+
+typedef struct {
+	struct entry *ents;
+	int n;
+	int fd;
+} list_stat_t;
+
+static list_tree g_list;
+static list_reader g_listrd = {.fd = -1};
+
 /* Retain old signal handlers */
 static struct sigaction oldsighup;
 static struct sigaction oldsigtstp;
@@ -539,6 +992,9 @@ alignas(max_align_t) static char g_tmpfpath[TMP_LEN_MAX];
 /* Buffer to store plugins control pipe location */
 alignas(max_align_t) static char g_pipepath[TMP_LEN_MAX];
 
+/* Buffer to store plugins reply pipe location */
+alignas(max_align_t) static char g_replypath[TMP_LEN_MAX];
+
 /* Non-persistent runtime states */
 static runstate g_state;
 
@@ -626,41 +1082,44 @@ static char * const utils[] = {
 #define MSG_SSN_NAME     6
 #define MSG_CP_MV_AS     7
 #define MSG_CUR_SEL_OPTS 8
-#define MSG_FILE_LIMIT   9
-#define MSG_SIZE_LIMIT   10
-#define MSG_NEW_OPTS     11
-#define MSG_CLI_MODE     12
-#define MSG_OVERWRITE    13
-#define MSG_SSN_OPTS     14
-#define MSG_QUIT_ALL     15
-#define MSG_HOSTNAME     16
-#define MSG_ARCHIVE_NAME 17
-#define MSG_OPEN_WITH    18
-#define MSG_NEW_PATH     19
-#define MSG_LINK_PREFIX  20
-#define MSG_COPY_NAME    21
-#define MSG_ENTER        22
-#define MSG_SEL_MISSING  23
-#define MSG_ACCESS       24
-#define MSG_EMPTY_FILE   25
-#define MSG_UNSUPPORTED  26
-#define MSG_NOT_SET      27
-#define MSG_EXISTS       28
-#define MSG_FEW_COLUMNS  29
-#define MSG_REMOTE_OPTS  30
-#define MSG_RCLONE_DELAY 31
-#define MSG_APP_NAME     32
-#define MSG_ARCHIVE_OPTS 33
-#define MSG_KEYS         34
-#define MSG_INVALID_REG  35
-#define MSG_ORDER        36
-#define MSG_LAZY         37
-#define MSG_FIRST        38
-#define MSG_RM_TMP       39
-#define MSG_INVALID_KEY  40
-#define MSG_NOCHANGE     41
-#define MSG_DIR_CHANGED  42
-#define MSG_BM_NAME      43
+#define MSG_NEW_OPTS     9
+#define MSG_CLI_MODE     10
+#define MSG_OVERWRITE    11
+#define MSG_SSN_OPTS     12
+#define MSG_QUIT_ALL     13
+#define MSG_HOSTNAME     14
+#define MSG_ARCHIVE_NAME 15
+#define MSG_OPEN_WITH    16
+#define MSG_NEW_PATH     17
+#define MSG_LINK_PREFIX  18
+#define MSG_COPY_NAME    19
+#define MSG_ENTER        20
+#define MSG_SEL_MISSING  21
+#define MSG_ACCESS       22
+#define MSG_EMPTY_FILE   23
+#define MSG_UNSUPPORTED  24
+#define MSG_NOT_SET      25
+#define MSG_EXISTS       26
+#define MSG_FEW_COLUMNS  27
+#define MSG_REMOTE_OPTS  28
+#define MSG_MOUNTING     29
+#define MSG_APP_NAME     30
+#define MSG_ARCHIVE_OPTS 31
+#define MSG_KEYS         32
+#define MSG_INVALID_REG  33
+#define MSG_ORDER        34
+#define MSG_LAZY         35
+#define MSG_FIRST        36
+#define MSG_RM_TMP       37
+#define MSG_INVALID_KEY  38
+#define MSG_NOCHANGE     39
+#define MSG_DIR_CHANGED  40
+#define MSG_BM_NAME      41
+#define MSG_DU_OFF       42
+#define MSG_NO_JOBS      43
+#define MSG_JOB_OPTS     44
+#define MSG_JOBS_QUIT    45
+#define MSG_MNT_TIMEOUT  46
 
 static const char * const messages[] = {
 	"",
@@ -672,8 +1131,6 @@ static const char * const messages[] = {
 	"session name: ",
 	"'c'p/'m'v as?",
 	"'c'urrent/'s'el?",
-	"file limit exceeded",
-	"size limit exceeded",
 	"['f'ile]/'d'ir/'s'ym/'h'ard?",
 	"['g'ui]/'c'li?",
 	"overwrite?",
@@ -694,7 +1151,7 @@ static const char * const messages[] = {
 	"entry exists",
 	"too few cols!",
 	"'s'shfs/'r'clone?",
-	"refresh if slow",
+	"mounting, 'u' cancels",
 	"app: ",
 	"['l's]/'o'pen/e'x'tract/'m'nt?",
 	"keys:",
@@ -707,6 +1164,11 @@ static const char * const messages[] = {
 	"unchanged",
 	"dir changed, range sel off",
 	"name: ",
+	"du mode off",
+	"no jobs",
+	"job # to cancel/dismiss: ",
+	"jobs running! quit?",
+	"mount timed out",
 };
 
 /* Supported configuration environment variables */
@@ -724,6 +1186,9 @@ static const char * const messages[] = {
 #define NNN_ORDER   11
 #define NNN_HELP    12
 #define NNN_TRASH   13
+#define NNN_WORKERS 14
+#define NNN_REPLY   15
+#define NNN_DAEMON  16
 
 static const char * const env_cfg[] = {
 	"NNN_OPTS",
@@ -740,6 +1205,9 @@ static const char * const env_cfg[] = {
 	"NNN_ORDER",
 	"NNN_HELP",
 	"NNN_TRASH",
+	"NNN_WORKERS",
+	"NNN_REPLY",
+	"NNN_DAEMON",
 };
 
 /* Required environment variables */
@@ -787,15 +1255,13 @@ static const char * const toks[] = {
 #define P_CPMVFMT 0
 #define P_CPMVRNM 1
 #define P_ARCHIVE 2
-#define P_REPLACE 3
-#define P_ARCHIVE_CMD 4
+#define P_ARCHIVE_CMD 3
 
 static const char * const patterns[] = {
 	SED" -i 's|^\\(\\(.*/\\)\\(.*\\)$\\)|#\\1\\n\\3|' %s",
 	SED" 's|^\\([^#/][^/]\\?.*\\)$|%s/\\1|;s|^#\\(/.*\\)$|\\1|' "
 		"%s | tr '\\n' '\\0' | xargs -0 -n2 sh -c '%s \"$0\" \"$@\" < /dev/tty'",
 	"\\.(bz|bz2|gz|tar|taz|tbz|tbz2|tgz|z|zip)$", /* Basic formats that don't need external tools */
-	SED" -i 's|^%s\\(.*\\)$|%s\\1|' %s",
 	"xargs -0 %s %s < '%s'",
 };
 
@@ -891,11 +1357,25 @@ static void redraw(char *path);
 static int spawn(char *file, char *arg1, char *arg2, char *arg3, ushort_t flag);
 static void move_cursor(int target, int ignore_scrolloff);
 static char *load_input(int fd, const char *path);
+static bool list_inpath(const char *str, size_t len);
+static bool list_setroot(void);
+static void list_free(void);
+static bool list_isdir(const char *path);
+static bool list_poll(void);
+static void daemon_event(uchar_t ev);
+static bool daemon_poll(void);
 static int set_sort_flags(int r);
 static void statusbar(char *path);
+static char *coolsize(off_t size);
+#ifndef NOFOPS
+static fop_job *fop_init(const char *path, uchar_t op, const char *name, const char *src);
+static void fop_fgrun(fop_job *job);
+#endif
 static bool get_output(char *file, char *arg1, char *arg2, int fdout, bool page);
 #ifndef NOFIFO
 static void notify_fifo(bool force);
+static void fifo_hover(void);
+static int fifo_wait(void);
 #endif
 
 /* Functions */
@@ -1179,9 +1659,67 @@ static char *getgrname(gid_t gid)
 }
 #endif
 
-static inline bool getutil(char *util)
+/* Executable in PATH (or at the path given) */
+static bool findutil(const char *util, size_t len)
+{
+	const char *dir = getenv("PATH"), *end;
+	char path[PATH_MAX];
+	struct stat sb;
+
+	if (memchr(util, '/', len)) {
+		xstrsncpy(path, util, MIN(len + 1, PATH_MAX));
+		return stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && access(path, X_OK) == 0;
+	}
+
+	for (; dir; dir = *end ? end + 1 : NULL) {
+		end = strchr(dir, ':');
+		if (!end)
+			end = dir + xstrlen(dir);
+
+		/* An empty entry is the current dir */
+		if (snprintf(path, PATH_MAX, "%.*s%s%.*s", (int)(end - dir), dir, (end == dir) ? "./" : "/",
+			     (int)len, util) < PATH_MAX
+		    && stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && access(path, X_OK) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Lookups are cached till PATH changes */
+static bool getutil(const char *util)
 {
-	return spawn("which", util, NULL, NULL, F_NORMAL | F_NOTRACE) == 0;
+	static struct {
+		char *name;
+		bool found;
+	} cache[UTIL_CACHE_MAX];
+	static uint_t count;
+	static char *cachedpath;
+	const char *path = getenv("PATH");
+	size_t len = strcspn(util, " \t");
+	uint_t i;
+	bool found;
+
+	if (!path || !cachedpath || strcmp(cachedpath, path)) {
+		while (count)
+			free(cache[--count].name);
+		free(cachedpath);
+		cachedpath = path ? xstrdup(path) : NULL;
+	}
+
+	for (i = 0; i < count; ++i)
+		if (!strncmp(cache[i].name, util, len) && !cache[i].name[len])
+			return cache[i].found;
+
+	if (count == UTIL_CACHE_MAX) /* Recycle the last slot */
+		free(cache[--count].name);
+
+	found = findutil(util, len);
+	cache[count].name = strndup(util, len);
+	if (cache[count].name)
+		cache[count++].found = found;
+
+	return found;
 }
 
 static inline bool tilde_is_home(const char *s)
@@ -1217,49 +1755,6 @@ static size_t mkpath(const char *dir, const char *name, char *out)
 	return (xstrsncpy(out + len, name, PATH_MAX - len) + len);
 }
 
-/* Assumes both the paths passed are directories */
-static char *common_prefix(const char *path, char *prefix)
-{
-	const char *x = path, *y = prefix;
-	char *sep;
-
-	if (!path || !*path || !prefix)
-		return NULL;
-
-	if (!*prefix) {
-		xstrsncpy(prefix, path, PATH_MAX);
-		return prefix;
-	}
-
-	while (*x && *y && (*x == *y))
-		++x, ++y;
-
-	/* Strings are same */
-	if (!*x && !*y)
-		return prefix;
-
-	/* Path is shorter */
-	if (!*x && *y == '/') {
-		xstrsncpy(prefix, path, y - path);
-		return prefix;
-	}
-
-	/* Prefix is shorter */
-	if (!*y && *x == '/')
-		return prefix;
-
-	/* Shorten prefix */
-	prefix[y - prefix] = '\0';
-
-	sep = xmemrchr((uchar_t *)prefix, '/', y - prefix);
-	if (sep != prefix)
-		*sep = '\0';
-	else /* Just '/' */
-		prefix[1] = '\0';
-
-	return prefix;
-}
-
 /*
  * The library function realpath() resolves symlinks.
  * If there's a symlink in file list we want to show the symlink not what it's points to.
@@ -1562,16 +2057,21 @@ static bool isselfileempty(void)
 	return (stat(selpath, &sb) == -1) || (!sb.st_size);
 }
 
+static inline bool selbufempty(void)
+{
+	return !selbufpos && !nselrecs;
+}
+
 static int get_cur_or_sel(void)
 {
-	bool sel = (selbufpos || !isselfileempty());
+	bool sel = (!selbufempty() || !isselfileempty());
 
 	/* Check both local buffer and selection file for external selection */
 	if (sel && ndents) {
 		/* If selection is preferred and we have a local selection, return selection.
 		 * Always show the prompt in case of an external selection.
 		 */
-		if (cfg.prefersel && selbufpos)
+		if (cfg.prefersel && !selbufempty())
 			return 's';
 
 		int choice = get_input(messages[MSG_CUR_SEL_OPTS]);
@@ -1643,508 +2143,1054 @@ static char confirm_force(bool selection, bool use_trash)
 	return (use_trash ? '\0' : 'i'); /* interactive for rm */
 }
 
-/* Writes buflen char(s) from buf to a file */
-static void writesel(const char *buf, const size_t buflen)
-{
-	if (!selpath)
-		return;
-
-	int fd = open(selpath, O_CREAT | O_WRONLY | O_TRUNC, S_IWUSR | S_IRUSR);
-
-	if (fd != -1) {
-		if (write(fd, buf, buflen) != (ssize_t)buflen)
-			printwarn(NULL);
-		close(fd);
-	} else
-		printwarn(NULL);
-}
+/*
+ * The selection buffer is indexed by two open addressing tables: the
+ * paths, to find an entry in O(1), and every ancestor dir of the paths
+ * with a count, to tell if a dir has anything selected under it.
+ */
+#define SEL_HASH_INIT 0xcbf29ce484222325ULL
+#define SEL_RANGE_MIN 64 /* Entries in a range kept as a record */
+#define SEL_DROPPED   '\1' /* Replaces the leading '/' of paths to drop */
 
-static void appendfpath(const char *path, const size_t len)
+static inline ullong_t selhash(ullong_t hash, const char *str, size_t len)
 {
-	if ((selbufpos >= selbuflen) || ((len + 3) > (selbuflen - selbufpos))) {
-		selbuflen += PATH_MAX;
-		pselbuf = xrealloc(pselbuf, selbuflen);
-		if (!pselbuf)
-			errexit();
+	while (len--) {
+		hash ^= (uchar_t)*str++;
+		hash *= 0x100000001b3ULL; /* FNV-1a */
 	}
 
-	selbufpos += xstrsncpy(pselbuf + selbufpos, path, len);
+	return hash;
 }
 
-static void selbufrealloc(const size_t alloclen)
+static bool selidx_grow(void **table, uint_t *cap, uint_t n, size_t size, bool dirs)
 {
-	if ((selbufpos + alloclen) > selbuflen) {
-		selbuflen = ALIGN_UP(selbufpos + alloclen, PATH_MAX);
-		pselbuf = xrealloc(pselbuf, selbuflen);
-		if (!pselbuf)
-			errexit();
+	uint_t newcap = *cap ? *cap << 1 : 256, i, k;
+	char *newtable;
+
+	if (*cap && (n << 1) < *cap)
+		return TRUE;
+
+	newtable = calloc(newcap, size);
+	if (!newtable)
+		return FALSE;
+
+	/* Rehash the used slots, the hashes are stored */
+	for (i = 0; i < *cap; ++i) {
+		if (dirs ? !seldirs[i].count : !selpaths[i].off)
+			continue;
+		k = (uint_t)(dirs ? seldirs[i].hash : selpaths[i].hash);
+		for (k &= newcap - 1; dirs ? ((seldir_t *)newtable)[k].count
+					   : ((selpath_t *)newtable)[k].off; k = (k + 1) & (newcap - 1));
+		memcpy(newtable + (size_t)k * size, dirs ? (void *)&seldirs[i] : (void *)&selpaths[i], size);
 	}
+
+	free(*table);
+	*table = newtable;
+	*cap = newcap;
+	return TRUE;
 }
 
-/* Write selected file paths to fd, linefeed separated */
-static size_t seltofile(int fd, uint_t *pcount, const char *separator)
+/* Linear probing removal, shifts back the slots that probed past i */
+#define SELIDX_DEL(table, cap, i, used) do { \
+	uint_t j_ = (i), k_, m_ = (cap) - 1; \
+	while (TRUE) { \
+		j_ = (j_ + 1) & m_; \
+		if (!(table)[j_].used) \
+			break; \
+		k_ = (uint_t)(table)[j_].hash & m_; \
+		if ((i) <= j_ ? ((i) < k_ && k_ <= j_) : ((i) < k_ || k_ <= j_)) \
+			continue; \
+		(table)[i] = (table)[j_]; \
+		(i) = j_; \
+	} \
+	(table)[i].used = 0; \
+} while (0)
+
+static int seldir_find(ullong_t hash)
 {
-	uint_t lastpos, count = 0;
-	char *pbuf = pselbuf;
-	size_t pos = 0;
-	ssize_t len, prefixlen = 0, initlen = 0;
-
-	if (pcount)
-		*pcount = 0;
+	uint_t k;
 
-	if (!selbufpos)
-		return 0;
+	if (!nseldirs)
+		return -1;
 
-	lastpos = selbufpos - 1;
+	for (k = (uint_t)hash & (seldircap - 1); seldirs[k].count; k = (k + 1) & (seldircap - 1))
+		if (seldirs[k].hash == hash)
+			return (int)k;
 
-	if (listpath) {
-		prefixlen = (ssize_t)xstrlen(listroot);
-		initlen = (ssize_t)xstrlen(listpath);
-	}
+	return -1;
+}
 
-	while (pos <= lastpos) {
-		DPRINTF_S(pbuf);
-		len = (ssize_t)xstrlen(pbuf);
+/* Adds delta paths under each dir ending with a '/' in path[0..len) */
+static void seldir_update(const char *path, size_t len, int delta)
+{
+	ullong_t hash = SEL_HASH_INIT;
+	uint_t k;
+	int i;
 
-		if (!listpath || !is_prefix(pbuf, listpath, initlen)) {
-			if (write(fd, pbuf, len) != len)
-				return pos;
-		} else {
-			if (write(fd, listroot, prefixlen) != prefixlen)
-				return pos;
-			if (write(fd, pbuf + initlen, len - initlen) != (len - initlen))
-				return pos;
-		}
+	for (size_t n = 0; n < len; ++n) {
+		hash = selhash(hash, path + n, 1);
+		if (path[n] != '/')
+			continue;
 
-		pos += len;
-		if (pos <= lastpos) {
-			if (write(fd, separator, 1) != 1)
-				return pos;
-			pbuf += len + 1;
+		i = seldir_find(hash);
+		if (i >= 0) {
+			seldirs[i].count += delta;
+			if (!seldirs[i].count) {
+				k = (uint_t)i;
+				SELIDX_DEL(seldirs, seldircap, k, count);
+				--nseldirs;
+			}
+			continue;
 		}
-		++pos;
-		++count;
-	}
 
-	if (pcount)
-		*pcount = count;
+		if (delta < 0)
+			continue;
 
-	return pos;
+		if (!selidx_grow((void **)&seldirs, &seldircap, nseldirs, sizeof(seldir_t), TRUE))
+			errexit();
+		for (k = (uint_t)hash & (seldircap - 1); seldirs[k].count; k = (k + 1) & (seldircap - 1));
+		seldirs[k].hash = hash;
+		seldirs[k].count = delta;
+		++nseldirs;
+	}
 }
 
-/* List selection from selection file (another instance) */
-static bool listselfile(void)
+/* Slot of path (len includes the NUL) in the selection, -1 if missing */
+static int selidx_find(const char *path, size_t len)
 {
-	if (isselfileempty())
-		return FALSE;
+	ullong_t hash;
+	uint_t k;
 
-	snprintf(g_buf, CMD_LEN_MAX, "tr \'\\0\' \'\\n\' < %s", selpath);
-	spawn(utils[UTIL_SH_EXEC], g_buf, NULL, NULL, F_CLI | F_CONFIRM);
+	if (!nselpaths)
+		return -1;
 
-	return TRUE;
+	hash = selhash(SEL_HASH_INIT, path, len - 1);
+	for (k = (uint_t)hash & (selpathcap - 1); selpaths[k].off; k = (k + 1) & (selpathcap - 1))
+		if (selpaths[k].hash == hash && !memcmp(pselbuf + selpaths[k].off - 1, path, len))
+			return (int)k;
+
+	return -1;
 }
 
-/* Reset selection indicators */
-static void resetselind(void)
+static void selidx_add(uint_t off)
 {
-	for (int r = 0; r < ndents; ++r)
-		if (pdents[r].flags & FILE_SELECTED)
-			pdents[r].flags &= ~FILE_SELECTED;
+	const char *path = pselbuf + off;
+	ullong_t hash;
+	uint_t k;
+
+	if (*path != '/') /* Only absolute paths are looked up */
+		return;
+
+	if (!selidx_grow((void **)&selpaths, &selpathcap, nselpaths, sizeof(selpath_t), FALSE))
+		errexit();
+
+	hash = selhash(SEL_HASH_INIT, path, xstrlen(path));
+	for (k = (uint_t)hash & (selpathcap - 1); selpaths[k].off; k = (k + 1) & (selpathcap - 1));
+	selpaths[k].hash = hash;
+	selpaths[k].off = off + 1;
+	++nselpaths;
+	seldir_update(path, xstrlen(path), 1);
 }
 
-static void startselection(void)
+static void selidx_del(int i)
 {
-	if (!g_state.selmode) {
-		g_state.selmode = 1;
-		nselected = 0;
+	uint_t k = (uint_t)i;
+	const char *path = pselbuf + selpaths[k].off - 1;
 
-		if (selbufpos) {
-			resetselind();
-			writesel(NULL, 0);
-			selbufpos = 0;
-		}
-	}
+	seldir_update(path, xstrlen(path), -1);
+	SELIDX_DEL(selpaths, selpathcap, k, off);
+	--nselpaths;
 }
 
-static void clearselection(void)
+static void selrec_free(selrec_t *rec)
 {
-	nselected = 0;
-	selbufpos = 0;
-	g_state.selmode = 0;
-	writesel(NULL, 0);
+	free(rec->dir);
+	free(rec->names);
+	free(rec->slots);
 }
 
-static char *findinsel(char *startpos, int len)
+/* Empties the selection index, range records included */
+static void selidx_clear(void)
 {
-	if (!selbufpos)
-		return FALSE;
-
-	if (!startpos)
-		startpos = pselbuf;
-
-	char *found = startpos;
-	size_t buflen = selbufpos - (startpos - pselbuf);
+	if (nselpaths)
+		memset(selpaths, 0, selpathcap * sizeof(selpath_t));
+	if (nseldirs)
+		memset(seldirs, 0, seldircap * sizeof(seldir_t));
+	nselpaths = nseldirs = seldropped = 0;
+
+	for (uint_t i = 0; i < nselrecs; ++i)
+		selrec_free(&selrecs[i]);
+	nselrecs = 0;
+	selrec = -1;
+	selinfile = FALSE;
+}
 
-	while (1) {
-		/* memmem(3): not specified in POSIX.1, but present on a number of other systems. */
-		found = memmem(found, buflen - (found - startpos), g_sel, len);
-		if (!found)
-			return NULL;
-		if (found == startpos || *(found - 1) == '\0')
-			return found;
-		found += len; /* We found g_sel as a substring of a path, move forward */
-		if (found >= startpos + buflen)
-			return NULL;
-	}
+/* Re-index the selection buffer after it was rewritten */
+static void selidx_rebuild(void)
+{
+	selidx_clear();
+	for (uint_t pos = 0; pos < selbufpos; pos += xstrlen(pselbuf + pos) + 1)
+		selidx_add(pos);
 }
 
-static int markcmp(const void *va, const void *vb)
+/* Record of dir (with a trailing '/'), -1 if none */
+static int selrec_find(const char *dir, size_t dirlen)
 {
-	const selmark *ma = (selmark*)va;
-	const selmark *mb = (selmark*)vb;
+	for (uint_t i = 0; i < nselrecs; ++i)
+		if (selrecs[i].dirlen == dirlen && !memcmp(selrecs[i].dir, dir, dirlen))
+			return (int)i;
 
-	return ma->startpos - mb->startpos;
+	return -1;
 }
 
-/* scanselforpath() must be called before calling this */
-static inline void findmarkentry(size_t len, struct entry *dentp)
+/* Looks up name (len includes the NUL) in a record, indexing it on first use */
+static bool selrec_has(selrec_t *rec, const char *name, size_t len)
 {
-	if (!(dentp->flags & FILE_SCANNED)) {
-		if (findinsel(findselpos, len + xstrsncpy(g_sel + len, dentp->name, dentp->nlen)))
-			dentp->flags |= FILE_SELECTED;
-		dentp->flags |= FILE_SCANNED;
+	uint_t k, cap;
+
+	if (!rec->slots) {
+		for (cap = 64; cap < (rec->count << 1); cap <<= 1);
+		rec->slots = calloc(cap, sizeof(uint_t));
+		if (!rec->slots)
+			errexit();
+		rec->cap = cap;
+
+		for (size_t pos = 0, n; pos < rec->nameslen; pos += n) {
+			n = xstrlen(rec->names + pos) + 1;
+			k = (uint_t)selhash(SEL_HASH_INIT, rec->names + pos, n - 1) & (cap - 1);
+			for (; rec->slots[k]; k = (k + 1) & (cap - 1));
+			rec->slots[k] = (uint_t)pos + 1;
+		}
 	}
+
+	k = (uint_t)selhash(SEL_HASH_INIT, name, len - 1) & (rec->cap - 1);
+	for (; rec->slots[k]; k = (k + 1) & (rec->cap - 1))
+		if (!memcmp(rec->names + rec->slots[k] - 1, name, len))
+			return TRUE;
+
+	return FALSE;
 }
 
 /*
- * scanselforpath() must be called before calling this
- * pathlen = length of path + 1 (+1 for trailing slash)
+ * Adds the unselected entries in [startid, endid] of the current dir to
+ * its range record. Only the names are stored, paths are generated when
+ * the selection is written or expanded.
  */
-static void invertselbuf(const int pathlen)
+static void selrec_add(const char *dir, size_t dirlen, int startid, int endid)
 {
-	size_t len, endpos, shrinklen = 0, alloclen = 0;
-	char * const pbuf = g_sel + pathlen;
-	char *found;
-	int i, nmarked = 0, prev = 0;
-	struct entry *dentp;
-	bool scan = FALSE;
-	selmark *marked = malloc(nselected * sizeof(selmark));
+	selrec_t *rec;
+	size_t alloclen = 0;
+	uint_t added = 0;
+	int i;
 
-	if (!marked) {
-		printwarn(NULL);
-		return;
-	}
+	for (i = startid; i <= endid; ++i)
+		if (!(pdents[i].flags & FILE_SELECTED))
+			alloclen += pdents[i].nlen;
 
-	/* First pass: inversion */
-	for (i = 0; i < ndents; ++i) {
-		dentp = &pdents[i];
+	if (!alloclen) /* All selected already */
+		return;
 
-		if (dentp->flags & FILE_SCANNED) {
-			if (dentp->flags & FILE_SELECTED) {
-				dentp->flags ^= FILE_SELECTED; /* Clear selection status */
-				scan = TRUE;
-			} else {
-				dentp->flags |= FILE_SELECTED;
-				alloclen += pathlen + dentp->nlen;
-			}
-		} else {
-			dentp->flags |= FILE_SCANNED;
-			scan = TRUE;
+	i = selrec_find(dir, dirlen);
+	if (i < 0) {
+		if (!(nselrecs & (nselrecs - 1))) { /* 0 or a power of 2 */
+			rec = xrealloc(selrecs, (nselrecs ? nselrecs << 1 : 4) * sizeof(selrec_t));
+			if (!rec)
+				errexit();
+			selrecs = rec;
 		}
 
-		if (scan) {
-			len = pathlen + xstrsncpy(pbuf, dentp->name, NAME_MAX);
-			found = findinsel(findselpos, len);
-			if (found) {
-				if (findselpos == found)
-					findselpos += len;
+		rec = &selrecs[nselrecs];
+		memset(rec, 0, sizeof(selrec_t));
+		rec->dir = malloc(dirlen);
+		if (!rec->dir)
+			errexit();
+		memcpy(rec->dir, dir, dirlen);
+		rec->dirlen = dirlen;
+		selrec = (int)nselrecs++;
+	} else
+		rec = &selrecs[i];
 
-				if (nmarked && (found
-				    == (marked[nmarked - 1].startpos + marked[nmarked - 1].len)))
-					marked[nmarked - 1].len += len;
-				else {
-					marked[nmarked].startpos = found;
-					marked[nmarked].len = len;
-					++nmarked;
-				}
+	rec->names = xrealloc(rec->names, rec->nameslen + alloclen);
+	if (!rec->names)
+		errexit();
 
-				--nselected;
-				shrinklen += len; /* buffer size adjustment */
-			} else {
-				dentp->flags |= FILE_SELECTED;
-				alloclen += pathlen + dentp->nlen;
+	for (i = startid; i <= endid; ++i) {
+		if (pdents[i].flags & FILE_SELECTED)
+			continue;
+		memcpy(rec->names + rec->nameslen, pdents[i].name, pdents[i].nlen);
+		rec->nameslen += pdents[i].nlen;
+		pdents[i].flags |= (FILE_SCANNED | FILE_SELECTED);
+		++added;
+	}
+
+	/* Indexed again on the next lookup */
+	free(rec->slots);
+	rec->slots = NULL;
+
+	rec->count += added;
+	nselected += added;
+	seldir_update(rec->dir, rec->dirlen, (int)added);
+}
+
+static void appendfpath(const char *path, size_t len)
+{
+	if ((selbufpos >= selbuflen) || ((len + 3) > (selbuflen - selbufpos))) {
+		selbuflen += PATH_MAX;
+		pselbuf = xrealloc(pselbuf, selbuflen);
+		if (!pselbuf)
+			errexit();
+	}
+
+	len = xstrsncpy(pselbuf + selbufpos, path, len);
+	selidx_add(selbufpos);
+	selbufpos += len;
+}
+
+static void selbufrealloc(const size_t alloclen)
+{
+	if ((selbufpos + alloclen) > selbuflen) {
+		selbuflen = ALIGN_UP(selbufpos + alloclen, PATH_MAX);
+		pselbuf = xrealloc(pselbuf, selbuflen);
+		if (!pselbuf)
+			errexit();
+	}
+}
+
+/*
+ * Drop the paths marked SEL_DROPPED from the selection buffer in one pass.
+ * The index slots of the paths that move are pointed to their new offsets.
+ */
+static void selbufcompact(void)
+{
+	uint_t pos, newpos = 0, synced = 0, k;
+	size_t len;
+
+	for (pos = 0; pos < selbufpos; pos += len) {
+		len = xstrlen(pselbuf + pos) + 1;
+		if (pselbuf[pos] == SEL_DROPPED)
+			continue;
+
+		if (newpos != pos) {
+			if (nselpaths && pselbuf[pos] == '/') {
+				k = (uint_t)selhash(SEL_HASH_INIT, pselbuf + pos, len - 1);
+				for (k &= selpathcap - 1; selpaths[k].off; k = (k + 1) & (selpathcap - 1))
+					if (selpaths[k].off == pos + 1) {
+						selpaths[k].off = newpos + 1;
+						break;
+					}
 			}
-			scan = FALSE;
+			memmove(pselbuf + newpos, pselbuf + pos, len);
 		}
+
+		newpos += len;
+		if (pos < selsynced)
+			synced = newpos;
 	}
 
-	/*
-	 * Files marked for deselection could be found in arbitrary order.
-	 * Sort by appearance in selection buffer.
-	 * With entries sorted we can merge adjacent ones allowing us to
-	 * move them in a single go.
-	 */
-	qsort(marked, nmarked, sizeof(selmark), &markcmp);
+	selbufpos = newpos;
+	selsynced = synced;
+	seldropped = 0;
+}
 
-	/* Some files might be adjacent. Merge them into a single entry */
-	for (i = 1; i < nmarked; ++i) {
-		if (marked[i].startpos == marked[prev].startpos + marked[prev].len)
-			marked[prev].len += marked[i].len;
-		else {
-			++prev;
-			marked[prev].startpos = marked[i].startpos;
-			marked[prev].len = marked[i].len;
+/* First path in the selection buffer, there must be one */
+static char *selbuffirst(void)
+{
+	char *path = pselbuf;
+
+	while (*path == SEL_DROPPED)
+		path += xstrlen(path) + 1;
+
+	return path;
+}
+
+/* Expands the range records into paths in the selection buffer */
+static void selexpand(void)
+{
+	selrec_t *rec;
+	bool synced;
+
+	if (seldropped)
+		selbufcompact();
+
+	synced = selinfile && selsynced == selbufpos;
+	for (uint_t i = 0; i < nselrecs; ++i) {
+		rec = &selrecs[i];
+		synced = synced && rec->synced == rec->nameslen;
+		seldir_update(rec->dir, rec->dirlen, -(int)rec->count);
+		selbufrealloc(rec->nameslen + (size_t)rec->count * rec->dirlen);
+
+		for (size_t pos = 0, len; pos < rec->nameslen; pos += len) {
+			len = xstrlen(rec->names + pos) + 1;
+			memcpy(pselbuf + selbufpos, rec->dir, rec->dirlen);
+			memcpy(pselbuf + selbufpos + rec->dirlen, rec->names + pos, len);
+			selidx_add(selbufpos);
+			selbufpos += rec->dirlen + len;
 		}
+
+		selrec_free(rec);
 	}
 
-	/*
-	 * Number of entries is increased by encountering a non-adjacent entry
-	 * After we finish the loop we should increment it once more.
-	 */
+	nselrecs = 0;
+	selrec = -1;
+
+	/* The paths in the file are the same, only their order may differ */
+	if (synced)
+		selsynced = selbufpos;
+	else
+		selinfile = FALSE;
+}
 
-	if (nmarked) /* Make sure there is something to deselect */
-		nmarked = prev + 1;
+#define SEL_EXPORT_BUF (1 << 16) /* Staging buffer for selection exports */
 
-	/* Using merged entries remove unselected chunks from selection buffer */
-	for (i = 0; i < nmarked; ++i) {
-		/*
-		 * found: points to where the current block starts
-		 *        variable is recycled from previous for readability
-		 * endpos: points to where the the next block starts
-		 *         area between the end of current block (found + len)
-		 *         and endpos is selected entries. This is what we are
-		 *         moving back.
-		 */
-		found = marked[i].startpos;
-		endpos = (i + 1 == nmarked ? selbufpos : marked[i + 1].startpos - pselbuf);
-		len = marked[i].len;
+/* Staged writer for selection exports */
+typedef struct {
+	char *buf;
+	size_t used;
+	int fd;
+	char sep;
+	bool first;
+	bool err;
+} selout_t;
+
+static bool selflush(int fd, const char *buf, size_t len)
+{
+	for (ssize_t w; len; buf += w, len -= w) {
+		w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno != EINTR)
+				return FALSE;
+			w = 0;
+		}
+	}
+
+	return TRUE;
+}
 
-		/* Move back only selected entries. No selected memory is moved twice */
-		memmove(found, found + len, endpos - (found + len - pselbuf));
+static void selout_put(selout_t *out, const char *str, size_t len)
+{
+	if (out->used + len > SEL_EXPORT_BUF) {
+		if (!out->err && !selflush(out->fd, out->buf, out->used))
+			out->err = TRUE;
+		out->used = 0;
+
+		if (len > SEL_EXPORT_BUF) {
+			if (!out->err && !selflush(out->fd, str, len))
+				out->err = TRUE;
+			return;
+		}
 	}
 
-	free(marked);
+	memcpy(out->buf + out->used, str, len);
+	out->used += len;
+}
 
-	/* Buffer size adjustment */
-	selbufpos -= shrinklen;
+/* Adds path dir + name, the separator goes before all but the first */
+static void selout_path(selout_t *out, const char *dir, size_t dirlen, const char *name, size_t namelen)
+{
+	if (!out->first)
+		selout_put(out, &out->sep, 1);
+	out->first = FALSE;
 
-	selbufrealloc(alloclen);
+	selout_put(out, dir, dirlen);
+	selout_put(out, name, namelen);
+}
 
-	/* Second pass: append newly selected to buffer */
-	for (i = 0; i < ndents; ++i) {
-		if (pdents[i].flags & FILE_SELECTED) {
-			len = pathlen + xstrsncpy(pbuf, pdents[i].name, NAME_MAX);
-			appendfpath(g_sel, len);
-			++nselected;
+/* Adds the records' names from their synced offsets (from 0 if all) */
+static uint_t selout_recs(selout_t *out, bool all)
+{
+	uint_t count = 0;
+	size_t len;
+
+	for (uint_t i = 0; i < nselrecs; ++i) {
+		for (size_t pos = all ? 0 : selrecs[i].synced; pos < selrecs[i].nameslen; pos += len + 1) {
+			len = xstrlen(selrecs[i].names + pos);
+			selout_path(out, selrecs[i].dir, selrecs[i].dirlen, selrecs[i].names + pos, len);
+			++count;
 		}
 	}
 
-	nselected ? writesel(pselbuf, selbufpos - 1) : clearselection();
+	return count;
+}
+
+static bool selout_end(selout_t *out)
+{
+	if (!out->err && out->used && !selflush(out->fd, out->buf, out->used))
+		out->err = TRUE;
+	free(out->buf);
+	return !out->err;
 }
 
 /*
- * scanselforpath() must be called before calling this
- * pathlen = length of path + 1 (+1 for trailing slash)
+ * Write selected file paths to fd, linefeed separated. The paths are
+ * staged in a buffer flushed with one write() per SEL_EXPORT_BUF bytes.
  */
-static void addtoselbuf(const int pathlen, int startid, int endid)
+static bool seltofile(int fd, uint_t *pcount, const char *separator)
 {
-	int i;
-	size_t len, alloclen = 0;
-	struct entry *dentp;
-	char *found;
-	char * const pbuf = g_sel + pathlen;
+	selout_t out = {.fd = fd, .sep = *separator, .first = TRUE};
+	size_t pos, len;
+	uint_t count = 0;
 
-	/* Remember current selection buffer position */
-	for (i = startid; i <= endid; ++i) {
-		dentp = &pdents[i];
+	if (pcount)
+		*pcount = 0;
 
-		if (findselpos) {
-			len = pathlen + xstrsncpy(pbuf, dentp->name, NAME_MAX);
-			found = findinsel(findselpos, len);
-			if (found) {
-				dentp->flags |= (FILE_SCANNED | FILE_SELECTED);
-				if (found == findselpos) {
-					findselpos += len;
-					if (findselpos == (pselbuf + selbufpos))
-						findselpos = NULL;
-				}
-			} else
-				alloclen += pathlen + dentp->nlen;
-		} else
-			alloclen += pathlen + dentp->nlen;
+	if (selbufempty())
+		return FALSE;
+
+	if (*separator == '\0' && !nselrecs && !seldropped) { /* The buffer is the output */
+		if (!selflush(fd, pselbuf, selbufpos - 1))
+			return FALSE;
+		if (pcount) {
+			for (pos = 0; pos < selbufpos; ++pos)
+				count += !pselbuf[pos];
+			*pcount = count;
+		}
+		return TRUE;
 	}
 
-	selbufrealloc(alloclen);
+	out.buf = malloc(SEL_EXPORT_BUF);
+	if (!out.buf)
+		return FALSE;
 
-	for (i = startid; i <= endid; ++i) {
-		if (!(pdents[i].flags & FILE_SELECTED)) {
-			len = pathlen + xstrsncpy(pbuf, pdents[i].name, NAME_MAX);
-			appendfpath(g_sel, len);
-			++nselected;
-			pdents[i].flags |= (FILE_SCANNED | FILE_SELECTED);
+	for (pos = 0; pos < selbufpos; pos += len + 1) {
+		len = xstrlen(pselbuf + pos);
+		if (pselbuf[pos] != SEL_DROPPED) {
+			selout_path(&out, pselbuf + pos, len, NULL, 0);
+			++count;
 		}
 	}
+	count += selout_recs(&out, TRUE);
+
+	if (pcount)
+		*pcount = count;
 
-	writesel(pselbuf, selbufpos - 1); /* Truncate NULL from end */
+	return selout_end(&out);
 }
 
-/* Removes g_sel from selbuf */
-static void rmfromselbuf(size_t len)
+static inline void selgen_set(const struct stat *sb)
 {
-	char *found = findinsel(findselpos, len);
-	if (!found)
-		return;
-
-	memmove(found, found + len, selbufpos - (found + len - pselbuf));
-	selbufpos -= len;
+	selgen.ino = sb->st_ino;
+	selgen.size = sb->st_size;
+	selgen.mtim = FOP_MTIM(sb);
+}
 
-	nselected ? writesel(pselbuf, selbufpos - 1) : clearselection();
+static inline bool selgen_same(const struct stat *sb)
+{
+	return selgen.ino == sb->st_ino && selgen.size == sb->st_size
+		&& selgen.mtim.tv_sec == FOP_MTIM(sb).tv_sec
+		&& selgen.mtim.tv_nsec == FOP_MTIM(sb).tv_nsec;
 }
 
-static int scanselforpath(const char *path, bool getsize)
+/* Adds the NUL separated paths in [pos, end) to the selection */
+static void seladdpaths(const char *pos, const char *end, bool dedup)
 {
-	if (!path[1]) { /* path should always be at least two bytes (including NULL) */
-		g_sel[0] = '/';
-		findselpos = pselbuf;
-		return 1; /* Length of '/' is 1 */
+	const char *nul;
+	size_t len;
+
+	for (; pos < end; pos += len + 1) {
+		nul = memchr(pos, '\0', end - pos);
+		len = (nul ? nul : end) - pos;
+		selbufrealloc(len + 1);
+		memcpy(pselbuf + selbufpos, pos, len);
+		pselbuf[selbufpos + len] = '\0';
+		if (dedup && selidx_find(pselbuf + selbufpos, len + 1) >= 0)
+			continue;
+		selidx_add(selbufpos);
+		selbufpos += len + 1;
+		++nselected;
 	}
+}
 
-	size_t off = xstrsncpy(g_sel, path, PATH_MAX);
+/*
+ * Called with the selection file locked for writing. If other instances
+ * appended paths to it since it was last written or read, they are merged
+ * into the buffer so that rewriting the file doesn't lose them.
+ */
+static void selfile_merge(int fd, const struct stat *sb)
+{
+	char *map;
 
-	g_sel[off - 1] = '/';
-	/*
-	 * We set findselpos only here. Directories can be listed in arbitrary order.
-	 * This is the best best we can do for remembering position.
-	 */
-	findselpos = findinsel(NULL, off);
+	if (g_state.picker || selbufempty() || !selgen.ino
+	    || sb->st_ino != selgen.ino || sb->st_size <= selgen.size)
+		return;
 
-	if (getsize)
-		return off;
-	return (findselpos ? off : 0);
+	map = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return;
+
+	if (!map[selgen.size]) { /* Paths appended after a separator */
+		selexpand();
+		seladdpaths(map + selgen.size + 1, map + sb->st_size, TRUE);
+		selinfile = FALSE;
+		for (int r = 0; r < ndents; ++r)
+			pdents[r].flags &= ~FILE_SCANNED;
+	}
+
+	munmap(map, sb->st_size);
 }
 
-/* Finish selection procedure before an operation */
-static void endselection(bool endselmode)
+/*
+ * Writes the selection to the selection file. The file is shared by
+ * instances, so it is locked and, if the file is still the one written
+ * last, only the paths added since are appended.
+ */
+static void writesel(void)
 {
-	int fd;
-	ssize_t count;
-	char buf[sizeof(patterns[P_REPLACE]) + PATH_MAX + (TMP_LEN_MAX << 1)];
-
-	if (endselmode && g_state.selmode)
-		g_state.selmode = 0;
+	selout_t out = {.sep = '\0'};
+	struct stat sb;
+	bool all;
 
-	/* The code below is only for listing mode */
-	if (!listpath || !selbufpos)
-		return;
+	daemon_event(DMN_EV_SEL);
 
-	fd = create_tmp_file();
-	if (fd == -1) {
-		DPRINTF_S("couldn't create tmp file");
+	if (!selpath)
 		return;
-	}
 
-	seltofile(fd, NULL, NEWLINE);
-	if (close(fd)) {
-		DPRINTF_S(strerror(errno));
+	out.fd = open(selpath, O_CREAT | O_RDWR | O_CLOEXEC, S_IWUSR | S_IRUSR);
+	if (out.fd == -1) {
 		printwarn(NULL);
 		return;
 	}
 
-	snprintf(buf, sizeof(buf), patterns[P_REPLACE], listpath, listroot, g_tmpfpath);
-	spawn(utils[UTIL_SH_EXEC], buf, NULL, NULL, F_CLI);
+	flock(out.fd, LOCK_EX);
 
-	fd = open(g_tmpfpath, O_RDONLY);
-	if (fd == -1) {
-		DPRINTF_S(strerror(errno));
-		printwarn(NULL);
-		if (unlink(g_tmpfpath)) {
-			DPRINTF_S(strerror(errno));
-			printwarn(NULL);
-		}
-		return;
+	if (fstat(out.fd, &sb) == -1)
+		all = TRUE;
+	else {
+		if (!selgen_same(&sb))
+			selfile_merge(out.fd, &sb);
+		all = !selinfile || !selgen_same(&sb);
 	}
 
-	count = read(fd, pselbuf, selbuflen);
-	if (count < 0) {
-		DPRINTF_S(strerror(errno));
-		printwarn(NULL);
-		if (close(fd) || unlink(g_tmpfpath)) {
-			DPRINTF_S(strerror(errno));
+	if (all) {
+		selsynced = 0;
+		out.first = TRUE;
+		out.err = (ftruncate(out.fd, 0) == -1);
+	} else {
+		out.first = !sb.st_size;
+		out.err = (lseek(out.fd, 0, SEEK_END) == -1);
+	}
+
+	out.buf = malloc(SEL_EXPORT_BUF);
+	if (!out.buf)
+		out.err = TRUE;
+	else {
+		if (selsynced < selbufpos && !seldropped) { /* New paths in the buffer */
+			if (!out.first)
+				selout_put(&out, "", 1);
+			selout_put(&out, pselbuf + selsynced, selbufpos - selsynced - 1);
+			out.first = FALSE;
+		} else if (selsynced < selbufpos) {
+			for (uint_t pos = selsynced, len; pos < selbufpos; pos += len + 1) {
+				len = xstrlen(pselbuf + pos);
+				if (pselbuf[pos] == SEL_DROPPED)
+					continue;
+				if (!out.first)
+					selout_put(&out, "", 1);
+				selout_put(&out, pselbuf + pos, len);
+				out.first = FALSE;
+			}
 		}
-		return;
+		selout_recs(&out, all);
 	}
 
-	if (close(fd) || unlink(g_tmpfpath)) {
-		DPRINTF_S(strerror(errno));
+	if (!selout_end(&out)) {
 		printwarn(NULL);
-		return;
+		selinfile = FALSE;
+	} else {
+		selinfile = !fstat(out.fd, &sb);
+		if (selinfile)
+			selgen_set(&sb);
+		selsynced = selbufpos;
+		for (uint_t i = 0; i < nselrecs; ++i)
+			selrecs[i].synced = selrecs[i].nameslen;
 	}
 
-	selbufpos = count;
-	pselbuf[--count] = '\0';
-	for (--count; count > 0; --count)
-		if (pselbuf[count] == '\n' && pselbuf[count+1] == '/')
-			pselbuf[count] = '\0';
-
-	writesel(pselbuf, selbufpos - 1);
+	close(out.fd); /* Unlocks */
 }
 
-/* Returns: 1 - success, 0 - none selected, -1 - other failure */
-static int editselection(void)
+/* Maps the selection file locked for reading, NULL if empty */
+static char *selfile_map(int *pfd, struct stat *sb)
 {
-	int ret = -1;
-	int fd, lines = 0;
-	ssize_t count;
-	struct stat sb;
-	time_t mtime;
+	char *map;
+	int fd = open(selpath, O_RDONLY | O_CLOEXEC);
 
-	if (!selbufpos) /* External selection is only editable at source */
-		return listselfile();
-
-	fd = create_tmp_file();
-	if (fd == -1) {
-		DPRINTF_S("couldn't create tmp file");
-		return -1;
-	}
+	if (fd == -1)
+		return NULL;
 
-	seltofile(fd, NULL, NEWLINE);
-	if (close(fd)) {
-		DPRINTF_S(strerror(errno));
-		return -1;
+	flock(fd, LOCK_SH);
+	if (fstat(fd, sb) == -1 || !sb->st_size
+	    || (map = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
 	}
 
-	/* Save the last modification time */
-	if (stat(g_tmpfpath, &sb)) {
-		DPRINTF_S(strerror(errno));
-		unlink(g_tmpfpath);
-		return -1;
-	}
-	mtime = sb.st_mtime;
+	*pfd = fd;
+	return map;
+}
 
-	spawn((cfg.waitedit ? enveditor : editor), g_tmpfpath, NULL, NULL, F_CLI);
+/* Writes the selection file to fd linefeed separated, returns the linefeeds */
+static uint_t selfiletofd(int fd)
+{
+	char buf[1 << 14];
+	struct stat sb;
+	size_t pos = 0;
+	uint_t count = 0;
+	int sfd;
+	char *map = selfile_map(&sfd, &sb);
 
-	fd = open(g_tmpfpath, O_RDONLY);
-	if (fd == -1) {
-		DPRINTF_S(strerror(errno));
-		unlink(g_tmpfpath);
-		return -1;
-	}
+	if (!map)
+		return 0;
 
-	fstat(fd, &sb);
+	for (off_t i = 0; i < sb.st_size; ++i) {
+		if (map[i])
+			buf[pos++] = map[i];
+		else {
+			buf[pos++] = '\n';
+			++count;
+		}
 
-	if (mtime == sb.st_mtime) {
-		DPRINTF_S("selection is not modified");
-		unlink(g_tmpfpath);
-		return 1;
+		if ((pos == sizeof(buf) || i == sb.st_size - 1) && write(fd, buf, pos) != (ssize_t)pos)
+			break;
+		if (pos == sizeof(buf))
+			pos = 0;
 	}
 
-	if (sb.st_size > selbufpos) {
-		DPRINTF_S("edited buffer larger than previous");
-		unlink(g_tmpfpath);
-		goto emptyedit;
-	}
+	munmap(map, sb.st_size);
+	close(sfd);
+	return count;
+}
 
-	count = read(fd, pselbuf, selbuflen);
+/* List selection from selection file (another instance) */
+static bool listselfile(void)
+{
+	int r;
+
+	if (isselfileempty())
+		return FALSE;
+
+	exitcurses();
+	selfiletofd(STDOUT_FILENO);
+	r = write(STDOUT_FILENO, "\n", 1);
+	r = write(STDOUT_FILENO, messages[MSG_ENTER], xstrlen(messages[MSG_ENTER]));
+	while ((read(STDIN_FILENO, &r, 1) > 0) && (r != '\n'));
+	refresh();
+
+	return TRUE;
+}
+
+/* Reset selection indicators */
+static void resetselind(void)
+{
+	for (int r = 0; r < ndents; ++r)
+		if (pdents[r].flags & FILE_SELECTED)
+			pdents[r].flags &= ~FILE_SELECTED;
+}
+
+/*
+ * Picks up changes made to the selection file by other instances. Paths
+ * appended to the file since it was last seen are added to the selection,
+ * other changes reload it. Returns TRUE if the selection changed.
+ */
+static bool selfile_sync(void)
+{
+	struct stat sb;
+	char *map, *pos;
+	int fd = -1;
+
+	if (!selpath || g_state.picker || stat(selpath, &sb) == -1 || selgen_same(&sb))
+		return FALSE;
+
+	map = selfile_map(&fd, &sb);
+	if (!map && sb.st_size) /* Vanished or unreadable, keep ours */
+		return FALSE;
+
+	if (seldropped)
+		selbufcompact();
+
+	if (map && selinfile && !nselrecs && sb.st_ino == selgen.ino && sb.st_size > selgen.size
+	    && (off_t)selsynced == selgen.size + 1 && !map[selgen.size]
+	    && !memcmp(map, pselbuf, selgen.size))
+		pos = map + selgen.size + 1;
+	else {
+		selbufpos = 0;
+		selidx_clear();
+		nselected = 0;
+		pos = map;
+	}
+
+	if (map) {
+		seladdpaths(pos, map + sb.st_size, FALSE);
+
+		/* The buffer mirrors the file unless that ends with a NUL */
+		selinfile = map[sb.st_size - 1];
+		munmap(map, sb.st_size);
+		close(fd);
+	} else
+		selinfile = TRUE;
+
+	selsynced = selbufpos;
+	selgen_set(&sb);
+
+	g_state.selmode = !!nselected;
+	for (int r = 0; r < ndents; ++r)
+		pdents[r].flags &= ~(FILE_SCANNED | FILE_SELECTED);
+
+	return TRUE;
+}
+
+static void startselection(void)
+{
+	selfile_sync();
+
+	if (!g_state.selmode) {
+		g_state.selmode = 1;
+		nselected = 0;
+
+		if (!selbufempty()) {
+			resetselind();
+			selbufpos = 0;
+			selidx_clear();
+			writesel();
+		}
+	}
+}
+
+static void clearselection(void)
+{
+	nselected = 0;
+	selbufpos = 0;
+	selidx_clear();
+	g_state.selmode = 0;
+	writesel();
+}
+
+/* scanselforpath() must be called before calling this */
+static inline bool findinsel(size_t len)
+{
+	return selidx_find(g_sel, len) >= 0
+		|| (selrec >= 0 && selrec_has(&selrecs[selrec], g_sel + selrecs[selrec].dirlen,
+					     len - selrecs[selrec].dirlen));
+}
+
+/* scanselforpath() must be called before calling this */
+static inline void findmarkentry(size_t len, struct entry *dentp)
+{
+	if (!(dentp->flags & FILE_SCANNED)) {
+		if (findinsel(len + xstrsncpy(g_sel + len, dentp->name, dentp->nlen)))
+			dentp->flags |= FILE_SELECTED;
+		dentp->flags |= FILE_SCANNED;
+	}
+}
+
+/*
+ * scanselforpath() must be called before calling this
+ * pathlen = length of path + 1 (+1 for trailing slash)
+ */
+static void invertselbuf(const int pathlen)
+{
+	size_t len, alloclen = 0;
+	char * const pbuf = g_sel + pathlen;
+	struct entry *dentp;
+	bool dropped = FALSE;
+	int i, slot;
+	uint_t off;
+
+	selexpand();
+
+	/* First pass: inversion, deselected paths are marked and dropped in one go */
+	for (i = 0; i < ndents; ++i) {
+		dentp = &pdents[i];
+		len = pathlen + xstrsncpy(pbuf, dentp->name, NAME_MAX);
+		slot = selidx_find(g_sel, len);
+		dentp->flags |= FILE_SCANNED;
+
+		if (slot >= 0) {
+			off = selpaths[slot].off - 1;
+			selidx_del(slot);
+			pselbuf[off] = SEL_DROPPED;
+			seldropped += len;
+			dentp->flags &= ~FILE_SELECTED;
+			--nselected;
+			dropped = TRUE;
+		} else {
+			dentp->flags |= FILE_SELECTED;
+			alloclen += len;
+		}
+	}
+
+	/* The file has the dropped paths, it is rewritten rather than appended to */
+	if (dropped) {
+		selinfile = FALSE;
+		selbufcompact();
+	}
+
+	selbufrealloc(alloclen);
+
+	/* Second pass: append newly selected to buffer */
+	for (i = 0; i < ndents; ++i) {
+		if (pdents[i].flags & FILE_SELECTED) {
+			len = pathlen + xstrsncpy(pbuf, pdents[i].name, NAME_MAX);
+			appendfpath(g_sel, len);
+			++nselected;
+		}
+	}
+
+	nselected ? writesel() : clearselection();
+}
+
+/*
+ * scanselforpath() must be called before calling this
+ * pathlen = length of path + 1 (+1 for trailing slash)
+ */
+static void addtoselbuf(const int pathlen, int startid, int endid)
+{
+	int i;
+	size_t len, alloclen = 0;
+	struct entry *dentp;
+	char * const pbuf = g_sel + pathlen;
+
+	for (i = startid; i <= endid; ++i) {
+		dentp = &pdents[i];
+		len = pathlen + xstrsncpy(pbuf, dentp->name, NAME_MAX);
+
+		if (selindir && findinsel(len))
+			dentp->flags |= (FILE_SCANNED | FILE_SELECTED);
+		else
+			alloclen += len;
+	}
+
+	/* Large ranges are kept as a record of names */
+	if (endid - startid >= SEL_RANGE_MIN) {
+		selrec_add(g_sel, pathlen, startid, endid);
+		writesel();
+		return;
+	}
+
+	selbufrealloc(alloclen);
+
+	for (i = startid; i <= endid; ++i) {
+		if (!(pdents[i].flags & FILE_SELECTED)) {
+			len = pathlen + xstrsncpy(pbuf, pdents[i].name, NAME_MAX);
+			appendfpath(g_sel, len);
+			++nselected;
+			pdents[i].flags |= (FILE_SCANNED | FILE_SELECTED);
+		}
+	}
+
+	writesel();
+}
+
+/*
+ * Removes g_sel from selbuf. The path is only marked dropped, the buffer
+ * is compacted once half of it is dropped paths or before it is reused.
+ */
+static void rmfromselbuf(size_t len)
+{
+	int slot;
+	uint_t off;
+
+	if (nselrecs)
+		selexpand();
+	slot = selidx_find(g_sel, len);
+	if (slot < 0)
+		return;
+
+	off = selpaths[slot].off - 1;
+	selidx_del(slot);
+	selinfile = FALSE;
+	pselbuf[off] = SEL_DROPPED;
+	seldropped += len;
+	if (seldropped > selbufpos >> 1)
+		selbufcompact();
+
+	nselected ? writesel() : clearselection();
+}
+
+/* Returns the length of path with a trailing '/', 0 if nothing under it is selected */
+static int scanselforpath(const char *path, bool getsize)
+{
+	if (!path[1]) { /* path should always be at least two bytes (including NULL) */
+		g_sel[0] = '/';
+		selindir = nselpaths || nselrecs;
+		selrec = selrec_find(g_sel, 1);
+		return 1; /* Length of '/' is 1 */
+	}
+
+	size_t off = xstrsncpy(g_sel, path, PATH_MAX);
+
+	g_sel[off - 1] = '/';
+	selindir = seldir_find(selhash(SEL_HASH_INIT, g_sel, off)) >= 0;
+	selrec = selrec_find(g_sel, off);
+
+	if (getsize)
+		return off;
+	return (selindir ? off : 0);
+}
+
+/* Finish selection procedure before an operation */
+static void endselection(bool endselmode)
+{
+	if (endselmode && g_state.selmode)
+		g_state.selmode = 0;
+}
+
+/* Returns: 1 - success, 0 - none selected, -1 - other failure */
+static int editselection(void)
+{
+	int ret = -1;
+	int fd, lines = 0;
+	ssize_t count;
+	struct stat sb;
+	time_t mtime;
+
+	if (selbufempty()) /* External selection is only editable at source */
+		return listselfile();
+
+	selexpand();
+
+	fd = create_tmp_file();
+	if (fd == -1) {
+		DPRINTF_S("couldn't create tmp file");
+		return -1;
+	}
+
+	seltofile(fd, NULL, NEWLINE);
+	if (close(fd)) {
+		DPRINTF_S(strerror(errno));
+		return -1;
+	}
+
+	/* Save the last modification time */
+	if (stat(g_tmpfpath, &sb)) {
+		DPRINTF_S(strerror(errno));
+		unlink(g_tmpfpath);
+		return -1;
+	}
+	mtime = sb.st_mtime;
+
+	spawn((cfg.waitedit ? enveditor : editor), g_tmpfpath, NULL, NULL, F_CLI);
+
+	fd = open(g_tmpfpath, O_RDONLY);
+	if (fd == -1) {
+		DPRINTF_S(strerror(errno));
+		unlink(g_tmpfpath);
+		return -1;
+	}
+
+	fstat(fd, &sb);
+
+	if (mtime == sb.st_mtime) {
+		DPRINTF_S("selection is not modified");
+		unlink(g_tmpfpath);
+		return 1;
+	}
+
+	if (sb.st_size > selbufpos) {
+		DPRINTF_S("edited buffer larger than previous");
+		unlink(g_tmpfpath);
+		goto emptyedit;
+	}
+
+	count = read(fd, pselbuf, selbuflen);
 	if (count < 0) {
 		DPRINTF_S(strerror(errno));
 		printwarn(NULL);
@@ -2187,7 +3233,8 @@ static int editselection(void)
 	}
 
 	nselected = lines;
-	writesel(pselbuf, selbufpos - 1);
+	selidx_rebuild();
+	writesel();
 
 	return 1;
 
@@ -2451,6 +3498,7 @@ static char *parseargs(char *cmd, char **argv, int *pindex)
 	return cmd;
 }
 
+#if !defined(NOFOPS) || defined(SPAWNHELPER)
 static void enable_signals(void)
 {
 	struct sigaction dfl_act = {.sa_handler = SIG_DFL};
@@ -2461,44 +3509,224 @@ static void enable_signals(void)
 	sigaction(SIGTSTP, &dfl_act, NULL);
 	sigaction(SIGWINCH, &dfl_act, NULL);
 }
+#endif
+
+/* Detached children are reaped when idle */
+static void reap_detached(void)
+{
+	for (uint_t i = 0; i < ndetached; )
+		if (waitpid(detached[i], NULL, WNOHANG) != 0)
+			detached[i] = detached[--ndetached];
+		else
+			++i;
+}
 
-static pid_t xfork(uchar_t flag)
+#ifdef SPAWNHELPER
+/*
+ * A helper forked at startup, before the listing grows, launches the
+ * detached commands. Requests are the flags, the cwd, argv and the
+ * environment as NUL separated strings, prefixed with the length.
+ */
+static void helper_run(int fd)
 {
-	pid_t p = fork();
+	char *buf, *p, *end, *argv[EXEC_ARGS_MAX + 1], **envp;
+	uint_t len, argc, envc;
 
-	if (p > 0) {
-		/* the parent ignores the interrupt, quit and hangup signals */
-		sigaction(SIGHUP, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsighup);
-		sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_DFL}, &oldsigtstp);
-		sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsigwinch);
-	} else if (p == 0) {
-		/* We create a grandchild to detach */
-		if (flag & F_NOWAIT) {
-			p = fork();
+	setsid();
+	enable_signals();
+	sigaction(SIGCHLD, &(struct sigaction){.sa_handler = SIG_IGN, .sa_flags = SA_NOCLDWAIT}, NULL);
+
+	while (read(fd, &len, sizeof(len)) == sizeof(len) && len > 8 && (buf = malloc(len + 1))) {
+		ushort_t flag;
+		ssize_t n;
 
-			if (p > 0)
+		for (p = buf, end = buf + len; p < end; p += n) {
+			n = read(fd, p, end - p);
+			if (n <= 0)
 				_exit(EXIT_SUCCESS);
-			else if (p == 0) {
-				enable_signals();
-				setsid();
-				return p;
+		}
+		buf[len] = '\0';
+
+		memcpy(&flag, buf, sizeof(flag));
+		argc = (uchar_t)buf[2];
+		memcpy(&envc, buf + 4, sizeof(envc));
+		envp = (argc <= EXEC_ARGS_MAX) ? malloc((envc + 1) * sizeof(char *)) : NULL;
+		if (envp && fork() == 0) {
+			p = buf + 8;
+			if (chdir(p) == -1)
+				_exit(EXIT_FAILURE);
+			for (uint_t i = 0; i < argc + envc; ++i) {
+				p += xstrlen(p) + 1;
+				if (p >= end)
+					_exit(EXIT_FAILURE);
+				if (i < argc)
+					argv[i] = p;
+				else
+					envp[i - argc] = p;
 			}
+			argv[argc] = NULL;
+			envp[envc] = NULL;
+
+			setsid();
+			close(fd);
+			if (flag & F_NOTRACE) {
+				int null = open("/dev/null", O_RDWR);
 
-			perror("fork");
+				if (flag & F_NOSTDIN)
+					dup2(null, STDIN_FILENO);
+				dup2(null, STDOUT_FILENO);
+				dup2(null, STDERR_FILENO);
+			}
+			environ = envp;
+			execvp(*argv, argv);
 			_exit(EXIT_FAILURE);
 		}
 
-		/* So they can be used to stop the child */
-		enable_signals();
+		free(envp);
+		free(buf);
 	}
 
-	/* This is the parent waiting for the child to create grandchild */
-	if (flag & F_NOWAIT)
-		waitpid(p, NULL, 0);
-
-	if (p == -1)
-		perror("fork");
-	return p;
+	_exit(EXIT_SUCCESS);
+}
+
+static void helper_start(void)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+		return;
+
+	pid = fork();
+	if (pid == 0) {
+		close(fds[0]);
+		helper_run(fds[1]);
+	}
+
+	close(fds[1]);
+	if (pid == -1)
+		close(fds[0]);
+	else {
+		fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+		helperfd = fds[0];
+	}
+}
+
+static bool helper_spawn(char **argv, ushort_t flag)
+{
+	char cwd[PATH_MAX], *buf, *p;
+	uint_t len = 8, argc = 0, envc = 0;
+	bool ret;
+
+	if (helperfd == -1 || !getcwd(cwd, PATH_MAX))
+		return FALSE;
+
+	len += xstrlen(cwd) + 1;
+	for (; argv[argc]; ++argc)
+		len += xstrlen(argv[argc]) + 1;
+	for (; environ[envc]; ++envc)
+		len += xstrlen(environ[envc]) + 1;
+
+	buf = malloc(sizeof(len) + len);
+	if (!buf)
+		return FALSE;
+
+	memcpy(buf, &len, sizeof(len));
+	p = buf + sizeof(len);
+	memcpy(p, &flag, sizeof(flag));
+	p[2] = (char)argc;
+	p[3] = '\0';
+	memcpy(p + 4, &envc, sizeof(envc));
+	p += 8;
+	p = stpcpy(p, cwd) + 1;
+	for (uint_t i = 0; i < argc; ++i)
+		p = stpcpy(p, argv[i]) + 1;
+	for (uint_t i = 0; i < envc; ++i)
+		p = stpcpy(p, environ[i]) + 1;
+
+	len += sizeof(len);
+	p = buf;
+	for (ssize_t n; len; p += n, len -= n) {
+		n = write(helperfd, p, len);
+		if (n <= 0) {
+			/* The helper is gone, spawn from here */
+			close(helperfd);
+			helperfd = -1;
+			break;
+		}
+	}
+
+	ret = !len;
+	free(buf);
+	return ret;
+}
+#endif
+
+/*
+ * Launch with posix_spawn(3), a vfork-like clone on glibc and musl, so the
+ * page tables of a large listing are not copied. The redirections are
+ * file actions, the child gets default signal dispositions.
+ */
+static pid_t xspawn(char **argv, ushort_t flag, int fdin, int fdout)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t set;
+	short attrflags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+	pid_t pid = -1;
+	int r;
+
+	if (posix_spawn_file_actions_init(&actions))
+		return -1;
+	if (posix_spawnattr_init(&attr)) {
+		posix_spawn_file_actions_destroy(&actions);
+		return -1;
+	}
+
+	if (flag & F_NOTRACE) {
+		/* fdout, if given, still gets stdout */
+		posix_spawn_file_actions_adddup2(&actions, fdout != -1 ? fdout : devnullfd, STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, devnullfd, STDERR_FILENO);
+	} else if (fdout != -1) {
+		posix_spawn_file_actions_adddup2(&actions, fdout, STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, fdout, STDERR_FILENO);
+	} else if ((flag & F_TTY) && !isatty(STDOUT_FILENO))
+		/* If stdout has been redirected to a non-tty, force output to tty */
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, ctermid(NULL), O_WRONLY, 0);
+	if (fdin != -1)
+		posix_spawn_file_actions_adddup2(&actions, fdin, STDIN_FILENO);
+	else if (flag & F_NOSTDIN)
+		posix_spawn_file_actions_adddup2(&actions, devnullfd, STDIN_FILENO);
+
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGQUIT);
+	sigaddset(&set, SIGTSTP);
+	sigaddset(&set, SIGWINCH);
+	sigaddset(&set, SIGPIPE); /* Ignored while daemons run */
+	posix_spawnattr_setsigdefault(&attr, &set);
+
+	/* Detach from the terminal session */
+	if (flag & F_NOWAIT) {
+#ifdef POSIX_SPAWN_SETSID
+		attrflags |= POSIX_SPAWN_SETSID;
+#else
+		attrflags |= POSIX_SPAWN_SETPGROUP;
+#endif
+	}
+	posix_spawnattr_setflags(&attr, attrflags);
+
+	r = posix_spawnp(&pid, *argv, &actions, &attr, argv, environ);
+	if (r) {
+		DPRINTF_S(strerror(r));
+		pid = -1;
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return pid;
 }
 
 static int join(pid_t p, uchar_t flag)
@@ -2562,41 +3790,36 @@ static int spawn(char *file, char *arg1, char *arg2, char *arg3, ushort_t flag)
 	if (flag & F_NORMAL)
 		exitcurses();
 
-	pid = xfork(flag);
-	if (pid == 0) {
-		/* Suppress stdout and stderr */
-		if (flag & F_NOTRACE) {
-			if (flag & F_NOSTDIN)
-				dup2(devnullfd, STDIN_FILENO); // NOLINT
-			dup2(devnullfd, STDOUT_FILENO); // NOLINT
-			dup2(devnullfd, STDERR_FILENO); // NOLINT
-		} else if (flag & F_TTY) {
-			/* If stdout has been redirected to a non-tty, force output to tty */
-			if (!isatty(STDOUT_FILENO)) {
-				int fd = open(ctermid(NULL), O_WRONLY, 0200);
-				dup2(fd, STDOUT_FILENO);
-				close(fd);
-			}
-		}
+	reap_detached();
+#ifdef SPAWNHELPER
+	if ((flag & F_NOWAIT) && helper_spawn(argv, flag))
+		pid = 0;
+	else
+#endif
+		pid = xspawn(argv, flag, -1, -1);
 
-		execvp(*argv, argv);
-		_exit(EXIT_SUCCESS);
-	} else {
+	if (pid > 0 && (flag & F_NOWAIT) && ndetached < DETACHED_MAX)
+		detached[ndetached++] = pid;
+
+	if (pid > 0 && !(flag & F_NOWAIT)) {
+		/* The parent ignores the interrupt, quit and hangup signals */
+		sigaction(SIGHUP, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsighup);
+		sigaction(SIGTSTP, &(struct sigaction){.sa_handler = SIG_DFL}, &oldsigtstp);
+		sigaction(SIGWINCH, &(struct sigaction){.sa_handler = SIG_IGN}, &oldsigwinch);
 		retstatus = join(pid, flag);
 		DPRINTF_D(pid);
+	}
 
-		if ((flag & F_CONFIRM) || ((flag & F_CHKRTN) && retstatus)) {
-			status = write(STDOUT_FILENO, messages[MSG_ENTER], xstrlen(messages[MSG_ENTER]));
-			(void)status;
-			while ((read(STDIN_FILENO, &status, 1) > 0) && (status != '\n'));
-		}
-
-		if (flag & F_NORMAL)
-			refresh();
-
-		free(cmd);
+	if ((flag & F_CONFIRM) || ((flag & F_CHKRTN) && retstatus)) {
+		status = write(STDOUT_FILENO, messages[MSG_ENTER], xstrlen(messages[MSG_ENTER]));
+		(void)status;
+		while ((read(STDIN_FILENO, &status, 1) > 0) && (status != '\n'));
 	}
 
+	if (flag & F_NORMAL)
+		refresh();
+
+	free(cmd);
 	return retstatus;
 }
 
@@ -2638,20 +3861,14 @@ static void opstr(char *buf, char *op)
 	snprintf(buf, CMD_LEN_MAX, "xargs -0 sh -c '%s \"$0\" \"$@\" . < /dev/tty' < %s", op, selpath);
 }
 
-static bool rmmulstr(char *buf, bool use_trash)
+static void rmmulstr(char *buf, char r, bool use_trash)
 {
-	char r = confirm_force(TRUE, use_trash);
-	if (!r)
-		return FALSE;
-
 	if (!use_trash)
 		snprintf(buf, CMD_LEN_MAX, "xargs -0 sh -c 'rm -%cvr -- \"$0\" \"$@\" < /dev/tty' < %s",
 			 r, selpath);
 	else
 		snprintf(buf, CMD_LEN_MAX, "xargs -0 %s < %s",
 			 trashcmd, selpath);
-
-	return TRUE;
 }
 
 /* Returns TRUE if file is removed, else FALSE */
@@ -2661,13 +3878,18 @@ static bool xrm(char * const fpath, bool use_trash)
 	if (!r)
 		return FALSE;
 
-	if (!use_trash) {
+	if (use_trash)
+		spawn(trashcmd, fpath, NULL, NULL, F_NORMAL | F_MULTI);
+#ifndef NOFOPS
+	else if (r == 'f')
+		fop_fgrun(fop_init(fpath, FOP_RM, "rm", fpath));
+#endif
+	else {
 		char rm_opts[5] = "-vr\0";
 
 		rm_opts[3] = r;
 		spawn("rm", rm_opts, "--", fpath, F_NORMAL | F_CHKRTN);
-	} else
-		spawn(trashcmd, fpath, NULL, NULL, F_NORMAL | F_MULTI);
+	}
 
 	return (access(fpath, F_OK) == -1); /* File is removed */
 }
@@ -2706,11 +3928,8 @@ static bool cpmv_rename(int choice, const char *path)
 		return ret;
 
 	/* selsafe() returned TRUE for this to be called */
-	if (!selbufpos) {
-		snprintf(buf, sizeof(buf), "tr '\\0' '\\n' < %s > %s", selpath, g_tmpfpath);
-		spawn(utils[UTIL_SH_EXEC], buf, NULL, NULL, F_CLI);
-
-		count = entries_in_file(fd, buf, sizeof(buf), NEWLINE_CHAR);
+	if (selbufempty()) {
+		count = selfiletofd(fd);
 		if (!count)
 			goto finish;
 	} else
@@ -2745,3222 +3964,9732 @@ finish:
 	return ret;
 }
 
-static bool cpmvrm_selection(enum action sel, char *path)
+/* Skip self and parent */
+static inline bool selforparent(const char *path)
 {
-	int r;
+	return path[0] == '.' && (path[1] == '\0' || (path[1] == '.' && path[2] == '\0'));
+}
 
-	if (isselfileempty()) {
-		if (nselected)
-			clearselection();
-		printmsg(messages[MSG_0_SELECTED]);
-		return FALSE;
-	}
+/*
+ * Path of an archive member relative to the archive root without the
+ * leading / and ./, NULL if empty or it climbs out with ..
+ * The length excludes trailing slashes.
+ */
+static const char *arc_member(const char *name, size_t *plen)
+{
+	size_t len;
 
-	if (!selsafe())
-		return FALSE;
+	if (!name)
+		return NULL;
 
-	switch (sel) {
-	case SEL_CP:
-		opstr(g_buf, cp);
-		break;
-	case SEL_MV:
-		opstr(g_buf, mv);
-		break;
-	case SEL_CPMVAS:
-		r = get_input(messages[MSG_CP_MV_AS]);
-		if (r != 'c' && r != 'm') {
-			printmsg(messages[MSG_INVALID_KEY]);
-			return FALSE;
-		}
+	while (*name == '/' || (name[0] == '.' && name[1] == '/'))
+		name += (*name == '/') ? 1 : 2;
 
-		if (!cpmv_rename(r, path)) {
-			printmsg(messages[MSG_FAILED]);
-			return FALSE;
-		}
-		break;
-	default: /* SEL_TRASH, SEL_RM_RF */
-		if (!rmmulstr(g_buf, trashcmd && (sel == SEL_TRASH))) {
-			printmsg(messages[MSG_CANCEL]);
-			return FALSE;
-		}
-	}
+	len = xstrlen(name);
+	while (len && name[len - 1] == '/')
+		--len;
 
-	if (sel != SEL_CPMVAS && spawn(utils[UTIL_SH_EXEC], g_buf, NULL, NULL, F_CLI | F_CHKRTN)) {
-		printmsg(messages[MSG_FAILED]);
-		return FALSE;
+	if (!len || (len == 1 && *name == '.') || len >= PATH_MAX)
+		return NULL;
+
+	for (const char *p = name; p < name + len; ) {
+		const char *end = memchr(p, '/', name + len - p);
+
+		if (!end)
+			end = name + len;
+		if (end - p == 2 && p[0] == '.' && p[1] == '.')
+			return NULL;
+		p = end + 1;
 	}
 
-	/* Clear selection */
-	clearselection();
+	*plen = len;
+	return name;
+}
 
-	return TRUE;
+/*
+ * Archive member index
+ *
+ * A zip is indexed from its central directory, a tar from its headers
+ * (member data is skipped, not read) and other formats by libarchive if
+ * available. Members are sorted by (parent dir, name) so a dir lists from
+ * one range. Stored members are read in place at their offset, compressed
+ * ones are streamed by libarchive or unzip(1).
+ */
+static pthread_mutex_t arc_sortlock = PTHREAD_MUTEX_INITIALIZER;
+static const char *arc_names; /* Name pool of the index being sorted */
+
+static int arc_namecmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	int r = memcmp(a, b, MIN(alen, blen));
+
+	return r ? r : (alen > blen) - (alen < blen);
 }
 
-#ifndef NOBATCH
-static bool batch_rename(void)
+static inline const char *arc_base(const char *names, const arc_ent *ent, size_t *len)
 {
-	int fd1, fd2;
-	uint_t count = 0, lines = 0;
-	bool dir = FALSE, ret = FALSE;
-	char foriginal[TMP_LEN_MAX] = {0};
-	static const char batchrenamecmd[] = "paste -d'\n' %s %s | "SED" 'N; /^\\(.*\\)\\n\\1$/!p;d' | "
-					     "tr '\n' '\\0' | xargs -0 -n2 sh -c 'mv -i -- \"$0\" \"$@\" <"
-					     " /dev/tty'";
-	char buf[sizeof(batchrenamecmd) + (PATH_MAX << 1)];
-	int i = get_cur_or_sel();
+	size_t skip = ent->dlen ? ent->dlen + 1U : 0;
 
-	if (!i)
-		return ret;
+	*len = ent->len - skip;
+	return names + ent->name + skip;
+}
 
-	if (i == 'c') { /* Rename entries in current dir */
-		selbufpos = 0;
-		dir = TRUE;
-	}
+static int arc_entcmp(const void *va, const void *vb)
+{
+	const arc_ent *a = (const arc_ent *)va, *b = (const arc_ent *)vb;
+	const char *an, *bn;
+	size_t alen, blen;
+	int r = arc_namecmp(arc_names + a->name, a->dlen, arc_names + b->name, b->dlen);
 
-	fd1 = create_tmp_file();
-	if (fd1 == -1)
-		return ret;
+	if (r)
+		return r;
 
-	xstrsncpy(foriginal, g_tmpfpath, xstrlen(g_tmpfpath) + 1);
+	an = arc_base(arc_names, a, &alen);
+	bn = arc_base(arc_names, b, &blen);
+	r = arc_namecmp(an, alen, bn, blen);
 
-	fd2 = create_tmp_file();
-	if (fd2 == -1) {
-		unlink(foriginal);
-		close(fd1);
-		return ret;
-	}
+	/* Archive order for duplicates, the last one wins */
+	return r ? r : (a->name > b->name) - (a->name < b->name);
+}
 
-	if (dir)
-		for (i = 0; i < ndents; ++i)
-			appendfpath(pdents[i].name, NAME_MAX);
+/* First member at or after dir/name in the sorted index */
+static uint_t arc_lower(const arc_index *arc, const char *dir, size_t dlen, const char *name, size_t len)
+{
+	uint_t lo = 0, hi = arc->nents, mid;
+	const arc_ent *ent;
+	const char *base;
+	size_t blen;
+	int r;
 
-	seltofile(fd1, &count, NEWLINE);
-	seltofile(fd2, NULL, NEWLINE);
-	close(fd2);
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		ent = &arc->ents[mid];
+		r = arc_namecmp(arc->names + ent->name, ent->dlen, dir, dlen);
+		if (!r) {
+			base = arc_base(arc->names, ent, &blen);
+			r = arc_namecmp(base, blen, name, len);
+		}
 
-	if (dir) /* Don't retain dir entries in selection */
-		selbufpos = 0;
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	spawn((cfg.waitedit ? enveditor : editor), g_tmpfpath, NULL, NULL, F_CLI);
+	return lo;
+}
 
-	/* Reopen file descriptor to get updated contents */
-	fd2 = open(g_tmpfpath, O_RDONLY);
-	if (fd2 == -1)
-		goto finish;
+static arc_ent *arc_lookup(const arc_index *arc, const char *rel)
+{
+	size_t len = xstrlen(rel);
+	const char *name, *base = xmemrchr((uchar_t *)rel, '/', len);
+	size_t blen, dlen = base ? (size_t)(base - rel) : 0;
+	uint_t i;
+
+	base = base ? base + 1 : rel;
+	len -= base - rel;
+	i = arc_lower(arc, rel, dlen, base, len);
+	if (i == arc->nents
+	    || arc_namecmp(arc->names + arc->ents[i].name, arc->ents[i].dlen, rel, dlen))
+		return NULL;
 
-	lines = entries_in_file(fd2, buf, sizeof(buf), NEWLINE_CHAR);
-	DPRINTF_U(count);
-	DPRINTF_U(lines);
-	if (!lines || (count != lines)) {
-		DPRINTF_S("cannot delete files");
-		goto finish;
-	}
+	name = arc_base(arc->names, &arc->ents[i], &blen);
+	return arc_namecmp(name, blen, base, len) ? NULL : &arc->ents[i];
+}
 
-	snprintf(buf, sizeof(buf), batchrenamecmd, foriginal, g_tmpfpath);
-	spawn(utils[UTIL_SH_EXEC], buf, NULL, NULL, F_CLI);
-	ret = TRUE;
+/* Append to the name pool, returns the offset or SIZE_MAX */
+static size_t arc_addname(arc_index *arc, const char *name, size_t len)
+{
+	size_t off = arc->nameslen;
 
-finish:
-	if (fd1 >= 0)
-		close(fd1);
-	unlink(foriginal);
+	if (arc->nameslen + len + 1 > arc->namescap) {
+		size_t cap = (arc->namescap + len + 1) << 1;
+		char *names = xrealloc(arc->names, cap);
 
-	if (fd2 >= 0)
-		close(fd2);
-	unlink(g_tmpfpath);
+		if (!names)
+			return SIZE_MAX;
+		arc->names = names;
+		arc->namescap = cap;
+	}
 
-	return ret;
+	memcpy(arc->names + off, name, len);
+	arc->names[off + len] = '\0';
+	arc->nameslen += len + 1;
+
+	return off;
 }
-#endif
 
-static char *get_archive_cmd(const char *archive)
+static bool arc_addent(arc_index *arc, const char *path, size_t len, const arc_ent *tmpl, const char *link)
 {
-	uchar_t i = 3;
+	const char *base = xmemrchr((uchar_t *)path, '/', len);
+	arc_ent *ent;
+	size_t name, target = 0;
 
-	if (!g_state.usebsdtar && getutil(utils[UTIL_ATOOL]))
-		i = 0;
-	else if (getutil(utils[UTIL_BSDTAR]))
-		i = 1;
-	else if (is_suffix(archive, ".zip"))
-		i = 2;
-	// else tar
+	if (arc->nents == arc->entslen) {
+		ent = xrealloc(arc->ents, (arc->entslen + ARC_ENT_INCR) * sizeof(arc_ent));
+		if (!ent)
+			return FALSE;
+		arc->ents = ent;
+		arc->entslen += ARC_ENT_INCR;
+	}
 
-	return archive_cmd[i];
+	name = arc_addname(arc, path, len);
+	if (name == SIZE_MAX || (link && (target = arc_addname(arc, link, xstrlen(link))) == SIZE_MAX))
+		return FALSE;
+
+	ent = &arc->ents[arc->nents++];
+	*ent = *tmpl;
+	ent->name = name;
+	ent->link = target;
+	ent->len = (ushort_t)len;
+	ent->dlen = base ? (ushort_t)(base - path) : 0;
+	if (!(ent->mode & S_IFMT)) /* Hard links may come without a type */
+		ent->mode |= S_IFREG;
+	if (S_ISDIR(ent->mode))
+		ent->size = ent->csize = 0;
+	if (link)
+		ent->flags |= ARC_LINK;
+
+	return TRUE;
 }
 
-static void archive_selection(const char *cmd, const char *archive)
+/* Add a member and the parent dirs not seen in the previous member's path */
+static bool arc_add(arc_index *arc, const char *name, const arc_ent *tmpl, const char *link, char *lastdir)
 {
-	size_t len = xstrlen(patterns[P_ARCHIVE_CMD]) + xstrlen(cmd) + xstrlen(archive)
-	            + xstrlen(selpath) + 1;
-	char *buf = malloc(len);
-	if (!buf) {
-		DPRINTF_S(strerror(errno));
-		printwarn(NULL);
-		return;
+	const char *end;
+	size_t len, dlen;
+
+	name = arc_member(name, &len);
+	if (!name)
+		return TRUE;
+
+	end = xmemrchr((uchar_t *)name, '/', len);
+	dlen = end ? (size_t)(end - name) : 0;
+	if (dlen && (strncmp(lastdir, name, dlen) || lastdir[dlen])) {
+		arc_ent dir = *tmpl;
+
+		dir.mode = S_IFDIR | 0755;
+		dir.off = -1;
+		dir.flags = ARC_IMPLICIT;
+		for (end = memchr(name, '/', dlen + 1); end; end = memchr(end + 1, '/', name + dlen - end))
+			if (!arc_addent(arc, name, end - name, &dir, NULL))
+				return FALSE;
+
+		memcpy(lastdir, name, dlen);
+		lastdir[dlen] = '\0';
 	}
 
-	snprintf(buf, len, patterns[P_ARCHIVE_CMD], cmd, archive, selpath);
-	spawn(utils[UTIL_SH_EXEC], buf, NULL, NULL, F_CLI | F_CONFIRM);
-	free(buf);
+	return arc_addent(arc, name, len, tmpl, link);
 }
 
-static void write_lastdir(const char *curpath, const char *outfile)
+/* Sort and keep one member per path, archived dirs over implicit ones */
+static void arc_sort(arc_index *arc)
 {
-	bool tilde = false, ok = false;
-	if (!outfile)
-		xstrsncpy(cfgpath + xstrlen(cfgpath), "/.lastd", 8);
-	else
-		tilde = convert_tilde(outfile, g_buf);
+	uint_t i, n = 0;
+
+	pthread_mutex_lock(&arc_sortlock);
+	arc_names = arc->names;
+	qsort(arc->ents, arc->nents, sizeof(arc_ent), arc_entcmp);
+	pthread_mutex_unlock(&arc_sortlock);
+
+	for (i = 0; i < arc->nents; ++i) {
+		arc_ent *ent = &arc->ents[i];
+		size_t alen, blen;
+
+		if (n) {
+			arc_ent *prev = &arc->ents[n - 1];
+			const char *an = arc_base(arc->names, prev, &alen), *bn = arc_base(arc->names, ent, &blen);
+
+			if (prev->dlen == ent->dlen && !arc_namecmp(arc->names + prev->name, prev->dlen,
+								    arc->names + ent->name, ent->dlen)
+			    && !arc_namecmp(an, alen, bn, blen)) {
+				if (!(ent->flags & ARC_IMPLICIT))
+					*prev = *ent;
+				continue;
+			}
+		}
 
-	int fd = open(outfile
-			? (tilde ? g_buf : outfile)
-			: cfgpath, O_CREAT | O_WRONLY | O_TRUNC, S_IWUSR | S_IRUSR);
-	if (fd >= 0) {
-		memcpy(g_buf, "cd ", 3);  // NOLINT
-		ssize_t l = shell_escape(g_buf + 3, sizeof(g_buf) - 3, curpath);
-		ok = l >= 0 && write(fd, g_buf, l + 3) == l + 3;
-		close(fd);
+		arc->ents[n++] = *ent;
 	}
-	if (!ok)
-		errexit();
+
+	arc->nents = n;
 }
 
-/*
- * We assume none of the strings are NULL.
- *
- * Let's have the logic to sort numeric names in numeric order.
- * E.g., the order '1, 10, 2' doesn't make sense to human eyes.
- *
- * If the absolute numeric values are same, we fallback to alphasort.
- */
-static int xstricmp(const char * const s1, const char * const s2)
+static inline uint_t arc_le16(const uchar_t *p)
 {
-	char *p1, *p2;
-
-	long long v1 = strtoll(s1, &p1, 10);
-	long long v2 = strtoll(s2, &p2, 10);
-
-	/* Check if at least 1 string is numeric */
-	if (s1 != p1 || s2 != p2) {
-		/* Handle both pure numeric */
-		if (s1 != p1 && s2 != p2) {
-			if (v2 > v1)
-				return -1;
+	return p[0] | (uint_t)p[1] << 8;
+}
 
-			if (v1 > v2)
-				return 1;
-		}
+static inline uint_t arc_le32(const uchar_t *p)
+{
+	return p[0] | (uint_t)p[1] << 8 | (uint_t)p[2] << 16 | (uint_t)p[3] << 24;
+}
 
-		/* Only first string non-numeric */
-		if (s1 == p1)
-			return 1;
+static inline ullong_t arc_le64(const uchar_t *p)
+{
+	return arc_le32(p) | (ullong_t)arc_le32(p + 4) << 32;
+}
 
-		/* Only second string non-numeric */
-		if (s2 == p2)
-			return -1;
-	}
+static time_t arc_dostime(uint_t t, uint_t d)
+{
+	struct tm tm = {
+		.tm_sec = (t & 0x1f) << 1, .tm_min = (t >> 5) & 0x3f, .tm_hour = t >> 11,
+		.tm_mday = d & 0x1f, .tm_mon = ((d >> 5) & 0xf) - 1, .tm_year = (d >> 9) + 80,
+		.tm_isdst = -1,
+	};
 
-	/* Handle 1. all non-numeric and 2. both same numeric value cases */
-#ifndef NOLC
-	return strcoll(s1, s2);
-#else
-	return strcasecmp(s1, s2);
-#endif
+	return mktime(&tm);
 }
 
-/*
- * Version comparison
- *
- * The code for version compare is a modified version of the GLIBC
- * and uClibc implementation of strverscmp(). The source is here:
- * https://elixir.bootlin.com/uclibc-ng/latest/source/libc/string/strverscmp.c
- */
-
-/*
- * Compare S1 and S2 as strings holding indices/version numbers,
- * returning less than, equal to or greater than zero if S1 is less than,
- * equal to or greater than S2 (for more info, see the texinfo doc).
- *
- * Ignores case.
- */
-static int xstrverscasecmp(const char * const s1, const char * const s2)
+/* Sizes, offset and mtime from the zip64 and extended timestamp extra fields */
+static void arc_zipextra(const uchar_t *p, const uchar_t *end, arc_ent *ent)
 {
-	const uchar_t *p1 = (const uchar_t *)s1;
-	const uchar_t *p2 = (const uchar_t *)s2;
-	int state, diff;
-	uchar_t c1, c2;
+	for (uint_t id, len; end - p >= 4; p += 4 + len) {
+		id = arc_le16(p);
+		len = arc_le16(p + 2);
+		if ((size_t)(end - p - 4) < len)
+			break;
 
-	/*
-	 * Symbol(s)    0       [1-9]   others
-	 * Transition   (10) 0  (01) d  (00) x
-	 */
-	static const uint8_t next_state[] = {
-		/* state    x    d    0  */
-		/* S_N */  S_N, S_I, S_Z,
-		/* S_I */  S_N, S_I, S_I,
-		/* S_F */  S_N, S_F, S_F,
-		/* S_Z */  S_N, S_F, S_Z
-	};
+		if (id == 0x0001) {
+			const uchar_t *v = p + 4, *vend = v + len;
 
-	alignas(max_align_t) static const int8_t result_type[] = {
-		/* state   x/x  x/d  x/0  d/x  d/d  d/0  0/x  0/d  0/0  */
+			if (ent->size == 0xFFFFFFFF && vend - v >= 8) {
+				ent->size = (off_t)arc_le64(v);
+				v += 8;
+			}
+			if (ent->csize == 0xFFFFFFFF && vend - v >= 8) {
+				ent->csize = (off_t)arc_le64(v);
+				v += 8;
+			}
+			if (ent->off == 0xFFFFFFFF && vend - v >= 8)
+				ent->off = (off_t)arc_le64(v);
+		} else if (id == 0x5455 && len >= 5 && (p[4] & 1))
+			ent->mtime = (time_t)(int)arc_le32(p + 5);
+	}
+}
 
-		/* S_N */  VCMP, VCMP, VCMP, VCMP, VLEN, VCMP, VCMP, VCMP, VCMP,
-		/* S_I */  VCMP,   -1,   -1,    1, VLEN, VLEN,    1, VLEN, VLEN,
-		/* S_F */  VCMP, VCMP, VCMP, VCMP, VCMP, VCMP, VCMP, VCMP, VCMP,
-		/* S_Z */  VCMP,    1,    1,   -1, VCMP, VCMP,   -1, VCMP, VCMP
-	};
+/* Returns 1 if indexed, 0 if not a zip, -1 on error */
+static int arc_zip(arc_index *arc, int fd, const struct stat *sb)
+{
+	uchar_t *buf, *p, *end, *eocd = NULL;
+	ullong_t n, cdoff, cdlen;
+	size_t tail = (size_t)MIN(sb->st_size, 0xFFFF + 22);
+	char name[PATH_MAX], link[PATH_MAX], lastdir[PATH_MAX] = "";
+	int r = -1;
 
-	if (p1 == p2)
+	if (tail < 22)
 		return 0;
 
-	c1 = TOUPPER(*p1);
-	++p1;
-	c2 = TOUPPER(*p2);
-	++p2;
+	buf = malloc(tail);
+	if (!buf)
+		return -1;
 
-	/* Hint: '0' is a digit too.  */
-	state = S_N + ((c1 == '0') + (xisdigit(c1) != 0));
+	if (pread(fd, buf, tail, sb->st_size - tail) != (ssize_t)tail) {
+		free(buf);
+		return 0;
+	}
 
-	while ((diff = c1 - c2) == 0) {
-		if (c1 == '\0')
-			return diff;
+	for (p = buf + tail - 22; p >= buf; --p)
+		if (arc_le32(p) == 0x06054b50) {
+			eocd = p;
+			break;
+		}
 
-		state = next_state[state];
-		c1 = TOUPPER(*p1);
-		++p1;
-		c2 = TOUPPER(*p2);
-		++p2;
-		state += (c1 == '0') + (xisdigit(c1) != 0);
+	if (!eocd) {
+		free(buf);
+		return 0;
 	}
 
-	state = result_type[state * 3 + (((c2 == '0') + (xisdigit(c2) != 0)))]; // NOLINT
-
-	switch (state) {
-	case VCMP:
-		return diff;
-	case VLEN:
-		while (xisdigit(*p1++))
-			if (!xisdigit(*p2++))
-				return 1;
-		return xisdigit(*p2) ? -1 : diff;
-	default:
-		return state;
+	n = arc_le16(eocd + 10);
+	cdlen = arc_le32(eocd + 12);
+	cdoff = arc_le32(eocd + 16);
+	if ((cdoff == 0xFFFFFFFF || n == 0xFFFF) && eocd - buf >= 20 && arc_le32(eocd - 20) == 0x07064b50) {
+		uchar_t z64[56];
+
+		if (pread(fd, z64, sizeof(z64), (off_t)arc_le64(eocd - 12)) == sizeof(z64)
+		    && arc_le32(z64) == 0x06064b50) {
+			n = arc_le64(z64 + 32);
+			cdlen = arc_le64(z64 + 40);
+			cdoff = arc_le64(z64 + 48);
+		}
 	}
-}
+	free(buf);
 
-static int (*namecmpfn)(const char * const s1, const char * const s2) = &xstricmp;
+	if (cdoff + cdlen > (ullong_t)sb->st_size || !(buf = malloc(cdlen + 1)))
+		return -1;
 
-static char * (*fnstrstr)(const char *haystack, const char *needle) = &strcasestr;
-#ifdef PCRE2
-static const unsigned char *tables;
-static int pcre2flags = PCRE2_NO_AUTO_CAPTURE | PCRE2_EXTENDED | PCRE2_CASELESS | PCRE2_UTF;
-#else
-static int regflags = REG_NOSUB | REG_EXTENDED | REG_ICASE;
+	if (pread(fd, buf, cdlen, (off_t)cdoff) != (ssize_t)cdlen)
+		goto done;
+
+	end = buf + cdlen;
+	for (p = buf; n && end - p >= 46 && arc_le32(p) == 0x02014b50; --n) {
+		uint_t nlen = arc_le16(p + 28), xlen = arc_le16(p + 30), clen = arc_le16(p + 32);
+		uint_t attr = arc_le32(p + 38) >> 16;
+		arc_ent ent = {0};
+		char *target = NULL;
+
+		if ((size_t)(end - p - 46) < (size_t)nlen + xlen + clen)
+			break;
+
+		ent.csize = arc_le32(p + 20);
+		ent.size = arc_le32(p + 24);
+		ent.off = arc_le32(p + 42);
+		ent.mtime = arc_dostime(arc_le16(p + 12), arc_le16(p + 14));
+		arc_zipextra(p + 46 + nlen, p + 46 + nlen + xlen, &ent);
+
+		/* Unix modes are in the high half of the external attributes */
+		if ((p[5] == 3 || p[5] == 19) && (attr & S_IFMT))
+			ent.mode = attr;
+		else
+			ent.mode = (nlen && p[46 + nlen - 1] == '/') ? (S_IFDIR | 0755) : (S_IFREG | 0644);
+#ifndef NOUG
+		ent.uid = getuid();
+		ent.gid = getgid();
 #endif
+		if (arc_le16(p + 8) & 1)
+			ent.flags = ARC_CRYPT;
+		else if (arc_le16(p + 10))
+			ent.flags = ARC_PACKED;
+
+		/* Link targets are the data of stored links */
+		if (S_ISLNK(ent.mode) && !ent.flags && ent.size < PATH_MAX) {
+			uchar_t lh[30];
+
+			if (pread(fd, lh, sizeof(lh), ent.off) == sizeof(lh) && arc_le32(lh) == 0x04034b50
+			    && pread(fd, link, ent.size, ent.off + 30 + arc_le16(lh + 26) + arc_le16(lh + 28))
+			       == ent.size) {
+				link[ent.size] = '\0';
+				target = link;
+			}
+		}
 
-#ifdef PCRE2
-static int setfilter(pcre2_code **pcre2x, const char *filter)
-{
-	int errcode;
-	PCRE2_SIZE erroffset;
+		p += 46;
+		if (nlen < PATH_MAX) {
+			memcpy(name, p, nlen);
+			name[nlen] = '\0';
+			if (!arc_add(arc, name, &ent, target, lastdir))
+				goto done;
+		}
+		p += nlen + xlen + clen;
+	}
 
-	*pcre2x = pcre2_compile((PCRE2_SPTR)filter, PCRE2_ZERO_TERMINATED, pcre2flags, &errcode, &erroffset, NULL);
-	return *pcre2x ? 0 : -1;
-}
-#else
-static int setfilter(regex_t *regex, const char *filter)
-{
-	return regcomp(regex, filter, regflags);
+	arc->fmt = ARC_ZIP;
+	r = 1;
+done:
+	free(buf);
+	return r;
 }
-#endif
 
-static int visible_re(const fltrexp_t *fltrexp, const char *fname)
+/* Octal or base-256 tar header number */
+static ullong_t arc_tarnum(const uchar_t *p, size_t len)
 {
-#ifdef PCRE2
-	int r = 0;
-	pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(fltrexp->pcre2x, NULL);
+	ullong_t n = 0;
 
-	if (match_data) {
-		r = pcre2_match(fltrexp->pcre2x, (PCRE2_SPTR)fname, xstrlen(fname), 0, 0, match_data, NULL);
-		pcre2_match_data_free(match_data);
+	if (*p & 0x80) {
+		n = *p & 0x3f;
+		while (--len)
+			n = (n << 8) | *++p;
+		return n;
 	}
 
-	return r > 0;
-#else
-	return regexec(fltrexp->regex, fname, 0, NULL, 0) == 0;
-#endif
+	for (; len && (*p == ' ' || !*p); ++p, --len)
+		if (!*p)
+			return 0;
+	for (; len && *p >= '0' && *p <= '7'; ++p, --len)
+		n = (n << 3) | (*p - '0');
+
+	return n;
 }
 
-static int visible_str(const fltrexp_t *fltrexp, const char *fname)
+static bool arc_tarsum(const uchar_t *hdr)
 {
-	return fnstrstr(fname, fltrexp->str) != NULL;
-}
+	ullong_t sum = 0;
 
-static int (*filterfn)(const fltrexp_t *fltr, const char *fname) = &visible_str;
+	for (uint_t i = 0; i < 512; ++i)
+		sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
 
-static void clearfilter(void)
+	return sum == arc_tarnum(hdr + 148, 8);
+}
+
+/* Path, link target, size and mtime records of a pax extended header */
+static void arc_pax(char *rec, size_t len, char *name, char *link, arc_ent *ent)
 {
-	char * const fltr = g_ctx[cfg.curctx].c_fltr;
+	char *end = rec + len, *key, *val, *next;
 
-	if (fltr[1]) {
-		fltr[REGEX_MAX - 1] = fltr[1];
-		fltr[1] = '\0';
+	for (; rec < end; rec = next) {
+		len = strtoul(rec, &key, 10);
+		if (!len || key == rec || *key != ' ' || (size_t)(end - rec) < len)
+			break;
+
+		next = rec + len;
+		++key;
+		val = memchr(key, '=', next - key);
+		if (!val || next[-1] != '\n')
+			continue;
+
+		next[-1] = '\0';
+		*val++ = '\0';
+		if (!strcmp(key, "path"))
+			xstrsncpy(name, val, PATH_MAX);
+		else if (!strcmp(key, "linkpath"))
+			xstrsncpy(link, val, PATH_MAX);
+		else if (!strcmp(key, "size"))
+			ent->size = ent->csize = strtoll(val, NULL, 10);
+		else if (!strcmp(key, "mtime"))
+			ent->mtime = strtoll(val, NULL, 10);
 	}
 }
 
-static int entrycmp(const void *va, const void *vb)
+/* Returns 1 if indexed, 0 if not an uncompressed tar, -1 on error */
+static int arc_tar(arc_index *arc, int fd, const struct stat *sb)
 {
-	const struct entry *pa = (pEntry)va;
-	const struct entry *pb = (pEntry)vb;
+	uchar_t hdr[512];
+	char name[PATH_MAX], link[PATH_MAX], lastdir[PATH_MAX] = "";
+	char *buf;
+	off_t off = 0;
+	arc_ent ext = {.size = -1, .mtime = -1}; /* Overrides from the preceding headers */
 
-	if ((pb->flags & DIR_OR_DIRLNK) != (pa->flags & DIR_OR_DIRLNK)) {
-		if (pb->flags & DIR_OR_DIRLNK)
-			return 1;
-		return -1;
-	}
+	if (pread(fd, hdr, 512, 0) != 512 || !arc_tarsum(hdr))
+		return 0;
 
-	/* Sort based on specified order */
-	if (cfg.timeorder) {
-		if (pb->sec > pa->sec)
-			return 1;
-		if (pb->sec < pa->sec)
-			return -1;
-		/* If sec matches, comare nsec */
-		if (pb->nsec > pa->nsec)
-			return 1;
-		if (pb->nsec < pa->nsec)
+	name[0] = link[0] = '\0';
+	while (off + 512 <= sb->st_size && pread(fd, hdr, 512, off) == 512) {
+		arc_ent ent = {0};
+		uchar_t type = hdr[156];
+
+		if (!hdr[0] && !memcmp(hdr, hdr + 1, 511)) /* End of archive */
+			break;
+
+		if (!arc_tarsum(hdr))
 			return -1;
-	} else if (cfg.sizeorder) {
-		if (pb->size > pa->size)
-			return 1;
-		if (pb->size < pa->size)
+
+		ent.size = ent.csize = (off_t)arc_tarnum(hdr + 124, 12);
+		if (ext.size != -1 && type != 'L' && type != 'K' && type != 'x' && type != 'g')
+			ent.size = ent.csize = ext.size;
+		/* A crafted size must not stall or rewind the walk */
+		if (ent.size < 0 || ent.size > sb->st_size)
 			return -1;
-	} else if (cfg.blkorder) {
-		if (pb->blocks > pa->blocks)
-			return 1;
-		if (pb->blocks < pa->blocks)
+		ent.off = off + 512;
+		if (ent.off + ((ent.size + 511) & ~(off_t)511) <= off)
 			return -1;
-	} else if (cfg.extnorder && !(pb->flags & DIR_OR_DIRLNK)) {
-		char *extna = xextension(pa->name, pa->nlen - 1);
-		char *extnb = xextension(pb->name, pb->nlen - 1);
+		off = ent.off + ((ent.size + 511) & ~(off_t)511);
 
-		if (extna || extnb) {
-			if (!extna)
+		if (type == 'L' || type == 'K' || type == 'x') {
+			if (ent.size >= (type == 'x' ? (1 << 20) : PATH_MAX) || !(buf = malloc(ent.size + 1)))
 				return -1;
+			if (pread(fd, buf, ent.size, ent.off) != ent.size) {
+				free(buf);
+				return -1;
+			}
 
-			if (!extnb)
-				return 1;
+			buf[ent.size] = '\0';
+			if (type == 'x')
+				arc_pax(buf, ent.size, name, link, &ext);
+			else
+				xstrsncpy(type == 'L' ? name : link, buf, PATH_MAX);
+			free(buf);
+			continue;
+		}
 
-			int ret = strcasecmp(extna, extnb);
+		if (type == 'g') /* Global pax header */
+			continue;
 
-			if (ret)
-				return ret;
+		/* POSIX headers split long names in a prefix */
+		if (!name[0]) {
+			if (!memcmp(hdr + 257, "ustar", 6) && hdr[345])
+				snprintf(name, PATH_MAX, "%.155s/%.100s", (char *)hdr + 345, (char *)hdr);
+			else
+				snprintf(name, PATH_MAX, "%.100s", (char *)hdr);
 		}
-	}
+		if (!link[0])
+			snprintf(link, PATH_MAX, "%.100s", (char *)hdr + 157);
 
-	return namecmpfn(pa->name, pb->name);
-}
+		ent.mode = (mode_t)arc_tarnum(hdr + 100, 8) & 07777;
+		ent.mtime = (ext.mtime != -1) ? ext.mtime : (time_t)arc_tarnum(hdr + 136, 12);
+#ifndef NOUG
+		ent.uid = (uid_t)arc_tarnum(hdr + 108, 8);
+		ent.gid = (gid_t)arc_tarnum(hdr + 116, 8);
+#endif
+		switch (type) {
+		case '1':
+			ent.mode |= S_IFREG;
+			ent.flags = ARC_HARDLINK;
+			break;
+		case '2':
+			ent.mode |= S_IFLNK;
+			break;
+		case '3':
+			ent.mode |= S_IFCHR;
+			break;
+		case '4':
+			ent.mode |= S_IFBLK;
+			break;
+		case '5':
+			ent.mode |= S_IFDIR;
+			break;
+		case '6':
+			ent.mode |= S_IFIFO;
+			break;
+		case 'S': /* GNU sparse */
+			ent.mode |= S_IFREG;
+			ent.flags = ARC_CRYPT;
+			break;
+		default:
+			ent.mode |= S_IFREG;
+			break;
+		}
 
-static int reventrycmp(const void *va, const void *vb)
-{
-	if ((((pEntry)vb)->flags & DIR_OR_DIRLNK)
-	    != (((pEntry)va)->flags & DIR_OR_DIRLNK)) {
-		if (((pEntry)vb)->flags & DIR_OR_DIRLNK)
-			return 1;
-		return -1;
+		if (!arc_add(arc, name, &ent, (type == '1' || type == '2') ? link : NULL, lastdir))
+			return -1;
+
+		name[0] = link[0] = '\0';
+		ext.size = ext.mtime = -1;
 	}
 
-	return -entrycmp(va, vb);
+	arc->fmt = ARC_TAR;
+	return 1;
 }
 
-static int (*entrycmpfn)(const void *va, const void *vb) = &entrycmp;
-
-/* In case of an error, resets *wch to Esc */
-static int handle_alt_key(wint_t *wch)
+#ifdef LIBARCHIVE
+/* Any other format libarchive reads, members are numbered in archive order */
+static int arc_la(arc_index *arc)
 {
-	timeout(0);
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
+	char lastdir[PATH_MAX] = "";
+	off_t seq = 0;
+	int r = ARCHIVE_FATAL;
 
-	int r = get_wch(wch);
+	if (!a)
+		return -1;
 
-	if (r == ERR)
-		*wch = ESC;
-	cleartimeout();
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if (archive_read_open_filename(a, arc->path, 1 << 16) == ARCHIVE_OK)
+		while ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN) {
+			const struct stat *sb = archive_entry_stat(entry);
+			const char *link = archive_entry_hardlink(entry);
+			arc_ent ent = {
+				.off = seq++, .size = sb->st_size, .csize = sb->st_size,
+				.mtime = sb->st_mtime, .mode = sb->st_mode,
+#ifndef NOUG
+				.uid = sb->st_uid, .gid = sb->st_gid,
+#endif
+				.flags = link ? (ARC_HARDLINK | ARC_PACKED) : ARC_PACKED,
+			};
+
+			if (!link)
+				link = archive_entry_symlink(entry);
+			if (!arc_add(arc, archive_entry_pathname(entry), &ent, link, lastdir)
+			    || g_state.interrupt) {
+				r = ARCHIVE_FATAL;
+				break;
+			}
+		}
 
-	return r;
+	archive_read_free(a);
+	arc->fmt = ARC_LA;
+	return (r == ARCHIVE_EOF) ? 1 : -1;
 }
+#endif
 
-static inline int handle_event(void)
+static void arc_close(arc_index *arc)
 {
-	if (nselected && isselfileempty())
-		clearselection();
-	return CONTROL('L');
+	if (!arc)
+		return;
+
+	free(arc->ents);
+	free(arc->names);
+	free(arc);
 }
 
-/*
- * Returns SEL_* if key is bound and 0 otherwise.
- * Also modifies the run and env pointers (used on SEL_{RUN,RUNARG}).
- * The next keyboard input can be simulated by presel.
- */
-static int nextsel(int presel)
+/* Index an archive, the caller owns it */
+static arc_index *arc_open(const char *path)
 {
-#ifdef BENCH
-	return SEL_QUIT;
-#endif
-	wint_t c = presel;
-	int i = 0;
-	bool escaped = FALSE;
+	struct stat sb;
+	arc_index *arc;
+	int r = 0, fd = open(path, O_RDONLY | O_CLOEXEC);
 
-	if (c == 0 || c == MSGWAIT) {
-try_quit:
-		i = get_wch(&c);
-		//DPRINTF_D(c);
-		//DPRINTF_S(keyname(c));
+	if (fd == -1)
+		return NULL;
 
-#ifdef KEY_RESIZE
-		if (c == KEY_RESIZE)
-			handle_key_resize();
-#endif
+	arc = calloc(1, sizeof(arc_index));
+	if (!arc || fstat(fd, &sb) == -1) {
+		close(fd);
+		free(arc);
+		return NULL;
+	}
 
-		/* Handle Alt+key */
-		if (c == ESC) {
-			timeout(0);
-			i = get_wch(&c);
-			if (i != ERR) {
-				if (c == ESC)
-					c = CONTROL('L');
-				else {
-					unget_wch(c);
-					c = ';';
-				}
-				settimeout();
-			} else if (escaped) {
-				settimeout();
-				c = CONTROL('Q');
-			} else {
-#ifndef NOFIFO
-				if (!g_state.fifomode)
-					notify_fifo(TRUE); /* Send hovered path to NNN_FIFO */
+	arc->plen = xstrsncpy(arc->path, path, PATH_MAX) - 1;
+	arc->dev = sb.st_dev;
+	arc->ino = sb.st_ino;
+	arc->mtime = sb.st_mtime;
+
+	if (S_ISREG(sb.st_mode)) {
+		r = arc_zip(arc, fd, &sb);
+		if (!r)
+			r = arc_tar(arc, fd, &sb);
+#ifdef LIBARCHIVE
+		if (!r)
+			r = arc_la(arc);
 #endif
-				escaped = TRUE;
-				settimeout();
-				goto try_quit;
-			}
-		}
+	}
+	close(fd);
 
-		if (i == ERR && presel == MSGWAIT)
-			c = (cfg.filtermode || filterset()) ? FILTER : CONTROL('L');
-		else if (c == FILTER || c == CONTROL('L'))
-			/* Clear previous filter when manually starting */
-			clearfilter();
+	if (r != 1) {
+		arc_close(arc);
+		errno = r ? EINVAL : EOPNOTSUPP;
+		return NULL;
 	}
 
-	if (i == ERR) {
-		++idle;
+	arc_sort(arc);
+	return arc;
+}
 
-		/*
-		 * Do not check for directory changes in du mode.
-		 * A redraw forces du calculation.
-		 * Check for changes every odd second.
-		 */
-#ifdef LINUX_INOTIFY
-		if (!cfg.blkorder && inotify_wd >= 0 && (idle & 1)) {
-			struct inotify_event *event;
-			char inotify_buf[EVENT_BUF_LEN] = {0};
+/* The archive a path is in (or is), NULL if the deepest existing path isn't a file */
+static char *arc_root(const char *path, char *buf)
+{
+	struct stat sb;
+	char *p;
 
-			i = read(inotify_fd, inotify_buf, EVENT_BUF_LEN);
-			if (i > 0) {
-				for (char *ptr = inotify_buf;
-				     ptr + ((struct inotify_event *)ptr)->len < inotify_buf + i;
-				     ptr += sizeof(struct inotify_event) + event->len) {
-					event = (struct inotify_event *)ptr;
-					DPRINTF_D(event->wd);
-					DPRINTF_D(event->mask);
-					if (!event->wd)
-						break;
+	xstrsncpy(buf, path, PATH_MAX);
+	while (stat(buf, &sb) == -1) {
+		p = strrchr(buf, '/');
+		if (!p || p == buf)
+			return NULL;
+		*p = '\0';
+	}
 
-					if (event->mask & INOTIFY_MASK) {
-						c = handle_event();
-						break;
-					}
-				}
-				DPRINTF_S("inotify read done");
-			}
-		}
-#elif defined(BSD_KQUEUE)
-		if (!cfg.blkorder && event_fd >= 0 && (idle & 1)) {
-			struct kevent event_data[NUM_EVENT_SLOTS] = {0};
+	return S_ISREG(sb.st_mode) ? buf : NULL;
+}
 
-			if (kevent(kq, events_to_monitor, NUM_EVENT_SLOTS,
-				   event_data, NUM_EVENT_FDS, &gtimeout) > 0)
-				c = handle_event();
+static int arc_write(int out, const char *buf, size_t len)
+{
+	for (ssize_t w; len; buf += w, len -= w) {
+		w = write(out, buf, len);
+		if (w < 0) {
+			if (errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			return errno;
 		}
-#elif defined(HAIKU_NM)
-		if (!cfg.blkorder && haiku_nm_active && (idle & 1) && haiku_is_update_needed(haiku_hnd))
-			c = handle_event();
-#endif
-	} else
-		idle = 0;
-
-	for (i = 0; i < (int)ELEMENTS(bindings); ++i)
-		if (c == bindings[i].sym)
-			return bindings[i].act;
+	}
 
 	return 0;
 }
 
-static int getorderstr(char *sort)
+/* Copy len bytes at off, in the kernel where possible */
+static int arc_copy(int fd, off_t off, off_t len, int out)
 {
-	int i = 0;
+	char *buf;
+	ssize_t n;
+	int r = 0;
 
-	if (cfg.showhidden)
-		sort[i++] = 'H';
+#ifdef __linux__
+	while (len > 0 && (n = copy_file_range(fd, &off, out, NULL, len, 0)) > 0)
+		len -= n;
+#endif
+	if (len <= 0)
+		return 0;
 
-	if (cfg.timeorder)
-		sort[i++] = (cfg.timetype == T_MOD) ? 'M' : ((cfg.timetype == T_ACCESS) ? 'A' : 'C');
-	else if (cfg.sizeorder)
-		sort[i++] = 'S';
-	else if (cfg.extnorder)
-		sort[i++] = 'E';
+	buf = malloc(ARC_BUFSIZ);
+	if (!buf)
+		return errno;
 
-	if (entrycmpfn == &reventrycmp)
-		sort[i++] = 'R';
+	while (!r && len > 0) {
+		n = pread(fd, buf, MIN(len, ARC_BUFSIZ), off);
+		if (n <= 0)
+			r = n ? errno : EIO;
+		else {
+			r = arc_write(out, buf, n);
+			off += n;
+			len -= n;
+		}
+	}
 
-	if (namecmpfn == &xstrverscasecmp)
-		sort[i++] = 'V';
+	free(buf);
+	return r;
+}
 
-	if (i)
-		sort[i] = ' ';
+#ifdef LIBARCHIVE
+/* Scan forward to the member, from the start once if it's behind */
+static int arc_readla(arc_reader *rd, const arc_ent *ent, int out)
+{
+	struct archive_entry *entry;
+	const char *name;
+	size_t len;
+	int r;
 
-	return i;
-}
+	for (int pass = 0; pass < 2; ++pass) {
+		if (!rd->a) {
+			rd->a = archive_read_new();
+			if (!rd->a)
+				return ENOMEM;
+			archive_read_support_filter_all(rd->a);
+			archive_read_support_format_all(rd->a);
+			if (archive_read_open_filename(rd->a, rd->arc->path, 1 << 16) != ARCHIVE_OK)
+				return EIO;
+		}
 
-static void showfilterinfo(void)
+		while ((r = archive_read_next_header(rd->a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN) {
+			name = arc_member(archive_entry_pathname(entry), &len);
+			if (name && len == ent->len && !memcmp(name, rd->arc->names + ent->name, len))
+				return (archive_read_data_into_fd(rd->a, out) == ARCHIVE_OK) ? 0 : EIO;
+		}
+
+		archive_read_free(rd->a);
+		rd->a = NULL;
+	}
+
+	return ENOENT;
+}
+#else
+/* unzip(1) takes the member name as a pattern */
+static int arc_unzip(const arc_index *arc, const arc_ent *ent, int out)
 {
-	int i = 0;
-	char info[REGEX_MAX] = "\0\0\0\0\0";
+	char pat[PATH_MAX << 1], *p = pat;
+	const char *name = arc->names + ent->name;
+	pid_t pid;
+	int status;
 
-	i = getorderstr(info);
+	for (; *name; *p++ = *name++)
+		if (strchr("[]*?\\", *name))
+			*p++ = '\\';
+	*p = '\0';
 
-	if (cfg.fileinfo && ndents && get_output("file", "-b", pdents[cur].name, -1, FALSE))
-		mvaddstr(xlines - 2, 2, g_buf);
-	else
-		snprintf(info + i, REGEX_MAX - i - 1, "  %s [/], %s [:]",
-			 (cfg.regex ? "reg" : "str"), ((fnstrstr == &strcasestr) ? "ic" : "noic"));
+	pid = xspawn((char *[]){utils[UTIL_UNZIP], "-p", (char *)arc->path, pat, NULL}, F_NOTRACE | F_NOSTDIN, -1, out);
+	if (pid == -1)
+		return EIO;
 
-	mvaddstr(xlines - 2, xcols - xstrlen(info), info);
+	while (waitpid(pid, &status, 0) == -1)
+		if (errno != EINTR)
+			return errno;
+
+	return (WIFEXITED(status) && !WEXITSTATUS(status)) ? 0 : EIO;
 }
+#endif
 
-static void showfilter(char *str)
+static void arc_rclose(arc_reader *rd)
 {
-	attron(COLOR_PAIR(cfg.curctx + 1));
-	showfilterinfo();
-	printmsg_nc(str);
-	attroff(COLOR_PAIR(cfg.curctx + 1));
+	if (rd->fd != -1)
+		close(rd->fd);
+#ifdef LIBARCHIVE
+	if (rd->a)
+		archive_read_free(rd->a);
+#endif
 }
 
-static inline void swap_ent(int id1, int id2)
+static void arc_ropen(arc_reader *rd, arc_index *arc)
 {
-	struct entry _dent, *pdent1 = &pdents[id1], *pdent2 =  &pdents[id2];
-
-	*(&_dent) = *pdent1;
-	*pdent1 = *pdent2;
-	*pdent2 = *(&_dent);
+	rd->arc = arc;
+	rd->fd = open(arc->path, O_RDONLY | O_CLOEXEC);
+#ifdef LIBARCHIVE
+	rd->a = NULL;
+#endif
 }
 
-#ifdef PCRE2
-static int fill(const char *fltr, pcre2_code *pcre2x)
-#else
-static int fill(const char *fltr, regex_t *re)
-#endif
+/* Write the data of a member to out, returns 0 or the error */
+static int arc_read(arc_reader *rd, const arc_ent *ent, int out)
 {
-#ifdef PCRE2
-	fltrexp_t fltrexp = { .pcre2x = pcre2x, .str = fltr };
+	uchar_t lh[30];
+	off_t off;
+
+	if (ent->flags & ARC_HARDLINK) {
+		size_t len;
+		const char *target = arc_member(rd->arc->names + ent->link, &len);
+		char rel[PATH_MAX];
+
+		if (!target)
+			return ENOENT;
+		xstrsncpy(rel, target, len + 1);
+		ent = arc_lookup(rd->arc, rel);
+		if (!ent || (ent->flags & ARC_HARDLINK) || !S_ISREG(ent->mode))
+			return ENOENT;
+	}
+
+	if (ent->flags & ARC_CRYPT)
+		return EOPNOTSUPP;
+
+	if (ent->flags & ARC_PACKED)
+#ifdef LIBARCHIVE
+		return arc_readla(rd, ent, out);
 #else
-	fltrexp_t fltrexp = { .regex = re, .str = fltr };
+		return arc_unzip(rd->arc, ent, out);
 #endif
 
-	for (int count = 0; count < ndents; ++count) {
-		if (filterfn(&fltrexp, pdents[count].name) == 0) {
-			if (count != --ndents) {
-				swap_ent(count, ndents);
-				--count;
-			}
+	if (rd->fd == -1)
+		return EBADF;
 
-			continue;
-		}
+	off = ent->off;
+	if (rd->arc->fmt == ARC_ZIP) {
+		if (pread(rd->fd, lh, sizeof(lh), off) != sizeof(lh) || arc_le32(lh) != 0x04034b50)
+			return EIO;
+		off += 30 + arc_le16(lh + 26) + arc_le16(lh + 28);
 	}
 
-	return ndents;
+	return arc_copy(rd->fd, off, ent->size, out);
 }
 
-static int matches(const char *fltr)
+#ifndef NOFOPS
+/*
+ * Native copy/move/remove engine
+ *
+ * A job thread resolves renames, scans the sources for the totals and walks
+ * the trees. Dirs, symlinks and special files are created by the walker,
+ * regular files are queued for the worker pool. Data is copied by reflink,
+ * copy_file_range(2) or sendfile(2) (Linux) with a buffered fallback.
+ *
+ * Removal empties dirs in parallel from a shared stack: entries are unlinked
+ * relative to the dir fd, subdirs pushed and a dir is removed by whoever
+ * drops its last reference.
+ */
+static void fop_wake(fop_job *job)
 {
-#ifdef PCRE2
-	pcre2_code *pcre2x = NULL;
+	pthread_cond_broadcast(&job->notempty);
+	pthread_cond_broadcast(&job->notfull);
+}
 
-	/* Search filter */
-	if (cfg.regex && setfilter(&pcre2x, fltr))
-		return -1;
+static void fop_cancel(fop_job *job)
+{
+	pthread_mutex_lock(&job->lock);
+	job->cancel = TRUE;
+	fop_wake(job);
+	pthread_mutex_unlock(&job->lock);
+}
 
-	ndents = fill(fltr, pcre2x);
+static void fop_log(fop_job *job, uint_t root, const char *path, int err)
+{
+	pthread_mutex_lock(&job->lock);
+	++job->errors;
+	if (root < job->nroots)
+		job->rootfail[root] = TRUE;
 
-	if (cfg.regex)
-		pcre2_code_free(pcre2x);
-#else
-	regex_t re;
+	if (job->errlen < FOP_ERRLOG_MAX) {
+		int n = snprintf(job->errlog + job->errlen, FOP_ERRLOG_MAX - job->errlen,
+				 "%s: %s\n", path, strerror(err));
 
-	/* Search filter */
-	if (cfg.regex && setfilter(&re, fltr))
-		return -1;
+		job->errlen = (n < 0) ? job->errlen : MIN(job->errlen + n, FOP_ERRLOG_MAX);
+	}
+	pthread_mutex_unlock(&job->lock);
+}
 
-	ndents = fill(fltr, &re);
+static inline void fop_addbytes(fop_job *job, off_t n)
+{
+	pthread_mutex_lock(&job->lock);
+	job->bytes += n;
+	pthread_mutex_unlock(&job->lock);
+}
 
-	if (cfg.regex)
-		regfree(&re);
-#endif
+static int fop_copyfd(fop_job *job, int in, int out, char *buf)
+{
+	ssize_t n, w;
 
-	ENTSORT(pdents, ndents, entrycmpfn);
+#ifdef __linux__
+	off_t done = 0;
 
-	return ndents;
-}
+	if (ioctl(out, FICLONE, in) == 0) {
+		struct stat sb;
 
-/*
- * Return the position of the matching entry or 0 otherwise
- * Note there's no NULL check for fname
- */
-static int dentfind(const char *fname, int n)
-{
-	for (int i = 0; i < n; ++i)
-		if (xstrcmp(fname, pdents[i].name) == 0)
-			return i;
-
-	return 0;
-}
-
-static int filterentries(char *path, char *lastname)
-{
-	alignas(max_align_t) wchar_t wln[REGEX_MAX];
-	char *ln = g_ctx[cfg.curctx].c_fltr;
-	wint_t ch[1];
-	int r, total = ndents, len;
-	char *pln = g_ctx[cfg.curctx].c_fltr + 1;
+		if (fstat(in, &sb) == 0)
+			fop_addbytes(job, sb.st_size);
+		return 0;
+	}
 
-	DPRINTF_S(__func__);
+	while ((n = copy_file_range(in, NULL, out, NULL, FOP_CHUNK, 0)) > 0) {
+		done += n;
+		fop_addbytes(job, n);
+		if (job->cancel)
+			return ECANCELED;
+	}
 
-	if (ndents && (ln[0] == FILTER || ln[0] == RFILTER) && *pln) {
-		if (matches(pln) != -1) {
-			move_cursor(dentfind(lastname, ndents), 0);
-			redraw(path);
-		}
+	/* Some pseudo files report EOF to copy_file_range(2), retry with read(2) */
+	if (done && !n)
+		return 0;
 
-		if (!cfg.filtermode) {
-			statusbar(path);
-			return 0;
-		}
+	if (n < 0 && done)
+		return errno;
 
-		len = mbstowcs(wln, ln, REGEX_MAX);
-	} else {
-		ln[0] = wln[0] = cfg.regex ? RFILTER : FILTER;
-		ln[1] = wln[1] = '\0';
-		len = 1;
+	while ((n = sendfile(out, in, NULL, FOP_CHUNK)) > 0) {
+		done += n;
+		fop_addbytes(job, n);
+		if (job->cancel)
+			return ECANCELED;
 	}
 
-	cleartimeout();
-	curs_set(TRUE);
-	showfilter(ln);
-
-	while ((r = get_wch(ch)) != ERR) {
-		//DPRINTF_D(*ch);
-		//DPRINTF_S(keyname(*ch));
+	if (done && !n)
+		return 0;
 
-		switch (*ch) {
-#ifdef KEY_RESIZE
-		case 0: // fallthrough
-		case KEY_RESIZE:
-			clearoldprompt();
-			redraw(path);
-			showfilter(ln);
-			continue;
+	if (n < 0 && done)
+		return errno;
 #endif
-		case KEY_DC: // fallthrough
-		case KEY_BACKSPACE: // fallthrough
-		case '\b': // fallthrough
-		case DEL: /* handle DEL */
-			if (len != 1) {
-				wln[--len] = '\0';
-				wcstombs(ln, wln, REGEX_MAX);
-				ndents = total;
-			} else {
-				*ch = FILTER;
-				goto end;
-			}
-			// fallthrough
-		case CONTROL('L'):
-			if (*ch == CONTROL('L')) {
-				if (wln[1]) {
-					ln[REGEX_MAX - 1] = ln[1];
-					ln[1] = wln[1] = '\0';
-					len = 1;
-					ndents = total;
-				} else if (ln[REGEX_MAX - 1]) { /* Show the previous filter */
-					ln[1] = ln[REGEX_MAX - 1];
-					ln[REGEX_MAX - 1] = '\0';
-					len = mbstowcs(wln, ln, REGEX_MAX);
-				} else
-					goto end;
-			}
-
-			/* Go to the top, we don't know if the hovered file will match the filter */
-			cur = 0;
 
-			if (matches(pln) != -1)
-				redraw(path);
-
-			showfilter(ln);
-			continue;
-#ifndef NOMOUSE
-		case KEY_MOUSE:
-		{
-			MEVENT event = {0};
-			getmouse(&event);
-			if (event.bstate == 0)
+#if _POSIX_C_SOURCE >= 200112L
+	posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	while ((n = read(in, buf, FOP_BUFSIZ)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
 				continue;
-			ungetmouse(&event);
-			goto end;
+			return errno;
 		}
-#endif
-		case ESC:
-			if (handle_alt_key(ch) != ERR) {
-				if (*ch == ESC) /* Handle Alt+Esc */
-					*ch = 'q'; /* Quit context */
-				else {
-					unget_wch(*ch);
-					*ch = ';'; /* Run plugin */
+
+		for (ssize_t off = 0; off < n; off += w) {
+			w = write(out, buf + off, n - off);
+			if (w < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
 				}
+				return errno;
 			}
-			goto end;
 		}
 
-		if (r != OK) /* Handle Fn keys in main loop */
-			break;
+		fop_addbytes(job, n);
+		if (job->cancel)
+			return ECANCELED;
+	}
 
-		/* Handle all control chars in main loop */
-		if (*ch < ASCII_MAX && keyname(*ch)[0] == '^' && *ch != '^')
-			goto end;
+	return 0;
+}
 
-		if (len == 1) {
-			if (*ch == '?') /* Help and config key, '?' is an invalid regex */
-				goto end;
+static void fop_copyfile(fop_job *job, fop_task *task, char *buf)
+{
+	struct stat sb;
+	struct timespec times[2] = {FOP_ATIM(&task->sb), FOP_MTIM(&task->sb)};
+	mode_t mode = task->sb.st_mode & 07777;
+	int in, out, err = 0;
 
-			if (cfg.filtermode) {
-				switch (*ch) {
-				case '\'': // fallthrough /* Go to first non-dir file */
-				case '+': // fallthrough /* Toggle file selection */
-				case ',': // fallthrough /* Mark CWD */
-				case '-': // fallthrough /* Visit last visited dir */
-				case '.': // fallthrough /* Show hidden files */
-				case ';': // fallthrough /* Run plugin key */
-				case '=': // fallthrough /* Launch app */
-				case '>': // fallthrough /* Export file list */
-				case '@': // fallthrough /* Visit start dir */
-				case ']': // fallthorugh /* Prompt key */
-				case '`': // fallthrough /* Visit / */
-				case '~': /* Go HOME */
-					goto end;
-				}
-			}
+	in = open(task->src, O_RDONLY | O_CLOEXEC);
+	if (in == -1) {
+		fop_log(job, task->root, task->src, errno);
+		return;
+	}
 
-			/* Toggle case-sensitivity */
-			if (*ch == CASE) {
-				fnstrstr = (fnstrstr == &strcasestr) ? &strstr : &strcasestr;
-#ifdef PCRE2
-				pcre2flags ^= PCRE2_CASELESS;
-#else
-				regflags ^= REG_ICASE;
-#endif
-				showfilter(ln);
-				continue;
-			}
+	out = open(task->dst, O_WRONLY | O_CREAT | O_CLOEXEC | (job->overwrite ? 0 : O_EXCL), 0600);
+	if (out == -1 && job->overwrite && (errno == EACCES || errno == ETXTBSY)) {
+		/* Like cp -f, remove the destination and try again */
+		if (unlink(task->dst) == 0)
+			out = open(task->dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	}
 
-			/* Toggle string or regex filter */
-			if (*ch == FILTER) {
-				ln[0] = (ln[0] == FILTER) ? RFILTER : FILTER;
-				wln[0] = (uchar_t)ln[0];
-				cfg.regex ^= 1;
-				filterfn = cfg.regex ? &visible_re : &visible_str;
-				showfilter(ln);
-				continue;
-			}
+	if (out == -1) {
+		if (errno == EEXIST) {
+			pthread_mutex_lock(&job->lock);
+			++job->skipped;
+			pthread_mutex_unlock(&job->lock);
+		} else
+			fop_log(job, task->root, task->dst, errno);
+		close(in);
+		return;
+	}
 
-			/* Reset cur in case it's a repeat search */
-			cur = 0;
-		} else if (len == REGEX_MAX - 1)
-			continue;
+	/* Never truncate the source */
+	if (fstat(out, &sb) == -1)
+		err = errno;
+	else if (sb.st_dev == task->sb.st_dev && sb.st_ino == task->sb.st_ino)
+		err = EINVAL;
+	else if (sb.st_size && ftruncate(out, 0) == -1)
+		err = errno;
+
+	if (!err)
+		err = fop_copyfd(job, in, out, buf);
+
+	if (!err) {
+		if (fchown(out, task->sb.st_uid, task->sb.st_gid) == -1)
+			mode &= ~(S_ISUID | S_ISGID);
+		if (fchmod(out, mode) == -1 || futimens(out, times) == -1)
+			err = errno;
+	}
 
-		wln[len] = (wchar_t)*ch;
-		wln[++len] = '\0';
-		wcstombs(ln, wln, REGEX_MAX);
+	close(in);
+	close(out);
 
-		/* Forward-filtering optimization:
-		 * - new matches can only be a subset of current matches.
-		 */
-		/* ndents = total; */
-#ifdef MATCHFLTR
-		r = matches(pln);
-		if (r <= 0) {
-			!r ? unget_wch(KEY_BACKSPACE) : showfilter(ln);
-#else
-		if (matches(pln) == -1) {
-			showfilter(ln);
-#endif
-			continue;
-		}
+	if (err) {
+		if (err != EINVAL)
+			unlink(task->dst);
+		if (err != ECANCELED)
+			fop_log(job, task->root, task->src, err);
+		return;
+	}
 
-		/* If the only match is a dir, auto-enter and cd into it */
-		if ((ndents == 1) && cfg.autoenter && (pdents[0].flags & DIR_OR_DIRLNK)) {
-			*ch = KEY_ENTER;
-			cur = 0;
-			goto end;
+	pthread_mutex_lock(&job->lock);
+	++job->files;
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void *fop_worker(void *arg)
+{
+	fop_job *job = (fop_job *)arg;
+	fop_task task;
+	char *buf = malloc(FOP_BUFSIZ);
+
+	while (buf) {
+		pthread_mutex_lock(&job->lock);
+		while (!job->count && !job->walked && !job->cancel)
+			pthread_cond_wait(&job->notempty, &job->lock);
+
+		if (!job->count || job->cancel) {
+			pthread_mutex_unlock(&job->lock);
+			break;
 		}
 
-		/*
-		 * redraw() should be above the auto-enter optimization, for
-		 * the case where there's an issue with dir auto-enter, say,
-		 * due to a permission problem. The transition is _jumpy_ in
-		 * case of such an error. However, we optimize for successful
-		 * cases where the dir has permissions. This skips a redraw().
-		 */
-		redraw(path);
-		showfilter(ln);
+		task = job->queue[job->head];
+		job->head = (job->head + 1) % FOP_QUEUE_MAX;
+		--job->count;
+		pthread_cond_signal(&job->notfull);
+		pthread_mutex_unlock(&job->lock);
+
+		fop_copyfile(job, &task, buf);
+		free(task.src);
 	}
-end:
-	/* Clear the info line after the down arrow */
-	move(xlines - 2, 2);
-	clrtoeol();
 
-	/* Save last working filter in-filter */
-	if (ln[1])
-		ln[REGEX_MAX - 1] = ln[1];
+	if (!buf)
+		fop_cancel(job);
 
-	/* Save current */
-	copycurname();
+	free(buf);
+	return NULL;
+}
 
-	curs_set(FALSE);
-	settimeout();
+static bool fop_push(fop_job *job, const char *src, const char *dst, const struct stat *sb, uint_t root)
+{
+	size_t srclen = xstrlen(src) + 1, dstlen = xstrlen(dst) + 1;
+	char *p = malloc(srclen + dstlen);
+	fop_task *task;
 
-	/* Return keys for navigation etc. */
-	return *ch;
+	if (!p) {
+		fop_log(job, root, src, errno);
+		return FALSE;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	while (job->count == FOP_QUEUE_MAX && !job->cancel)
+		pthread_cond_wait(&job->notfull, &job->lock);
+
+	if (job->cancel) {
+		pthread_mutex_unlock(&job->lock);
+		free(p);
+		return FALSE;
+	}
+
+	task = &job->queue[(job->head + job->count) % FOP_QUEUE_MAX];
+	task->src = p;
+	task->dst = p + srclen;
+	memcpy(task->src, src, srclen);
+	memcpy(task->dst, dst, dstlen);
+	task->sb = *sb;
+	task->root = root;
+	++job->count;
+	pthread_cond_signal(&job->notempty);
+	pthread_mutex_unlock(&job->lock);
+
+	return TRUE;
 }
 
-static char *getcmdfromhist(bool up)
+/*
+ * Opens the dir of an archive member under rootfd, creating the missing
+ * ones. As with the secure modes of bsdtar a symlink in the way is not
+ * followed, arc_member() has already rejected '..' and absolute names.
+ */
+static int fop_openparent(int rootfd, char *rel, char **leaf)
 {
-	if (lastcmdpos == INVALID_POS) /* No entry in history */
-		return NULL;
-
-	if (selcmdpos == INVALID_POS) /* Initial position at prompt */
-		selcmdpos = up ? lastcmdpos : 0;
-	else if (up)
-		selcmdpos = (selcmdpos == 0) ? lastcmdpos : selcmdpos - 1;
-	else
-		selcmdpos = (selcmdpos == lastcmdpos) ? 0 : selcmdpos + 1;
+	char *p, *name = rel;
+	int fd = fcntl(rootfd, F_DUPFD_CLOEXEC, 0), next, err;
+
+	for (; fd != -1 && (p = strchr(name, '/')); name = p + 1) {
+		*p = '\0';
+		next = openat(fd, name, O_DIRFD | O_NOFOLLOW);
+		if (next == -1 && errno == ENOENT && (mkdirat(fd, name, 0777) == 0 || errno == EEXIST))
+			next = openat(fd, name, O_DIRFD | O_NOFOLLOW);
+		err = errno;
+		*p = '/';
+		close(fd);
+		fd = next;
+		errno = err;
+	}
 
-	return cmd_hist[selcmdpos];
+	*leaf = name;
+	return fd;
 }
 
-static void addcmdtohist(char *cmd)
+/* mkdirat() that takes an existing dir, not a link to one */
+static int fop_mkdirat(int fd, const char *name)
 {
-	bool new = FALSE;
+	struct stat sb;
 
-	if (lastcmdpos == INVALID_POS)
-		new = TRUE;
-	else if ((selcmdpos == INVALID_POS) || (xstrcmp(cmd_hist[selcmdpos], cmd) != 0)) { /* New or not matching */
-		if (lastcmdpos == (MAX_HISTORY - 1)) {
-			free(cmd_hist[0]);
+	if (mkdirat(fd, name, 0700) == 0)
+		return 0;
 
-			for (uchar_t pos = 0; pos < lastcmdpos; ++pos)
-				cmd_hist[pos] = cmd_hist[pos + 1];
-			--lastcmdpos;
-		}
+	if (errno != EEXIST || fstatat(fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+		return -1;
 
-		new = TRUE;
-	} else if (selcmdpos != lastcmdpos) { /* Command matches, make it the latest if not already */
-		cmd = cmd_hist[selcmdpos];
+	if (!S_ISDIR(sb.st_mode)) {
+		errno = ENOTDIR;
+		return -1;
+	}
 
-		for (uchar_t pos = selcmdpos; pos < lastcmdpos; ++pos)
-			cmd_hist[pos] = cmd_hist[pos + 1];
-		cmd_hist[lastcmdpos] = cmd;
+	return 0;
+}
+
+/* Dir permissions and times are set once the files in it are done */
+static void fop_adddir(fop_job *job, const char *dst, const struct stat *sb)
+{
+	if (job->ndirs == job->dirslen) {
+		fop_dir *dirs = xrealloc(job->dirs, (job->dirslen + FOP_QUEUE_MAX) * sizeof(fop_dir));
+
+		if (!dirs)
+			return;
+		job->dirs = dirs;
+		job->dirslen += FOP_QUEUE_MAX;
 	}
 
-	if (new)
-		cmd_hist[++lastcmdpos] = xstrdup(cmd);
+	job->dirs[job->ndirs].path = xstrdup(dst);
+	if (job->dirs[job->ndirs].path)
+		job->dirs[job->ndirs++].sb = *sb;
 }
 
-#ifdef NORL
-/* Reads the history file and populates command history */
-static void xread_history(const char *histpath)
+static void fop_setdirs(fop_job *job)
 {
-	int linesread = 0;
-	size_t len = 0;
-	ssize_t read;
-	char *line = NULL;
-	FILE *fptr = fopen(histpath, "r");
+	for (size_t i = 0; i < job->ndirs; ++i) {
+		fop_dir *dir = &job->dirs[i];
+		struct timespec times[2] = {FOP_ATIM(&dir->sb), FOP_MTIM(&dir->sb)};
+		mode_t mode = dir->sb.st_mode & 07777;
+
+		if (chown(dir->path, dir->sb.st_uid, dir->sb.st_gid) == -1)
+			mode &= ~(S_ISUID | S_ISGID);
+		if (chmod(dir->path, mode) == -1 || utimensat(AT_FDCWD, dir->path, times, 0) == -1)
+			fop_log(job, job->nroots, dir->path, errno);
+		free(dir->path);
+	}
 
-	/* We want to open for reading, ignore errors */
-	if (fptr) {
-		while ((linesread++ < MAX_HISTORY) && ((read = getline(&line, &len, fptr)) != -1))
-		{
-			if (line[read - 1] == NEWLINE_CHAR)
-				line[read - 1] = '\0';
-			addcmdtohist(line);
+	free(job->dirs);
+	job->dirs = NULL;
+	job->ndirs = job->dirslen = 0;
+}
+
+static void fop_special(fop_job *job, FTSENT *node, const char *dst, uint_t root)
+{
+	struct stat *sb = node->fts_statp;
+	struct timespec times[2] = {FOP_ATIM(sb), FOP_MTIM(sb)};
+	char target[PATH_MAX];
+	ssize_t len;
+	int r;
+
+	if (S_ISLNK(sb->st_mode)) {
+		len = readlink(node->fts_accpath, target, PATH_MAX - 1);
+		if (len < 0) {
+			fop_log(job, root, node->fts_path, errno);
+			return;
 		}
+		target[len] = '\0';
 
-		free(line);
+		r = symlink(target, dst);
+		if (r == -1 && errno == EEXIST && job->overwrite && unlink(dst) == 0)
+			r = symlink(target, dst);
+	} else {
+		r = mknod(dst, sb->st_mode, sb->st_rdev);
+		if (r == -1 && errno == EEXIST && job->overwrite && unlink(dst) == 0)
+			r = mknod(dst, sb->st_mode, sb->st_rdev);
+	}
+
+	if (r == -1) {
+		if (errno != EEXIST)
+			fop_log(job, root, dst, errno);
+		else {
+			pthread_mutex_lock(&job->lock);
+			++job->skipped;
+			pthread_mutex_unlock(&job->lock);
+		}
+		return;
+	}
+
+	if (lchown(dst, sb->st_uid, sb->st_gid) == -1) {
+		DPRINTF_S(strerror(errno));
 	}
+	utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+
+	pthread_mutex_lock(&job->lock);
+	++job->files;
+	pthread_mutex_unlock(&job->lock);
 }
 
-/* Populates the history file from the command history */
-static void xwrite_history(const char *histpath)
+static void fop_walk(fop_job *job, char *src, const char *dstroot, uint_t root)
 {
-	if (lastcmdpos == INVALID_POS)
+	char *path[2] = {src, NULL};
+	char dst[PATH_MAX];
+	size_t srclen = xstrlen(src);
+	FTS *tree = fts_open(path, FTS_PHYSICAL | FTS_NOCHDIR, 0);
+	FTSENT *node;
+
+	if (!tree) {
+		fop_log(job, root, src, errno);
 		return;
+	}
 
-	FILE *fptr = fopen(histpath, "w");
+	while (!job->cancel && (node = fts_read(tree))) {
+		if (snprintf(dst, PATH_MAX, "%s%s", dstroot, node->fts_path + srclen) >= PATH_MAX) {
+			fop_log(job, root, node->fts_path, ENAMETOOLONG);
+			if (node->fts_info == FTS_D)
+				fts_set(tree, node, FTS_SKIP);
+			continue;
+		}
 
-	if (fptr)
-		for (uchar_t pos = 0; pos <= lastcmdpos; ++pos)
-			fprintf(fptr, "%s\n", cmd_hist[pos]);
-	else
-		xerror();
+		switch (node->fts_info) {
+		case FTS_D:
+			if (mkdir(dst, (node->fts_statp->st_mode & 07777) | S_IRWXU) == -1) {
+				struct stat sb;
+
+				/* Merge into an existing dir */
+				if (errno != EEXIST || stat(dst, &sb) == -1 || !S_ISDIR(sb.st_mode)) {
+					fop_log(job, root, dst, errno == EEXIST ? ENOTDIR : errno);
+					fts_set(tree, node, FTS_SKIP);
+				}
+			}
+			break;
+		case FTS_DP:
+			fop_adddir(job, dst, node->fts_statp);
+			break;
+		case FTS_F:
+			fop_push(job, node->fts_path, dst, node->fts_statp, root);
+			break;
+		case FTS_SL: // fallthrough
+		case FTS_SLNONE: // fallthrough
+		case FTS_DEFAULT:
+			fop_special(job, node, dst, root);
+			break;
+		case FTS_DC:
+			fop_log(job, root, node->fts_path, ELOOP);
+			break;
+		case FTS_DNR: // fallthrough
+		case FTS_ERR: // fallthrough
+		case FTS_NS:
+			fop_log(job, root, node->fts_path, node->fts_errno);
+			break;
+		default:
+			break;
+		}
+	}
+
+	fts_close(tree);
 }
-#endif
 
-/* Show a prompt with input string and return the changes */
-static char *xreadline(const char *prefill, const char *prompt)
+/* A path listed from an archive */
+static inline bool fop_inarc(const char *path)
 {
-	size_t len, pos, lpos;
-	int x, r;
-	const int WCHAR_T_WIDTH = sizeof(wchar_t);
-	wint_t ch[1];
-	wchar_t * const buf = malloc(sizeof(wchar_t) * READLINE_MAX);
+	struct stat sb;
 
-	if (!buf)
-		errexit();
+	return lstat(path, &sb) == -1 && errno == ENOTDIR;
+}
 
-	cleartimeout();
-	printmsg(prompt);
+static int fop_arcoff(const void *a, const void *b)
+{
+	off_t x = (*(arc_ent * const *)a)->off, y = (*(arc_ent * const *)b)->off;
 
-	if (prefill) {
-		DPRINTF_S(prefill);
-		len = pos = mbstowcs(buf, prefill, READLINE_MAX);
-	} else
-		len = (size_t)-1;
+	return (x > y) - (x < y);
+}
 
-	if (len == (size_t)-1) {
-		buf[0] = '\0';
-		len = pos = 0;
+/* A symlink target that resolves under the dir of rel, relative to rootfd */
+static bool fop_linkinside(const char *rel, const char *target)
+{
+	const char *p, *end;
+	int depth = 0;
+
+	if (*target == '/')
+		return FALSE;
+
+	for (p = rel; (p = strchr(p, '/')); ++p)
+		++depth;
+
+	for (p = target; *p; p = *end ? end + 1 : end) {
+		end = strchr(p, '/');
+		if (!end)
+			end = p + xstrlen(p);
+		if (end - p == 2 && p[0] == '.' && p[1] == '.') {
+			if (--depth < 0)
+				return FALSE;
+		} else if (end - p && !(end - p == 1 && *p == '.'))
+			++depth;
 	}
 
-	x = getcurx(stdscr);
-	curs_set(TRUE);
+	return TRUE;
+}
 
-	while (1) {
-		buf[len] = ' ';
-		attron(COLOR_PAIR(cfg.curctx + 1));
-		if (pos > (size_t)(xcols - x)) {
-			mvaddnwstr(xlines - 1, x, buf + (pos - (xcols - x) + 1), xcols - x);
-			move(xlines - 1, xcols - 1);
+/*
+ * Copies a member to dst, rel is the part of dst under rootfd. Members
+ * are created relative to the dirs opened on the way, symlinks are never
+ * followed and device nodes are not created.
+ */
+static void fop_arcent(fop_job *job, arc_reader *rd, const arc_ent *ent, char *dst,
+		       int rootfd, char *rel, uint_t root)
+{
+	struct stat sb = {.st_mode = ent->mode, .st_size = ent->size};
+	struct timespec times[2];
+	const char *target;
+	char *leaf;
+	int fd, dirfd, r = 0;
+
+	FOP_ATIM(&sb).tv_sec = FOP_MTIM(&sb).tv_sec = ent->mtime;
+	times[0] = times[1] = FOP_MTIM(&sb);
+#ifndef NOUG
+	sb.st_uid = ent->uid;
+	sb.st_gid = ent->gid;
+#else
+	sb.st_uid = getuid();
+	sb.st_gid = getgid();
+#endif
+
+	/* Parent dirs are not always archived */
+	dirfd = fop_openparent(rootfd, rel, &leaf);
+	if (dirfd == -1) {
+		fop_log(job, root, dst, errno);
+		return;
+	}
+
+	if (S_ISDIR(ent->mode)) {
+		r = fop_mkdirat(dirfd, leaf);
+		close(dirfd);
+		if (r == -1)
+			fop_log(job, root, dst, errno);
+		else
+			fop_adddir(job, dst, &sb);
+		return;
+	}
+
+	if (S_ISREG(ent->mode)) {
+		fd = openat(dirfd, leaf, O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW
+			    | (job->overwrite ? O_TRUNC : O_EXCL), 0600);
+		if (fd == -1) {
+			if (errno != EEXIST)
+				r = errno;
+			else {
+				close(dirfd);
+				pthread_mutex_lock(&job->lock);
+				++job->skipped;
+				pthread_mutex_unlock(&job->lock);
+				return;
+			}
 		} else {
-			mvaddnwstr(xlines - 1, x, buf, len + 1);
-			move(xlines - 1, x + wcswidth(buf, pos));
+			r = arc_read(rd, ent, fd);
+			if (!r && (fchmod(fd, ent->mode & 0777) == -1 || futimens(fd, times) == -1))
+				r = errno;
+			close(fd);
+			if (r)
+				unlinkat(dirfd, leaf, 0);
+			else
+				fop_addbytes(job, ent->size);
 		}
-		attroff(COLOR_PAIR(cfg.curctx + 1));
+	} else {
+		if (job->overwrite)
+			unlinkat(dirfd, leaf, 0);
+		if (S_ISLNK(ent->mode)) {
+			target = rd->arc->names + ent->link;
+			if (!(ent->flags & ARC_LINK))
+				r = EOPNOTSUPP;
+			else if (!fop_linkinside(rel, target)) /* Points out of the destination */
+				r = EPERM;
+			else if (symlinkat(target, dirfd, leaf) == -1)
+				r = errno;
+		} else if (S_ISFIFO(ent->mode))
+			r = (mkfifoat(dirfd, leaf, ent->mode & 0777) == -1) ? errno : 0;
+		else /* Devices and sockets */
+			r = EPERM;
+	}
+	close(dirfd);
 
-		r = get_wch(ch);
-		if (r == ERR)
+	if (r)
+		fop_log(job, root, dst, r);
+	else {
+		pthread_mutex_lock(&job->lock);
+		++job->files;
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+/* Copy members out of an archive in archive order, the data is streamed */
+static void fop_arccopy(fop_job *job, const char *src, const char *dstroot, uint_t root)
+{
+	char buf[PATH_MAX], dst[PATH_MAX];
+	const char *rel, *name;
+	arc_index *arc = arc_root(src, buf) ? arc_open(buf) : NULL;
+	arc_ent **ents = NULL;
+	arc_reader rd;
+	size_t rlen, dlen = strrchr(dstroot, '/') + 1 - dstroot;
+	uint_t i, n = 0;
+	int rootfd;
+
+	if (!arc) {
+		fop_log(job, root, src, errno);
+		return;
+	}
+
+	/* The members are created under the destination dir without following links */
+	rootfd = open(job->dst, O_DIRFD);
+	if (rootfd == -1) {
+		fop_log(job, root, job->dst, errno);
+		arc_close(arc);
+		return;
+	}
+
+	rel = src + arc->plen + 1;
+	rlen = xstrlen(rel);
+	ents = malloc(arc->nents * sizeof(arc_ent *));
+	if (!ents) {
+		fop_log(job, root, src, errno);
+		close(rootfd);
+		arc_close(arc);
+		return;
+	}
+
+	for (i = 0; i < arc->nents; ++i) {
+		arc_ent *ent = &arc->ents[i];
+
+		name = arc->names + ent->name;
+		if (ent->len < rlen || memcmp(name, rel, rlen) || (ent->len > rlen && name[rlen] != '/'))
 			continue;
 
-		if (r == OK) {
-			switch (*ch) {
-			case KEY_ENTER: // fallthrough
-			case '\n': // fallthrough
-			case '\r':
-				goto END;
-			case CONTROL('D'):
-				if (pos < len)
-					++pos;
-				else if (!(pos || len)) { /* Exit on ^D at empty prompt */
-					len = 0;
-					goto END;
-				} else
-					continue;
-				// fallthrough
-			case DEL: // fallthrough
-			case '\b': /* rhel25 sends '\b' for backspace */
-				if (pos > 0) {
-					memmove(buf + pos - 1, buf + pos,
-						(len - pos) * WCHAR_T_WIDTH);
-					--len, --pos;
+		ents[n++] = ent;
+		if (!S_ISDIR(ent->mode)) {
+			pthread_mutex_lock(&job->lock);
+			++job->totfiles;
+			job->totbytes += ent->size;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+
+	if (!n)
+		fop_log(job, root, src, ENOENT);
+
+	/* Stored members are read front to back, others decoded in one pass */
+	qsort(ents, n, sizeof(arc_ent *), fop_arcoff);
+	arc_ropen(&rd, arc);
+	for (i = 0; i < n && !job->cancel; ++i) {
+		name = arc->names + ents[i]->name + rlen;
+		/* Not mkpath(), a member named ~ is not home */
+		if (snprintf(dst, PATH_MAX, "%s%s", dstroot, name) >= PATH_MAX)
+			fop_log(job, root, name, ENAMETOOLONG);
+		else
+			fop_arcent(job, &rd, ents[i], dst, rootfd, dst + dlen, root);
+	}
+
+	arc_rclose(&rd);
+	free(ents);
+	close(rootfd);
+	arc_close(arc);
+}
+
+/* Counts what's left to copy for the progress indicator */
+static void fop_scan(fop_job *job, char *src)
+{
+	char *path[2] = {src, NULL};
+	FTS *tree = fts_open(path, FTS_PHYSICAL | FTS_NOCHDIR, 0);
+	FTSENT *node;
+
+	if (!tree)
+		return;
+
+	while (!job->cancel && (node = fts_read(tree))) {
+		if (node->fts_info == FTS_D || node->fts_info == FTS_DP)
+			continue;
+
+		pthread_mutex_lock(&job->lock);
+		++job->totfiles;
+		if (node->fts_info == FTS_F)
+			job->totbytes += node->fts_statp->st_size;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	fts_close(tree);
+}
+
+static inline void fop_addremoved(fop_job *job, ullong_t n)
+{
+	pthread_mutex_lock(&job->lock);
+	job->removed += n;
+	pthread_mutex_unlock(&job->lock);
+}
+
+static inline void fop_rmfail(fop_job *job, fop_rmdir *dir)
+{
+	pthread_mutex_lock(&job->lock);
+	dir->failed = TRUE;
+	pthread_mutex_unlock(&job->lock);
+}
+
+/* Path for the log, rebuilt from the names up the tree */
+static void fop_rmpath(const fop_rmdir *dir, const char *name, char *out)
+{
+	char buf[PATH_MAX];
+	size_t len, pos = PATH_MAX - 1;
+
+	buf[pos] = '\0';
+	for (; name; dir = dir->parent) {
+		len = xstrlen(name);
+		if (len + 1 > pos) /* Too deep, keep the tail */
+			break;
+		pos -= len;
+		memcpy(buf + pos, name, len);
+		if (!dir)
+			break;
+		buf[--pos] = '/';
+		name = dir->name;
+	}
+
+	xstrsncpy(out, buf + pos + (buf[pos] == '/' && dir), PATH_MAX);
+}
+
+/* Drop a reference, remove the dir once the last one is gone and go up */
+static void fop_rmrelease(fop_job *job, fop_rmdir *dir)
+{
+	char path[PATH_MAX];
+	fop_rmdir *parent;
+	bool done;
+	int r;
+
+	while (dir) {
+		pthread_mutex_lock(&job->lock);
+		done = !--dir->pending;
+		pthread_mutex_unlock(&job->lock);
+		if (!done)
+			return;
+
+		parent = dir->parent;
+		if (dir->fd != -1)
+			close(dir->fd);
+
+		if (!dir->failed && !job->cancel) {
+			/* The parent is held open by this dir */
+			r = parent ? unlinkat(parent->fd, dir->name, AT_REMOVEDIR) : rmdir(dir->name);
+			if (r == 0)
+				fop_addremoved(job, 1);
+			else {
+				fop_rmpath(parent, dir->name, path);
+				fop_log(job, dir->root, path, errno);
+				dir->failed = TRUE;
+			}
+		}
+
+		if (parent && (dir->failed || job->cancel))
+			fop_rmfail(job, parent);
+
+		free(dir);
+		dir = parent;
+	}
+}
+
+/*
+ * Unlink the entries of a dir relative to its fd, push the subdirs.
+ * Subdirs are opened relative to the parent without following links,
+ * so neither the depth nor a swapped in symlink takes it elsewhere.
+ */
+static void fop_rmscan(fop_job *job, fop_rmdir *dir)
+{
+	struct dirent *dp;
+	struct stat sb;
+	fop_rmdir *child;
+	DIR *dirp = NULL;
+	char path[PATH_MAX];
+	size_t namelen;
+	ullong_t removed = 0;
+	int fd = -1, flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+	bool isdir;
+
+	if (!job->cancel)
+		dir->fd = dir->parent ? openat(dir->parent->fd, dir->name, flags) : open(dir->name, flags);
+
+	if (dir->fd != -1) {
+		fd = fcntl(dir->fd, F_DUPFD_CLOEXEC, 0);
+		dirp = (fd == -1) ? NULL : fdopendir(fd);
+		if (!dirp && fd != -1)
+			close(fd);
+		fd = dir->fd;
+	}
+
+	if (!dirp) {
+		if (!job->cancel) {
+			fop_rmpath(dir->parent, dir->name, path);
+			fop_log(job, dir->root, path, errno);
+		}
+		fop_rmfail(job, dir);
+		fop_rmrelease(job, dir);
+		return;
+	}
+
+	while (!job->cancel && (dp = readdir(dirp))) {
+		if (selforparent(dp->d_name))
+			continue;
+
+#if defined(__sun) || defined(__HAIKU__) /* no d_type */
+		isdir = (fstatat(fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode));
+#else
+		isdir = (dp->d_type == DT_DIR);
+		if (dp->d_type == DT_UNKNOWN)
+			isdir = (fstatat(fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+				 && S_ISDIR(sb.st_mode));
+#endif
+		if (!isdir) {
+			if (unlinkat(fd, dp->d_name, 0) == 0) {
+				if (++removed == FOP_RM_BATCH) {
+					fop_addremoved(job, removed);
+					removed = 0;
 				}
-				continue;
-			case '\t':
-				if ((len == pos) && ndents && (pos < (READLINE_MAX - xstrlen(pdents[cur].name)))) {
-					buf[pos] = '\0';
-					lpos = mbstowcs(NULL, pdents[cur].name, MB_CUR_MAX);
-					pos += mbstowcs(buf + wcslen(buf), pdents[cur].name, lpos);
-					len = pos;
-				}
-				continue;
-			case CONTROL('F'):
-				if (pos < len)
-					++pos;
-				continue;
-			case CONTROL('B'):
-				if (pos > 0)
-					--pos;
-				continue;
-			case CONTROL('W'):
-				printmsg(prompt);
-				lpos = pos;
-				while (pos > 0 && ISSPACE(buf[pos-1]))
-					--pos;
-				while (pos > 0 && !ISSPACE(buf[pos-1]))
-					--pos;
-				memmove(buf + pos, buf + lpos, (len - lpos) * WCHAR_T_WIDTH);
-				len -= lpos - pos;
-				continue;
-			case CONTROL('K'):
-				printmsg(prompt);
-				len = pos;
-				continue;
-			case CONTROL('L'):
-				printmsg(prompt);
-				len = pos = 0;
-				continue;
-			case CONTROL('A'):
-				pos = 0;
-				continue;
-			case CONTROL('E'):
-				pos = len;
-				continue;
-			case CONTROL('U'):
-				printmsg(prompt);
-				memmove(buf, buf + pos, (len - pos) * WCHAR_T_WIDTH);
-				len -= pos;
-				pos = 0;
-				continue;
-			case ESC: /* Exit prompt on Esc, but just filter out Alt+key */
-				if (handle_alt_key(ch) != ERR) {
-					switch (*ch) {
-					case 'd':
-						printmsg(prompt);
-						lpos = pos;
-						while (pos < len && !iswalnum(buf[pos + 1]))
-							++pos;
-						while (pos < len && iswalnum(buf[++pos]));
-						memmove(buf + lpos, buf + pos, (len - pos) * WCHAR_T_WIDTH);
-						len -= pos - lpos;
-						pos = lpos;
-						continue;
-					case KEY_BACKSPACE:
-						printmsg(prompt);
-						lpos = pos;
-						while (pos > 0 && !iswalnum(buf[pos - 1]))
-							--pos;
-						while (pos > 0 && iswalnum(buf[pos - 1]))
-							--pos;
-						memmove(buf + pos, buf + lpos, (len - lpos) * WCHAR_T_WIDTH);
-						len -= lpos - pos;
-						continue;
-					case 'f':
-						while (pos < len && !iswalnum(buf[pos + 1]))
-							++pos;
-						while (pos < len && iswalnum(buf[++pos]));
-						continue;
-					case 'b':
-						while (pos > 0 && !iswalnum(buf[pos - 1]))
-							--pos;
-						while (pos > 0 && iswalnum(buf[pos - 1]))
-							--pos;
-						continue;
-					}
+			} else {
+				fop_rmpath(dir, dp->d_name, path);
+				fop_log(job, dir->root, path, errno);
+				fop_rmfail(job, dir);
+			}
+			continue;
+		}
+
+		namelen = xstrlen(dp->d_name);
+		child = malloc(sizeof(fop_rmdir) + namelen + 1);
+		if (!child) {
+			fop_rmpath(dir, dp->d_name, path);
+			fop_log(job, dir->root, path, errno);
+			fop_rmfail(job, dir);
+			continue;
+		}
+
+		memcpy(child->name, dp->d_name, namelen + 1);
+		child->parent = dir;
+		child->pending = 1;
+		child->root = dir->root;
+		child->fd = -1;
+		child->failed = FALSE;
+
+		pthread_mutex_lock(&job->lock);
+		++dir->pending;
+		child->next = job->rmstack;
+		job->rmstack = child;
+		pthread_cond_signal(&job->notempty);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	closedir(dirp);
+
+	if (removed)
+		fop_addremoved(job, removed);
+
+	if (job->cancel)
+		fop_rmfail(job, dir);
+
+	fop_rmrelease(job, dir);
+}
+
+static void *fop_rmworker(void *arg)
+{
+	fop_job *job = (fop_job *)arg;
+	fop_rmdir *dir;
+
+	while (TRUE) {
+		pthread_mutex_lock(&job->lock);
+		while (!job->rmstack && job->rmbusy)
+			pthread_cond_wait(&job->notempty, &job->lock);
+
+		/* Nothing queued and no one left to queue more */
+		dir = job->rmstack;
+		if (!dir) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+
+		job->rmstack = dir->next;
+		++job->rmbusy;
+		pthread_mutex_unlock(&job->lock);
+
+		fop_rmscan(job, dir);
+
+		pthread_mutex_lock(&job->lock);
+		if (!--job->rmbusy && !job->rmstack)
+			pthread_cond_broadcast(&job->notempty);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Parallel post-order removal of the selected paths, all or the ones
+ * copied across filesystems without errors on move
+ */
+static void fop_rm(fop_job *job, bool all)
+{
+	char *src = job->srcs, *end = job->srcs + job->srcslen;
+	pthread_t workers[FOP_WORKERS_MAX];
+	struct stat sb;
+	fop_rmdir *dir;
+	uint_t i, nworkers = 0;
+	size_t len;
+
+	for (i = 0; src < end && !job->cancel; src += len + 1, ++i) {
+		len = xstrlen(src);
+		if (!all && (job->rootdone[i] || job->rootfail[i]))
+			continue;
+
+		if (!len || !strcmp(src, "/")) {
+			fop_log(job, i, src, EPERM);
+			continue;
+		}
+
+		if (lstat(src, &sb) == -1) {
+			fop_log(job, i, src, errno);
+			continue;
+		}
+
+		if (!S_ISDIR(sb.st_mode)) {
+			if (unlink(src) == 0)
+				fop_addremoved(job, 1);
+			else
+				fop_log(job, i, src, errno);
+			continue;
+		}
+
+		dir = malloc(sizeof(fop_rmdir) + len + 1);
+		if (!dir) {
+			fop_log(job, i, src, errno);
+			continue;
+		}
+
+		memcpy(dir->name, src, len + 1);
+		dir->parent = NULL;
+		dir->pending = 1;
+		dir->root = i;
+		dir->fd = -1;
+		dir->failed = FALSE;
+		dir->next = job->rmstack;
+		job->rmstack = dir;
+	}
+
+	if (!job->rmstack)
+		return;
+
+	for (; nworkers < fop_nworkers; ++nworkers)
+		if (pthread_create(&workers[nworkers], NULL, fop_rmworker, job))
+			break;
+
+	if (!nworkers)
+		fop_rmworker(job);
+
+	while (nworkers)
+		pthread_join(workers[--nworkers], NULL);
+}
+
+static void fop_cpmv(fop_job *job)
+{
+	char *src = job->srcs, *end = job->srcs + job->srcslen;
+	char dst[PATH_MAX];
+	uint_t i, nworkers = 0;
+	pthread_t workers[FOP_WORKERS_MAX];
+	bool move = (job->op == FOP_MV);
+
+	/* Moves within a filesystem are renames */
+	for (i = 0; src < end && !job->cancel; src += xstrlen(src) + 1, ++i) {
+		size_t len = xstrlen(src);
+
+		mkpath(job->dst, xbasename(src), dst);
+		if (!strcmp(src, dst) || (!strncmp(src, job->dst, len) && job->dst[len] == '/')
+		    || !strcmp(src, job->dst)) {
+			fop_log(job, i, src, EINVAL);
+			job->rootdone[i] = TRUE;
+			continue;
+		}
+
+		/* Archive members can be copied, not moved */
+		if (move && fop_inarc(src)) {
+			fop_log(job, i, src, EROFS);
+			job->rootdone[i] = TRUE;
+			continue;
+		}
+
+		if (!move)
+			continue;
+
+		if (!job->overwrite && access(dst, F_OK) == 0) {
+			++job->skipped;
+			job->rootdone[i] = TRUE;
+		} else if (rename(src, dst) == 0) {
+			++job->files;
+			job->rootdone[i] = TRUE;
+		} else if (errno != EXDEV) {
+			fop_log(job, i, src, errno);
+			job->rootdone[i] = TRUE;
+		}
+	}
+
+	for (i = 0, src = job->srcs; src < end && !job->cancel; src += xstrlen(src) + 1, ++i)
+		if (!job->rootdone[i] && !fop_inarc(src))
+			fop_scan(job, src);
+	job->scanned = TRUE;
+
+	for (; nworkers < fop_nworkers; ++nworkers)
+		if (pthread_create(&workers[nworkers], NULL, fop_worker, job))
+			break;
+
+	if (!nworkers)
+		fop_cancel(job);
+
+	for (i = 0, src = job->srcs; src < end && !job->cancel; src += xstrlen(src) + 1, ++i) {
+		if (job->rootdone[i])
+			continue;
+
+		mkpath(job->dst, xbasename(src), dst);
+		if (fop_inarc(src))
+			fop_arccopy(job, src, dst, i);
+		else
+			fop_walk(job, src, dst, i);
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->walked = TRUE;
+	fop_wake(job);
+	pthread_mutex_unlock(&job->lock);
+
+	while (nworkers)
+		pthread_join(workers[--nworkers], NULL);
+
+	/* Drop the tasks left behind on cancel */
+	for (; job->count; --job->count, job->head = (job->head + 1) % FOP_QUEUE_MAX)
+		free(job->queue[job->head].src);
+
+	fop_setdirs(job);
+
+	/* Remove the sources copied across filesystems without errors */
+	if (move && !job->cancel)
+		fop_rm(job, FALSE);
+}
+
+/*
+ * Run an external command in dst with the selection on stdin,
+ * stderr goes to the error log
+ */
+static void fop_cmd(fop_job *job)
+{
+	struct pollfd pfd[2];
+	size_t off = 0;
+	ssize_t n;
+	int status, in[2], err[2];
+	sigset_t mask;
+
+	if (pipe(in) == -1) {
+		fop_log(job, job->nroots, job->argv[0], errno);
+		return;
+	}
+
+	if (pipe(err) == -1) {
+		fop_log(job, job->nroots, job->argv[0], errno);
+		close(in[0]);
+		close(in[1]);
+		return;
+	}
+
+	job->pid = fork();
+	if (job->pid == 0) {
+		setpgid(0, 0);
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		enable_signals();
+		dup2(in[0], STDIN_FILENO);
+		dup2(devnullfd, STDOUT_FILENO);
+		dup2(err[1], STDERR_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(err[0]);
+		close(err[1]);
+		if (chdir(job->dst) == 0)
+			execvp(job->argv[0], job->argv);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(err[1]);
+
+	if (job->pid == -1) {
+		fop_log(job, job->nroots, job->argv[0], errno);
+		close(in[1]);
+		close(err[0]);
+		return;
+	}
+
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	pfd[0].fd = in[1];
+	pfd[0].events = POLLOUT;
+	pfd[1].fd = err[0];
+	pfd[1].events = POLLIN;
+
+	/* Feed the selection and drain stderr together so neither side stalls */
+	while (pfd[0].fd != -1 || pfd[1].fd != -1) {
+		if (job->cancel && pfd[0].fd != -1) {
+			kill(-job->pid, SIGTERM);
+			close(pfd[0].fd);
+			pfd[0].fd = -1;
+		}
+
+		if (poll(pfd, 2, FOP_REFRESH_MS) <= 0)
+			continue;
+
+		if (pfd[0].revents) {
+			n = (pfd[0].revents & POLLOUT)
+			    ? write(pfd[0].fd, job->srcs + off, job->srcslen - off) : -1;
+			if (n > 0) {
+				off += n;
+				fop_addbytes(job, n);
+			}
+			if ((n < 0 && errno != EAGAIN) || off == job->srcslen) {
+				close(pfd[0].fd);
+				pfd[0].fd = -1;
+			}
+		}
+
+		if (pfd[1].revents) {
+			char buf[PIPE_BUF];
+
+			n = read(pfd[1].fd, buf, sizeof(buf));
+			if (n <= 0) {
+				close(pfd[1].fd);
+				pfd[1].fd = -1;
+			} else {
+				pthread_mutex_lock(&job->lock);
+				n = MIN((size_t)n, FOP_ERRLOG_MAX - job->errlen);
+				memcpy(job->errlog + job->errlen, buf, n);
+				job->errlen += n;
+				pthread_mutex_unlock(&job->lock);
+			}
+		}
+	}
+
+	while (waitpid(job->pid, &status, 0) == -1 && errno == EINTR);
+
+	if (!job->cancel && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+		pthread_mutex_lock(&job->lock);
+		++job->errors;
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+#ifdef LIBARCHIVE
+/*
+ * Archive extraction: the job thread decompresses and creates the entries,
+ * file data is handed to the workers in blocks written at their offsets.
+ * A file is finalized by whoever drops the last reference to it.
+ */
+typedef struct {
+	int fd;
+	int err;
+	uint_t refs;
+	struct stat sb;
+	char path[];
+} xarc_file;
+
+typedef struct {
+	xarc_file *file;
+	char *buf;
+	size_t len;
+	off_t off;
+} xarc_chunk;
+
+typedef struct {
+	fop_job *job;
+	int dstfd;
+	xarc_chunk queue[FOP_XARC_CHUNKS];
+	uint_t head;
+	uint_t count;
+} xarc_ctx;
+
+static void xarc_release(fop_job *job, xarc_file *file)
+{
+	struct timespec times[2] = {FOP_ATIM(&file->sb), FOP_MTIM(&file->sb)};
+	mode_t mode = file->sb.st_mode & 07777;
+	bool done;
+
+	pthread_mutex_lock(&job->lock);
+	done = !--file->refs;
+	pthread_mutex_unlock(&job->lock);
+	if (!done)
+		return;
+
+	if (!file->err && !job->cancel) {
+		if (fchown(file->fd, file->sb.st_uid, file->sb.st_gid) == -1)
+			mode &= ~(S_ISUID | S_ISGID);
+		/* Sparse members may end in a hole */
+		if (ftruncate(file->fd, file->sb.st_size) == -1 || fchmod(file->fd, mode) == -1
+		    || futimens(file->fd, times) == -1)
+			file->err = errno;
+	}
+
+	close(file->fd);
+	if (file->err || job->cancel) {
+		if (file->err)
+			fop_log(job, job->nroots, file->path, file->err);
+		unlink(file->path);
+	} else {
+		pthread_mutex_lock(&job->lock);
+		++job->files;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	free(file);
+}
+
+static void *xarc_worker(void *arg)
+{
+	xarc_ctx *ctx = (xarc_ctx *)arg;
+	fop_job *job = ctx->job;
+	xarc_chunk chunk;
+	ssize_t n;
+
+	while (TRUE) {
+		pthread_mutex_lock(&job->lock);
+		while (!ctx->count && !job->walked && !job->cancel)
+			pthread_cond_wait(&job->notempty, &job->lock);
+
+		/* Drain on cancel too, the files are released with the blocks */
+		if (!ctx->count) {
+			pthread_mutex_unlock(&job->lock);
+			break;
+		}
+
+		chunk = ctx->queue[ctx->head];
+		ctx->head = (ctx->head + 1) % FOP_XARC_CHUNKS;
+		--ctx->count;
+		pthread_cond_signal(&job->notfull);
+		pthread_mutex_unlock(&job->lock);
+
+		for (size_t done = 0; !job->cancel && !chunk.file->err && done < chunk.len; done += n) {
+			n = pwrite(chunk.file->fd, chunk.buf + done, chunk.len - done, chunk.off + done);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) {
+					n = 0;
 					continue;
 				}
+				pthread_mutex_lock(&job->lock);
+				chunk.file->err = n ? errno : EIO;
+				pthread_mutex_unlock(&job->lock);
+				break;
+			}
+		}
+
+		free(chunk.buf);
+		xarc_release(job, chunk.file);
+	}
+
+	return NULL;
+}
+
+static bool xarc_push(xarc_ctx *ctx, xarc_file *file, const void *buf, size_t len, off_t off)
+{
+	fop_job *job = ctx->job;
+	xarc_chunk *chunk;
+	char *copy = malloc(len);
+
+	if (!copy) {
+		pthread_mutex_lock(&job->lock);
+		file->err = errno;
+		pthread_mutex_unlock(&job->lock);
+		return FALSE;
+	}
+
+	memcpy(copy, buf, len);
+
+	pthread_mutex_lock(&job->lock);
+	while (ctx->count == FOP_XARC_CHUNKS && !job->cancel)
+		pthread_cond_wait(&job->notfull, &job->lock);
+
+	if (job->cancel) {
+		pthread_mutex_unlock(&job->lock);
+		free(copy);
+		return FALSE;
+	}
+
+	chunk = &ctx->queue[(ctx->head + ctx->count) % FOP_XARC_CHUNKS];
+	chunk->file = file;
+	chunk->buf = copy;
+	chunk->len = len;
+	chunk->off = off;
+	++file->refs;
+	++ctx->count;
+	pthread_cond_signal(&job->notempty);
+	pthread_mutex_unlock(&job->lock);
+
+	return TRUE;
+}
+
+static void xarc_file_data(xarc_ctx *ctx, struct archive *a, int dirfd, const char *name,
+			   const char *path, const struct stat *sb)
+{
+	fop_job *job = ctx->job;
+	size_t len = xstrlen(path), size;
+	xarc_file *file = malloc(sizeof(xarc_file) + len + 1);
+	const void *buf;
+	la_int64_t off;
+	int r, flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_NOFOLLOW | (job->overwrite ? O_TRUNC : O_EXCL);
+
+	if (!file) {
+		fop_log(job, job->nroots, path, errno);
+		return;
+	}
+
+	file->fd = openat(dirfd, name, flags, 0600);
+	if (file->fd == -1) {
+		if (errno == EEXIST) {
+			pthread_mutex_lock(&job->lock);
+			++job->skipped;
+			pthread_mutex_unlock(&job->lock);
+		} else
+			fop_log(job, job->nroots, path, errno);
+		free(file);
+		return;
+	}
+
+	memcpy(file->path, path, len + 1);
+	file->sb = *sb;
+	file->err = 0;
+	file->refs = 1; /* Held by the reader till the data ends */
+
+	while ((r = archive_read_data_block(a, &buf, &size, &off)) == ARCHIVE_OK)
+		if (size && !xarc_push(ctx, file, buf, size, off))
+			break;
+
+	if (r != ARCHIVE_OK && r != ARCHIVE_EOF) {
+		pthread_mutex_lock(&job->lock);
+		file->err = archive_errno(a) ? archive_errno(a) : EIO;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	xarc_release(job, file);
+}
+
+static void xarc_entry(xarc_ctx *ctx, struct archive *a, struct archive_entry *entry,
+		       const char *path, char *rel, const struct stat *sb)
+{
+	fop_job *job = ctx->job;
+	const char *link = archive_entry_hardlink(entry);
+	char target[PATH_MAX], *leaf, *tleaf;
+	size_t len;
+	int r, err, tfd, fd = fop_openparent(ctx->dstfd, rel, &leaf);
+
+	if (fd == -1) {
+		fop_log(job, job->nroots, path, errno);
+		return;
+	}
+
+	if (S_ISDIR(sb->st_mode)) {
+		r = fop_mkdirat(fd, leaf);
+		close(fd);
+
+		if (r == -1)
+			fop_log(job, job->nroots, path, errno);
+		else
+			fop_adddir(job, path, sb);
+		return;
+	}
+
+	if (job->overwrite && !S_ISREG(sb->st_mode))
+		unlinkat(fd, leaf, 0);
+
+	if (link) { /* The target is looked up the same way */
+		link = arc_member(link, &len);
+		tfd = -1;
+		if (link) {
+			memcpy(target, link, len);
+			target[len] = '\0';
+			tfd = fop_openparent(ctx->dstfd, target, &tleaf);
+		} else
+			errno = EINVAL;
+		r = (tfd == -1) ? -1 : linkat(tfd, tleaf, fd, leaf, 0);
+		if (tfd != -1) {
+			err = errno;
+			close(tfd);
+			errno = err;
+		}
+	} else if (S_ISREG(sb->st_mode)) {
+		xarc_file_data(ctx, a, fd, leaf, path, sb);
+		close(fd);
+		return;
+	} else if (S_ISLNK(sb->st_mode))
+		r = (link = archive_entry_symlink(entry)) ? symlinkat(link, fd, leaf) : (errno = EINVAL, -1);
+	else /* No mknodat() everywhere, the parents are checked above */
+		r = mknod(path, sb->st_mode, sb->st_rdev);
+
+	err = errno;
+	close(fd);
+
+	if (r == -1)
+		fop_log(job, job->nroots, path, err);
+	else {
+		pthread_mutex_lock(&job->lock);
+		++job->files;
+		pthread_mutex_unlock(&job->lock);
+	}
+}
+
+static void fop_xarc(fop_job *job)
+{
+	struct archive *a = archive_read_new();
+	struct archive_entry *entry;
+	pthread_t workers[FOP_WORKERS_MAX];
+	xarc_ctx *ctx = calloc(1, sizeof(xarc_ctx));
+	char path[PATH_MAX];
+	struct stat sb;
+	const char *name;
+	uint_t nworkers = 0;
+	size_t len;
+	int r = ARCHIVE_FATAL;
+
+	if (!a || !ctx) {
+		fop_log(job, job->nroots, job->srcs, ENOMEM);
+		goto done;
+	}
+
+	ctx->dstfd = -1;
+	if (stat(job->srcs, &sb) == -1) {
+		fop_log(job, job->nroots, job->srcs, errno);
+		goto done;
+	}
+
+	job->totbytes = sb.st_size;
+	job->scanned = TRUE;
+	ctx->job = job;
+	ctx->dstfd = open(job->dst, O_DIRFD);
+	if (ctx->dstfd == -1) {
+		fop_log(job, job->nroots, job->dst, errno);
+		goto done;
+	}
+
+	archive_read_support_filter_all(a);
+	archive_read_support_format_all(a);
+	if (archive_read_open_filename(a, job->srcs, FOP_BUFSIZ) != ARCHIVE_OK)
+		goto done;
+
+	for (; nworkers < fop_nworkers; ++nworkers)
+		if (pthread_create(&workers[nworkers], NULL, xarc_worker, ctx))
+			break;
+
+	if (!nworkers)
+		fop_cancel(job);
+
+	while (!job->cancel && ((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK || r == ARCHIVE_WARN)) {
+		/* Compressed bytes consumed is the progress */
+		pthread_mutex_lock(&job->lock);
+		job->bytes = (ullong_t)archive_filter_bytes(a, -1);
+		pthread_mutex_unlock(&job->lock);
+
+		name = arc_member(archive_entry_pathname(entry), &len);
+		if (!name) {
+			if (archive_entry_pathname(entry))
+				fop_log(job, job->nroots, archive_entry_pathname(entry), EINVAL);
+			continue;
+		}
+
+		/* Not mkpath(), a member named ~ is not home */
+		if (snprintf(path, PATH_MAX, "%s/%.*s", job->dst, (int)len, name) >= PATH_MAX) {
+			fop_log(job, job->nroots, name, ENAMETOOLONG);
+			continue;
+		}
+
+		xarc_entry(ctx, a, entry, path, path + xstrlen(job->dst) + 1,
+			   archive_entry_stat(entry));
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->walked = TRUE;
+	fop_wake(job);
+	pthread_mutex_unlock(&job->lock);
+
+	while (nworkers)
+		pthread_join(workers[--nworkers], NULL);
+
+	fop_setdirs(job);
+
+done:
+	if (r != ARCHIVE_EOF && !job->cancel && a && !job->errors) {
+		pthread_mutex_lock(&job->lock);
+		if (archive_error_string(a) && job->errlen < FOP_ERRLOG_MAX) {
+			r = snprintf(job->errlog + job->errlen, FOP_ERRLOG_MAX - job->errlen,
+				     "%s: %s\n", job->srcs, archive_error_string(a));
+			job->errlen = (r < 0) ? job->errlen : MIN(job->errlen + r, FOP_ERRLOG_MAX);
+		}
+		++job->errors;
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	if (a)
+		archive_read_free(a);
+	if (ctx && ctx->dstfd != -1)
+		close(ctx->dstfd);
+	free(ctx);
+}
+#endif
+
+static void *fop_job_thread(void *arg)
+{
+	fop_job *job = (fop_job *)arg;
+	sigset_t mask;
+
+	/* Get EPIPE instead of SIGPIPE, leave ^C to the UI */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	sigaddset(&mask, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if (job->op == FOP_CMD) {
+		job->totbytes = job->srcslen;
+		job->scanned = TRUE;
+		fop_cmd(job);
+	} else if (job->op == FOP_RM) {
+		job->scanned = TRUE;
+		fop_rm(job, TRUE);
+#ifdef LIBARCHIVE
+	} else if (job->op == FOP_XARC) {
+		fop_xarc(job);
+#endif
+	} else
+		fop_cpmv(job);
+
+	job->end = time(NULL);
+	job->done = TRUE;
+	return NULL;
+}
+
+static void fop_free(fop_job *job)
+{
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->notempty);
+	pthread_cond_destroy(&job->notfull);
+	free(job->cmd);
+	free(job->arg);
+	free(job->srcs);
+	free(job->rootdone);
+	free(job);
+}
+
+/*
+ * Take a snapshot of the selection file (or use the single path src),
+ * the paths are NUL separated
+ */
+static fop_job *fop_init(const char *path, uchar_t op, const char *name, const char *src)
+{
+	struct stat sb;
+	ssize_t len;
+	fop_job *job;
+	int fd = src ? -1 : open(selpath, O_RDONLY | O_CLOEXEC);
+
+	if (!src && fd == -1)
+		return NULL;
+
+	job = calloc(1, sizeof(fop_job));
+	if (!job || (!src && (fstat(fd, &sb) == -1 || !sb.st_size))) {
+		free(job);
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+
+	if (src) {
+		job->srcs = xstrdup(src);
+		len = job->srcs ? (ssize_t)xstrlen(src) : -1;
+	} else {
+		job->srcs = malloc(sb.st_size + 1);
+		len = job->srcs ? read(fd, job->srcs, sb.st_size) : -1;
+		close(fd);
+	}
+	if (len <= 0) {
+		free(job->srcs);
+		free(job);
+		return NULL;
+	}
+
+	job->srcs[len] = '\0';
+	job->srcslen = (size_t)len;
+	for (ssize_t i = 0; i < len; ++i)
+		if (!job->srcs[i] || i == len - 1)
+			++job->nroots;
+
+	job->rootdone = calloc(2, job->nroots);
+	if (!job->rootdone) {
+		free(job->srcs);
+		free(job);
+		return NULL;
+	}
+	job->rootfail = job->rootdone + job->nroots;
+
+	xstrsncpy(job->dst, path, PATH_MAX);
+	xstrsncpy(job->name, name, sizeof(job->name));
+	job->op = op;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->notempty, NULL);
+	pthread_cond_init(&job->notfull, NULL);
+
+	return job;
+}
+
+static bool fop_start(fop_job *job)
+{
+	job->start = time(NULL);
+	job->state = FOP_RUNNING;
+	if (pthread_create(&job->tid, NULL, fop_job_thread, job)) {
+		job->state = FOP_DONE;
+		job->cancel = TRUE;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static bool fop_devbusy(dev_t dev)
+{
+	int running = 0;
+
+	for (int i = 0; i < FOP_JOBS_MAX; ++i)
+		if (fop_jobs[i] && fop_jobs[i]->state == FOP_RUNNING && fop_jobs[i]->dev == dev)
+			++running;
+
+	return running >= FOP_DEV_JOBS;
+}
+
+/* Start the job or queue it behind the jobs on the same device */
+static bool fop_submit(fop_job *job)
+{
+	struct stat sb;
+	int i = 0;
+
+	while (i < FOP_JOBS_MAX && fop_jobs[i])
+		++i;
+
+	if (i == FOP_JOBS_MAX) {
+		errno = EBUSY;
+		return FALSE;
+	}
+
+	/* Copies and archives write to dst, removals to the source device */
+	job->dev = (stat(job->srcdev ? job->srcs : job->dst, &sb) == 0)
+		   ? sb.st_dev : 0;
+
+	if (fop_devbusy(job->dev))
+		job->state = FOP_QUEUED;
+	else if (!fop_start(job))
+		return FALSE;
+
+	fop_jobs[i] = job;
+	++fop_njobs;
+	return TRUE;
+}
+
+/* Run the selection through a native op or a command in the background */
+static bool fop_bgrun(const char *path, uchar_t op, const char *name, const char *cmd,
+		      const char *arg, bool srcdev)
+{
+	fop_job *job = fop_init(path, op, name, NULL);
+	char dst[PATH_MAX];
+	int n;
+
+	if (!job) {
+		printwarn(NULL);
+		return FALSE;
+	}
+
+	if (cmd) {
+		job->cmd = parseargs((char *)cmd, job->argv, &n);
+		if (!job->cmd) {
+			fop_free(job);
+			printmsg(messages[MSG_FAILED]);
+			return FALSE;
+		}
+		if (arg) {
+			job->arg = xstrdup(arg);
+			if (!job->arg) {
+				fop_free(job);
+				printwarn(NULL);
+				return FALSE;
+			}
+		}
+		job->argv[n] = job->arg;
+		job->argv[n + 1] = NULL;
+	} else if (op != FOP_RM) {
+		/* Prompt once if anything would be overwritten */
+		for (char *src = job->srcs; src < job->srcs + job->srcslen; src += xstrlen(src) + 1) {
+			mkpath(path, xbasename(src), dst);
+			if (strcmp(src, dst) && access(dst, F_OK) == 0) {
+				n = get_input(messages[MSG_OVERWRITE]);
+				if (n == ESC) {
+					fop_free(job);
+					printmsg(messages[MSG_CANCEL]);
+					return FALSE;
+				}
+
+				job->overwrite = xconfirm(n);
+				break;
+			}
+		}
+	}
+
+	job->srcdev = srcdev;
+	if (!fop_submit(job)) {
+		fop_free(job);
+		printwarn(NULL);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#ifdef LIBARCHIVE
+/* Extract an archive to the cwd in the background */
+static void fop_xarcrun(const char *archive)
+{
+	char cwd[PATH_MAX];
+	fop_job *job = getcwd(cwd, PATH_MAX) ? fop_init(cwd, FOP_XARC, "extract", archive) : NULL;
+	const char *name = strrchr(archive, '/');
+	struct dirent *dp;
+	DIR *dirp;
+	int r;
+
+	if (!job) {
+		printwarn(NULL);
+		return;
+	}
+
+	/* Prompt if members could clash with the files here */
+	name = name ? name + 1 : archive;
+	dirp = opendir(cwd);
+	while (dirp && (dp = readdir(dirp)) && (selforparent(dp->d_name) || !strcmp(dp->d_name, name)));
+	if (dirp && dp) {
+		r = get_input(messages[MSG_OVERWRITE]);
+		if (r == ESC) {
+			closedir(dirp);
+			fop_free(job);
+			printmsg(messages[MSG_CANCEL]);
+			return;
+		}
+		job->overwrite = xconfirm(r);
+	}
+	if (dirp)
+		closedir(dirp);
+
+	if (!fop_submit(job)) {
+		fop_free(job);
+		printwarn(NULL);
+	}
+}
+#endif
+
+static bool fop_active(void)
+{
+	for (int i = 0; i < FOP_JOBS_MAX; ++i)
+		if (fop_jobs[i] && fop_jobs[i]->state != FOP_DONE)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Cancels the jobs and waits for the running ones to clean up after them */
+static void fop_cancelall(void)
+{
+	int i;
+
+	for (i = 0; i < FOP_JOBS_MAX; ++i) {
+		if (!fop_jobs[i] || fop_jobs[i]->state == FOP_DONE)
+			continue;
+
+		fop_cancel(fop_jobs[i]);
+		if (fop_jobs[i]->pid > 0)
+			kill(-fop_jobs[i]->pid, SIGTERM);
+	}
+
+	/* A partial destination file is removed by its worker */
+	for (i = 0; i < FOP_JOBS_MAX; ++i) {
+		if (!fop_jobs[i] || fop_jobs[i]->state != FOP_RUNNING)
+			continue;
+
+		pthread_join(fop_jobs[i]->tid, NULL);
+		fop_jobs[i]->state = FOP_DONE;
+	}
+}
+
+static void fop_remove(int i)
+{
+	fop_free(fop_jobs[i]);
+	fop_jobs[i] = NULL;
+	--fop_njobs;
+}
+
+/*
+ * Collect finished jobs and start the queued ones. Jobs with errors are
+ * kept in the list. Returns TRUE if any job finished.
+ */
+static bool fop_reap(void)
+{
+	bool finished = FALSE;
+	fop_job *job;
+	int i;
+
+	for (i = 0; i < FOP_JOBS_MAX; ++i) {
+		job = fop_jobs[i];
+		if (!job || job->state != FOP_RUNNING || !job->done)
+			continue;
+
+		pthread_join(job->tid, NULL);
+		job->state = FOP_DONE;
+		finished = TRUE;
+
+		if (!job->errors || job->cancel)
+			fop_remove(i);
+	}
+
+	for (i = 0; i < FOP_JOBS_MAX; ++i) {
+		job = fop_jobs[i];
+		if (job && job->state == FOP_QUEUED && !fop_devbusy(job->dev) && !fop_start(job))
+			fop_remove(i);
+	}
+
+#ifndef NOX11
+	/* Show notification on operation complete */
+	if (finished && cfg.x11)
+		plugscript(utils[UTIL_NTFY], F_NOWAIT | F_NOTRACE);
+#endif
+
+	return finished;
+}
+
+/* One line of job status for the job list */
+static void fop_jobstr(fop_job *job, char *buf, size_t buflen)
+{
+	char size[12], total[12], rate[12];
+	time_t elapsed = (job->done ? job->end : time(NULL)) - job->start;
+	ullong_t bytes, totbytes, files, removed, eta = 0;
+	int pct = 0;
+
+	pthread_mutex_lock(&job->lock);
+	bytes = job->bytes;
+	totbytes = job->totbytes;
+	files = job->files;
+	removed = job->removed;
+	pthread_mutex_unlock(&job->lock);
+
+	if (job->state == FOP_QUEUED) {
+		snprintf(buf, buflen, "%-7s queued", job->name);
+		return;
+	}
+
+	if (job->state == FOP_DONE) {
+		snprintf(buf, buflen, "%-7s failed %llu error(s)", job->name, job->errors);
+		return;
+	}
+
+	if (!job->scanned) {
+		snprintf(buf, buflen, "%-7s scanning %llu files", job->name, job->totfiles);
+		return;
+	}
+
+	if (totbytes)
+		pct = (int)(MIN(bytes, totbytes) * 100 / totbytes);
+	if (bytes && elapsed > 0 && totbytes > bytes)
+		eta = (totbytes - bytes) * elapsed / bytes;
+
+	xstrsncpy(size, coolsize(bytes), sizeof(size));
+	xstrsncpy(total, coolsize(totbytes), sizeof(total));
+	xstrsncpy(rate, coolsize(elapsed > 0 ? (off_t)(bytes / elapsed) : (off_t)bytes), sizeof(rate));
+
+	if (job->op == FOP_CMD)
+		snprintf(buf, buflen, "%-7s running %llds", job->name, (long long)elapsed);
+	else if (job->op == FOP_RM)
+		snprintf(buf, buflen, "%-7s %llu removed %llu/s %llu error(s)", job->name, removed,
+			 elapsed > 0 ? removed / elapsed : removed, job->errors);
+	else if (job->op == FOP_XARC) /* Progress in compressed bytes */
+		snprintf(buf, buflen, "%-7s %3d%% %s/%s %s/s ETA %llu:%02llu %llu files",
+			 job->name, pct, size, total, rate, eta / 60, eta % 60, files);
+	else
+		snprintf(buf, buflen, "%-7s %3d%% %s/%s %s/s ETA %llu:%02llu %llu/%llu files",
+			 job->name, pct, size, total, rate, eta / 60, eta % 60, files, job->totfiles);
+}
+
+/* Status bar indicator: number of jobs and progress of the oldest running one */
+static void fop_indicator(void)
+{
+	int i, active = 0, failed = 0, pct = -1;
+	fop_job *job;
+
+	for (i = 0; i < FOP_JOBS_MAX; ++i) {
+		job = fop_jobs[i];
+		if (!job)
+			continue;
+
+		if (job->state == FOP_DONE) {
+			++failed;
+			continue;
+		}
+
+		++active;
+		if (pct == -1 && job->state == FOP_RUNNING && job->scanned && job->totbytes
+		    && job->op != FOP_CMD && job->op != FOP_RM)
+			pct = (int)(MIN(job->bytes, job->totbytes) * 100 / job->totbytes);
+	}
+
+	if (!active && !failed)
+		return;
+
+	attron(A_REVERSE);
+	addstr(" J");
+	if (active)
+		addstr(xitoa(active));
+	if (pct >= 0) {
+		addch(' ');
+		addstr(xitoa(pct));
+		addch('%');
+	}
+	if (failed)
+		addch('!');
+	addch(' ');
+	attroff(A_REVERSE);
+	addch(' ');
+}
+
+static void fop_showerr(fop_job *job)
+{
+	int fd = create_tmp_file();
+
+	if (fd == -1)
+		return;
+
+	if (write(fd, job->errlog, job->errlen) == (ssize_t)job->errlen)
+		spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+	close(fd);
+	unlink(g_tmpfpath);
+}
+
+/* Run a job in the foreground with a live status, Esc or ^C cancels */
+static void fop_fgrun(fop_job *job)
+{
+	char buf[CMD_LEN_MAX];
+	wint_t ch;
+
+	if (!job || !fop_start(job)) {
+		if (job)
+			fop_free(job);
+		printwarn(NULL);
+		return;
+	}
+
+	timeout(FOP_REFRESH_MS);
+	while (!job->done) {
+		fop_jobstr(job, buf, sizeof(buf));
+		printmsg(buf);
+		if ((get_wch(&ch) != ERR && ch == ESC) || g_state.interrupt) {
+			g_state.interrupt = 0;
+			fop_cancel(job);
+		}
+	}
+	settimeout();
+
+	pthread_join(job->tid, NULL);
+	if (job->errlen)
+		fop_showerr(job);
+	fop_free(job);
+}
+
+/* List the jobs, cancel a running one or view the errors of a failed one */
+static void show_jobs(void)
+{
+	char buf[CMD_LEN_MAX];
+	int i, r;
+	fop_job *job;
+
+	erase();
+	attron(A_BOLD);
+	mvaddstr(0, 0, "JOBS");
+	attroff(A_BOLD);
+
+	for (i = 0, r = 2; i < FOP_JOBS_MAX && r < xlines - 2; ++i) {
+		job = fop_jobs[i];
+		if (!job)
+			continue;
+
+		fop_jobstr(job, buf, sizeof(buf));
+		mvprintw(r++, 0, " %d %s", i + 1, buf);
+		mvprintw(r++, 5, "in %s", job->dst);
+	}
+
+	r = get_input(messages[MSG_JOB_OPTS]) - '1';
+	if (r < 0 || r >= FOP_JOBS_MAX || !fop_jobs[r])
+		return;
+
+	job = fop_jobs[r];
+	if (job->state == FOP_QUEUED) {
+		fop_remove(r);
+		return;
+	}
+
+	if (job->state == FOP_RUNNING) {
+		fop_cancel(job);
+		if (job->pid > 0)
+			kill(-job->pid, SIGTERM);
+		return;
+	}
+
+	fop_showerr(job);
+	fop_remove(r);
+}
+#endif
+
+static bool cpmvrm_selection(enum action sel, char *path)
+{
+	int r;
+	bool bg = FALSE, use_trash = trashcmd && (sel == SEL_TRASH);
+
+	if (isselfileempty()) {
+		if (nselected)
+			clearselection();
+		printmsg(messages[MSG_0_SELECTED]);
+		return FALSE;
+	}
+
+	if (!selsafe())
+		return FALSE;
+
+	switch (sel) {
+	case SEL_CP: // fallthrough
+	case SEL_MV:
+#ifndef NOFOPS
+		if (!g_state.extcpmv) {
+			if (!fop_bgrun(path, sel == SEL_CP ? FOP_CP : FOP_MV,
+				       sel == SEL_CP ? "cp" : "mv", NULL, NULL, FALSE))
+				return FALSE;
+			bg = TRUE;
+			break;
+		}
+#endif
+		opstr(g_buf, sel == SEL_CP ? cp : mv);
+		break;
+	case SEL_CPMVAS:
+		r = get_input(messages[MSG_CP_MV_AS]);
+		if (r != 'c' && r != 'm') {
+			printmsg(messages[MSG_INVALID_KEY]);
+			return FALSE;
+		}
+
+		if (!cpmv_rename(r, path)) {
+			printmsg(messages[MSG_FAILED]);
+			return FALSE;
+		}
+		break;
+	default: /* SEL_TRASH, SEL_RM_RF */
+		r = confirm_force(TRUE, use_trash);
+		if (!r) {
+			printmsg(messages[MSG_CANCEL]);
+			return FALSE;
+		}
+#ifndef NOFOPS
+		/* Forced removal doesn't need the tty */
+		if (r == 'f') {
+			if (use_trash) {
+				snprintf(g_buf, CMD_LEN_MAX, "xargs -0 %s", trashcmd);
+				if (!fop_bgrun(path, FOP_CMD, "trash", g_buf, NULL, TRUE))
+					return FALSE;
+			} else if (!fop_bgrun(path, FOP_RM, "rm", NULL, NULL, TRUE))
+				return FALSE;
+			bg = TRUE;
+			break;
+		}
+#endif
+		rmmulstr(g_buf, r, use_trash);
+	}
+
+	if (!bg && sel != SEL_CPMVAS) {
+		if (spawn(utils[UTIL_SH_EXEC], g_buf, NULL, NULL, F_CLI | F_CHKRTN)) {
+			printmsg(messages[MSG_FAILED]);
+			return FALSE;
+		}
+	}
+
+#ifndef NOX11
+	/* Show notification on operation complete, background jobs notify when done */
+	if (!bg && cfg.x11)
+		plugscript(utils[UTIL_NTFY], F_NOWAIT | F_NOTRACE);
+#endif
+
+	/* Clear selection */
+	clearselection();
+
+	return TRUE;
+}
+
+#ifndef NOBATCH
+/* A rename from the batch, parked at tmp while its target is another source */
+typedef struct {
+	char *src;
+	char *dst;
+	char *tmp;
+	int err;
+} brename;
+
+static int brename_cmp(const void *va, const void *vb)
+{
+	return strcmp(*(char * const *)va, *(char * const *)vb);
+}
+
+static int brename_dstcmp(const void *va, const void *vb)
+{
+	return strcmp((*(brename * const *)va)->dst, (*(brename * const *)vb)->dst);
+}
+
+/* Rename without replacing an existing dst */
+static int xrename_noreplace(const char *src, const char *dst)
+{
+#if defined(__linux__) && defined(RENAME_NOREPLACE)
+	if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS)
+		return errno;
+	/* Not supported by the filesystem */
+#endif
+	struct stat sb;
+
+	if (lstat(dst, &sb) == 0)
+		return EEXIST;
+
+	return rename(src, dst) ? errno : 0;
+}
+
+/* Read a list file into a buffer and split it into lines in place */
+static char **batch_lines(int fd, uint_t *plines, char **pbuf)
+{
+	struct stat sb;
+	char *buf, *p, *end, **lines;
+	uint_t n = 0;
+	ssize_t len;
+
+	*pbuf = NULL;
+	if (fstat(fd, &sb) == -1 || lseek(fd, 0, SEEK_SET) == -1)
+		return NULL;
+
+	buf = malloc(sb.st_size + 1);
+	if (!buf)
+		return NULL;
+
+	len = read(fd, buf, sb.st_size);
+	if (len < 0) {
+		free(buf);
+		return NULL;
+	}
+
+	/* The trailing newline is optional */
+	if (len && buf[len - 1] == '\n')
+		--len;
+	buf[len] = '\0';
+
+	for (p = buf, end = buf + len; len && p <= end; ++p)
+		if (*p == '\n' || p == end)
+			++n;
+
+	lines = malloc((n + 1) * sizeof(char *));
+	if (!lines) {
+		free(buf);
+		return NULL;
+	}
+
+	lines[0] = buf;
+	for (p = buf, n = len ? 1 : 0; p < end; ++p)
+		if (*p == '\n') {
+			*p = '\0';
+			lines[n++] = p + 1;
+		}
+
+	*plines = n;
+	*pbuf = buf;
+	return lines;
+}
+
+/* Relative names are in the current dir */
+static char *batch_path(const char *path, const char *name)
+{
+	char buf[PATH_MAX];
+
+	if (name[0] == '/')
+		return xstrdup(name);
+
+	mkpath(path, name, buf);
+	return xstrdup(buf);
+}
+
+/* Write the planned renames and the ones refused (with the reason) */
+static void batch_report(int fd, brename *br, uint_t n, bool errors)
+{
+	for (uint_t i = 0; i < n; ++i) {
+		if (errors && !br[i].err)
+			continue;
+
+		dprintf(fd, "%s%s -> %s%s%s\n", br[i].err ? "! " : "", br[i].src, br[i].dst,
+			br[i].err ? ": " : "", br[i].err ? strerror(br[i].err) : "");
+	}
+}
+
+/* Show the report in the pager, a tmp file is used as the ones listed are gone */
+static void batch_show(brename *br, uint_t n, bool errors)
+{
+	int fd = create_tmp_file();
+
+	if (fd == -1)
+		return;
+
+	batch_report(fd, br, n, errors);
+	close(fd);
+	spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+	unlink(g_tmpfpath);
+}
+
+/*
+ * Plan the renames: targets taken by other sources (swaps, cycles, chains)
+ * are freed by parking those sources at temporary names first
+ */
+static uint_t batch_plan(brename *br, uint_t n)
+{
+	char **srcs = malloc(n * sizeof(char *));
+	brename **dsts = malloc(n * sizeof(brename *));
+	struct stat sb;
+	uint_t i, valid = 0;
+
+	if (!srcs || !dsts) {
+		free(srcs);
+		free(dsts);
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		srcs[i] = br[i].src;
+		dsts[i] = &br[i];
+	}
+	qsort(srcs, n, sizeof(char *), brename_cmp);
+	qsort(dsts, n, sizeof(brename *), brename_dstcmp);
+
+	for (i = 0; i < n; ++i) {
+		if (!*xbasename(dsts[i]->dst))
+			dsts[i]->err = EINVAL;
+		else if ((i && !strcmp(dsts[i]->dst, dsts[i - 1]->dst))
+			 || (i + 1 < n && !strcmp(dsts[i]->dst, dsts[i + 1]->dst)))
+			dsts[i]->err = EEXIST;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (br[i].err)
+			continue;
+
+		if (bsearch(&br[i].dst, srcs, n, sizeof(char *), brename_cmp)) {
+			char tmp[PATH_MAX];
+
+			snprintf(tmp, PATH_MAX, "%s.nnn%d.%u", br[i].src, getpid(), i);
+			br[i].tmp = xstrdup(tmp);
+			if (!br[i].tmp)
+				br[i].err = ENOMEM;
+		} else if (lstat(br[i].dst, &sb) == 0)
+			br[i].err = EEXIST;
+
+		valid += !br[i].err;
+	}
+
+	free(srcs);
+	free(dsts);
+	return valid;
+}
+
+static void batch_apply(brename *br, uint_t n)
+{
+	uint_t i;
+
+	/* Park the sources standing in the way */
+	for (i = 0; i < n; ++i)
+		if (!br[i].err && br[i].tmp)
+			br[i].err = xrename_noreplace(br[i].src, br[i].tmp);
+
+	/* Renames to free names first, then the parked ones */
+	for (int pass = 0; pass < 2; ++pass)
+		for (i = 0; i < n; ++i) {
+			if (br[i].err || (!!br[i].tmp != pass))
+				continue;
+
+			br[i].err = xrename_noreplace(br[i].tmp ? br[i].tmp : br[i].src, br[i].dst);
+			if (br[i].err && br[i].tmp && xrename_noreplace(br[i].tmp, br[i].src)) {
+				/* Report where it was left */
+				free(br[i].dst);
+				br[i].dst = br[i].tmp;
+				br[i].tmp = NULL;
+			}
+		}
+}
+
+static bool batch_rename(void)
+{
+	int fd1, fd2, r;
+	uint_t count = 0, lines = 0, n = 0, valid, i;
+	bool dir = FALSE, ret = FALSE;
+	char foriginal[TMP_LEN_MAX] = {0};
+	char *obuf = NULL, *ebuf = NULL, **olines = NULL, **elines = NULL;
+	const char *path = g_ctx[cfg.curctx].c_path;
+	brename *br = NULL;
+	char str[64];
+
+	r = get_cur_or_sel();
+	if (!r)
+		return ret;
+
+	if (r == 'c') { /* Rename entries in current dir */
+		selbufpos = 0;
+		selidx_clear();
+		dir = TRUE;
+	}
+
+	fd1 = create_tmp_file();
+	if (fd1 == -1)
+		return ret;
+
+	xstrsncpy(foriginal, g_tmpfpath, xstrlen(g_tmpfpath) + 1);
+
+	fd2 = create_tmp_file();
+	if (fd2 == -1) {
+		unlink(foriginal);
+		close(fd1);
+		return ret;
+	}
+
+	if (dir)
+		for (r = 0; r < ndents; ++r)
+			appendfpath(pdents[r].name, NAME_MAX);
+
+	seltofile(fd1, &count, NEWLINE);
+	seltofile(fd2, NULL, NEWLINE);
+	close(fd2);
+
+	if (dir) /* Don't retain dir entries in selection */
+		selbufpos = 0;
+
+	spawn((cfg.waitedit ? enveditor : editor), g_tmpfpath, NULL, NULL, F_CLI);
+
+	/* Reopen file descriptor to get updated contents */
+	fd2 = open(g_tmpfpath, O_RDONLY);
+	if (fd2 >= 0) {
+		olines = batch_lines(fd1, &count, &obuf);
+		elines = batch_lines(fd2, &lines, &ebuf);
+		close(fd2);
+	}
+
+	close(fd1);
+	unlink(foriginal);
+	unlink(g_tmpfpath);
+
+	DPRINTF_U(count);
+	DPRINTF_U(lines);
+	if (!olines || !elines || !lines || (count != lines)) {
+		DPRINTF_S("cannot delete files");
+		goto finish;
+	}
+
+	br = calloc(lines, sizeof(brename));
+	if (!br)
+		goto finish;
+
+	for (i = 0; i < lines; ++i) {
+		if (!strcmp(olines[i], elines[i]))
+			continue;
+
+		br[n].src = batch_path(path, olines[i]);
+		br[n].dst = batch_path(path, elines[i]);
+		if (!br[n].src || !br[n].dst) {
+			free(br[n].src);
+			free(br[n].dst);
+			goto finish;
+		}
+		++n;
+	}
+
+	ret = TRUE;
+	if (!n)
+		goto finish;
+
+	valid = batch_plan(br, n);
+
+	/* Dry run till confirmed */
+	while (TRUE) {
+		snprintf(str, sizeof(str), "rename %u/%u? 'p'review", valid, n);
+		r = get_input(str);
+		if (r != 'p')
+			break;
+		batch_show(br, n, FALSE);
+	}
+
+	if (!xconfirm(r)) {
+		printmsg(messages[MSG_CANCEL]);
+		goto finish;
+	}
+
+	batch_apply(br, n);
+	for (i = 0; i < n && !br[i].err; ++i)
+		;
+	if (i < n)
+		batch_show(br, n, TRUE);
+
+finish:
+	for (i = 0; i < n; ++i) {
+		free(br[i].src);
+		free(br[i].dst);
+		free(br[i].tmp);
+	}
+	free(br);
+	free(olines);
+	free(elines);
+	free(obuf);
+	free(ebuf);
+
+	return ret;
+}
+#endif
+
+static char *get_archive_cmd(const char *archive)
+{
+	uchar_t i = 3;
+
+	if (!g_state.usebsdtar && getutil(utils[UTIL_ATOOL]))
+		i = 0;
+	else if (getutil(utils[UTIL_BSDTAR]))
+		i = 1;
+	else if (is_suffix(archive, ".zip"))
+		i = 2;
+	// else tar
+
+	return archive_cmd[i];
+}
+
+static void archive_selection(const char *cmd, const char *archive)
+{
+#ifndef NOFOPS
+	snprintf(g_buf, CMD_LEN_MAX, "xargs -0 %s", cmd);
+	if (fop_bgrun(g_ctx[cfg.curctx].c_path, FOP_CMD, "archive", g_buf, archive, FALSE))
+		clearselection();
+#else
+	size_t len = xstrlen(patterns[P_ARCHIVE_CMD]) + xstrlen(cmd) + xstrlen(archive)
+	            + xstrlen(selpath) + 1;
+	char *buf = malloc(len);
+	if (!buf) {
+		DPRINTF_S(strerror(errno));
+		printwarn(NULL);
+		return;
+	}
+
+	snprintf(buf, len, patterns[P_ARCHIVE_CMD], cmd, archive, selpath);
+	spawn(utils[UTIL_SH_EXEC], buf, NULL, NULL, F_CLI | F_CONFIRM);
+	free(buf);
+#endif
+}
+
+static void write_lastdir(const char *curpath, const char *outfile)
+{
+	bool tilde = false, ok = false;
+	if (!outfile)
+		xstrsncpy(cfgpath + xstrlen(cfgpath), "/.lastd", 8);
+	else
+		tilde = convert_tilde(outfile, g_buf);
+
+	int fd = open(outfile
+			? (tilde ? g_buf : outfile)
+			: cfgpath, O_CREAT | O_WRONLY | O_TRUNC, S_IWUSR | S_IRUSR);
+	if (fd >= 0) {
+		memcpy(g_buf, "cd ", 3);  // NOLINT
+		ssize_t l = shell_escape(g_buf + 3, sizeof(g_buf) - 3, curpath);
+		ok = l >= 0 && write(fd, g_buf, l + 3) == l + 3;
+		close(fd);
+	}
+	if (!ok)
+		errexit();
+}
+
+/*
+ * We assume none of the strings are NULL.
+ *
+ * Let's have the logic to sort numeric names in numeric order.
+ * E.g., the order '1, 10, 2' doesn't make sense to human eyes.
+ *
+ * If the absolute numeric values are same, we fallback to alphasort.
+ */
+static int xstricmp(const char * const s1, const char * const s2)
+{
+	char *p1, *p2;
+
+	long long v1 = strtoll(s1, &p1, 10);
+	long long v2 = strtoll(s2, &p2, 10);
+
+	/* Check if at least 1 string is numeric */
+	if (s1 != p1 || s2 != p2) {
+		/* Handle both pure numeric */
+		if (s1 != p1 && s2 != p2) {
+			if (v2 > v1)
+				return -1;
+
+			if (v1 > v2)
+				return 1;
+		}
+
+		/* Only first string non-numeric */
+		if (s1 == p1)
+			return 1;
+
+		/* Only second string non-numeric */
+		if (s2 == p2)
+			return -1;
+	}
+
+	/* Handle 1. all non-numeric and 2. both same numeric value cases */
+#ifndef NOLC
+	return strcoll(s1, s2);
+#else
+	return strcasecmp(s1, s2);
+#endif
+}
+
+/*
+ * Version comparison
+ *
+ * The code for version compare is a modified version of the GLIBC
+ * and uClibc implementation of strverscmp(). The source is here:
+ * https://elixir.bootlin.com/uclibc-ng/latest/source/libc/string/strverscmp.c
+ */
+
+/*
+ * Compare S1 and S2 as strings holding indices/version numbers,
+ * returning less than, equal to or greater than zero if S1 is less than,
+ * equal to or greater than S2 (for more info, see the texinfo doc).
+ *
+ * Ignores case.
+ */
+static int xstrverscasecmp(const char * const s1, const char * const s2)
+{
+	const uchar_t *p1 = (const uchar_t *)s1;
+	const uchar_t *p2 = (const uchar_t *)s2;
+	int state, diff;
+	uchar_t c1, c2;
+
+	/*
+	 * Symbol(s)    0       [1-9]   others
+	 * Transition   (10) 0  (01) d  (00) x
+	 */
+	static const uint8_t next_state[] = {
+		/* state    x    d    0  */
+		/* S_N */  S_N, S_I, S_Z,
+		/* S_I */  S_N, S_I, S_I,
+		/* S_F */  S_N, S_F, S_F,
+		/* S_Z */  S_N, S_F, S_Z
+	};
+
+	alignas(max_align_t) static const int8_t result_type[] = {
+		/* state   x/x  x/d  x/0  d/x  d/d  d/0  0/x  0/d  0/0  */
+
+		/* S_N */  VCMP, VCMP, VCMP, VCMP, VLEN, VCMP, VCMP, VCMP, VCMP,
+		/* S_I */  VCMP,   -1,   -1,    1, VLEN, VLEN,    1, VLEN, VLEN,
+		/* S_F */  VCMP, VCMP, VCMP, VCMP, VCMP, VCMP, VCMP, VCMP, VCMP,
+		/* S_Z */  VCMP,    1,    1,   -1, VCMP, VCMP,   -1, VCMP, VCMP
+	};
+
+	if (p1 == p2)
+		return 0;
+
+	c1 = TOUPPER(*p1);
+	++p1;
+	c2 = TOUPPER(*p2);
+	++p2;
+
+	/* Hint: '0' is a digit too.  */
+	state = S_N + ((c1 == '0') + (xisdigit(c1) != 0));
+
+	while ((diff = c1 - c2) == 0) {
+		if (c1 == '\0')
+			return diff;
+
+		state = next_state[state];
+		c1 = TOUPPER(*p1);
+		++p1;
+		c2 = TOUPPER(*p2);
+		++p2;
+		state += (c1 == '0') + (xisdigit(c1) != 0);
+	}
+
+	state = result_type[state * 3 + (((c2 == '0') + (xisdigit(c2) != 0)))]; // NOLINT
+
+	switch (state) {
+	case VCMP:
+		return diff;
+	case VLEN:
+		while (xisdigit(*p1++))
+			if (!xisdigit(*p2++))
+				return 1;
+		return xisdigit(*p2) ? -1 : diff;
+	default:
+		return state;
+	}
+}
+
+static int (*namecmpfn)(const char * const s1, const char * const s2) = &xstricmp;
+
+static char * (*fnstrstr)(const char *haystack, const char *needle) = &strcasestr;
+#ifdef PCRE2
+static const unsigned char *tables;
+static int pcre2flags = PCRE2_NO_AUTO_CAPTURE | PCRE2_EXTENDED | PCRE2_CASELESS | PCRE2_UTF;
+#else
+static int regflags = REG_NOSUB | REG_EXTENDED | REG_ICASE;
+#endif
+
+#ifdef PCRE2
+static int setfilter(pcre2_code **pcre2x, const char *filter)
+{
+	int errcode;
+	PCRE2_SIZE erroffset;
+
+	*pcre2x = pcre2_compile((PCRE2_SPTR)filter, PCRE2_ZERO_TERMINATED, pcre2flags, &errcode, &erroffset, NULL);
+	return *pcre2x ? 0 : -1;
+}
+#else
+static int setfilter(regex_t *regex, const char *filter)
+{
+	return regcomp(regex, filter, regflags);
+}
+#endif
+
+static int visible_re(const fltrexp_t *fltrexp, const char *fname)
+{
+#ifdef PCRE2
+	int r = 0;
+	pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(fltrexp->pcre2x, NULL);
+
+	if (match_data) {
+		r = pcre2_match(fltrexp->pcre2x, (PCRE2_SPTR)fname, xstrlen(fname), 0, 0, match_data, NULL);
+		pcre2_match_data_free(match_data);
+	}
+
+	return r > 0;
+#else
+	return regexec(fltrexp->regex, fname, 0, NULL, 0) == 0;
+#endif
+}
+
+static int visible_str(const fltrexp_t *fltrexp, const char *fname)
+{
+	return fnstrstr(fname, fltrexp->str) != NULL;
+}
+
+static int (*filterfn)(const fltrexp_t *fltr, const char *fname) = &visible_str;
+
+static void clearfilter(void)
+{
+	char * const fltr = g_ctx[cfg.curctx].c_fltr;
+
+	if (fltr[1]) {
+		fltr[REGEX_MAX - 1] = fltr[1];
+		fltr[1] = '\0';
+	}
+}
+
+static int entrycmp(const void *va, const void *vb)
+{
+	const struct entry *pa = (pEntry)va;
+	const struct entry *pb = (pEntry)vb;
+
+	if ((pb->flags & DIR_OR_DIRLNK) != (pa->flags & DIR_OR_DIRLNK)) {
+		if (pb->flags & DIR_OR_DIRLNK)
+			return 1;
+		return -1;
+	}
+
+	/* Sort based on specified order */
+	if (cfg.timeorder) {
+		if (pb->sec > pa->sec)
+			return 1;
+		if (pb->sec < pa->sec)
+			return -1;
+		/* If sec matches, comare nsec */
+		if (pb->nsec > pa->nsec)
+			return 1;
+		if (pb->nsec < pa->nsec)
+			return -1;
+	} else if (cfg.sizeorder) {
+		if (pb->size > pa->size)
+			return 1;
+		if (pb->size < pa->size)
+			return -1;
+	} else if (cfg.blkorder) {
+		if (pb->blocks > pa->blocks)
+			return 1;
+		if (pb->blocks < pa->blocks)
+			return -1;
+	} else if (cfg.extnorder && !(pb->flags & DIR_OR_DIRLNK)) {
+		char *extna = xextension(pa->name, pa->nlen - 1);
+		char *extnb = xextension(pb->name, pb->nlen - 1);
+
+		if (extna || extnb) {
+			if (!extna)
+				return -1;
+
+			if (!extnb)
+				return 1;
+
+			int ret = strcasecmp(extna, extnb);
+
+			if (ret)
+				return ret;
+		}
+	}
+
+	return namecmpfn(pa->name, pb->name);
+}
+
+static int reventrycmp(const void *va, const void *vb)
+{
+	if ((((pEntry)vb)->flags & DIR_OR_DIRLNK)
+	    != (((pEntry)va)->flags & DIR_OR_DIRLNK)) {
+		if (((pEntry)vb)->flags & DIR_OR_DIRLNK)
+			return 1;
+		return -1;
+	}
+
+	return -entrycmp(va, vb);
+}
+
+static int (*entrycmpfn)(const void *va, const void *vb) = &entrycmp;
+
+/* In case of an error, resets *wch to Esc */
+static int handle_alt_key(wint_t *wch)
+{
+	timeout(0);
+
+	int r = get_wch(wch);
+
+	if (r == ERR)
+		*wch = ESC;
+	cleartimeout();
+
+	return r;
+}
+
+static inline int handle_event(void)
+{
+	if (nselected && isselfileempty())
+		clearselection();
+	return CONTROL('L');
+}
+
+/*
+ * Mount commands run in the background while the new context waits at
+ * the empty mountpoint. The mount is up once the mountpoint changes
+ * identity; the command failing, timing out or being cancelled ends it.
+ */
+static bool mnt_start(char *cmd, char *arg1, char *arg2)
+{
+	char *argv[EXEC_ARGS_MAX] = {0};
+	struct stat sb;
+	mnt_job *job = mnt_jobs;
+	int argc = 0;
+	char *buf;
+
+	if (mnt_njobs == MNT_JOBS_MAX || stat(arg2, &sb) == -1)
+		return FALSE;
+
+	while (job->path[0])
+		++job;
+
+	buf = parseargs(cmd, argv, &argc);
+	if (!buf)
+		return FALSE;
+
+	argv[argc] = arg1;
+	argv[argc + 1] = arg2;
+	job->pid = xspawn(argv, F_NOWAIT | F_NOTRACE | F_NOSTDIN, -1, -1);
+	free(buf);
+	if (job->pid <= 0)
+		return FALSE;
+
+	job->start = time(NULL);
+	job->dev = sb.st_dev;
+	job->ino = sb.st_ino;
+	xstrsncpy(job->path, arg2, PATH_MAX);
+	++mnt_njobs;
+	return TRUE;
+}
+
+/*
+ * The mountpoint is stat(2)-ed in a thread: a FUSE mount that came up dead
+ * would otherwise hang the UI. A result is read on the next poll.
+ */
+static void *mnt_worker(void *arg)
+{
+	mnt_probe *probe = arg;
+	struct stat sb;
+	bool mounted, orphan;
+
+	mounted = stat(probe->path, &sb) == 0
+		  && (sb.st_dev != probe->dev || sb.st_ino != probe->ino);
+
+	pthread_mutex_lock(&mnt_lock);
+	probe->mounted = mounted;
+	probe->done = TRUE;
+	orphan = probe->orphan;
+	pthread_mutex_unlock(&mnt_lock);
+
+	if (orphan)
+		free(probe);
+
+	return NULL;
+}
+
+static void mnt_drop(mnt_job *job)
+{
+	mnt_probe *probe = job->probe;
+
+	if (!probe)
+		return;
+
+	pthread_mutex_lock(&mnt_lock);
+	if (!probe->done) {
+		probe->orphan = TRUE;
+		probe = NULL;
+	}
+	pthread_mutex_unlock(&mnt_lock);
+
+	free(probe);
+	job->probe = NULL;
+}
+
+/* Returns 1 if mounted, 0 if not and -1 if the probe is not back yet */
+static int mnt_check(mnt_job *job)
+{
+	mnt_probe *probe = job->probe;
+	int ret = -1;
+	pthread_t tid;
+
+	if (probe) {
+		pthread_mutex_lock(&mnt_lock);
+		if (probe->done)
+			ret = probe->mounted;
+		pthread_mutex_unlock(&mnt_lock);
+
+		if (ret == -1)
+			return -1;
+
+		free(probe);
+		job->probe = NULL;
+		if (ret)
+			return ret;
+	}
+
+	probe = calloc(1, sizeof(mnt_probe));
+	if (!probe)
+		return ret;
+
+	probe->dev = job->dev;
+	probe->ino = job->ino;
+	xstrsncpy(probe->path, job->path, PATH_MAX);
+	if (pthread_create(&tid, NULL, mnt_worker, probe)) {
+		free(probe);
+		return ret;
+	}
+	pthread_detach(tid);
+
+	job->probe = probe;
+	return ret;
+}
+
+static void mnt_end(mnt_job *job, bool mounted)
+{
+	mnt_drop(job);
+
+	if (job->pid > 0) {
+		/* Daemons like rclone keep running once mounted */
+		if (!mounted)
+			kill(-job->pid, SIGTERM); /* The command leads its own session */
+		if (ndetached < DETACHED_MAX)
+			detached[ndetached++] = job->pid;
+	}
+
+	if (!mounted) {
+		/* Contexts waiting at the mountpoint go up */
+		for (int i = 0; i < CTX_MAX; ++i)
+			if (g_ctx[i].c_cfg.ctxactive && strcmp(g_ctx[i].c_path, job->path) == 0) {
+				g_ctx[i].c_name[0] = '\0';
+				xdirname(g_ctx[i].c_path);
+			}
+		rmdir(job->path);
+	}
+
+	job->path[0] = '\0';
+	--mnt_njobs;
+}
+
+/* Returns TRUE if a mount finished, sets mnt_err if it failed */
+static bool mnt_poll(void)
+{
+	mnt_job *job;
+	bool done = FALSE;
+	int mounted;
+
+	for (job = mnt_jobs; job < mnt_jobs + MNT_JOBS_MAX; ++job) {
+		if (!job->path[0])
+			continue;
+
+		if (job->pid > 0 && waitpid(job->pid, NULL, WNOHANG) == job->pid) {
+			job->pid = 0;
+			/* A probe started before the exit may miss the mount */
+			mnt_drop(job);
+		}
+
+		mounted = mnt_check(job);
+		if (mounted == 1)
+			mnt_end(job, TRUE);
+		else if (!job->pid && !mounted) {
+			mnt_err = messages[MSG_FAILED];
+			mnt_end(job, FALSE);
+		} else if (time(NULL) - job->start >= MNT_TIMEOUT) {
+			mnt_err = messages[MSG_MNT_TIMEOUT];
+			mnt_end(job, FALSE);
+		} else
+			continue;
+
+		done = TRUE;
+	}
+
+	return done;
+}
+
+static mnt_job *mnt_pending(const char *path)
+{
+	for (mnt_job *job = mnt_jobs; mnt_njobs && job < mnt_jobs + MNT_JOBS_MAX; ++job)
+		if (job->path[0] && strcmp(job->path, path) == 0)
+			return job;
+
+	return NULL;
+}
+
+#ifndef NOPREVIEW
+/* Key of a rendered preview, a changed file gets a new one */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	time_t sec;
+	long nsec;
+} pv_key;
+
+/* Rendered preview, lines of wide chars each NUL-terminated */
+typedef struct {
+	pv_key key;
+	wchar_t *text;
+	uint_t nlines;
+	uint_t used; /* LRU clock */
+} pv_entry;
+
+/* Preview worker, the UI only renders from the cache */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t tid;
+	bool started;
+	bool quit;
+	bool exited;
+	bool req;     /* A request is queued */
+	bool ready;   /* Rendered since the UI looked */
+	bool waiting; /* The UI shows a placeholder */
+	uint_t gen;   /* Bumped per request, older renders are dropped */
+	uint_t clock;
+	long long due; /* Monotonic ms when polling for the request stops */
+	pv_key reqkey;
+	mode_t reqmode;
+	off_t reqsize;
+	char reqpath[PATH_MAX];
+	pv_entry cache[PV_CACHE];
+} g_pv;
+
+/* Rendering buffer of the worker */
+typedef struct {
+	wchar_t *text;
+	size_t len;
+	size_t cap;
+	uint_t nlines;
+} pv_buf;
+
+static bool pv_keyeq(const pv_key *a, const pv_key *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->sec == b->sec && a->nsec == b->nsec;
+}
+
+static void pv_keyset(pv_key *key, const struct stat *sb)
+{
+	key->dev = sb->st_dev;
+	key->ino = sb->st_ino;
+	key->sec = FOP_MTIM(sb).tv_sec;
+	key->nsec = FOP_MTIM(sb).tv_nsec;
+}
+
+static bool pv_stale(uint_t gen)
+{
+	bool stale;
+
+	pthread_mutex_lock(&g_pv.lock);
+	stale = g_pv.quit || g_pv.gen != gen;
+	pthread_mutex_unlock(&g_pv.lock);
+
+	return stale;
+}
+
+/* Appends a line of len bytes, invalid and control chars are shown as '?' and '.' */
+static bool pv_line(pv_buf *b, const char *s, size_t len)
+{
+	mbstate_t ps = {0};
+	wchar_t wc;
+	size_t n;
+	int cols = 0, w;
+
+	if (b->nlines == PV_LINES)
+		return FALSE;
+
+	if (b->cap - b->len < PV_COLS + 1) {
+		wchar_t *tmp = xrealloc(b->text, (b->cap + PV_LINES * 8 + PV_COLS + 1) * sizeof(wchar_t));
+
+		if (!tmp)
+			return FALSE;
+		b->text = tmp;
+		b->cap += PV_LINES * 8 + PV_COLS + 1;
+	}
+
+	while (len && cols < PV_COLS) {
+		n = mbrtowc(&wc, s, len, &ps);
+		if (n == (size_t)-1 || n == (size_t)-2 || n == 0) {
+			memset(&ps, 0, sizeof(ps));
+			wc = '?';
+			n = 1;
+		}
+		s += n;
+		len -= n;
+
+		if (wc == '\t') { /* Tab stops every 8 cols */
+			do
+				b->text[b->len++] = ' ';
+			while (++cols % 8 && cols < PV_COLS);
+			continue;
+		}
+
+		w = wcwidth(wc);
+		if (w < 0) {
+			wc = '.';
+			w = 1;
+		}
+		if (cols + w > PV_COLS)
+			break;
+		b->text[b->len++] = wc;
+		cols += w;
+	}
+
+	b->text[b->len++] = '\0';
+	++b->nlines;
+	return TRUE;
+}
+
+static bool pv_printf(pv_buf *b, const char *fmt, ...)
+{
+	char line[PV_COLS + 1];
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	return pv_line(b, line, MIN((size_t)MAX(len, 0), sizeof(line) - 1));
+}
+
+/* coolsize() is not for threads */
+static const char *pv_size(off_t size, char *buf)
+{
+	static const char units[] = "BKMGTPEZY";
+	double sz = (double)size;
+	int i = 0;
+
+	for (; sz >= 1024 && i < (int)sizeof(units) - 2; ++i)
+		sz /= 1024;
+
+	snprintf(buf, 16, i ? "%.1f%c" : "%.0f%c", sz, units[i]);
+	return buf;
+}
+
+/* Names the signature at the head of a file */
+static const char *pv_magic(const uchar_t *p, size_t n)
+{
+	static const struct {
+		ushort_t off;
+		uchar_t len;
+		const char *sig;
+		const char *desc;
+	} sigs[] = {
+		{0, 4, "\x7f" "ELF", "ELF binary"},
+		{0, 8, "\x89PNG\r\n\x1a\n", "PNG image"},
+		{0, 3, "\xff\xd8\xff", "JPEG image"},
+		{0, 4, "GIF8", "GIF image"},
+		{8, 4, "WEBP", "WebP image"},
+		{0, 5, "%PDF-", "PDF document"},
+		{0, 4, "%!PS", "PostScript document"},
+		{0, 4, "PK\x03\x04", "Zip archive"},
+		{0, 2, "\x1f\x8b", "gzip compressed data"},
+		{0, 6, "\xfd" "7zXZ\0", "xz compressed data"},
+		{0, 3, "BZh", "bzip2 compressed data"},
+		{0, 4, "\x28\xb5\x2f\xfd", "zstd compressed data"},
+		{0, 6, "7z\xbc\xaf\x27\x1c", "7-zip archive"},
+		{257, 5, "ustar", "tar archive"},
+		{0, 16, "SQLite format 3\0", "SQLite database"},
+		{4, 4, "ftyp", "ISO media (MP4, MOV...)"},
+		{0, 4, "\x1a\x45\xdf\xa3", "Matroska/WebM video"},
+		{0, 4, "OggS", "Ogg media"},
+		{0, 4, "fLaC", "FLAC audio"},
+		{0, 3, "ID3", "MP3 audio"},
+		{0, 4, "RIFF", "RIFF media (WAV, AVI...)"},
+	};
+
+	for (size_t i = 0; i < ELEMENTS(sigs); ++i)
+		if (n >= (size_t)sigs[i].off + sigs[i].len
+		    && !memcmp(p + sigs[i].off, sigs[i].sig, sigs[i].len))
+			return sigs[i].desc;
+
+	return NULL;
+}
+
+/* Text if there is no NUL and hardly any control chars */
+static bool pv_istext(const char *p, size_t n)
+{
+	size_t bad = 0;
+
+	n = MIN(n, (size_t)4096);
+	if (memchr(p, '\0', n))
+		return FALSE;
+
+	for (size_t i = 0; i < n; ++i)
+		if (((uchar_t)p[i] < ' ' && !strchr("\t\n\r\f\b\x1b", p[i])) || p[i] == DEL)
+			++bad;
+
+	return bad * 32 <= n;
+}
+
+static void pv_file(pv_buf *b, const char *path, off_t size)
+{
+	char buf[16], *head;
+	const char *p, *end, *nl, *desc;
+	size_t n = 0;
+	ssize_t r = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd == -1) {
+		pv_printf(b, "%s", strerror(errno));
+		return;
+	}
+
+	head = malloc(PV_HEAD);
+	if (!head) {
+		close(fd);
+		return;
+	}
+
+	/* Only the head is read, a file truncated meanwhile just gives less */
+	while (n < PV_HEAD) {
+		r = read(fd, head + n, PV_HEAD - n);
+		if (r > 0)
+			n += r;
+		else if (r == 0 || errno != EINTR)
+			break;
+	}
+	close(fd);
+
+	if (!n) {
+		pv_printf(b, "%s", r ? strerror(errno) : "empty file");
+		free(head);
+		return;
+	}
+
+	p = head;
+	if (pv_istext(p, n)) {
+		for (end = p + n; p < end && b->nlines < PV_LINES; p = nl + 1) {
+			nl = memchr(p, '\n', end - p);
+			if (!nl)
+				nl = end;
+			pv_line(b, p, (size_t)(nl - p) - (nl > p && nl[-1] == '\r'));
+		}
+		free(head);
+		return;
+	}
+
+	desc = pv_magic((const uchar_t *)p, n);
+	pv_printf(b, "%s, %s", desc ? desc : "binary data", pv_size(size, buf));
+	pv_line(b, "", 0);
+
+	/* Hex dump of the head */
+	for (size_t off = 0; off < n && b->nlines < PV_LINES; off += 16) {
+		char line[80], *q = line;
+		size_t k, cnt = MIN((size_t)16, n - off);
+
+		q += snprintf(q, 12, "%08zx ", off);
+		for (k = 0; k < 16; ++k)
+			q += (k < cnt) ? snprintf(q, 4, " %02x", (uchar_t)p[off + k]) : snprintf(q, 4, "   ");
+		*q++ = ' ';
+		*q++ = ' ';
+		for (k = 0; k < cnt; ++k)
+			*q++ = (p[off + k] >= ' ' && p[off + k] < DEL) ? p[off + k] : '.';
+		pv_line(b, line, q - line);
+	}
+
+	free(head);
+}
+
+static int pv_namecmp(const void *a, const void *b)
+{
+	return strcoll(*(char * const *)a, *(char * const *)b);
+}
+
+/* Counts of the entries and the sorted names, dropped if another file is hovered */
+static bool pv_dir(pv_buf *b, const char *path, uint_t gen)
+{
+	char buf[16], *pool = NULL, **names = NULL;
+	size_t poollen = 0, poolcap = 0;
+	uint_t ndirs = 0, nfiles = 0, nlinks = 0, nother = 0, nnames = 0, cnt = 0;
+	off_t total = 0;
+	struct dirent *dp;
+	struct stat sb;
+	bool dir, ret = TRUE;
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *dirp = (fd == -1) ? NULL : fdopendir(fd);
+
+	if (!dirp) {
+		pv_printf(b, "%s", strerror(errno));
+		if (fd != -1)
+			close(fd);
+		return TRUE;
+	}
+
+	while ((dp = readdir(dirp))) {
+		if (selforparent(dp->d_name))
+			continue;
+
+		if (!(++cnt & 0xff) && pv_stale(gen)) {
+			ret = FALSE;
+			break;
+		}
+
+		if (fstatat(fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+			++nother;
+			continue;
+		}
+
+		dir = S_ISDIR(sb.st_mode);
+		if (dir)
+			++ndirs;
+		else if (S_ISREG(sb.st_mode)) {
+			++nfiles;
+			total += sb.st_size;
+		} else if (S_ISLNK(sb.st_mode))
+			++nlinks;
+		else
+			++nother;
+
+		if (nnames < PV_DIR_NAMES) { /* Dirs get a '/' */
+			size_t len = xstrlen(dp->d_name);
+
+			if (poolcap - poollen < len + 2) {
+				char *tmp = xrealloc(pool, poolcap + (PATH_MAX << 2));
+
+				if (!tmp)
+					break;
+				pool = tmp;
+				poolcap += PATH_MAX << 2;
+			}
+			memcpy(pool + poollen, dp->d_name, len);
+			if (dir)
+				pool[poollen + len++] = '/';
+			pool[poollen + len] = '\0';
+			poollen += len + 1;
+			++nnames;
+		}
+	}
+
+	closedir(dirp);
+
+	if (ret) {
+		pv_printf(b, "%u dirs, %u files (%s)", ndirs, nfiles, pv_size(total, buf));
+		if (nlinks || nother)
+			pv_printf(b, "%u links, %u other", nlinks, nother);
+		pv_line(b, "", 0);
+
+		names = nnames ? malloc(nnames * sizeof(char *)) : NULL;
+		if (names) {
+			char *p = pool;
+
+			for (uint_t i = 0; i < nnames; p += xstrlen(p) + 1)
+				names[i++] = p;
+			qsort(names, nnames, sizeof(char *), pv_namecmp);
+			for (uint_t i = 0; i < nnames && pv_line(b, names[i], xstrlen(names[i])); ++i);
+			free(names);
+		}
+	}
+
+	free(pool);
+	return ret;
+}
+
+static void *pv_worker(void *arg)
+{
+	char path[PATH_MAX];
+	pv_buf b;
+	pv_key key;
+	pv_entry *e;
+	mode_t mode;
+	off_t size;
+	uint_t gen, i;
+	bool done;
+
+	(void)arg;
+
+	pthread_mutex_lock(&g_pv.lock);
+	while (TRUE) {
+		while (!g_pv.req && !g_pv.quit)
+			pthread_cond_wait(&g_pv.cond, &g_pv.lock);
+		if (g_pv.quit)
+			break;
+
+		g_pv.req = FALSE;
+		gen = g_pv.gen;
+		key = g_pv.reqkey;
+		mode = g_pv.reqmode;
+		size = g_pv.reqsize;
+		xstrsncpy(path, g_pv.reqpath, PATH_MAX);
+		pthread_mutex_unlock(&g_pv.lock);
+
+		memset(&b, 0, sizeof(b));
+		done = TRUE;
+		if (S_ISDIR(mode))
+			done = pv_dir(&b, path, gen);
+		else if (S_ISREG(mode))
+			pv_file(&b, path, size);
+		else
+			pv_printf(&b, "%s", S_ISFIFO(mode) ? "FIFO" : S_ISSOCK(mode) ? "socket"
+					    : S_ISCHR(mode) ? "character device" : "block device");
+
+		pthread_mutex_lock(&g_pv.lock);
+		if (!done || !b.text) {
+			free(b.text);
+			continue;
+		}
+
+		/* Replace the least recently used */
+		for (e = &g_pv.cache[0], i = 1; i < PV_CACHE; ++i)
+			if (g_pv.cache[i].used < e->used)
+				e = &g_pv.cache[i];
+		free(e->text);
+		e->key = key;
+		e->text = b.text;
+		e->nlines = b.nlines;
+		e->used = ++g_pv.clock;
+		g_pv.ready = TRUE;
+	}
+	g_pv.exited = TRUE;
+	pthread_cond_broadcast(&g_pv.cond);
+	pthread_mutex_unlock(&g_pv.lock);
+
+	return NULL;
+}
+
+/* The worker is started on first use, sets errno on failure */
+static bool pv_start(void)
+{
+	int r;
+
+	if (g_pv.started)
+		return TRUE;
+
+	r = pthread_mutex_init(&g_pv.lock, NULL);
+	if (r) {
+		errno = r;
+		return FALSE;
+	}
+
+	r = pthread_cond_init(&g_pv.cond, NULL);
+	if (!r) {
+		r = pthread_create(&g_pv.tid, NULL, pv_worker, NULL);
+		if (r)
+			pthread_cond_destroy(&g_pv.cond);
+	}
+
+	if (r) {
+		pthread_mutex_destroy(&g_pv.lock);
+		errno = r;
+		return FALSE;
+	}
+
+	g_pv.started = TRUE;
+	return TRUE;
+}
+
+/* A worker stuck on a hung mount is left behind rather than joined */
+static void pv_stop(void)
+{
+	struct timespec ts;
+	bool exited;
+
+	if (!g_pv.started)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += PV_QUIT_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&g_pv.lock);
+	g_pv.quit = TRUE;
+	pthread_cond_broadcast(&g_pv.cond);
+	while (!g_pv.exited && pthread_cond_timedwait(&g_pv.cond, &g_pv.lock, &ts) != ETIMEDOUT);
+	exited = g_pv.exited;
+	pthread_mutex_unlock(&g_pv.lock);
+
+	if (!exited) {
+		pthread_detach(g_pv.tid);
+		return;
+	}
+
+	pthread_join(g_pv.tid, NULL);
+
+	for (uint_t i = 0; i < PV_CACHE; ++i)
+		free(g_pv.cache[i].text);
+
+	pthread_cond_destroy(&g_pv.cond);
+	pthread_mutex_destroy(&g_pv.lock);
+	g_pv.started = FALSE;
+}
+
+/* Columns of the preview pane with its border, 0 if it is off */
+static int pv_cols(void)
+{
+	return (g_state.preview && xcols >= PV_MIN_COLS) ? xcols >> 1 : 0;
+}
+
+/*
+ * Draws the preview of the hovered file if it is rendered. Else the file
+ * is queued for the worker and a placeholder is shown till it is done.
+ */
+static void pv_draw(void)
+{
+	int pw = pv_cols() - 1, px = xcols - pw, row = 2, w, cols;
+	char path[PATH_MAX];
+	struct stat sb;
+	pv_entry *e = NULL;
+	pv_key key;
+	struct timespec ts;
+	wchar_t *line;
+
+	if (pw < 0)
+		return;
+
+	mvvline(2, px - 1, ACS_VLINE, ONSCREEN);
+	for (int i = 2; i < xlines - 2; ++i) {
+		move(i, px);
+		clrtoeol();
+	}
+
+	if (!ndents)
+		return;
+
+	mkpath(g_ctx[cfg.curctx].c_path, pdents[cur].name, path);
+	if (stat(path, &sb) == -1) {
+		mvaddnstr(row, px, strerror(errno), pw - 1);
+		return;
+	}
+
+	pv_keyset(&key, &sb);
+
+	pthread_mutex_lock(&g_pv.lock);
+	for (uint_t i = 0; i < PV_CACHE; ++i)
+		if (g_pv.cache[i].text && pv_keyeq(&g_pv.cache[i].key, &key)) {
+			e = &g_pv.cache[i];
+			break;
+		}
+
+	if (e) {
+		e->used = ++g_pv.clock;
+		g_pv.waiting = FALSE;
+		line = e->text;
+		for (uint_t i = 0; i < e->nlines && row < xlines - 2; ++i, ++row) {
+			/* Cut at the pane width */
+			for (w = cols = 0; line[w] && cols + MAX(wcwidth(line[w]), 0) < pw; ++w)
+				cols += MAX(wcwidth(line[w]), 0);
+			mvaddnwstr(row, px, line, w);
+			line += wcslen(line) + 1;
+		}
+	} else if (!g_pv.waiting || !pv_keyeq(&g_pv.reqkey, &key)) {
+		g_pv.reqkey = key;
+		g_pv.reqmode = sb.st_mode;
+		g_pv.reqsize = sb.st_size;
+		xstrsncpy(g_pv.reqpath, path, PATH_MAX);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		g_pv.due = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + PV_WAIT_MS;
+		++g_pv.gen;
+		g_pv.req = g_pv.waiting = TRUE;
+		pthread_cond_signal(&g_pv.cond);
+	}
+	pthread_mutex_unlock(&g_pv.lock);
+
+	if (!e)
+		mvaddstr(row, px, "...");
+}
+
+/*
+ * Milliseconds to wait for a preview being rendered, -1 if none is. A
+ * render taking longer is shown on the next redraw instead.
+ */
+static int pv_wait(void)
+{
+	struct timespec ts;
+
+	if (!g_state.preview || !g_pv.waiting)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 < g_pv.due) ? PV_POLL_MS : -1;
+}
+
+/* Shows a preview the worker has rendered */
+static void pv_check(void)
+{
+	bool ready;
+
+	pthread_mutex_lock(&g_pv.lock);
+	ready = g_pv.ready;
+	g_pv.ready = FALSE;
+	pthread_mutex_unlock(&g_pv.lock);
+
+	if (ready) {
+		pv_draw();
+		tocursor();
+	}
+}
+#else
+#define pv_cols() (0)
+#define pv_draw()
+#endif
+
+/* Milliseconds till a pending update of the screen is due, -1 if none is */
+static int wake_ms(void)
+{
+	int ms = -1;
+
+#ifndef NOFIFO
+	ms = fifo_wait();
+#endif
+#ifndef NOPREVIEW
+	int pv = pv_wait();
+
+	if (pv >= 0 && (ms < 0 || pv < ms))
+		ms = pv;
+#endif
+	return ms;
+}
+
+/*
+ * Returns SEL_* if key is bound and 0 otherwise.
+ * Also modifies the run and env pointers (used on SEL_{RUN,RUNARG}).
+ * The next keyboard input can be simulated by presel.
+ */
+static int nextsel(int presel)
+{
+#ifdef BENCH
+	return SEL_QUIT;
+#endif
+	wint_t c = presel;
+	int i = 0;
+	int wake, waited = 0;
+	bool escaped = FALSE;
+
+	if (mnt_err && !c) {
+		printmsg(mnt_err);
+		mnt_err = NULL;
+	}
+
+	if (c == 0 || c == MSGWAIT) {
+try_quit:
+		/* Wake up to send a held hover notification or show a preview */
+		wake = wake_ms();
+		if (wake >= 0)
+			timeout(wake);
+		i = get_wch(&c);
+		if (wake >= 0) {
+			settimeout();
+#ifndef NOFIFO
+			if (fifo_wait() == 0)
+				fifo_hover();
+#endif
+#ifndef NOPREVIEW
+			if (g_state.preview)
+				pv_check();
+#endif
+			/* Not idle yet, the idle work is still due every second */
+			if (i == ERR && (waited += wake) < 1000)
+				goto try_quit;
+		}
+		//DPRINTF_D(c);
+		//DPRINTF_S(keyname(c));
+
+#ifdef KEY_RESIZE
+		if (c == KEY_RESIZE)
+			handle_key_resize();
+#endif
+
+		/* Handle Alt+key */
+		if (c == ESC) {
+			timeout(0);
+			i = get_wch(&c);
+			if (i != ERR) {
+				if (c == ESC)
+					c = CONTROL('L');
+				else {
+					unget_wch(c);
+					c = ';';
+				}
+				settimeout();
+			} else if (escaped) {
+				settimeout();
+				c = CONTROL('Q');
+			} else {
+#ifndef NOFIFO
+				if (!g_state.fifomode)
+					notify_fifo(TRUE); /* Send hovered path to NNN_FIFO */
+#endif
+				escaped = TRUE;
+				settimeout();
+				goto try_quit;
+			}
+		}
+
+		if (i == ERR && presel == MSGWAIT)
+			c = (cfg.filtermode || filterset()) ? FILTER : CONTROL('L');
+		else if (c == FILTER || c == CONTROL('L'))
+			/* Clear previous filter when manually starting */
+			clearfilter();
+	}
+
+	if (i == ERR) {
+		++idle;
+		reap_detached();
+
+#ifndef NOFIFO
+		if (fifo_retry)
+			fifo_hover();
+#endif
+
+		/* Pick up selection changes from other instances */
+		if (selfile_sync()) {
+			redraw(g_ctx[cfg.curctx].c_path);
+			statusbar(g_ctx[cfg.curctx].c_path);
+		}
+
+		/* Messages from plugin daemons */
+		if (daemon_poll())
+			return SEL_DAEMON;
+
+		/* Show list mode input as it arrives */
+		if (g_listrd.fd != -1) {
+			if (list_poll())
+				return SEL_REDRAW;
+			if (presel != MSGWAIT)
+				statusbar(g_ctx[cfg.curctx].c_path);
+		}
+
+		if (mnt_njobs) {
+			if (mnt_poll())
+				return SEL_REDRAW;
+			if (presel != MSGWAIT && mnt_pending(g_ctx[cfg.curctx].c_path))
+				statusbar(g_ctx[cfg.curctx].c_path);
+		}
+
+#ifndef NOFOPS
+		/* Refresh on job completion, else update the progress */
+		if (fop_njobs) {
+			if (fop_reap())
+				return SEL_REDRAW;
+			if (presel != MSGWAIT)
+				statusbar(g_ctx[cfg.curctx].c_path);
+		}
+#endif
+
+		/*
+		 * Do not check for directory changes in du mode.
+		 * A redraw forces du calculation.
+		 * Check for changes every odd second.
+		 */
+#ifdef LINUX_INOTIFY
+		if (!cfg.blkorder && inotify_wd >= 0 && (idle & 1)) {
+			struct inotify_event *event;
+			char inotify_buf[EVENT_BUF_LEN] = {0};
+
+			i = read(inotify_fd, inotify_buf, EVENT_BUF_LEN);
+			if (i > 0) {
+				for (char *ptr = inotify_buf;
+				     ptr + ((struct inotify_event *)ptr)->len < inotify_buf + i;
+				     ptr += sizeof(struct inotify_event) + event->len) {
+					event = (struct inotify_event *)ptr;
+					DPRINTF_D(event->wd);
+					DPRINTF_D(event->mask);
+					if (!event->wd)
+						break;
+
+					if (event->mask & INOTIFY_MASK) {
+						c = handle_event();
+						break;
+					}
+				}
+				DPRINTF_S("inotify read done");
+			}
+		}
+#elif defined(BSD_KQUEUE)
+		if (!cfg.blkorder && event_fd >= 0 && (idle & 1)) {
+			struct kevent event_data[NUM_EVENT_SLOTS] = {0};
+
+			if (kevent(kq, events_to_monitor, NUM_EVENT_SLOTS,
+				   event_data, NUM_EVENT_FDS, &gtimeout) > 0)
+				c = handle_event();
+		}
+#elif defined(HAIKU_NM)
+		if (!cfg.blkorder && haiku_nm_active && (idle & 1) && haiku_is_update_needed(haiku_hnd))
+			c = handle_event();
+#endif
+	} else
+		idle = 0;
+
+	for (i = 0; i < (int)ELEMENTS(bindings); ++i)
+		if (c == bindings[i].sym)
+			return bindings[i].act;
+
+	return 0;
+}
+
+static int getorderstr(char *sort)
+{
+	int i = 0;
+
+	if (cfg.showhidden)
+		sort[i++] = 'H';
+
+	if (cfg.timeorder)
+		sort[i++] = (cfg.timetype == T_MOD) ? 'M' : ((cfg.timetype == T_ACCESS) ? 'A' : 'C');
+	else if (cfg.sizeorder)
+		sort[i++] = 'S';
+	else if (cfg.extnorder)
+		sort[i++] = 'E';
+
+	if (entrycmpfn == &reventrycmp)
+		sort[i++] = 'R';
+
+	if (namecmpfn == &xstrverscasecmp)
+		sort[i++] = 'V';
+
+	if (i)
+		sort[i] = ' ';
+
+	return i;
+}
+
+/*
+ * File type descriptions for the status bar, by libmagic if built with it
+ * else file(1). Cached by (dev, ino, mtime, size) and prefetched for the
+ * next entries by a worker thread while the cursor moves.
+ */
+static bool ftype_detect(const char *path, char *buf, size_t len, void *cookie)
+{
+#ifdef LIBMAGIC
+	const char *desc = magic_file((magic_t)cookie, path);
+
+	if (!desc)
+		return FALSE;
+
+	xstrsncpy(buf, desc, len);
+	return TRUE;
+#else
+	char *argv[] = {"file", "-b", (char *)path, NULL};
+	int pipefd[2];
+	ssize_t n, off = 0;
+	pid_t pid;
+
+	(void)cookie;
+	if (pipe(pipefd) == -1)
+		return FALSE;
+
+	fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+	pid = xspawn(argv, F_NOSTDIN, -1, pipefd[1]);
+	close(pipefd[1]);
+	if (pid > 0) {
+		while ((n = read(pipefd[0], buf + off, len - 1 - off)) > 0 && (size_t)(off += n) < len - 1)
+			;
+		waitpid(pid, NULL, 0);
+	}
+	close(pipefd[0]);
+
+	buf[off] = '\0';
+	if (off && buf[off - 1] == '\n')
+		buf[off - 1] = '\0';
+	return pid > 0 && off;
+#endif
+}
+
+static inline ftype_ent *ftype_slot(const struct stat *sb)
+{
+	return &ftypes[((ullong_t)sb->st_dev * 0x9E3779B97F4A7C15ULL ^ (ullong_t)sb->st_ino) & (FTYPE_SLOTS - 1)];
+}
+
+/* Cached description, detected with cookie if missing (if cookie isn't NULL) */
+static bool ftype_get(const char *path, char *buf, void *cookie)
+{
+	struct stat sb;
+	ftype_ent *ent;
+	bool found = FALSE;
+
+	if (!ftypes || lstat(path, &sb) == -1)
+		return FALSE;
+
+	pthread_mutex_lock(&ftype_lock);
+	ent = ftype_slot(&sb);
+	if (ent->ino == sb.st_ino && ent->dev == sb.st_dev && ent->mtime == sb.st_mtime
+	    && ent->size == sb.st_size) {
+		xstrsncpy(buf, ent->desc, FTYPE_LEN);
+		found = TRUE;
+	}
+	pthread_mutex_unlock(&ftype_lock);
+
+	if (found || !cookie || !ftype_detect(path, buf, FTYPE_LEN, cookie))
+		return found;
+
+	pthread_mutex_lock(&ftype_lock);
+	ent->dev = sb.st_dev;
+	ent->ino = sb.st_ino;
+	ent->mtime = sb.st_mtime;
+	ent->size = sb.st_size;
+	xstrsncpy(ent->desc, buf, FTYPE_LEN);
+	pthread_mutex_unlock(&ftype_lock);
+
+	return TRUE;
+}
+
+static void *ftype_worker(void *arg)
+{
+	char path[PATH_MAX], desc[FTYPE_LEN];
+	void *cookie = arg;
+
+	while (TRUE) {
+		pthread_mutex_lock(&ftype_lock);
+		while (ftype_next == ftype_count)
+			pthread_cond_wait(&ftype_cond, &ftype_lock);
+		xstrsncpy(path, ftype_queue[ftype_next++], PATH_MAX);
+		pthread_mutex_unlock(&ftype_lock);
+
+		ftype_get(path, desc, cookie);
+	}
+
+	return NULL;
+}
+
+static void *ftype_open(void)
+{
+#ifdef LIBMAGIC
+	magic_t cookie = magic_open(MAGIC_ERROR);
+
+	if (cookie && magic_load(cookie, NULL) == -1) {
+		magic_close(cookie);
+		cookie = NULL;
+	}
+	return cookie;
+#else
+	return (void *)1; /* file(1) needs no state */
+#endif
+}
+
+/* Description of the hovered file, queues the next ones for the worker */
+static bool ftype_hovered(char *buf)
+{
+	static void *cookie;
+	const char *dir = g_ctx[cfg.curctx].c_path;
+	char path[PATH_MAX];
+	int i, n = 0;
+
+	if (!ftypes) {
+		pthread_t tid;
+		void *wcookie;
+
+		ftypes = calloc(FTYPE_SLOTS, sizeof(ftype_ent));
+		cookie = ftype_open();
+		if (!ftypes || !cookie) {
+			free(ftypes);
+			ftypes = NULL;
+			return FALSE;
+		}
+
+		/* libmagic handles are per thread */
+		wcookie = ftype_open();
+		if (wcookie && pthread_create(&tid, NULL, ftype_worker, wcookie) == 0)
+			pthread_detach(tid);
+	}
+
+	if (!ndents)
+		return FALSE;
+
+	pthread_mutex_lock(&ftype_lock);
+	for (i = 1; i <= FTYPE_PREFETCH && n < FTYPE_PREFETCH; ++i) {
+		if (cur + i < ndents)
+			mkpath(dir, pdents[cur + i].name, ftype_queue[n++]);
+		if (cur - i >= 0 && n < FTYPE_PREFETCH)
+			mkpath(dir, pdents[cur - i].name, ftype_queue[n++]);
+	}
+	ftype_count = n;
+	ftype_next = 0;
+	pthread_cond_signal(&ftype_cond);
+	pthread_mutex_unlock(&ftype_lock);
+
+	mkpath(dir, pdents[cur].name, path);
+	return ftype_get(path, buf, cookie);
+}
+
+/*
+ * Opener rules are read once from the openers file in the config dir,
+ * one "patterns command" pair per line. Patterns are comma separated
+ * extensions (.pdf) or MIME types (text/plain; image/ or a trailing star
+ * matches all the images). A command prefixed with '&' is detached like
+ * a desktop opener, else it runs in the terminal. Extensions land in an
+ * open addressing table; the MIME type is detected only if no extension
+ * matches.
+ */
+static uint32_t open_ext_hash(const char *str)
+{
+	uint32_t hash = 7;
+	enum { wsz = sizeof hash * CHAR_BIT, z = wsz - OPEN_EXT_BITS, r = 5 };
+
+	/* Case-insensitive xor-rotate, same as the icons hash */
+	for (; *str; ++str) {
+		hash ^= TOUPPER((uchar_t)*str);
+		hash = (hash >> (wsz - r)) | (hash << r);
+	}
+
+	hash ^= (hash >> z);
+	hash *= UINT32_C(2654442313);
+
+	return hash >> z;
+}
+
+static void open_addext(const char *ext, uchar_t rule)
+{
+	uint32_t k, h;
+	open_ext *slot;
+
+	if (!*ext || xstrlen(ext) >= OPEN_EXT_LEN || nopen_exts >= OPEN_EXT_MAX)
+		return;
+
+	h = open_ext_hash(ext);
+	for (k = 0; k < ELEMENTS(open_exts); ++k) {
+		slot = &open_exts[(h + k) & (ELEMENTS(open_exts) - 1)];
+		if (!slot->ext[0]) {
+			xstrsncpy(slot->ext, ext, OPEN_EXT_LEN);
+			slot->rule = rule;
+			++nopen_exts;
+			return;
+		}
+
+		/* The first rule for an extension wins */
+		if (strcasecmp(slot->ext, ext) == 0)
+			return;
+	}
+}
+
+static void open_addmime(const char *mime, uchar_t rule)
+{
+	open_mime *m = &open_mimes[nopen_mimes];
+	size_t len = xstrlen(mime);
+
+	if (len >= OPEN_MIME_LEN || nopen_mimes >= OPEN_RULES_MAX)
+		return;
+
+	if (len && mime[len - 1] == '*')
+		--len;
+
+	xstrsncpy(m->mime, mime, len + 1);
+	m->len = (uchar_t)len;
+	m->rule = rule;
+	m->prefix = (m->mime[len - 1] == '/');
+	++nopen_mimes;
+}
+
+static void open_rules_load(void)
+{
+	char path[PATH_MAX], *line = NULL, *pat, *cmd, *next;
+	size_t len = 0;
+	ssize_t n;
+	ushort_t flag;
+	FILE *fp;
+
+	mkpath(cfgpath, "openers", path);
+	fp = fopen(path, "r");
+	if (!fp)
+		return;
+
+	while (nopen_rules < OPEN_RULES_MAX && (n = getline(&line, &len, fp)) != -1) {
+		if (n && line[n - 1] == '\n')
+			line[n - 1] = '\0';
+
+		for (pat = line; ISBLANK(*pat); ++pat);
+		if (!*pat || *pat == '#')
+			continue;
+
+		for (cmd = pat; *cmd && !ISBLANK(*cmd); ++cmd);
+		if (!*cmd)
+			continue;
+		*cmd++ = '\0';
+
+		for (; ISBLANK(*cmd); ++cmd);
+		/* The command may have arguments either way */
+		flag = F_MULTI;
+		if (*cmd == '&') {
+			flag |= F_NOTRACE | F_NOSTDIN | F_NOWAIT;
+			for (++cmd; ISBLANK(*cmd); ++cmd);
+		} else
+			flag |= F_NORMAL;
+
+		if (!*cmd)
+			continue;
+
+		open_rules[nopen_rules].cmd = xstrdup(cmd);
+		if (!open_rules[nopen_rules].cmd)
+			break;
+		open_rules[nopen_rules].flag = flag;
+
+		for (; pat; pat = next) {
+			next = strchr(pat, ',');
+			if (next)
+				*next++ = '\0';
+
+			if (*pat == '.')
+				open_addext(pat + 1, nopen_rules);
+			else if (strchr(pat, '/'))
+				open_addmime(pat, nopen_rules);
+		}
+
+		++nopen_rules;
+	}
+
+	free(line);
+	fclose(fp);
+	DPRINTF_U(nopen_rules);
+}
+
+/* Rule to open the file with, NULL to fall back to the opener */
+static open_rule *open_rule_get(const char *path, const char *name, size_t len)
+{
+	char *ext = xextension(name, len);
+	uint32_t k, h;
+	open_ext *slot;
+	char *mime;
+
+	if (!nopen_rules)
+		return NULL;
+
+	if (ext && nopen_exts) {
+		h = open_ext_hash(++ext);
+		for (k = 0; k < ELEMENTS(open_exts); ++k) {
+			slot = &open_exts[(h + k) & (ELEMENTS(open_exts) - 1)];
+			if (!slot->ext[0])
+				break;
+			if (strcasecmp(slot->ext, ext) == 0)
+				return &open_rules[slot->rule];
+		}
+	}
+
+	if (!nopen_mimes)
+		return NULL;
+
+#ifdef LIBMAGIC
+	static magic_t cookie;
+
+	if (!cookie) {
+		cookie = magic_open(MAGIC_MIME_TYPE | MAGIC_SYMLINK | MAGIC_ERROR);
+		if (cookie && magic_load(cookie, NULL) == -1) {
+			magic_close(cookie);
+			cookie = NULL;
+		}
+	}
+
+	mime = cookie ? (char *)magic_file(cookie, path) : NULL;
+#elif defined(FILE_MIME_OPTS)
+	mime = get_output("file", FILE_MIME_OPTS, (char *)path, -1, FALSE) ? g_buf : NULL;
+#else
+	(void)path;
+	mime = NULL; /* no MIME option for 'file' */
+#endif
+	if (!mime)
+		return NULL;
+
+	for (k = 0; k < nopen_mimes; ++k)
+		if (strncmp(mime, open_mimes[k].mime, open_mimes[k].len) == 0
+		    && (open_mimes[k].prefix || !mime[open_mimes[k].len]
+			|| mime[open_mimes[k].len] == ';' || mime[open_mimes[k].len] == '\n'))
+			return &open_rules[open_mimes[k].rule];
+
+	return NULL;
+}
+
+static void showfilterinfo(void)
+{
+	int i = 0;
+	char info[REGEX_MAX] = "\0\0\0\0\0";
+	char desc[FTYPE_LEN];
+
+	i = getorderstr(info);
+
+	if (cfg.fileinfo && ftype_hovered(desc)) {
+		mvaddstr(xlines - 2, 2, desc);
+		clrtoeol();
+	} else
+		snprintf(info + i, REGEX_MAX - i - 1, "  %s [/], %s [:]",
+			 (cfg.regex ? "reg" : "str"), ((fnstrstr == &strcasestr) ? "ic" : "noic"));
+
+	mvaddstr(xlines - 2, xcols - xstrlen(info), info);
+}
+
+static void showfilter(char *str)
+{
+	attron(COLOR_PAIR(cfg.curctx + 1));
+	showfilterinfo();
+	printmsg_nc(str);
+	attroff(COLOR_PAIR(cfg.curctx + 1));
+}
+
+static inline void swap_ent(int id1, int id2)
+{
+	struct entry _dent, *pdent1 = &pdents[id1], *pdent2 =  &pdents[id2];
+
+	*(&_dent) = *pdent1;
+	*pdent1 = *pdent2;
+	*pdent2 = *(&_dent);
+}
+
+#ifdef PCRE2
+static int fill(const char *fltr, pcre2_code *pcre2x)
+#else
+static int fill(const char *fltr, regex_t *re)
+#endif
+{
+#ifdef PCRE2
+	fltrexp_t fltrexp = { .pcre2x = pcre2x, .str = fltr };
+#else
+	fltrexp_t fltrexp = { .regex = re, .str = fltr };
+#endif
+
+	for (int count = 0; count < ndents; ++count) {
+		if (filterfn(&fltrexp, pdents[count].name) == 0) {
+			if (count != --ndents) {
+				swap_ent(count, ndents);
+				--count;
+			}
+
+			continue;
+		}
+	}
+
+	return ndents;
+}
+
+static int matches(const char *fltr)
+{
+#ifdef PCRE2
+	pcre2_code *pcre2x = NULL;
+
+	/* Search filter */
+	if (cfg.regex && setfilter(&pcre2x, fltr))
+		return -1;
+
+	ndents = fill(fltr, pcre2x);
+
+	if (cfg.regex)
+		pcre2_code_free(pcre2x);
+#else
+	regex_t re;
+
+	/* Search filter */
+	if (cfg.regex && setfilter(&re, fltr))
+		return -1;
+
+	ndents = fill(fltr, &re);
+
+	if (cfg.regex)
+		regfree(&re);
+#endif
+
+	ENTSORT(pdents, ndents, entrycmpfn);
+
+	return ndents;
+}
+
+/*
+ * Return the position of the matching entry or 0 otherwise
+ * Note there's no NULL check for fname
+ */
+static int dentfind(const char *fname, int n)
+{
+	for (int i = 0; i < n; ++i)
+		if (xstrcmp(fname, pdents[i].name) == 0)
+			return i;
+
+	return 0;
+}
+
+static int filterentries(char *path, char *lastname)
+{
+	alignas(max_align_t) wchar_t wln[REGEX_MAX];
+	char *ln = g_ctx[cfg.curctx].c_fltr;
+	wint_t ch[1];
+	int r, total = ndents, len;
+	char *pln = g_ctx[cfg.curctx].c_fltr + 1;
+
+	DPRINTF_S(__func__);
+
+	if (ndents && (ln[0] == FILTER || ln[0] == RFILTER) && *pln) {
+		if (matches(pln) != -1) {
+			move_cursor(dentfind(lastname, ndents), 0);
+			redraw(path);
+		}
+
+		if (!cfg.filtermode) {
+			statusbar(path);
+			return 0;
+		}
+
+		len = mbstowcs(wln, ln, REGEX_MAX);
+	} else {
+		ln[0] = wln[0] = cfg.regex ? RFILTER : FILTER;
+		ln[1] = wln[1] = '\0';
+		len = 1;
+	}
+
+	cleartimeout();
+	curs_set(TRUE);
+	showfilter(ln);
+
+	while ((r = get_wch(ch)) != ERR) {
+		//DPRINTF_D(*ch);
+		//DPRINTF_S(keyname(*ch));
+
+		switch (*ch) {
+#ifdef KEY_RESIZE
+		case 0: // fallthrough
+		case KEY_RESIZE:
+			clearoldprompt();
+			redraw(path);
+			showfilter(ln);
+			continue;
+#endif
+		case KEY_DC: // fallthrough
+		case KEY_BACKSPACE: // fallthrough
+		case '\b': // fallthrough
+		case DEL: /* handle DEL */
+			if (len != 1) {
+				wln[--len] = '\0';
+				wcstombs(ln, wln, REGEX_MAX);
+				ndents = total;
+			} else {
+				*ch = FILTER;
+				goto end;
+			}
+			// fallthrough
+		case CONTROL('L'):
+			if (*ch == CONTROL('L')) {
+				if (wln[1]) {
+					ln[REGEX_MAX - 1] = ln[1];
+					ln[1] = wln[1] = '\0';
+					len = 1;
+					ndents = total;
+				} else if (ln[REGEX_MAX - 1]) { /* Show the previous filter */
+					ln[1] = ln[REGEX_MAX - 1];
+					ln[REGEX_MAX - 1] = '\0';
+					len = mbstowcs(wln, ln, REGEX_MAX);
+				} else
+					goto end;
+			}
+
+			/* Go to the top, we don't know if the hovered file will match the filter */
+			cur = 0;
+
+			if (matches(pln) != -1)
+				redraw(path);
+
+			showfilter(ln);
+			continue;
+#ifndef NOMOUSE
+		case KEY_MOUSE:
+		{
+			MEVENT event = {0};
+			getmouse(&event);
+			if (event.bstate == 0)
+				continue;
+			ungetmouse(&event);
+			goto end;
+		}
+#endif
+		case ESC:
+			if (handle_alt_key(ch) != ERR) {
+				if (*ch == ESC) /* Handle Alt+Esc */
+					*ch = 'q'; /* Quit context */
+				else {
+					unget_wch(*ch);
+					*ch = ';'; /* Run plugin */
+				}
+			}
+			goto end;
+		}
+
+		if (r != OK) /* Handle Fn keys in main loop */
+			break;
+
+		/* Handle all control chars in main loop */
+		if (*ch < ASCII_MAX && keyname(*ch)[0] == '^' && *ch != '^')
+			goto end;
+
+		if (len == 1) {
+			if (*ch == '?') /* Help and config key, '?' is an invalid regex */
+				goto end;
+
+			if (cfg.filtermode) {
+				switch (*ch) {
+				case '\'': // fallthrough /* Go to first non-dir file */
+				case '+': // fallthrough /* Toggle file selection */
+				case ',': // fallthrough /* Mark CWD */
+				case '-': // fallthrough /* Visit last visited dir */
+				case '.': // fallthrough /* Show hidden files */
+				case ';': // fallthrough /* Run plugin key */
+				case '=': // fallthrough /* Launch app */
+				case '>': // fallthrough /* Export file list */
+				case '@': // fallthrough /* Visit start dir */
+				case ']': // fallthorugh /* Prompt key */
+				case '`': // fallthrough /* Visit / */
+				case '~': /* Go HOME */
+					goto end;
+				}
+			}
+
+			/* Toggle case-sensitivity */
+			if (*ch == CASE) {
+				fnstrstr = (fnstrstr == &strcasestr) ? &strstr : &strcasestr;
+#ifdef PCRE2
+				pcre2flags ^= PCRE2_CASELESS;
+#else
+				regflags ^= REG_ICASE;
+#endif
+				showfilter(ln);
+				continue;
+			}
+
+			/* Toggle string or regex filter */
+			if (*ch == FILTER) {
+				ln[0] = (ln[0] == FILTER) ? RFILTER : FILTER;
+				wln[0] = (uchar_t)ln[0];
+				cfg.regex ^= 1;
+				filterfn = cfg.regex ? &visible_re : &visible_str;
+				showfilter(ln);
+				continue;
+			}
+
+			/* Reset cur in case it's a repeat search */
+			cur = 0;
+		} else if (len == REGEX_MAX - 1)
+			continue;
+
+		wln[len] = (wchar_t)*ch;
+		wln[++len] = '\0';
+		wcstombs(ln, wln, REGEX_MAX);
+
+		/* Forward-filtering optimization:
+		 * - new matches can only be a subset of current matches.
+		 */
+		/* ndents = total; */
+#ifdef MATCHFLTR
+		r = matches(pln);
+		if (r <= 0) {
+			!r ? unget_wch(KEY_BACKSPACE) : showfilter(ln);
+#else
+		if (matches(pln) == -1) {
+			showfilter(ln);
+#endif
+			continue;
+		}
+
+		/* If the only match is a dir, auto-enter and cd into it */
+		if ((ndents == 1) && cfg.autoenter && (pdents[0].flags & DIR_OR_DIRLNK)) {
+			*ch = KEY_ENTER;
+			cur = 0;
+			goto end;
+		}
+
+		/*
+		 * redraw() should be above the auto-enter optimization, for
+		 * the case where there's an issue with dir auto-enter, say,
+		 * due to a permission problem. The transition is _jumpy_ in
+		 * case of such an error. However, we optimize for successful
+		 * cases where the dir has permissions. This skips a redraw().
+		 */
+		redraw(path);
+		showfilter(ln);
+	}
+end:
+	/* Clear the info line after the down arrow */
+	move(xlines - 2, 2);
+	clrtoeol();
+
+	/* Save last working filter in-filter */
+	if (ln[1])
+		ln[REGEX_MAX - 1] = ln[1];
+
+	/* Save current */
+	copycurname();
+
+	curs_set(FALSE);
+	settimeout();
+
+	/* Return keys for navigation etc. */
+	return *ch;
+}
+
+static char *getcmdfromhist(bool up)
+{
+	if (lastcmdpos == INVALID_POS) /* No entry in history */
+		return NULL;
+
+	if (selcmdpos == INVALID_POS) /* Initial position at prompt */
+		selcmdpos = up ? lastcmdpos : 0;
+	else if (up)
+		selcmdpos = (selcmdpos == 0) ? lastcmdpos : selcmdpos - 1;
+	else
+		selcmdpos = (selcmdpos == lastcmdpos) ? 0 : selcmdpos + 1;
+
+	return cmd_hist[selcmdpos];
+}
+
+static void addcmdtohist(char *cmd)
+{
+	bool new = FALSE;
+
+	if (lastcmdpos == INVALID_POS)
+		new = TRUE;
+	else if ((selcmdpos == INVALID_POS) || (xstrcmp(cmd_hist[selcmdpos], cmd) != 0)) { /* New or not matching */
+		if (lastcmdpos == (MAX_HISTORY - 1)) {
+			free(cmd_hist[0]);
+
+			for (uchar_t pos = 0; pos < lastcmdpos; ++pos)
+				cmd_hist[pos] = cmd_hist[pos + 1];
+			--lastcmdpos;
+		}
+
+		new = TRUE;
+	} else if (selcmdpos != lastcmdpos) { /* Command matches, make it the latest if not already */
+		cmd = cmd_hist[selcmdpos];
+
+		for (uchar_t pos = selcmdpos; pos < lastcmdpos; ++pos)
+			cmd_hist[pos] = cmd_hist[pos + 1];
+		cmd_hist[lastcmdpos] = cmd;
+	}
+
+	if (new)
+		cmd_hist[++lastcmdpos] = xstrdup(cmd);
+}
+
+#ifdef NORL
+/* Reads the history file and populates command history */
+static void xread_history(const char *histpath)
+{
+	int linesread = 0;
+	size_t len = 0;
+	ssize_t read;
+	char *line = NULL;
+	FILE *fptr = fopen(histpath, "r");
+
+	/* We want to open for reading, ignore errors */
+	if (fptr) {
+		while ((linesread++ < MAX_HISTORY) && ((read = getline(&line, &len, fptr)) != -1))
+		{
+			if (line[read - 1] == NEWLINE_CHAR)
+				line[read - 1] = '\0';
+			addcmdtohist(line);
+		}
+
+		free(line);
+	}
+}
+
+/* Populates the history file from the command history */
+static void xwrite_history(const char *histpath)
+{
+	if (lastcmdpos == INVALID_POS)
+		return;
+
+	FILE *fptr = fopen(histpath, "w");
+
+	if (fptr)
+		for (uchar_t pos = 0; pos <= lastcmdpos; ++pos)
+			fprintf(fptr, "%s\n", cmd_hist[pos]);
+	else
+		xerror();
+}
+#endif
+
+/* Show a prompt with input string and return the changes */
+static char *xreadline(const char *prefill, const char *prompt)
+{
+	size_t len, pos, lpos;
+	int x, r;
+	const int WCHAR_T_WIDTH = sizeof(wchar_t);
+	wint_t ch[1];
+	wchar_t * const buf = malloc(sizeof(wchar_t) * READLINE_MAX);
+
+	if (!buf)
+		errexit();
+
+	cleartimeout();
+	printmsg(prompt);
+
+	if (prefill) {
+		DPRINTF_S(prefill);
+		len = pos = mbstowcs(buf, prefill, READLINE_MAX);
+	} else
+		len = (size_t)-1;
+
+	if (len == (size_t)-1) {
+		buf[0] = '\0';
+		len = pos = 0;
+	}
+
+	x = getcurx(stdscr);
+	curs_set(TRUE);
+
+	while (1) {
+		buf[len] = ' ';
+		attron(COLOR_PAIR(cfg.curctx + 1));
+		if (pos > (size_t)(xcols - x)) {
+			mvaddnwstr(xlines - 1, x, buf + (pos - (xcols - x) + 1), xcols - x);
+			move(xlines - 1, xcols - 1);
+		} else {
+			mvaddnwstr(xlines - 1, x, buf, len + 1);
+			move(xlines - 1, x + wcswidth(buf, pos));
+		}
+		attroff(COLOR_PAIR(cfg.curctx + 1));
+
+		r = get_wch(ch);
+		if (r == ERR)
+			continue;
+
+		if (r == OK) {
+			switch (*ch) {
+			case KEY_ENTER: // fallthrough
+			case '\n': // fallthrough
+			case '\r':
+				goto END;
+			case CONTROL('D'):
+				if (pos < len)
+					++pos;
+				else if (!(pos || len)) { /* Exit on ^D at empty prompt */
+					len = 0;
+					goto END;
+				} else
+					continue;
+				// fallthrough
+			case DEL: // fallthrough
+			case '\b': /* rhel25 sends '\b' for backspace */
+				if (pos > 0) {
+					memmove(buf + pos - 1, buf + pos,
+						(len - pos) * WCHAR_T_WIDTH);
+					--len, --pos;
+				}
+				continue;
+			case '\t':
+				if ((len == pos) && ndents && (pos < (READLINE_MAX - xstrlen(pdents[cur].name)))) {
+					buf[pos] = '\0';
+					lpos = mbstowcs(NULL, pdents[cur].name, MB_CUR_MAX);
+					pos += mbstowcs(buf + wcslen(buf), pdents[cur].name, lpos);
+					len = pos;
+				}
+				continue;
+			case CONTROL('F'):
+				if (pos < len)
+					++pos;
+				continue;
+			case CONTROL('B'):
+				if (pos > 0)
+					--pos;
+				continue;
+			case CONTROL('W'):
+				printmsg(prompt);
+				lpos = pos;
+				while (pos > 0 && ISSPACE(buf[pos-1]))
+					--pos;
+				while (pos > 0 && !ISSPACE(buf[pos-1]))
+					--pos;
+				memmove(buf + pos, buf + lpos, (len - lpos) * WCHAR_T_WIDTH);
+				len -= lpos - pos;
+				continue;
+			case CONTROL('K'):
+				printmsg(prompt);
+				len = pos;
+				continue;
+			case CONTROL('L'):
+				printmsg(prompt);
+				len = pos = 0;
+				continue;
+			case CONTROL('A'):
+				pos = 0;
+				continue;
+			case CONTROL('E'):
+				pos = len;
+				continue;
+			case CONTROL('U'):
+				printmsg(prompt);
+				memmove(buf, buf + pos, (len - pos) * WCHAR_T_WIDTH);
+				len -= pos;
+				pos = 0;
+				continue;
+			case ESC: /* Exit prompt on Esc, but just filter out Alt+key */
+				if (handle_alt_key(ch) != ERR) {
+					switch (*ch) {
+					case 'd':
+						printmsg(prompt);
+						lpos = pos;
+						while (pos < len && !iswalnum(buf[pos + 1]))
+							++pos;
+						while (pos < len && iswalnum(buf[++pos]));
+						memmove(buf + lpos, buf + pos, (len - pos) * WCHAR_T_WIDTH);
+						len -= pos - lpos;
+						pos = lpos;
+						continue;
+					case KEY_BACKSPACE:
+						printmsg(prompt);
+						lpos = pos;
+						while (pos > 0 && !iswalnum(buf[pos - 1]))
+							--pos;
+						while (pos > 0 && iswalnum(buf[pos - 1]))
+							--pos;
+						memmove(buf + pos, buf + lpos, (len - lpos) * WCHAR_T_WIDTH);
+						len -= lpos - pos;
+						continue;
+					case 'f':
+						while (pos < len && !iswalnum(buf[pos + 1]))
+							++pos;
+						while (pos < len && iswalnum(buf[++pos]));
+						continue;
+					case 'b':
+						while (pos > 0 && !iswalnum(buf[pos - 1]))
+							--pos;
+						while (pos > 0 && iswalnum(buf[pos - 1]))
+							--pos;
+						continue;
+					}
+					continue;
+				}
+
+				len = 0;
+				goto END;
+			}
+
+			/* Filter out all other control chars */
+			if (*ch < ASCII_MAX && keyname(*ch)[0] == '^')
+				continue;
+
+			if (pos < READLINE_MAX - 1) {
+				memmove(buf + pos + 1, buf + pos,
+					(len - pos) * WCHAR_T_WIDTH);
+				buf[pos] = *ch;
+				++len, ++pos;
+				continue;
+			}
+		} else {
+			switch (*ch) {
+#ifdef KEY_RESIZE
+			case KEY_RESIZE:
+				clearoldprompt();
+				xlines = LINES;
+				printmsg(prompt);
+				break;
+#endif
+			case KEY_LEFT:
+				if (pos > 0)
+					--pos;
+				break;
+			case KEY_RIGHT:
+				if (pos < len)
+					++pos;
+				break;
+			case KEY_BACKSPACE:
+				if (pos > 0) {
+					memmove(buf + pos - 1, buf + pos,
+						(len - pos) * WCHAR_T_WIDTH);
+					--len, --pos;
+				}
+				break;
+			case KEY_DC:
+				if (pos < len) {
+					memmove(buf + pos, buf + pos + 1,
+						(len - pos - 1) * WCHAR_T_WIDTH);
+					--len;
+				}
+				break;
+			case KEY_END:
+				pos = len;
+				break;
+			case KEY_HOME:
+				pos = 0;
+				break;
+			case KEY_UP: // fallthrough
+			case KEY_DOWN:
+			{
+				char *cmd = getcmdfromhist(*ch == KEY_UP);
+
+				if (prompt && cmd && (xstrcmp(prompt, PROMPT) == 0)) {
+					printmsg(prompt);
+					len = pos = mbstowcs(buf, cmd, READLINE_MAX); // fallthrough
+				}
+			}
+			default:
+				break;
+			}
+		}
+	}
+
+END:
+	curs_set(FALSE);
+	settimeout();
+	printmsg("");
+
+	buf[len] = '\0';
+
+	pos = wcstombs(g_buf, buf, READLINE_MAX - 1);
+	if (pos >= READLINE_MAX - 1)
+		g_buf[READLINE_MAX - 1] = '\0';
+
+	free(buf);
+	return g_buf;
+}
+
+#ifndef NORL
+/*
+ * Caller should check the value of presel to confirm if it needs to wait to show warning
+ */
+static char *getreadline(const char *prompt)
+{
+	exitcurses();
+
+	char *input = readline(prompt);
+
+	refresh();
+
+	if (input && input[0]) {
+		add_history(input);
+		xstrsncpy(g_buf, input, CMD_LEN_MAX);
+		free(input);
+		return g_buf;
+	}
+
+	free(input);
+	return NULL;
+}
+#endif
+
+/*
+ * Create symbolic/hard link(s) to file(s) in selection list
+ * Returns the number of links created, -1 on error
+ */
+static int xlink(char *prefix, char *path, char *curfname, char *buf, int type)
+{
+	int count = 0, choice;
+	char *psel, *fname;
+	size_t pos = 0, len, r;
+	int (*link_fn)(const char *, const char *) = NULL;
+	char lnpath[PATH_MAX];
+
+	choice = get_cur_or_sel();
+	if (!choice)
+		return -1;
+
+	selexpand();
+	psel = pselbuf;
+
+	if (type == 's') /* symbolic link */
+		link_fn = &symlink;
+	else /* hard link */
+		link_fn = &link;
+
+	if (choice == 'c' || (nselected == 1)) {
+		prefix = abspath(prefix, path, lnpath); /* Generate link path */
+		if (!prefix)
+			return -1;
+
+		if (choice == 'c')
+			mkpath(path, curfname, buf); /* Generate target file path */
+
+		if (!link_fn((choice == 'c') ? buf : pselbuf, lnpath)) {
+			if (choice == 's')
+				clearselection();
+			return 1; /* One link created */
+		}
+		return 0;
+	}
+
+	r = xstrsncpy(buf, prefix, NAME_MAX + 1); /* Copy prefix */
+
+	while (pos < selbufpos) {
+		len = xstrlen(psel);
+		fname = xbasename(psel);
+
+		xstrsncpy(buf + r - 1, fname, NAME_MAX - r); /* Suffix target file name */
+		mkpath(path, buf, lnpath); /* Generate link path */
+
+		if (!link_fn(psel, lnpath))
+			++count;
+
+		pos += len + 1;
+		psel += len + 1;
+	}
+
+	if (count == nselected) /* Clear selection if all links are generated */
+		clearselection();
+	return count;
+}
+
+static bool parsekvpair(kv **arr, char **envcpy, const uchar_t id, uchar_t *items)
+{
+	bool new = TRUE;
+	const uchar_t INCR = 8;
+	uint_t i = 0;
+	kv *kvarr = NULL;
+	char *ptr = getenv(env_cfg[id]);
+
+	if (!ptr || !*ptr)
+		return TRUE;
+
+	*envcpy = xstrdup(ptr);
+	if (!*envcpy) {
+		xerror();
+		return FALSE;
+	}
+
+	ptr = *envcpy;
+
+	while (*ptr && i < 100) {
+		if (new) {
+			if (!(i & (INCR - 1))) {
+				kvarr = xrealloc(kvarr, sizeof(kv) * (i + INCR));
+				*arr = kvarr;
+				if (!kvarr) {
+					xerror();
+					return FALSE;
+				}
+				memset(kvarr + i, 0, sizeof(kv) * INCR);
+			}
+			kvarr[i].key = (uchar_t)*ptr;
+			if (*++ptr != ':' || *++ptr == '\0' || *ptr == ';')
+				return FALSE;
+			kvarr[i].off = ptr - *envcpy;
+			++i;
+
+			new = FALSE;
+		}
+
+		if (*ptr == ';') {
+			*ptr = '\0';
+			new = TRUE;
+		}
+
+		++ptr;
+	}
+
+	*items = i;
+	return (i != 0);
+}
+
+/*
+ * Get the value corresponding to a key
+ *
+ * NULL is returned in case of no match, path resolution failure etc.
+ * buf would be modified, so check return value before access
+ */
+static char *get_kv_val(kv *kvarr, char *buf, int key, uchar_t max, uchar_t id)
+{
+	char *val;
+
+	if (!kvarr)
+		return NULL;
+
+	for (int r = 0; r < max && kvarr[r].key; ++r) {
+		if (kvarr[r].key == key) {
+			/* Do not allocate new memory for plugin */
+			if (id == NNN_PLUG)
+				return pluginstr + kvarr[r].off;
+
+			val = bmstr + kvarr[r].off;
+			bool tilde = convert_tilde(val, g_buf);
+			return abspath((tilde ? g_buf : val), NULL, buf);
+		}
+	}
+
+	DPRINTF_S("Invalid key");
+	return NULL;
+}
+
+static int get_kv_key(kv *kvarr, char *val, uchar_t max, uchar_t id)
+{
+	if (!kvarr)
+		return -1;
+
+	if (id != NNN_ORDER) /* For now this function supports only order string */
+		return -1;
+
+	for (int r = 0; r < max && kvarr[r].key; ++r) {
+		if (xstrcmp((orderstr + kvarr[r].off), val) == 0)
+			return kvarr[r].key;
+	}
+
+	return -1;
+}
+
+static void resetdircolor(int flags)
+{
+	/* Directories are always shown on top, clear the color when moving to first file */
+	if (g_state.dircolor && !(flags & DIR_OR_DIRLNK)) {
+		attroff(COLOR_PAIR(cfg.curctx + 1) | A_BOLD);
+		g_state.dircolor = 0;
+	}
+}
+
+/*
+ * Replace escape characters in a string with '?'
+ * Adjust string length to maxcols if > 0;
+ * Max supported str length: NAME_MAX;
+ */
+#ifdef NOLC
+static char *unescape(const char *str, uint_t maxcols)
+{
+	char * const wbuf = g_buf;
+	char *buf = wbuf;
+
+	xstrsncpy(wbuf, str, maxcols);
+#else
+static wchar_t *unescape(const char *str, uint_t maxcols)
+{
+	wchar_t * const wbuf = (wchar_t *)g_buf;
+	wchar_t *buf = wbuf;
+	size_t len = mbstowcs(wbuf, str, maxcols); /* Convert multi-byte to wide char */
+
+	len = wcswidth(wbuf, len);
+
+	if (len >= maxcols) {
+		size_t lencount = maxcols;
+
+		while (len > maxcols) /* Reduce wide chars one by one till it fits */
+			len = wcswidth(wbuf, --lencount);
+
+		wbuf[lencount] = L'\0';
+	}
+#endif
+
+	while (*buf) {
+		if (*buf <= '\x1f' || *buf == '\x7f')
+			*buf = '\?';
+
+		++buf;
+	}
+
+	return wbuf;
+}
+
+static off_t get_size(off_t size, off_t *pval, int comp)
+{
+	off_t rem = *pval;
+	off_t quo = rem / 10;
+
+	if ((rem - (quo * 10)) >= 5) {
+		rem = quo + 1;
+		if (rem == comp) {
+			++size;
+			rem = 0;
+		}
+	} else
+		rem = quo;
+
+	*pval = rem;
+	return size;
+}
+
+static char *coolsize(off_t size)
+{
+	const char * const U = "BKMGTPEZY";
+	static char size_buf[12]; /* Buffer to hold human readable size */
+	off_t rem = 0;
+	size_t ret;
+	int i = 0;
+
+	while (size >= 1024) {
+		rem = size & (0x3FF); /* 1024 - 1 = 0x3FF */
+		size >>= 10;
+		++i;
+	}
+
+	if (i == 1) {
+		rem = (rem * 1000) >> 10;
+		rem /= 10;
+		size = get_size(size, &rem, 10);
+	} else if (i == 2) {
+		rem = (rem * 1000) >> 10;
+		size = get_size(size, &rem, 100);
+	} else if (i > 2) {
+		rem = (rem * 10000) >> 10;
+		size = get_size(size, &rem, 1000);
+	}
+
+	if (i > 0 && i < 6 && rem) {
+		ret = xstrsncpy(size_buf, xitoa(size), 12);
+		size_buf[ret - 1] = '.';
+
+		char *frac = xitoa(rem);
+		size_t toprint = i > 3 ? 3 : i;
+		size_t len = xstrlen(frac);
+
+		if (len < toprint) {
+			size_buf[ret] = size_buf[ret + 1] = size_buf[ret + 2] = '0';
+			xstrsncpy(size_buf + ret + (toprint - len), frac, len + 1);
+		} else
+			xstrsncpy(size_buf + ret, frac, toprint + 1);
+
+		ret += toprint;
+	} else {
+		ret = xstrsncpy(size_buf, size ? xitoa(size) : "0", 12);
+		--ret;
+	}
+
+	size_buf[ret] = U[i];
+	size_buf[ret + 1] = '\0';
+
+	return size_buf;
+}
+
+/* Convert a mode field into "ls -l" type perms field. */
+static char *get_lsperms(mode_t mode)
+{
+	static const char * const rwx[] = {"---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx"};
+	static char bits[11] = {'\0'};
+
+	switch (mode & S_IFMT) {
+	case S_IFREG:
+		bits[0] = '-';
+		break;
+	case S_IFDIR:
+		bits[0] = 'd';
+		break;
+	case S_IFLNK:
+		bits[0] = 'l';
+		break;
+	case S_IFSOCK:
+		bits[0] = 's';
+		break;
+	case S_IFIFO:
+		bits[0] = 'p';
+		break;
+	case S_IFBLK:
+		bits[0] = 'b';
+		break;
+	case S_IFCHR:
+		bits[0] = 'c';
+		break;
+	default:
+		bits[0] = '?';
+		break;
+	}
+
+	xstrsncpy(&bits[1], rwx[(mode >> 6) & 7], 4);
+	xstrsncpy(&bits[4], rwx[(mode >> 3) & 7], 4);
+	xstrsncpy(&bits[7], rwx[(mode & 7)], 4);
+
+	if (mode & S_ISUID)
+		bits[3] = (mode & 0100) ? 's' : 'S';  /* user executable */
+	if (mode & S_ISGID)
+		bits[6] = (mode & 0010) ? 's' : 'l';  /* group executable */
+	if (mode & S_ISVTX)
+		bits[9] = (mode & 0001) ? 't' : 'T';  /* others executable */
+
+	return bits;
+}
+
+#ifdef ICONS_ENABLED
+static struct icon get_icon(const struct entry *ent)
+{
+	for (size_t i = 0; i < ELEMENTS(icons_name); ++i)
+		if (strcasecmp(ent->name, icons_name[i].match) == 0)
+			return (struct icon){ icons_name[i].icon, icons_name[i].color };
+
+	if (ent->flags & DIR_OR_DIRLNK)
+        return (ent->mode & S_IFMT) & S_IFLNK ? dir_link_icon : dir_icon;
+
+	char *tmp = xextension(ent->name, ent->nlen);
+
+	if (tmp) {
+		uint16_t z, k, h = icon_ext_hash(++tmp); /* ++tmp to skip '.' */
+		for (k = 0; k < ICONS_PROBE_MAX; ++k) {
+			z = (h + k) % ELEMENTS(icons_ext);
+			if (strcasecmp(tmp, icons_ext[z].match) == 0)
+				return (struct icon){ icons_ext_uniq[icons_ext[z].idx], icons_ext[z].color };
+		}
+	}
+
+	/* If there's no match and the file is executable, icon that */
+	if (ent->mode & 0100)
+		return exec_icon;
+
+    if ((ent->mode & S_IFMT) == S_IFREG)
+      return file_icon;
+    if ((ent->mode & S_IFMT) == S_IFLNK)
+      return file_link_icon;
+  	return file_icon;
+}
+
+static void print_icon(const struct entry *ent, const int attrs, bool sel)
+{
+  int color;
+  const struct icon icon = get_icon(ent);
+
+  if (icon.color != 255) {
+    color = icon.color + C_ICONS;
+    if (sel)
+      color += C_ICONS_MAX;
+
+    attron(COLOR_PAIR(color));
+  } else if (attrs)
+    attron(attrs);
+
+  addch(' ');
+  addstr(icon.icon);
+  addch(' ');
+
+  if (icon.color != 255)
+    attroff(COLOR_PAIR(color));
+  else if (attrs)
+    attroff(attrs);
+}
+#endif // ICONS_ENABLED
+
+static void print_time(const time_t *timep, const uchar_t flags)
+{
+	struct tm t;
+
+	/* Highlight timestamp for entries 5 minutes young */
+	if (flags & FILE_YOUNG)
+		attron(A_REVERSE);
+
+	localtime_r(timep, &t);
+	printw("%s-%02d-%02d %02d:%02d",
+		xitoa(t.tm_year + 1900), t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min);
+
+	if (flags & FILE_YOUNG)
+		attroff(A_REVERSE);
+}
+
+static char get_detail_ind(const mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFDIR:  // fallthrough
+	case S_IFREG:  return ' ';
+	case S_IFLNK:  return '@';
+	case S_IFSOCK: return '=';
+	case S_IFIFO:  return '|';
+	case S_IFBLK:  return 'b';
+	case S_IFCHR:  return 'c';
+	}
+	return '?';
+}
+
+/* Note: attribute and indicator values must be initialized to 0 */
+static uchar_t get_color_pair_name_ind(const struct entry *ent, char *pind, int *pattr)
+{
+  if (ent->flags & FILE_MISSING)
+	  return C_MIS;
+
+	switch (ent->mode & S_IFMT) {
+	case S_IFREG:
+		if (!ent->size) {
+            *pattr |= A_ITALIC;
+			return C_FIL;
+		}
+		if (ent->flags & HARD_LINK)
+			return C_HRD;
+		if (ent->mode & 0100)
+			return C_EXE;
+		return C_FIL;
+	case S_IFDIR:
+		if (g_state.oldcolor)
+			return C_DIR;
+		*pattr |= A_BOLD;
+		return g_state.dirctx ? cfg.curctx + 1 : C_DIR;
+	case S_IFLNK:
+		if (ent->flags & DIR_OR_DIRLNK) {
+			*pattr |= g_state.oldcolor ? A_DIM : A_BOLD;
+		} else {
+			if (g_state.oldcolor)
+				*pattr |= A_DIM;
+		}
+		if (!g_state.oldcolor || cfg.showdetail)
+			return (ent->flags & SYM_ORPHAN) ? C_ORP : C_LNK;
+		return 0;
+	case S_IFSOCK:
+		*pind = '=';
+		return C_SOC;
+	case S_IFIFO:
+		*pind = '|';
+		return C_PIP;
+	case S_IFBLK:
+		return C_BLK;
+	case S_IFCHR:
+		return C_CHR;
+	}
+
+	*pind = '?';
+	return C_UND;
+}
+
+static void printent(int pdents_index, uint_t namecols, bool sel)
+{
+	const struct entry *ent = &pdents[pdents_index];
+	char ind = '\0';
+	int attrs;
+    uchar_t color_pair;
+
+	if (cfg.showdetail) {
+		int type = ent->mode & S_IFMT;
+		char perms[6] = {' ', ' ', (char)('0' + ((ent->mode >> 6) & 7)),
+				(char)('0' + ((ent->mode >> 3) & 7)),
+				(char)('0' + (ent->mode & 7)), '\0'};
+
+#ifdef GITSTATUS
+		if (ent->git)
+			perms[1] = ent->git;
+#endif
+
+		addch(' ');
+		attrs = g_state.oldcolor ? (resetdircolor(ent->flags), A_DIM)
+					 : (fcolors[C_MIS] ? COLOR_PAIR(C_MIS) : 0);
+		if (attrs)
+			attron(attrs);
+
+		/* Print details */
+		print_time(&ent->sec, ent->flags);
+
+		printw("%s%9s ", perms, (type == S_IFREG || type == S_IFDIR)
+			? coolsize(cfg.blkorder ? (blkcnt_t)ent->blocks << blk_shift : ent->size)
+			: (type = (uchar_t)get_detail_ind(ent->mode), (char *)&type));
+
+		if (attrs)
+			attroff(attrs);
+	}
+
+	if (g_state.showlines) {
+		ptrdiff_t rel_num = pdents_index - cur;
+		printw(rel_num == 0 ? "%4td" : "%+4td", rel_num);
+	}
+
+	attrs = 0;
+	color_pair = get_color_pair_name_ind(ent, &ind, &attrs);
+
+    if (ent->flags & FILE_SELECTED)
+#if defined(NERD)
+      addstr("");
+#else
+      addch('+' | A_REVERSE | A_BOLD);
+#endif
+    else
+      addch(' ');
+
+	if (g_state.oldcolor) {
+		resetdircolor(ent->flags);
+        if (sel)
+          attrs |= A_REVERSE;
+    }
+	else {
+		if (color_pair && fcolors[color_pair]) {
+            if (sel)
+              color_pair += C_FILES_MAX;
+			attrs |= COLOR_PAIR(color_pair);
+        } else if (sel)
+            attrs |= COLOR_PAIR(C_DEF_SEL);
+
+#ifdef ICONS_ENABLED
+		print_icon(ent, attrs, sel);
+#endif
+	}
+
+	if (attrs)
+		attron(attrs);
+	if (!ind)
+		++namecols;
+
+#ifndef NOLC
+	addwstr(unescape(ent->name, namecols));
+#else
+	addstr(unescape(ent->name, MIN(namecols, ent->nlen) + 1));
+#endif
+
+    if (ind)
+		addch(ind);
+    addch(' ');
+	if (attrs)
+		attroff(attrs);
+}
+
+/**
+ * Sets the global cfg variable and restores related state to match the new
+ * cfg.
+ */
+static void setcfg(settings newcfg)
+{
+	cfg = newcfg;
+	/* Synchronize the global function pointers to match the new cfg. */
+	entrycmpfn = cfg.reverse ? &reventrycmp : &entrycmp;
+	namecmpfn = cfg.version ? &xstrverscasecmp : &xstricmp;
+	filterfn = cfg.regex ? &visible_re : &visible_str;
+}
+
+static void savecurctx(char *path, char *curname, int nextctx)
+{
+	settings tmpcfg = cfg;
+	context *ctxr = &g_ctx[nextctx];
+
+	/* Save current context */
+	if (curname)
+		xstrsncpy(g_ctx[tmpcfg.curctx].c_name, curname, NAME_MAX + 1);
+	else
+		g_ctx[tmpcfg.curctx].c_name[0] = '\0';
+
+	g_ctx[tmpcfg.curctx].c_cfg = tmpcfg;
+
+	if (ctxr->c_cfg.ctxactive) { /* Switch to saved context */
+		tmpcfg = ctxr->c_cfg;
+		/* Skip ordering an open context */
+		if (order) {
+			cfgsort[CTX_MAX] = cfgsort[nextctx];
+			cfgsort[nextctx] = '0';
+		}
+	} else { /* Set up a new context from current context */
+		ctxr->c_cfg.ctxactive = 1;
+		xstrsncpy(ctxr->c_path, path, PATH_MAX);
+		ctxr->c_last[0] = ctxr->c_name[0] = ctxr->c_fltr[0] = ctxr->c_fltr[1] = '\0';
+		tmpcfg.listview = tmpcfg.listview && list_isdir(path);
+		tmpcfg.listlast = 0;
+		ctxr->c_cfg = tmpcfg;
+		/* If already in an ordered dir, clear ordering for the new context and let it order */
+		if (cfgsort[cfg.curctx] == 'z')
+			cfgsort[nextctx] = 'z';
+	}
+
+	tmpcfg.curctx = nextctx;
+	setcfg(tmpcfg);
+}
+
+#ifndef NOSSN
+static void save_session(const char *sname, int *presel)
+{
+	int fd, i;
+	session_header_t header = {0};
+	bool status = FALSE;
+	char ssnpath[PATH_MAX];
+	char spath[PATH_MAX];
+
+	header.ver = SESSIONS_VERSION;
+
+	for (i = 0; i < CTX_MAX; ++i) {
+		if (g_ctx[i].c_cfg.ctxactive) {
+			if (cfg.curctx == i && ndents)
+				/* Update current file name, arrows don't update it */
+				xstrsncpy(g_ctx[i].c_name, pdents[cur].name, NAME_MAX + 1);
+			header.pathln[i] = MIN(xstrlen(g_ctx[i].c_path), PATH_MAX) + 1;
+			header.lastln[i] = MIN(xstrlen(g_ctx[i].c_last), PATH_MAX) + 1;
+			header.nameln[i] = MIN(xstrlen(g_ctx[i].c_name), NAME_MAX) + 1;
+			header.fltrln[i] = REGEX_MAX;
+		}
+	}
+
+	mkpath(cfgpath, toks[TOK_SSN], ssnpath);
+	mkpath(ssnpath, sname, spath);
+
+	fd = open(spath, O_CREAT | O_WRONLY | O_TRUNC, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		printwait(messages[MSG_SEL_MISSING], presel);
+		return;
+	}
+
+	if ((write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+		|| (write(fd, &cfg, sizeof(cfg)) != (ssize_t)sizeof(cfg)))
+		goto END;
+
+	for (i = 0; i < CTX_MAX; ++i)
+		if ((write(fd, &g_ctx[i].c_cfg, sizeof(settings)) != (ssize_t)sizeof(settings))
+			|| (write(fd, &g_ctx[i].color, sizeof(uint_t)) != (ssize_t)sizeof(uint_t))
+			|| (header.nameln[i] > 0
+			    && write(fd, g_ctx[i].c_name, header.nameln[i]) != (ssize_t)header.nameln[i])
+			|| (header.lastln[i] > 0
+			    && write(fd, g_ctx[i].c_last, header.lastln[i]) != (ssize_t)header.lastln[i])
+			|| (header.fltrln[i] > 0
+			    && write(fd, g_ctx[i].c_fltr, header.fltrln[i]) != (ssize_t)header.fltrln[i])
+			|| (header.pathln[i] > 0
+			    && write(fd, g_ctx[i].c_path, header.pathln[i]) != (ssize_t)header.pathln[i]))
+			goto END;
+
+	status = TRUE;
+
+END:
+	close(fd);
+
+	if (!status)
+		printwait(messages[MSG_FAILED], presel);
+}
+
+static bool load_session(const char *sname, char **path, char **lastdir, char **lastname, bool restore)
+{
+	int fd, i = 0;
+	session_header_t header;
+	bool has_loaded_dynamically = !(sname || restore);
+	bool status = (sname && g_state.picker); /* Picker mode with session program option */
+	char ssnpath[PATH_MAX];
+	char spath[PATH_MAX];
+
+	mkpath(cfgpath, toks[TOK_SSN], ssnpath);
+
+	if (!restore) {
+		if (!sname || !sname[0])
+			sname = xreadline(NULL, messages[MSG_SSN_NAME]);
+		if (!sname[0])
+			return FALSE;
+
+		mkpath(ssnpath, sname, spath);
+
+		/* If user is explicitly loading the "last session", skip auto-save */
+		if ((sname[0] == '@') && !sname[1])
+			has_loaded_dynamically = FALSE;
+	} else
+		mkpath(ssnpath, "@", spath);
+
+	if (has_loaded_dynamically)
+		save_session("@", NULL);
+
+	fd = open(spath, O_RDONLY, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		if (!status) {
+			printmsg(messages[MSG_SEL_MISSING]);
+			xdelay(XDELAY_INTERVAL_MS);
+		}
+		return FALSE;
+	}
+
+	status = FALSE;
+
+	if ((read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+		|| (header.ver != SESSIONS_VERSION)
+		|| (read(fd, &cfg, sizeof(cfg)) != (ssize_t)sizeof(cfg)))
+		goto END;
+
+	g_ctx[cfg.curctx].c_name[0] = g_ctx[cfg.curctx].c_last[0]
+		= g_ctx[cfg.curctx].c_fltr[0] = g_ctx[cfg.curctx].c_fltr[1] = '\0';
+
+	for (; i < CTX_MAX; ++i)
+		if ((read(fd, &g_ctx[i].c_cfg, sizeof(settings)) != (ssize_t)sizeof(settings))
+			|| (read(fd, &g_ctx[i].color, sizeof(uint_t)) != (ssize_t)sizeof(uint_t))
+			|| (header.nameln[i] > 0
+			    && read(fd, g_ctx[i].c_name, header.nameln[i]) != (ssize_t)header.nameln[i])
+			|| (header.lastln[i] > 0
+			    && read(fd, g_ctx[i].c_last, header.lastln[i]) != (ssize_t)header.lastln[i])
+			|| (header.fltrln[i] > 0
+			    && read(fd, g_ctx[i].c_fltr, header.fltrln[i]) != (ssize_t)header.fltrln[i])
+			|| (header.pathln[i] > 0
+			    && read(fd, g_ctx[i].c_path, header.pathln[i]) != (ssize_t)header.pathln[i]))
+			goto END;
+
+	*path = g_ctx[cfg.curctx].c_path;
+	*lastdir = g_ctx[cfg.curctx].c_last;
+	*lastname = g_ctx[cfg.curctx].c_name;
+	/* Set correct sort and filter options */
+	set_sort_flags('\0');
+	filterfn = cfg.regex ? &visible_re : &visible_str;
+	xstrsncpy(curssn, sname ? sname : "@", NAME_MAX);
+	status = TRUE;
+
+END:
+	close(fd);
+
+	if (!status) {
+		printmsg(messages[MSG_FAILED]);
+		xdelay(XDELAY_INTERVAL_MS);
+	} else if (restore)
+		unlink(spath);
+
+	return status;
+}
+#endif
+
+static uchar_t get_free_ctx(void)
+{
+	uchar_t r = cfg.curctx;
+
+	do
+		r = (r + 1) & ~CTX_MAX;
+	while (g_ctx[r].c_cfg.ctxactive && (r != cfg.curctx));
+
+	return r;
+}
+
+/* ctx is absolute: 1 to 4, + for smart context */
+static void set_smart_ctx(int ctx, char *nextpath, char **path, char *file, char **lastname, char **lastdir)
+{
+	if (ctx == '+') /* Get smart context */
+		ctx = (int)(get_free_ctx() + 1);
+
+	if (ctx == 0 || ctx == cfg.curctx + 1) { /* Same context */
+		clearfilter();
+		xstrsncpy(*lastdir, *path, PATH_MAX);
+		xstrsncpy(*path, nextpath, PATH_MAX);
+		cfg.listlast = cfg.listview;
+	} else { /* New context */
+		--ctx;
+		/* Deactivate the new context and build from scratch */
+		g_ctx[ctx].c_cfg.ctxactive = 0;
+		DPRINTF_S(nextpath);
+		savecurctx(nextpath, file, ctx);
+		*path = g_ctx[ctx].c_path;
+		*lastdir = g_ctx[ctx].c_last;
+		*lastname = g_ctx[ctx].c_name;
+	}
+
+	/* A list loaded by a plugin */
+	cfg.listview = (nextpath == listroot);
+}
+
+/*
+ * This function does one of the following depending on the values of `fdout` and `page`:
+ *  1) fdout == -1 && !page: Write up to CMD_LEN_MAX bytes of command output into g_buf
+ *  2) fdout == -1 && page: Create a temp file, write full command output into it and show in pager.
+ *  3) fdout != -1 && !page: Write full command output into the provided file.
+ *  4) fdout != -1 && page: Don't use! Returns FALSE.
+ *
+ * g_buf is modified only in case 1.
+ * g_tmpfpath is modified only in case 2.
+ */
+static bool get_output(char *file, char *arg1, char *arg2, int fdout, bool page)
+{
+	pid_t pid;
+	int pipefd[2];
+	int index = 0, flags;
+	bool ret = FALSE;
+	bool have_file = fdout != -1;
+	int cmd_out_fd = -1;
+	char *argv[EXEC_ARGS_MAX] = {0};
+	char *cmd;
+	ssize_t len;
+
+	/*
+	 * In this case the logic of the function dictates that we should write the output of the command
+	 * to `fd` and show it in the pager. But since we didn't open the file descriptor we have no right
+	 * to close it, the caller must do it. We don't even know the path to pass to the pager and
+	 * it's a real hassle to get it. In general this just invites problems so we are blocking it.
+	 */
+	if (have_file && page) {
+		DPRINTF_S("invalid get_ouptput() call");
+		return FALSE;
+	}
+
+	/* Setup file descriptors for child command */
+	if (!have_file && page) {
+		// Case 2
+		fdout = create_tmp_file();
+		if (fdout == -1)
+			return FALSE;
+
+		cmd_out_fd = fdout;
+	} else if (have_file) {
+		// Case 3
+		cmd_out_fd = fdout;
+	} else {
+		// Case 1
+		if (pipe(pipefd) == -1)
+			errexit();
+
+		for (index = 0; index < 2; ++index) {
+			/* Get previous flags */
+			flags = fcntl(pipefd[index], F_GETFL, 0);
+
+			/* Set bit for non-blocking flag */
+			flags |= O_NONBLOCK;
+
+			/* Change flags on fd */
+			fcntl(pipefd[index], F_SETFL, flags);
+			fcntl(pipefd[index], F_SETFD, FD_CLOEXEC);
+		}
+
+		cmd_out_fd = pipefd[1];
+	}
+
+	/* The command reads nothing, writes to cmd_out_fd */
+	cmd = parseargs(file, argv, &index);
+	if (cmd) {
+		argv[index] = arg1 ? arg1 : arg2;
+		argv[index + 1] = arg1 ? arg2 : NULL;
+		pid = xspawn(argv, F_NOSTDIN, -1, cmd_out_fd);
+		if (pid > 0)
+			waitpid(pid, NULL, 0);
+		free(cmd);
+	}
+
+	/* Do what each case should do */
+	if (!have_file && page) {
+		// Case 2
+		close(fdout);
+
+		spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+
+		unlink(g_tmpfpath);
+		return TRUE;
+	}
+
+	if (have_file)
+		// Case 3
+		return TRUE;
+
+	// Case 1
+	len = read(pipefd[0], g_buf, CMD_LEN_MAX - 1);
+	if (len > 0)
+		ret = TRUE;
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+	return ret;
+}
+
+/*
+ * Follows the stat(1) output closely
+ */
+static bool show_stats(char *fpath)
+{
+	static char * const cmds[] = {
+#ifdef FILE_MIME_OPTS
+		("file " FILE_MIME_OPTS),
+#endif
+		"file -b",
+#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__) || defined(__DragonFly__)
+		"stat -x",
+#else
+		"stat",
+#endif
+	};
+
+	size_t r = ELEMENTS(cmds);
+	int fd = create_tmp_file();
+	if (fd == -1)
+		return FALSE;
+
+	while (r)
+		get_output(cmds[--r], fpath, NULL, fd, FALSE);
+
+	close(fd);
+
+	spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+	unlink(g_tmpfpath);
+	return TRUE;
+}
+
+static bool xchmod(const char *fpath, mode_t *mode)
+{
+	/* (Un)set (S_IXUSR | S_IXGRP | S_IXOTH) */
+	(0100 & *mode) ? (*mode &= ~0111) : (*mode |= 0111);
+
+	return (chmod(fpath, *mode) == 0);
+}
+
+/*
+ * Calls that can hang forever on a stale NFS/sshfs mount run in a thread
+ * while the UI waits for them with a timeout. Past it the path is flagged
+ * slow and the user may back out with any key while the kernel call is
+ * still stuck; the orphaned worker cleans up after itself if it ever
+ * returns.
+ */
+static wd_slow *wd_findslow(const char *path)
+{
+	size_t len;
+
+	for (wd_slow *slow = wd_slows; slow < wd_slows + WD_SLOW_MAX; ++slow) {
+		if (!slow->path[0])
+			continue;
+
+		len = xstrlen(slow->path);
+		if (is_prefix(path, slow->path, len) && (!path[len] || path[len] == '/'))
+			return slow;
+	}
+
+	return NULL;
+}
+
+static void wd_flag(const char *path)
+{
+	wd_slow *slow = wd_findslow(path), *oldest = wd_slows;
+
+	if (!slow) {
+		for (slow = wd_slows; slow < wd_slows + WD_SLOW_MAX && slow->path[0]; ++slow)
+			if (slow->since < oldest->since)
+				oldest = slow;
+		if (slow == wd_slows + WD_SLOW_MAX)
+			slow = oldest;
+		xstrsncpy(slow->path, path, PATH_MAX);
+	}
+
+	slow->since = time(NULL);
+}
+
+static void *wd_worker(void *arg)
+{
+	wd_call *call = arg;
+	int ret, err;
+	bool orphan;
+
+	ret = open(call->path, O_DIRFD);
+	err = errno;
+
+	pthread_mutex_lock(&wd_lock);
+	call->ret = ret;
+	call->err = err;
+	call->done = TRUE;
+	orphan = call->orphan;
+	pthread_cond_broadcast(&wd_cond);
+	pthread_mutex_unlock(&wd_lock);
+
+	if (orphan) {
+		if (ret >= 0)
+			close(ret);
+		free(call);
+	}
+
+	return NULL;
+}
+
+/* Opens the dir at path, -1 with ETIMEDOUT if given up */
+static int wd_open(const char *path)
+{
+	wd_slow *slow = wd_findslow(path);
+	struct timespec ts;
+	pthread_t tid;
+	wd_call *call;
+	int ret = -1;
+
+	/* Keep off paths known to hang for a while */
+	if (slow && time(NULL) - slow->since < WD_BACKOFF) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	call = calloc(1, sizeof(wd_call));
+	if (!call)
+		return -1;
+
+	xstrsncpy(call->path, path, PATH_MAX);
+	if (pthread_create(&tid, NULL, wd_worker, call)) {
+		free(call);
+		return open(path, O_DIRFD);
+	}
+	pthread_detach(tid);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += WD_TIMEOUT_MS / 1000;
+	ts.tv_nsec += (WD_TIMEOUT_MS % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&wd_lock);
+	while (!call->done && !slow && pthread_cond_timedwait(&wd_cond, &wd_lock, &ts) != ETIMEDOUT);
+
+	if (!call->done) {
+		pthread_mutex_unlock(&wd_lock);
+		printmsg("slow fs, any key to back out");
+		refresh();
+		timeout(WD_POLL_MS);
+		while (TRUE) {
+			pthread_mutex_lock(&wd_lock);
+			if (call->done)
+				break;
+			pthread_mutex_unlock(&wd_lock);
+			if (getch() != ERR) {
+				pthread_mutex_lock(&wd_lock);
+				break;
+			}
+		}
+		settimeout();
+	}
+
+	if (call->done) {
+		ret = call->ret;
+		errno = call->err;
+		free(call);
+		if (slow)
+			slow->path[0] = '\0';
+	} else {
+		call->orphan = TRUE;
+		wd_flag(path);
+		errno = ETIMEDOUT;
+	}
+	pthread_mutex_unlock(&wd_lock);
+
+	return ret;
+}
+
+/*
+ * Filesystem stats are cached per device and refreshed in a thread once
+ * older than FS_TTL, so redraws never wait on a statvfs(2) round trip.
+ * Slots are looked up by the last path asked for on the device.
+ */
+static void *fs_worker(void *arg)
+{
+	fs_stat *ent = arg;
+	char path[PATH_MAX];
+	struct statvfs svb;
+	struct stat sb;
+	size_t vals[VFS_SIZE + 1];
+	time_t now = time(NULL), stamp = 0;
+	bool ok;
+	int shift;
+
+	pthread_mutex_lock(&fs_lock);
+	xstrsncpy(path, ent->path, PATH_MAX);
+	pthread_mutex_unlock(&fs_lock);
+
+	ok = stat(path, &sb) == 0;
+	if (ok) {
+		/* Another path on the device may have fresh stats */
+		pthread_mutex_lock(&fs_lock);
+		for (fs_stat *p = fs_stats; p < fs_stats + FS_STATS_MAX; ++p)
+			if (p != ent && p->path[0] && p->stamp && p->dev == sb.st_dev
+			    && now - p->stamp < FS_TTL) {
+				memcpy(vals, p->vals, sizeof(vals));
+				stamp = p->stamp;
+				break;
+			}
+		pthread_mutex_unlock(&fs_lock);
+
+		if (!stamp && (ok = (statvfs(path, &svb) == 0))) {
+			shift = ffs((int)(svb.f_frsize >> 1));
+			vals[VFS_AVAIL] = (size_t)svb.f_bavail << shift;
+			vals[VFS_USED] = ((size_t)svb.f_blocks - (size_t)svb.f_bfree) << shift;
+			vals[VFS_SIZE] = (size_t)svb.f_blocks << shift;
+		}
+	}
+
+	pthread_mutex_lock(&fs_lock);
+	if (ok) {
+		ent->dev = sb.st_dev;
+		memcpy(ent->vals, vals, sizeof(vals));
+	} else
+		memset(ent->vals, 0, sizeof(ent->vals));
+	ent->stamp = stamp ? stamp : time(NULL);
+	ent->busy = FALSE;
+	pthread_cond_broadcast(&fs_cond);
+	pthread_mutex_unlock(&fs_lock);
+
+	return NULL;
+}
+
+static size_t get_fs_info(const char *path, uchar_t type)
+{
+	fs_stat *ent = NULL, *p;
+	struct timespec ts;
+	pthread_t tid;
+	size_t ret;
+
+	pthread_mutex_lock(&fs_lock);
+	for (p = fs_stats; p < fs_stats + FS_STATS_MAX; ++p) {
+		if (p->path[0] && strcmp(p->path, path) == 0) {
+			ent = p;
+			break;
+		}
+
+		/* Else recycle a free or the stalest idle slot */
+		if (!p->busy && (!ent || !p->path[0] || (ent->path[0] && p->stamp < ent->stamp)))
+			ent = p;
+	}
+
+	if (!ent) {
+		pthread_mutex_unlock(&fs_lock);
+		return 0;
+	}
+
+	if (p == fs_stats + FS_STATS_MAX) {
+		xstrsncpy(ent->path, path, PATH_MAX);
+		/* Show nothing rather than the old path's numbers until stat'ed */
+		memset(ent->vals, 0, sizeof(ent->vals));
+		ent->stamp = 0;
+	}
+
+	/* Paths flagged by the watchdog are left alone */
+	if (!ent->busy && time(NULL) - ent->stamp >= FS_TTL && !wd_findslow(path)) {
+		ent->busy = TRUE;
+		if (pthread_create(&tid, NULL, fs_worker, ent) == 0)
+			pthread_detach(tid);
+		else
+			ent->busy = FALSE;
+	}
+
+	if (!ent->stamp && ent->busy) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += FS_WAIT_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (ent->busy && pthread_cond_timedwait(&fs_cond, &fs_lock, &ts) != ETIMEDOUT);
+	}
+
+	ret = ent->vals[type];
+	pthread_mutex_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Create non-existent parents and a file or dir */
+static bool xmktree(char *path, bool dir)
+{
+	char *p = path;
+	char *slash = path;
+
+	if (!p || !*p)
+		return FALSE;
+
+	/* Skip the first '/' */
+	++p;
+
+	while (*p != '\0') {
+		if (*p == '/') {
+			slash = p;
+			*p = '\0';
+		} else {
+			++p;
+			continue;
+		}
+
+		/* Create folder from path to '\0' inserted at p */
+		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+#ifdef __HAIKU__
+			// XDG_CONFIG_HOME contains a directory
+			// that is read-only, but the full path
+			// is writeable.
+			// Try to continue and see what happens.
+			// TODO: Find a more robust solution.
+			if (errno == B_READ_ONLY_DEVICE)
+				goto next;
+#endif
+			DPRINTF_S("mkdir1!");
+			DPRINTF_S(strerror(errno));
+			*slash = '/';
+			return FALSE;
+		}
+
+#ifdef __HAIKU__
+next:
+#endif
+		/* Restore path */
+		*slash = '/';
+		++p;
+	}
+
+	if (dir) {
+		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+			DPRINTF_S("mkdir2!");
+			DPRINTF_S(strerror(errno));
+			return FALSE;
+		}
+	} else {
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR); /* Forced create mode for files */
 
-				len = 0;
-				goto END;
-			}
+		if (fd == -1 && errno != EEXIST) {
+			DPRINTF_S("open!");
+			DPRINTF_S(strerror(errno));
+			return FALSE;
+		}
 
-			/* Filter out all other control chars */
-			if (*ch < ASCII_MAX && keyname(*ch)[0] == '^')
-				continue;
+		close(fd);
+	}
 
-			if (pos < READLINE_MAX - 1) {
-				memmove(buf + pos + 1, buf + pos,
-					(len - pos) * WCHAR_T_WIDTH);
-				buf[pos] = *ch;
-				++len, ++pos;
-				continue;
-			}
-		} else {
-			switch (*ch) {
-#ifdef KEY_RESIZE
-			case KEY_RESIZE:
-				clearoldprompt();
-				xlines = LINES;
-				printmsg(prompt);
-				break;
+	return TRUE;
+}
+
+/* Archive by extension, as per NNN_ARCHIVE */
+static bool is_archive(const char *name, size_t len)
+{
+	char *ext = xextension(name, len);
+
+	if (!ext)
+		return FALSE;
+#ifdef PCRE2
+	int r = 0;
+	pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(archive_pcre2, NULL);
+
+	if (match_data) {
+		r = pcre2_match(archive_pcre2, (PCRE2_SPTR)ext, len - (ext - name), 0, 0, match_data, NULL);
+		pcre2_match_data_free(match_data);
+	}
+
+	return r > 0;
+#else
+	return !regexec(&archive_re, ext, 0, NULL, 0);
 #endif
-			case KEY_LEFT:
-				if (pos > 0)
-					--pos;
-				break;
-			case KEY_RIGHT:
-				if (pos < len)
-					++pos;
-				break;
-			case KEY_BACKSPACE:
-				if (pos > 0) {
-					memmove(buf + pos - 1, buf + pos,
-						(len - pos) * WCHAR_T_WIDTH);
-					--len, --pos;
-				}
-				break;
-			case KEY_DC:
-				if (pos < len) {
-					memmove(buf + pos, buf + pos + 1,
-						(len - pos - 1) * WCHAR_T_WIDTH);
-					--len;
-				}
-				break;
-			case KEY_END:
-				pos = len;
-				break;
-			case KEY_HOME:
-				pos = 0;
-				break;
-			case KEY_UP: // fallthrough
-			case KEY_DOWN:
-			{
-				char *cmd = getcmdfromhist(*ch == KEY_UP);
+}
 
-				if (prompt && cmd && (xstrcmp(prompt, PROMPT) == 0)) {
-					printmsg(prompt);
-					len = pos = mbstowcs(buf, cmd, READLINE_MAX); // fallthrough
-				}
-			}
-			default:
-				break;
+/*
+ * Virtual archive listing
+ *
+ * The members are browsed as a dir tree at <archive path>/<member dir>,
+ * the cwd is the dir of the archive meanwhile. The indexes of the last
+ * archives visited are kept.
+ */
+static arc_index *arcs[ARC_CACHE_MAX];
+static char arc_tmpdir[TMP_LEN_MAX]; /* Members copied out for openers and previewers */
+
+static void arc_free(int i)
+{
+	arc_close(arcs[i]);
+	arcs[i] = NULL;
+}
+
+/* Index an archive into the least recently used slot */
+static arc_index *arc_new(const char *path)
+{
+	int i, slot = 0;
+
+	for (i = 0; i < ARC_CACHE_MAX; ++i) {
+		if (!arcs[i]) {
+			slot = i;
+			break;
+		}
+		if (arcs[i]->used < arcs[slot]->used)
+			slot = i;
+	}
+
+	arc_free(slot);
+	printmsg("indexing...");
+	refresh();
+	arcs[slot] = arc_open(path);
+	if (arcs[slot])
+		arcs[slot]->used = time(NULL);
+
+	return arcs[slot];
+}
+
+/* Cached index of the archive the path is in, rel is the member path */
+static arc_index *arc_find(const char *path, const char **rel)
+{
+	for (int i = 0; i < ARC_CACHE_MAX; ++i) {
+		arc_index *arc = arcs[i];
+
+		if (arc && is_prefix(path, arc->path, arc->plen)
+		    && (!path[arc->plen] || path[arc->plen] == '/')) {
+			*rel = path + arc->plen + (path[arc->plen] == '/');
+			return arc;
+		}
+	}
+
+	return NULL;
+}
+
+/* As arc_find(), drops stale indexes and indexes the archive in the path if needed */
+static arc_index *arc_get(const char *path, const char **rel)
+{
+	struct stat sb;
+	char buf[PATH_MAX];
+	char *p;
+	arc_index *arc = arc_find(path, rel);
+
+	if (arc) {
+		if (stat(arc->path, &sb) == 0 && sb.st_dev == arc->dev && sb.st_ino == arc->ino
+		    && sb.st_mtime == arc->mtime) {
+			arc->used = time(NULL);
+			return arc;
+		}
+
+		for (int i = 0; i < ARC_CACHE_MAX; ++i)
+			if (arcs[i] == arc)
+				arc_free(i);
+	}
+
+	if (!arc_root(path, buf))
+		return NULL;
+
+	p = xbasename(buf);
+	if (!is_archive(p, xstrlen(p)) || !(arc = arc_new(buf)))
+		return NULL;
+
+	*rel = path + arc->plen + (path[arc->plen] == '/');
+	return arc;
+}
+
+/* Append an entry named name to the listing, the caller fills it and counts it */
+static struct entry *dentadd(struct entry **ppdents, const char *name, size_t len,
+			     size_t *off, size_t *namebuflen)
+{
+	struct entry *dentp;
+	char *pnb;
+
+	if (ndents == total_dents) {
+		total_dents += ENTRY_INCR;
+		*ppdents = xrealloc(*ppdents, total_dents * sizeof(**ppdents));
+		if (!*ppdents) {
+			free(pnamebuf);
+			errexit();
+		}
+	}
+
+	if (*namebuflen - *off < NAME_MAX + 1) {
+		*namebuflen += NAMEBUF_INCR;
+
+		pnb = pnamebuf;
+		pnamebuf = (char *)xrealloc(pnamebuf, *namebuflen);
+		if (!pnamebuf) {
+			free(*ppdents);
+			errexit();
+		}
+
+		if (pnb != pnamebuf) {
+			dentp = *ppdents;
+			dentp->name = pnamebuf;
+
+			for (int count = 1; count < ndents; ++dentp, ++count)
+				(dentp + 1)->name = (char *)((size_t)dentp->name + dentp->nlen);
+		}
+	}
+
+	dentp = *ppdents + ndents;
+	dentp->name = pnamebuf + *off;
+	dentp->nlen = xstrsncpy(dentp->name, name, len + 1);
+	*off += dentp->nlen;
+#ifdef GITSTATUS
+	dentp->git = '\0';
+#endif
+
+	return dentp;
+}
+
+/* Fill the listing from the members under rel */
+static int arc_fill(const char *path, struct entry **ppdents)
+{
+	const char *rel, *name;
+	size_t len, rlen, off = 0, namebuflen = NAMEBUF_INCR;
+	struct entry *dentp;
+	uint_t i;
+	arc_index *arc = arc_find(path, &rel);
+
+	if (!arc)
+		return 0;
+
+	rlen = xstrlen(rel);
+	for (i = arc_lower(arc, rel, rlen, "", 0); i < arc->nents; ++i) {
+		arc_ent *ent = &arc->ents[i];
+
+		if (arc_namecmp(arc->names + ent->name, ent->dlen, rel, rlen))
+			break;
+
+		name = arc_base(arc->names, ent, &len);
+		if ((!cfg.showhidden && name[0] == '.') || len > NAME_MAX)
+			continue;
+
+		dentp = dentadd(ppdents, name, len, &off, &namebuflen);
+		dentp->sec = ent->mtime;
+		dentp->nsec = 0;
+		dentp->mode = ent->mode;
+		dentp->size = ent->size;
+		dentp->blocks = (ullong_t)(ent->size + 511) >> 9;
+#ifndef NOUG
+		dentp->uid = ent->uid;
+		dentp->gid = ent->gid;
+#endif
+		dentp->flags = S_ISDIR(ent->mode) ? DIR_OR_DIRLNK : 0;
+		if (gtimesecs - ent->mtime <= 300)
+			dentp->flags |= FILE_YOUNG;
+
+		++ndents;
+	}
+
+	return ndents;
+}
+
+/* Dir inside an archive (or the archive itself) */
+static bool arc_isdir(const char *path)
+{
+	const char *rel;
+	arc_index *arc = arc_get(path, &rel);
+	arc_ent *ent;
+
+	if (!arc)
+		return FALSE;
+
+	ent = *rel ? arc_lookup(arc, rel) : NULL;
+	return !*rel || (ent && S_ISDIR(ent->mode));
+}
+
+/* Copy a regular member out to a tmp file, path is updated */
+static bool arc_tmpfile(char *path, bool preview)
+{
+	const char *rel;
+	arc_index *arc = arc_get(path, &rel);
+	arc_ent *ent = (arc && *rel) ? arc_lookup(arc, rel) : NULL;
+	arc_reader rd;
+	char tmp[PATH_MAX];
+	int fd, r;
+
+	if (!ent || !S_ISREG(ent->mode) || (preview && ent->size > ARC_PREVIEW_MAX)) {
+		errno = ent ? EFBIG : ENOENT;
+		return FALSE;
+	}
+
+	if (!arc_tmpdir[0]) {
+		snprintf(arc_tmpdir, TMP_LEN_MAX, "%.*s/nnn-arc.XXXXXX", tmpfplen - 1, g_tmpfpath);
+		if (!mkdtemp(arc_tmpdir)) {
+			arc_tmpdir[0] = '\0';
+			return FALSE;
+		}
+	}
+
+	mkpath(arc_tmpdir, xbasename(path), tmp);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return FALSE;
+
+	arc_ropen(&rd, arc);
+	r = arc_read(&rd, ent, fd);
+	arc_rclose(&rd);
+	close(fd);
+
+	if (r) {
+		unlink(tmp);
+		errno = r;
+		return FALSE;
+	}
+
+	xstrsncpy(path, tmp, PATH_MAX);
+	return TRUE;
+}
+
+static void arc_rmtmp(void)
+{
+	DIR *dirp = arc_tmpdir[0] ? opendir(arc_tmpdir) : NULL;
+	struct dirent *dp;
+
+	if (!dirp)
+		return;
+
+	while ((dp = readdir(dirp)))
+		if (!selforparent(dp->d_name))
+			unlinkat(dirfd(dirp), dp->d_name, 0);
+	closedir(dirp);
+	rmdir(arc_tmpdir);
+}
+
+/* chdir(2) guarded by the watchdog that also enters the dirs listed from an archive */
+static int xchdir(const char *path)
+{
+	const char *rel;
+	char dir[PATH_MAX];
+	int fd, r;
+
+	/* Staying in the dir the watchdog let through last time */
+	if (strcmp(path, wd_cwd) == 0)
+		r = chdir(path);
+	else {
+		fd = wd_open(path);
+		if (fd >= 0) {
+			r = fchdir(fd);
+			close(fd);
+		} else /* A search-only dir can't be opened without O_PATH/O_SEARCH */
+			r = (errno == EACCES) ? chdir(path) : -1;
+	}
+
+	if (r == 0) {
+		xstrsncpy(wd_cwd, path, PATH_MAX);
+		return 0;
+	}
+
+	wd_cwd[0] = '\0';
+	if (errno == ENOTDIR && arc_isdir(path)) {
+		xstrsncpy(dir, arc_find(path, &rel)->path, PATH_MAX);
+		r = chdir(xdirname(dir));
+		if (r == 0)
+			xstrsncpy(wd_cwd, path, PATH_MAX);
+	}
+
+	return r;
+}
+
+/* List or extract archive */
+static bool handle_archive(char *fpath /* in-out param */, char op)
+{
+	char arg[] = "-tvf"; /* options for tar/bsdtar to list files */
+	char *util, *outdir = NULL;
+	bool x_to = FALSE;
+	bool is_atool = (!g_state.usebsdtar && getutil(utils[UTIL_ATOOL]));
+
+	if (op == 'x') {
+		outdir = xreadline(is_atool ? "." : xbasename(fpath), messages[MSG_NEW_PATH]);
+		if (!outdir || !*outdir) { /* Cancelled */
+			printwait(messages[MSG_CANCEL], NULL);
+			return FALSE;
+		}
+		/* Do not create smart context for current dir */
+		if (!(*outdir == '.' && outdir[1] == '\0')) {
+			if (!xmktree(outdir, TRUE) || (chdir(outdir) == -1)) {
+				printwarn(NULL);
+				return FALSE;
 			}
+			/* Copy the new dir path to open it in smart context */
+			outdir = getcwd(NULL, 0); // NOLINT
+			x_to = TRUE;
 		}
 	}
 
-END:
-	curs_set(FALSE);
-	settimeout();
-	printmsg("");
+	if (is_atool) {
+		util = utils[UTIL_ATOOL];
+		arg[1] = op;
+		arg[2] = '\0';
+	} else if (getutil(utils[UTIL_BSDTAR])) {
+		util = utils[UTIL_BSDTAR];
+		if (op == 'x')
+			arg[1] = op;
+	} else if (is_suffix(fpath, ".zip")) {
+		util = utils[UTIL_UNZIP];
+		arg[1] = (op == 'l') ? 'v' /* verbose listing */ : '\0';
+		arg[2] = '\0';
+	} else {
+		util = utils[UTIL_TAR];
+		if (op == 'x')
+			arg[1] = op;
+	}
 
-	buf[len] = '\0';
+	if (op == 'x') { /* extract */
+#if defined(LIBARCHIVE) && !defined(NOFOPS)
+		fop_xarcrun(fpath);
+#else
+		spawn(util, arg, fpath, NULL, F_NORMAL | F_MULTI);
+#endif
+	} else /* list */
+		get_output(util, arg, fpath, -1, TRUE);
 
-	pos = wcstombs(g_buf, buf, READLINE_MAX - 1);
-	if (pos >= READLINE_MAX - 1)
-		g_buf[READLINE_MAX - 1] = '\0';
+	if (x_to) {
+		if (chdir(xdirname(fpath)) == -1) {
+			printwarn(NULL);
+			free(outdir);
+			return FALSE;
+		}
+		xstrsncpy(fpath, outdir, PATH_MAX);
+		free(outdir);
+	} else if (op == 'x')
+		fpath[0] = '\0';
 
-	free(buf);
-	return g_buf;
+	return TRUE;
 }
 
-#ifndef NORL
-/*
- * Caller should check the value of presel to confirm if it needs to wait to show warning
- */
-static char *getreadline(const char *prompt)
+static char *visit_parent(char *path, char *newpath, int *presel)
 {
-	exitcurses();
+	char *dir;
 
-	char *input = readline(prompt);
+	/* There is no going back */
+	if (istopdir(path)) {
+		/* Continue in type-to-nav mode, if enabled */
+		if (cfg.filtermode && presel)
+			*presel = FILTER;
+		return NULL;
+	}
 
-	refresh();
+	/* Use a copy as xdirname() may change the string passed */
+	if (newpath)
+		xstrsncpy(newpath, path, PATH_MAX);
+	else
+		newpath = path;
 
-	if (input && input[0]) {
-		add_history(input);
-		xstrsncpy(g_buf, input, CMD_LEN_MAX);
-		free(input);
-		return g_buf;
+	dir = xdirname(newpath);
+	if (xchdir(dir) == -1) {
+		printwarn(presel);
+		return NULL;
 	}
 
-	free(input);
-	return NULL;
+	return dir;
 }
-#endif
 
-/*
- * Create symbolic/hard link(s) to file(s) in selection list
- * Returns the number of links created, -1 on error
- */
-static int xlink(char *prefix, char *path, char *curfname, char *buf, int type)
+static void valid_parent(char *path, char *lastname)
 {
-	int count = 0, choice;
-	char *psel = pselbuf, *fname;
-	size_t pos = 0, len, r;
-	int (*link_fn)(const char *, const char *) = NULL;
-	char lnpath[PATH_MAX];
+	/* Save history */
+	xstrsncpy(lastname, xbasename(path), NAME_MAX + 1);
 
-	choice = get_cur_or_sel();
-	if (!choice)
-		return -1;
+	while (!istopdir(path))
+		if (visit_parent(path, NULL, NULL))
+			break;
 
-	if (type == 's') /* symbolic link */
-		link_fn = &symlink;
-	else /* hard link */
-		link_fn = &link;
+	printwarn(NULL);
+	xdelay(XDELAY_INTERVAL_MS);
+}
 
-	if (choice == 'c' || (nselected == 1)) {
-		prefix = abspath(prefix, path, lnpath); /* Generate link path */
-		if (!prefix)
-			return -1;
+static bool archive_mount(char *newpath)
+{
+	char *dir, *cmd = xgetenv("NNN_ARCHMNT", utils[UTIL_ARCHMNT]);
+	char *name = pdents[cur].name;
+	size_t len = pdents[cur].nlen;
+	char mntpath[PATH_MAX];
 
-		if (choice == 'c')
-			mkpath(path, curfname, buf); /* Generate target file path */
+	if (!getutil(cmd)) {
+		printmsg("install utility");
+		return FALSE;
+	}
 
-		if (!link_fn((choice == 'c') ? buf : pselbuf, lnpath)) {
-			if (choice == 's')
-				clearselection();
-			return 1; /* One link created */
-		}
-		return 0;
+	dir = xstrdup(name);
+	if (!dir) {
+		printmsg(messages[MSG_FAILED]);
+		return FALSE;
 	}
 
-	r = xstrsncpy(buf, prefix, NAME_MAX + 1); /* Copy prefix */
+	while (len > 1)
+		if (dir[--len] == '.') {
+			dir[len] = '\0';
+			break;
+		}
 
-	while (pos < selbufpos) {
-		len = xstrlen(psel);
-		fname = xbasename(psel);
+	DPRINTF_S(dir);
 
-		xstrsncpy(buf + r - 1, fname, NAME_MAX - r); /* Suffix target file name */
-		mkpath(path, buf, lnpath); /* Generate link path */
+	/* Create the mount point */
+	mkpath(cfgpath, toks[TOK_MNT], mntpath);
+	mkpath(mntpath, dir, newpath);
+	free(dir);
 
-		if (!link_fn(psel, lnpath))
-			++count;
+	if (!xmktree(newpath, TRUE)) {
+		printwarn(NULL);
+		return FALSE;
+	}
 
-		pos += len + 1;
-		psel += len + 1;
+	/* Mount archive in the background */
+	DPRINTF_S(name);
+	DPRINTF_S(newpath);
+	if (!mnt_start(cmd, name, newpath)) {
+		rmdir(newpath);
+		printmsg(messages[MSG_FAILED]);
+		return FALSE;
 	}
 
-	if (count == nselected) /* Clear selection if all links are generated */
-		clearselection();
-	return count;
+	return TRUE;
 }
 
-static bool parsekvpair(kv **arr, char **envcpy, const uchar_t id, uchar_t *items)
+static bool remote_mount(char *newpath)
 {
-	bool new = TRUE;
-	const uchar_t INCR = 8;
-	uint_t i = 0;
-	kv *kvarr = NULL;
-	char *ptr = getenv(env_cfg[id]);
+	int opt;
+	char *tmp, *env;
+	bool r = getutil(utils[UTIL_RCLONE]), s = getutil(utils[UTIL_SSHFS]);
+	char mntpath[PATH_MAX];
 
-	if (!ptr || !*ptr)
-		return TRUE;
+	if (!(r || s)) {
+		printmsg("install sshfs/rclone");
+		return FALSE;
+	}
 
-	*envcpy = xstrdup(ptr);
-	if (!*envcpy) {
-		xerror();
+	if (r && s)
+		opt = get_input(messages[MSG_REMOTE_OPTS]);
+	else
+		opt = (!s) ? 'r' : 's';
+
+	if (opt == 's')
+		env = xgetenv("NNN_SSHFS", utils[UTIL_SSHFS]);
+	else if (opt == 'r')
+		env = xgetenv("NNN_RCLONE", "rclone mount");
+	else {
+		printmsg(messages[MSG_INVALID_KEY]);
 		return FALSE;
 	}
 
-	ptr = *envcpy;
+	tmp = xreadline(NULL, "host[:dir] > ");
+	if (!tmp[0]) {
+		printmsg(messages[MSG_CANCEL]);
+		return FALSE;
+	}
 
-	while (*ptr && i < 100) {
-		if (new) {
-			if (!(i & (INCR - 1))) {
-				kvarr = xrealloc(kvarr, sizeof(kv) * (i + INCR));
-				*arr = kvarr;
-				if (!kvarr) {
-					xerror();
-					return FALSE;
-				}
-				memset(kvarr + i, 0, sizeof(kv) * INCR);
-			}
-			kvarr[i].key = (uchar_t)*ptr;
-			if (*++ptr != ':' || *++ptr == '\0' || *ptr == ';')
-				return FALSE;
-			kvarr[i].off = ptr - *envcpy;
-			++i;
+	char *div = strchr(tmp, ':');
 
-			new = FALSE;
-		}
+	if (div)
+		*div = '\0';
 
-		if (*ptr == ';') {
-			*ptr = '\0';
-			new = TRUE;
+	/* Create the mount point */
+	mkpath(cfgpath, toks[TOK_MNT], mntpath);
+	mkpath(mntpath, tmp, newpath);
+	if (!xmktree(newpath, TRUE)) {
+		printwarn(NULL);
+		return FALSE;
+	}
+
+	if (!div) { /* Convert "host" to "host:" */
+		size_t len = xstrlen(tmp);
+
+		tmp[len] = ':';
+		tmp[len + 1] = '\0';
+	} else
+		*div = ':';
+
+	/* sshfs may prompt for a password, it daemonizes once mounted */
+	if (opt == 's') {
+		if (spawn(env, tmp, newpath, NULL, F_CLI)) {
+			rmdir(newpath);
+			printmsg(messages[MSG_FAILED]);
+			return FALSE;
 		}
+		return TRUE;
+	}
 
-		++ptr;
+	/* Connect to remote in the background */
+	if (!mnt_start(env, tmp, newpath)) {
+		rmdir(newpath);
+		printmsg(messages[MSG_FAILED]);
+		return FALSE;
 	}
 
-	*items = i;
-	return (i != 0);
+	return TRUE;
 }
 
 /*
- * Get the value corresponding to a key
- *
- * NULL is returned in case of no match, path resolution failure etc.
- * buf would be modified, so check return value before access
+ * Unmounts if the directory represented by name is a mount point.
+ * Otherwise, asks for hostname
+ * Returns TRUE if directory needs to be refreshed *.
  */
-static char *get_kv_val(kv *kvarr, char *buf, int key, uchar_t max, uchar_t id)
+static bool unmount(char *name, char *newpath, int *presel, char *currentpath)
 {
-	char *val;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+	static char cmd[] = "umount";
+#else
+	static char cmd[] = "fusermount3"; /* Arch Linux utility */
+	static bool found = FALSE;
+#endif
+	char *tmp = name;
+	struct stat sb, psb;
+	bool child = FALSE;
+	bool parent = FALSE;
+	bool hovered = FALSE;
+	char mntpath[PATH_MAX];
 
-	if (!kvarr)
-		return NULL;
+#if !defined(__APPLE__) && !defined(__FreeBSD__) && !defined(__DragonFly__)
+	/* On Ubuntu it's fusermount */
+	if (!found && !getutil(cmd)) {
+		cmd[10] = '\0';
+		found = TRUE;
+	}
+#endif
+
+	mkpath(cfgpath, toks[TOK_MNT], mntpath);
 
-	for (int r = 0; r < max && kvarr[r].key; ++r) {
-		if (kvarr[r].key == key) {
-			/* Do not allocate new memory for plugin */
-			if (id == NNN_PLUG)
-				return pluginstr + kvarr[r].off;
+	if (tmp && strcmp(mntpath, currentpath) == 0) {
+		mkpath(mntpath, tmp, newpath);
+		child = lstat(newpath, &sb) != -1;
+		parent = lstat(xdirname(newpath), &psb) != -1;
+		if (!child && !parent) {
+			*presel = MSGWAIT;
+			return FALSE;
+		}
+	}
 
-			val = bmstr + kvarr[r].off;
-			bool tilde = convert_tilde(val, g_buf);
-			return abspath((tilde ? g_buf : val), NULL, buf);
+	if (!tmp || !child || !S_ISDIR(sb.st_mode) || (child && parent && sb.st_dev == psb.st_dev)) {
+		tmp = xreadline(NULL, messages[MSG_HOSTNAME]);
+		if (!tmp[0])
+			return FALSE;
+		if (name && (tmp[0] == '-') && (tmp[1] == '\0')) {
+			mkpath(currentpath, name, newpath);
+			hovered = TRUE;
 		}
 	}
 
-	DPRINTF_S("Invalid key");
-	return NULL;
-}
+	if (!hovered)
+		mkpath(mntpath, tmp, newpath);
 
-static int get_kv_key(kv *kvarr, char *val, uchar_t max, uchar_t id)
-{
-	if (!kvarr)
-		return -1;
+	if (!xdiraccess(newpath)) {
+		*presel = MSGWAIT;
+		return FALSE;
+	}
 
-	if (id != NNN_ORDER) /* For now this function supports only order string */
-		return -1;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
+	if (spawn(cmd, newpath, NULL, NULL, F_NORMAL)) {
+#else
+	if (spawn(cmd, "-qu", newpath, NULL, F_NORMAL)) {
+#endif
+		if (!xconfirm(get_input(messages[MSG_LAZY])))
+			return FALSE;
 
-	for (int r = 0; r < max && kvarr[r].key; ++r) {
-		if (xstrcmp((orderstr + kvarr[r].off), val) == 0)
-			return kvarr[r].key;
+#ifdef __APPLE__
+		if (spawn(cmd, "-l", newpath, NULL, F_NORMAL)) {
+#elif defined(__FreeBSD__) || defined(__DragonFly__)
+		if (spawn(cmd, "-f", newpath, NULL, F_NORMAL)) {
+#else
+		if (spawn(cmd, "-quz", newpath, NULL, F_NORMAL)) {
+#endif
+			printwait(messages[MSG_FAILED], presel);
+			return FALSE;
+		}
 	}
 
-	return -1;
+	if (rmdir(newpath) == -1) {
+		printwarn(presel);
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
-static void resetdircolor(int flags)
+static void lock_terminal(void)
 {
-	/* Directories are always shown on top, clear the color when moving to first file */
-	if (g_state.dircolor && !(flags & DIR_OR_DIRLNK)) {
-		attroff(COLOR_PAIR(cfg.curctx + 1) | A_BOLD);
-		g_state.dircolor = 0;
-	}
+	spawn(xgetenv("NNN_LOCKER", utils[UTIL_LOCKER]), NULL, NULL, NULL, F_CLI);
 }
 
-/*
- * Replace escape characters in a string with '?'
- * Adjust string length to maxcols if > 0;
- * Max supported str length: NAME_MAX;
- */
-#ifdef NOLC
-static char *unescape(const char *str, uint_t maxcols)
+static void printkv(kv *kvarr, FILE *f, uchar_t max, uchar_t id)
 {
-	char * const wbuf = g_buf;
-	char *buf = wbuf;
+	char *val = (id == NNN_BMS) ? bmstr : pluginstr;
 
-	xstrsncpy(wbuf, str, maxcols);
-#else
-static wchar_t *unescape(const char *str, uint_t maxcols)
+	for (uchar_t i = 0; i < max && kvarr[i].key; ++i)
+		fprintf(f, " %c: %s\n", (char)kvarr[i].key, val + kvarr[i].off);
+}
+
+static void printkeys(kv *kvarr, char *buf, uchar_t max)
 {
-	wchar_t * const wbuf = (wchar_t *)g_buf;
-	wchar_t *buf = wbuf;
-	size_t len = mbstowcs(wbuf, str, maxcols); /* Convert multi-byte to wide char */
+	uchar_t i = 0;
 
-	len = wcswidth(wbuf, len);
+	for (; i < max && kvarr[i].key; ++i) {
+		buf[i << 1] = ' ';
+		buf[(i << 1) + 1] = kvarr[i].key;
+	}
 
-	if (len >= maxcols) {
-		size_t lencount = maxcols;
+	buf[i << 1] = '\0';
+}
 
-		while (len > maxcols) /* Reduce wide chars one by one till it fits */
-			len = wcswidth(wbuf, --lencount);
+static size_t handle_bookmark(const char *bmark, char *newpath)
+{
+	int fd = '\r';
+	size_t r;
 
-		wbuf[lencount] = L'\0';
+	if (maxbm || bmark) {
+		r = xstrsncpy(g_buf, messages[MSG_KEYS], CMD_LEN_MAX);
+
+		if (bmark) { /* There is a marked directory */
+			g_buf[--r] = ' ';
+			g_buf[++r] = ',';
+			g_buf[++r] = '\0';
+			++r;
+		}
+		printkeys(bookmark, g_buf + r - 1, maxbm);
+		printmsg(g_buf);
+		fd = get_input(NULL);
 	}
-#endif
 
-	while (*buf) {
-		if (*buf <= '\x1f' || *buf == '\x7f')
-			*buf = '\?';
+	r = FALSE;
+	if (fd == ',') /* Visit marked directory */
+		bmark ? xstrsncpy(newpath, bmark, PATH_MAX) : (r = MSG_NOT_SET);
+	else if (fd == '\r') { /* Visit bookmarks directory */
+		mkpath(cfgpath, toks[TOK_BM], newpath);
+		g_state.selbm = 1;
+	} else if (!get_kv_val(bookmark, newpath, fd, maxbm, NNN_BMS))
+		r = MSG_INVALID_KEY;
 
-		++buf;
+	if (!r && xchdir(newpath) == -1) {
+		r = MSG_ACCESS;
+		if (g_state.selbm)
+			g_state.selbm = 0;
 	}
 
-	return wbuf;
+	return r;
 }
 
-static off_t get_size(off_t size, off_t *pval, int comp)
+static void add_bookmark(char *path, char *newpath, int *presel)
 {
-	off_t rem = *pval;
-	off_t quo = rem / 10;
+	char *dir = xbasename(path);
 
-	if ((rem - (quo * 10)) >= 5) {
-		rem = quo + 1;
-		if (rem == comp) {
-			++size;
-			rem = 0;
-		}
-	} else
-		rem = quo;
+	dir = xreadline(dir[0] ? dir : NULL, messages[MSG_BM_NAME]);
+	if (dir && *dir) {
+		size_t r = mkpath(cfgpath, toks[TOK_BM], newpath);
 
-	*pval = rem;
-	return size;
+		newpath[r - 1] = '/';
+		xstrsncpy(newpath + r, dir, PATH_MAX - r);
+		printwait((symlink(path, newpath) == -1) ? strerror(errno) : newpath, presel);
+	} else
+		printwait(messages[MSG_CANCEL], presel);
 }
 
-static char *coolsize(off_t size)
+/*
+ * The help string tokens (each line) start with a HEX value which indicates
+ * the number of spaces to print before the particular token. In the middle,
+ * %NN can be used to insert a run of spaces, e.g %10 will print 10 spaces.
+ * %NN MUST be 2 characters long, e.g %05 for 5 spaces.
+ *
+ * This method was chosen instead of a flat string because the number of bytes
+ * in help was increasing the binary size by around a hundred bytes. This would
+ * only have increased as we keep adding new options.
+ */
+static void show_help(void)
 {
-	const char * const U = "BKMGTPEZY";
-	static char size_buf[12]; /* Buffer to hold human readable size */
-	off_t rem = 0;
-	size_t ret;
-	int i = 0;
-
-	while (size >= 1024) {
-		rem = size & (0x3FF); /* 1024 - 1 = 0x3FF */
-		size >>= 10;
-		++i;
-	}
+	static const char helpstr[] = {
+	"1NAVIGATION\n"
+	"bUp  Up%19PgUp  Page up\n"
+	"bDn  Down%17PgDn  Page down\n"
+	"bLt  Parent%12~ ` @ -  ~, /, start, prev\n"
+	"aRet  Open%20'  First file/match\n"
+	"9Home  Top%21j  Jump to entry/offset\n"
+	"aEnd  End%20^J  Toggle auto-advance on open\n"
+	"cB  Bookmark%16b  Select bookmark\n"
+	"a1-4  Context%11(Sh)Tab  Cycle/new context\n"
+	"62Esc ^Q  Quit%19^y  Next young\n"
+	"b^G  QuitCD%18Q  Pick/err, quit\n"
+	"cq  Quit context\n"
+	"0\n"
+	"1FILTER & PROMPT\n"
+	"c/  Filter%17^N  Toggle type-to-nav\n"
+	"aEsc  Exit prompt%12^L  Toggle last filter\n"
+	"c.  Toggle hidden%05Alt+Esc  Unfilter, quit context\n"
+	"0\n"
+	"1FILES\n"
+	"co  Open with%15n  Create new/link\n"
+	"cf  File stats%14d  Detail mode toggle\n"
+	"cr  Rename/dup%14R  Batch rename\n"
+	"cz  Archive%17e  Edit file\n"
+	"c*  Toggle exe%14>  Export list\n"
+	"4Space Del  (Un)select%12m-m  Select range/clear\n"
+	"ca  Select all%14A  Invert sel\n"
+	"cp  Copy here%15w  Cp/mv sel as\n"
+	"cv  Move here%15E  Edit sel list\n"
+	"cx  Delete or trash%09S  Listed sel size\n"
+	"cX  Delete (rm -rf)%07Esc  Send to FIFO\n"
+	"0\n"
+	"1MISC\n"
+	"8Alt ;  Select plugin%11=  Launch app\n"
+	"c!  Shell%19]  Cmd prompt\n"
+	"cc  Connect remote%10u  Unmount remote/archive\n"
+	"ct  Sort toggles%12s  Manage session\n"
+	"cT  Set time type%110  Lock\n"
+	"cD  Du breakdown%14i  Jobs\n"
+	"b^r  Redraw%18?  Help, conf\n"
+#ifndef NOPREVIEW
+	"cP  Preview pane\n"
+#endif
+	};
 
-	if (i == 1) {
-		rem = (rem * 1000) >> 10;
-		rem /= 10;
-		size = get_size(size, &rem, 10);
-	} else if (i == 2) {
-		rem = (rem * 1000) >> 10;
-		size = get_size(size, &rem, 100);
-	} else if (i > 2) {
-		rem = (rem * 10000) >> 10;
-		size = get_size(size, &rem, 1000);
+	int fd = create_tmp_file();
+	if (fd == -1)
+		return;
+	FILE *f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		unlink(g_tmpfpath);
+		return;
 	}
 
-	if (i > 0 && i < 6 && rem) {
-		ret = xstrsncpy(size_buf, xitoa(size), 12);
-		size_buf[ret - 1] = '.';
-
-		char *frac = xitoa(rem);
-		size_t toprint = i > 3 ? 3 : i;
-		size_t len = xstrlen(frac);
+	char *prog = xgetenv(env_cfg[NNN_HELP], NULL);
+	if (prog)
+		get_output(prog, NULL, NULL, fd, FALSE);
 
-		if (len < toprint) {
-			size_buf[ret] = size_buf[ret + 1] = size_buf[ret + 2] = '0';
-			xstrsncpy(size_buf + ret + (toprint - len), frac, len + 1);
-		} else
-			xstrsncpy(size_buf + ret, frac, toprint + 1);
+	bool hex = true;
+	const char *end = helpstr + sizeof(helpstr) - 1;
 
-		ret += toprint;
-	} else {
-		ret = xstrsncpy(size_buf, size ? xitoa(size) : "0", 12);
-		--ret;
+	for (const char *s = helpstr; s < end; ++s) {
+		if (hex) {
+			for (int k = 0, n = xchartohex(*s); k < n; ++k)
+				fputc(' ', f);
+		} else if (*s == '%') {
+			int n = ((s[1] - '0') * 10) + (s[2] - '0');
+			for (int k = 0; k < n; ++k)
+				fputc(' ', f);
+			s += 2;
+		} else {
+			fputc(*s, f);
+		}
+		hex = (*s == '\n');
 	}
 
-	size_buf[ret] = U[i];
-	size_buf[ret + 1] = '\0';
+#ifndef NOSSN
+	if (curssn[0])
+		fprintf(f, "\nSESSION: %s\n", curssn);
+#endif
 
-	return size_buf;
-}
+	fprintf(f, "\nCONTEXTS\n");
+	for (uchar_t i = 0; i < CTX_MAX; ++i)
+		if (g_ctx[i].c_cfg.ctxactive)
+			fprintf(f, " %u%c %s\n", i + 1, (cfg.curctx == i) ? '*' : ' ', g_ctx[i].c_path);
 
-/* Convert a mode field into "ls -l" type perms field. */
-static char *get_lsperms(mode_t mode)
-{
-	static const char * const rwx[] = {"---", "--x", "-w-", "-wx", "r--", "r-x", "rw-", "rwx"};
-	static char bits[11] = {'\0'};
+	if (bookmark) {
+		fprintf(f, "\nBOOKMARKS\n");
+		printkv(bookmark, f, maxbm, NNN_BMS);
+		fprintf(f, "\n");
+	}
 
-	switch (mode & S_IFMT) {
-	case S_IFREG:
-		bits[0] = '-';
-		break;
-	case S_IFDIR:
-		bits[0] = 'd';
-		break;
-	case S_IFLNK:
-		bits[0] = 'l';
-		break;
-	case S_IFSOCK:
-		bits[0] = 's';
-		break;
-	case S_IFIFO:
-		bits[0] = 'p';
-		break;
-	case S_IFBLK:
-		bits[0] = 'b';
-		break;
-	case S_IFCHR:
-		bits[0] = 'c';
-		break;
-	default:
-		bits[0] = '?';
-		break;
+	if (plug) {
+		fprintf(f, "\nPLUGIN KEYS\n");
+		printkv(plug, f, maxplug, NNN_PLUG);
+		fprintf(f, "\n");
 	}
 
-	xstrsncpy(&bits[1], rwx[(mode >> 6) & 7], 4);
-	xstrsncpy(&bits[4], rwx[(mode >> 3) & 7], 4);
-	xstrsncpy(&bits[7], rwx[(mode & 7)], 4);
+	for (uchar_t i = NNN_OPENER; i <= NNN_WORKERS; ++i) {
+		char *s = getenv(env_cfg[i]);
+		if (s)
+			fprintf(f, "%s: %s\n", env_cfg[i], s);
+	}
 
-	if (mode & S_ISUID)
-		bits[3] = (mode & 0100) ? 's' : 'S';  /* user executable */
-	if (mode & S_ISGID)
-		bits[6] = (mode & 0010) ? 's' : 'l';  /* group executable */
-	if (mode & S_ISVTX)
-		bits[9] = (mode & 0001) ? 't' : 'T';  /* others executable */
+	fclose(f); // also closes fd
 
-	return bits;
+	spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+	unlink(g_tmpfpath);
 }
 
-#ifdef ICONS_ENABLED
-static struct icon get_icon(const struct entry *ent)
+static void setexports(const char *path)
 {
-	for (size_t i = 0; i < ELEMENTS(icons_name); ++i)
-		if (strcasecmp(ent->name, icons_name[i].match) == 0)
-			return (struct icon){ icons_name[i].icon, icons_name[i].color };
+	char dvar[] = "d0";
+	char fvar[] = "f0";
 
-	if (ent->flags & DIR_OR_DIRLNK)
-        return (ent->mode & S_IFMT) & S_IFLNK ? dir_link_icon : dir_icon;
+	if (ndents) {
+		setenv(envs[ENV_NCUR], pdents[cur].name, 1);
+		xstrsncpy(g_ctx[cfg.curctx].c_name, pdents[cur].name, NAME_MAX + 1);
+	} else if (g_ctx[cfg.curctx].c_name[0])
+		g_ctx[cfg.curctx].c_name[0] = '\0';
 
-	char *tmp = xextension(ent->name, ent->nlen);
+	for (uchar_t i = 0; i < CTX_MAX; ++i) {
+		if (g_ctx[i].c_cfg.ctxactive) {
+			dvar[1] = fvar[1] = '1' + i;
+			setenv(dvar, g_ctx[i].c_path, 1);
 
-	if (tmp) {
-		uint16_t z, k, h = icon_ext_hash(++tmp); /* ++tmp to skip '.' */
-		for (k = 0; k < ICONS_PROBE_MAX; ++k) {
-			z = (h + k) % ELEMENTS(icons_ext);
-			if (strcasecmp(tmp, icons_ext[z].match) == 0)
-				return (struct icon){ icons_ext_uniq[icons_ext[z].idx], icons_ext[z].color };
+			if (g_ctx[i].c_name[0]) {
+				mkpath(g_ctx[i].c_path, g_ctx[i].c_name, g_buf);
+				setenv(fvar, g_buf, 1);
+			}
 		}
 	}
-
-	/* If there's no match and the file is executable, icon that */
-	if (ent->mode & 0100)
-		return exec_icon;
-
-    if ((ent->mode & S_IFMT) == S_IFREG)
-      return file_icon;
-    if ((ent->mode & S_IFMT) == S_IFLNK)
-      return file_link_icon;
-  	return file_icon;
+	setenv("NNN_INCLUDE_HIDDEN", xitoa(cfg.showhidden), 1);
+	setenv("NNN_PREFER_SELECTION", xitoa(cfg.prefersel), 1);
+	setenv("PWD", path, 1);
 }
 
-static void print_icon(const struct entry *ent, const int attrs, bool sel)
+static void run_cmd_as_plugin(const char *file, uchar_t flags)
 {
-  int color;
-  const struct icon icon = get_icon(ent);
-
-  if (icon.color != 255) {
-    color = icon.color + C_ICONS;
-    if (sel)
-      color += C_ICONS_MAX;
+	size_t len;
 
-    attron(COLOR_PAIR(color));
-  } else if (attrs)
-    attron(attrs);
+	xstrsncpy(g_buf, file, PATH_MAX);
 
-  addch(' ');
-  addstr(icon.icon);
-  addch(' ');
+	len = xstrlen(g_buf);
+	if (len > 1 && g_buf[len - 1] == '*') {
+		flags &= ~F_CONFIRM; /* Skip user confirmation */
+		g_buf[len - 1] = '\0'; /* Get rid of trailing no confirmation symbol */
+		--len;
+	}
 
-  if (icon.color != 255)
-    attroff(COLOR_PAIR(color));
-  else if (attrs)
-    attroff(attrs);
+	if (flags & F_PAGE)
+		get_output(utils[UTIL_SH_EXEC], g_buf, NULL, -1, TRUE);
+	else
+		spawn(utils[UTIL_SH_EXEC], g_buf, NULL, NULL, flags);
 }
-#endif // ICONS_ENABLED
 
-static void print_time(const time_t *timep, const uchar_t flags)
+static bool plctrl_init(void)
 {
-	struct tm t;
-
-	/* Highlight timestamp for entries 5 minutes young */
-	if (flags & FILE_YOUNG)
-		attron(A_REVERSE);
+	size_t len;
 
-	localtime_r(timep, &t);
-	printw("%s-%02d-%02d %02d:%02d",
-		xitoa(t.tm_year + 1900), t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min);
+	/* g_tmpfpath is used to generate tmp file names */
+	g_tmpfpath[tmpfplen - 1] = '\0';
+	len = xstrsncpy(g_pipepath, g_tmpfpath, TMP_LEN_MAX);
+	g_pipepath[len - 1] = '/';
+	len = xstrsncpy(g_pipepath + len, "nnn-pipe.", TMP_LEN_MAX - len) + len;
+	xstrsncpy(g_pipepath + len - 1, xitoa(getpid()), TMP_LEN_MAX - len);
+	setenv(env_cfg[NNN_PIPE], g_pipepath, TRUE);
 
-	if (flags & FILE_YOUNG)
-		attroff(A_REVERSE);
-}
+	/* Replies to queries in a batch, kept till exit */
+	len = xstrsncpy(g_replypath, g_tmpfpath, TMP_LEN_MAX);
+	g_replypath[len - 1] = '/';
+	len = xstrsncpy(g_replypath + len, "nnn-reply.", TMP_LEN_MAX - len) + len;
+	xstrsncpy(g_replypath + len - 1, xitoa(getpid()), TMP_LEN_MAX - len);
+	if (mkfifo(g_replypath, 0600) == 0)
+		setenv(env_cfg[NNN_REPLY], g_replypath, TRUE);
+	else
+		g_replypath[0] = '\0';
 
-static char get_detail_ind(const mode_t mode)
-{
-	switch (mode & S_IFMT) {
-	case S_IFDIR:  // fallthrough
-	case S_IFREG:  return ' ';
-	case S_IFLNK:  return '@';
-	case S_IFSOCK: return '=';
-	case S_IFIFO:  return '|';
-	case S_IFBLK:  return 'b';
-	case S_IFCHR:  return 'c';
-	}
-	return '?';
+	return EXIT_SUCCESS;
 }
 
-/* Note: attribute and indicator values must be initialized to 0 */
-static uchar_t get_color_pair_name_ind(const struct entry *ent, char *pind, int *pattr)
+static ssize_t read_nointr(int fd, void *buf, size_t count)
 {
-  if (ent->flags & FILE_MISSING)
-	  return C_MIS;
+	ssize_t len;
 
-	switch (ent->mode & S_IFMT) {
-	case S_IFREG:
-		if (!ent->size) {
-            *pattr |= A_ITALIC;
-			return C_FIL;
-		}
-		if (ent->flags & HARD_LINK)
-			return C_HRD;
-		if (ent->mode & 0100)
-			return C_EXE;
-		return C_FIL;
-	case S_IFDIR:
-		if (g_state.oldcolor)
-			return C_DIR;
-		*pattr |= A_BOLD;
-		return g_state.dirctx ? cfg.curctx + 1 : C_DIR;
-	case S_IFLNK:
-		if (ent->flags & DIR_OR_DIRLNK) {
-			*pattr |= g_state.oldcolor ? A_DIM : A_BOLD;
-		} else {
-			if (g_state.oldcolor)
-				*pattr |= A_DIM;
-		}
-		if (!g_state.oldcolor || cfg.showdetail)
-			return (ent->flags & SYM_ORPHAN) ? C_ORP : C_LNK;
-		return 0;
-	case S_IFSOCK:
-		*pind = '=';
-		return C_SOC;
-	case S_IFIFO:
-		*pind = '|';
-		return C_PIP;
-	case S_IFBLK:
-		return C_BLK;
-	case S_IFCHR:
-		return C_CHR;
-	}
+	do
+		len = read(fd, buf, count);
+	while (len == -1 && errno == EINTR);
 
-	*pind = '?';
-	return C_UND;
+	return len;
 }
 
-static void printent(int pdents_index, uint_t namecols, bool sel)
+/* Buffered reader of the plugin control pipe */
+typedef struct {
+	int fd;
+	uint_t pos;
+	uint_t end;
+	char buf[4096];
+} plug_reader;
+
+/* Copies n bytes from the pipe to dst, FALSE on a short read */
+static bool plug_read(plug_reader *rd, char *dst, size_t n)
 {
-	const struct entry *ent = &pdents[pdents_index];
-	char ind = '\0';
-	int attrs;
-    uchar_t color_pair;
+	size_t len;
+	ssize_t r;
 
-	if (cfg.showdetail) {
-		int type = ent->mode & S_IFMT;
-		char perms[6] = {' ', ' ', (char)('0' + ((ent->mode >> 6) & 7)),
-				(char)('0' + ((ent->mode >> 3) & 7)),
-				(char)('0' + (ent->mode & 7)), '\0'};
+	while (n) {
+		if (rd->pos == rd->end) {
+			r = read_nointr(rd->fd, rd->buf, sizeof(rd->buf));
+			if (r <= 0)
+				return FALSE;
+			rd->pos = 0;
+			rd->end = (uint_t)r;
+		}
 
-		addch(' ');
-		attrs = g_state.oldcolor ? (resetdircolor(ent->flags), A_DIM)
-					 : (fcolors[C_MIS] ? COLOR_PAIR(C_MIS) : 0);
-		if (attrs)
-			attron(attrs);
+		len = MIN(n, (size_t)(rd->end - rd->pos));
+		memcpy(dst, rd->buf + rd->pos, len);
+		rd->pos += len;
+		dst += len;
+		n -= len;
+	}
 
-		/* Print details */
-		print_time(&ent->sec, ent->flags);
+	return TRUE;
+}
 
-		printw("%s%9s ", perms, (type == S_IFREG || type == S_IFDIR)
-			? coolsize(cfg.blkorder ? (blkcnt_t)ent->blocks << blk_shift : ent->size)
-			: (type = (uchar_t)get_detail_ind(ent->mode), (char *)&type));
+/* Reads a message header "<op><len>:", returns the op or 0 */
+static char plug_header(plug_reader *rd, size_t *len)
+{
+	char op, c;
 
-		if (attrs)
-			attroff(attrs);
-	}
+	if (!plug_read(rd, &op, 1))
+		return 0;
 
-	if (g_state.showlines) {
-		ptrdiff_t rel_num = pdents_index - cur;
-		printw(rel_num == 0 ? "%4td" : "%+4td", rel_num);
+	for (*len = 0; plug_read(rd, &c, 1); *len = *len * 10 + (c - '0')) {
+		if (c == ':')
+			return op;
+		if (!xisdigit(c) || *len > PLUG_MSG_MAX / 10)
+			break;
 	}
 
-	attrs = 0;
-	color_pair = get_color_pair_name_ind(ent, &ind, &attrs);
-
-    if (ent->flags & FILE_SELECTED)
-#if defined(NERD)
-      addstr("");
-#else
-      addch('+' | A_REVERSE | A_BOLD);
-#endif
-    else
-      addch(' ');
+	return 0;
+}
 
-	if (g_state.oldcolor) {
-		resetdircolor(ent->flags);
-        if (sel)
-          attrs |= A_REVERSE;
-    }
-	else {
-		if (color_pair && fcolors[color_pair]) {
-            if (sel)
-              color_pair += C_FILES_MAX;
-			attrs |= COLOR_PAIR(color_pair);
-        } else if (sel)
-            attrs |= COLOR_PAIR(C_DEF_SEL);
+/* Writes the reply "<len>:<val>" to a query, dropped if there is no reader */
+static void plug_reply(int *fd, const char *key, const char *path)
+{
+	char buf[PATH_MAX + 16];
+	const char *val = "";
+	int len;
+
+	if (*fd == -1) {
+		*fd = g_replypath[0] ? open(g_replypath, O_WRONLY | O_NONBLOCK | O_CLOEXEC) : -1;
+		if (*fd == -1) {
+			*fd = -2; /* Do not retry in this batch */
+			return;
+		}
+	} else if (*fd < 0)
+		return;
 
-#ifdef ICONS_ENABLED
-		print_icon(ent, attrs, sel);
-#endif
+	if (!strcmp(key, "path"))
+		val = path;
+	else if (!strcmp(key, "ctx"))
+		val = xitoa(cfg.curctx + 1);
+	else if (!strcmp(key, "nsel"))
+		val = xitoa(nselected);
+	else if (!strcmp(key, "filter"))
+		val = g_ctx[cfg.curctx].c_fltr + 1;
+	else if (!strcmp(key, "list") && cfg.listview)
+		val = listroot;
+
+	len = snprintf(buf, sizeof(buf), "%zu:%s", xstrlen(val), val);
+	if (write(*fd, buf, len) != len) { /* Reader is gone or not reading */
+		close(*fd);
+		*fd = -2;
 	}
+}
 
-	if (attrs)
-		attron(attrs);
-	if (!ind)
-		++namecols;
+/* Adds an absolute path to the selection if it is not selected already */
+static void seladdpath(const char *path)
+{
+	size_t len = xstrsncpy(g_sel, path, PATH_MAX);
+	size_t dirlen = xbasename(g_sel) - g_sel;
+	int rec = selrec_find(g_sel, dirlen);
 
-#ifndef NOLC
-	addwstr(unescape(ent->name, namecols));
-#else
-	addstr(unescape(ent->name, MIN(namecols, ent->nlen) + 1));
-#endif
+	if (selidx_find(g_sel, len) >= 0
+	    || (rec >= 0 && selrec_has(&selrecs[rec], g_sel + dirlen, len - dirlen)))
+		return;
 
-    if (ind)
-		addch(ind);
-    addch(' ');
-	if (attrs)
-		attroff(attrs);
+	appendfpath(g_sel, len);
+	++nselected;
 }
 
-/**
- * Sets the global cfg variable and restores related state to match the new
- * cfg.
+/* A plugin control session, the ops that change the view are kept */
+typedef struct {
+	char *nextpath; /* Path to show */
+	char *pathbuf;  /* Holds the path of a c message */
+	char *fltr;     /* Filter to set, REGEX_MAX bytes */
+	char ctx;       /* Context to show the path in */
+	bool list;      /* A list is started in the session */
+} plug_session;
+
+/*
+ * Plugin control messages "<op><len>:<data>":
+ *
+ * x  context to show the path in: 0-CTX_MAX or +
+ * c  change to an absolute path
+ * l  list NUL-separated paths, the messages in a session form one list
+ * s  add NUL-separated absolute paths to the selection
+ * S  clear the selection
+ * f  set a filter
+ * r  refresh the dir
+ * p  files are picked, quit in picker mode
+ * q  query, handled by the caller
+ *
+ * The last c or l wins. data is NUL-terminated at len.
  */
-static void setcfg(settings newcfg)
+static void plug_msg(plug_session *ps, char op, char *data, size_t len, const char *path)
 {
-	cfg = newcfg;
-	/* Synchronize the global function pointers to match the new cfg. */
-	entrycmpfn = cfg.reverse ? &reventrycmp : &entrycmp;
-	namecmpfn = cfg.version ? &xstrverscasecmp : &xstricmp;
-	filterfn = cfg.regex ? &visible_re : &visible_str;
+	char *tmp;
+
+	switch (op) {
+	case 'x':
+		if (data[0] == '+')
+			ps->ctx = (char)(get_free_ctx() + 1);
+		else if (len == 1 && xisdigit(data[0]) && data[0] - '0' <= CTX_MAX)
+			ps->ctx = data[0] - '0';
+		break;
+	case 'c':
+		if (data[0] == '/' && len < PATH_MAX) {
+			xstrsncpy(ps->pathbuf, data, PATH_MAX);
+			while (--len && (ps->pathbuf[len] == '/')) /* Trim all trailing '/' */
+				ps->pathbuf[len] = '\0';
+			ps->nextpath = ps->pathbuf;
+		}
+		break;
+	case 'l':
+		if (!ps->list) {
+			list_free();
+			xstrsncpy(g_listrd.cwd, path, PATH_MAX);
+			ps->list = TRUE;
+		}
+
+		for (tmp = data; tmp < data + len; tmp += xstrlen(tmp) + 1)
+			list_inpath(tmp, xstrlen(tmp));
+		ps->nextpath = list_setroot() ? listroot : NULL;
+		break;
+	case 's':
+		for (tmp = data; tmp < data + len; tmp += xstrlen(tmp) + 1)
+			if (*tmp == '/')
+				seladdpath(tmp);
+		writesel();
+		g_state.plugrfsh = 1;
+		break;
+	case 'S':
+		clearselection();
+		g_state.plugrfsh = 1;
+		break;
+	case 'f':
+		ps->fltr[0] = cfg.regex ? RFILTER : FILTER;
+		xstrsncpy(ps->fltr + 1, data, REGEX_MAX - 1);
+		g_state.plugfltr = 1;
+		break;
+	case 'r':
+		g_state.plugrfsh = 1;
+		break;
+	case 'p':
+		free(selpath);
+		selpath = NULL;
+		clearselection();
+		g_state.picker = 0;
+		g_state.picked = 1;
+		break;
+	default: /* Skip unknown messages */
+		break;
+	}
 }
 
-static void savecurctx(char *path, char *curname, int nextctx)
+/* Runs a batch of messages following the "#<version>" header */
+static char *plug_batch(int fd, char *ctxnum, char **path, char *fltr)
 {
-	settings tmpcfg = cfg;
-	context *ctxr = &g_ctx[nextctx];
+	plug_reader rd = {.fd = fd};
+	plug_session ps = {.pathbuf = g_buf, .fltr = fltr};
+	char op, *data = NULL, *tmp;
+	size_t len;
+	int replyfd = -1;
 
-	/* Save current context */
-	if (curname)
-		xstrsncpy(g_ctx[tmpcfg.curctx].c_name, curname, NAME_MAX + 1);
-	else
-		g_ctx[tmpcfg.curctx].c_name[0] = '\0';
+	if (!plug_read(&rd, &op, 1) || op != PLUG_VERSION)
+		return NULL;
 
-	g_ctx[tmpcfg.curctx].c_cfg = tmpcfg;
+	while ((op = plug_header(&rd, &len))) {
+		tmp = xrealloc(data, len + 1);
+		if (!tmp)
+			break;
+		data = tmp;
 
-	if (ctxr->c_cfg.ctxactive) { /* Switch to saved context */
-		tmpcfg = ctxr->c_cfg;
-		/* Skip ordering an open context */
-		if (order) {
-			cfgsort[CTX_MAX] = cfgsort[nextctx];
-			cfgsort[nextctx] = '0';
-		}
-	} else { /* Set up a new context from current context */
-		ctxr->c_cfg.ctxactive = 1;
-		xstrsncpy(ctxr->c_path, path, PATH_MAX);
-		ctxr->c_last[0] = ctxr->c_name[0] = ctxr->c_fltr[0] = ctxr->c_fltr[1] = '\0';
-		ctxr->c_cfg = tmpcfg;
-		/* If already in an ordered dir, clear ordering for the new context and let it order */
-		if (cfgsort[cfg.curctx] == 'z')
-			cfgsort[nextctx] = 'z';
+		if (!plug_read(&rd, data, len))
+			break;
+		data[len] = '\0';
+
+		if (op == 'q')
+			plug_reply(&replyfd, data, *path);
+		else
+			plug_msg(&ps, op, data, len, *path);
 	}
 
-	tmpcfg.curctx = nextctx;
-	setcfg(tmpcfg);
+	free(data);
+	if (replyfd >= 0)
+		close(replyfd);
+
+	*ctxnum = ps.ctx;
+	return ps.nextpath;
 }
 
-#ifndef NOSSN
-static void save_session(const char *sname, int *presel)
+static char *readpipe(int fd, char *ctxnum, char **path, char *fltr)
 {
-	int fd, i;
-	session_header_t header = {0};
-	bool status = FALSE;
-	char ssnpath[PATH_MAX];
-	char spath[PATH_MAX];
+	char ctx, *nextpath = NULL;
 
-	header.ver = SESSIONS_VERSION;
+	if (read_nointr(fd, g_buf, 1) != 1)
+		return NULL;
 
-	for (i = 0; i < CTX_MAX; ++i) {
-		if (g_ctx[i].c_cfg.ctxactive) {
-			if (cfg.curctx == i && ndents)
-				/* Update current file name, arrows don't update it */
-				xstrsncpy(g_ctx[i].c_name, pdents[cur].name, NAME_MAX + 1);
-			header.pathln[i] = MIN(xstrlen(g_ctx[i].c_path), PATH_MAX) + 1;
-			header.lastln[i] = MIN(xstrlen(g_ctx[i].c_last), PATH_MAX) + 1;
-			header.nameln[i] = MIN(xstrlen(g_ctx[i].c_name), NAME_MAX) + 1;
-			header.fltrln[i] = REGEX_MAX;
+	if (g_buf[0] == '#') /* Batch of messages */
+		return plug_batch(fd, ctxnum, path, fltr);
+
+	if (g_buf[0] == '-') { /* Clear selection on '-' */
+		clearselection();
+		if (read_nointr(fd, g_buf, 1) != 1)
+			return NULL;
+	}
+
+	if (g_buf[0] == '+')
+		ctx = (char)(get_free_ctx() + 1);
+	else if (g_buf[0] < '0')
+		return NULL;
+	else {
+		ctx = g_buf[0] - '0';
+		if (ctx > CTX_MAX)
+			return NULL;
+	}
+
+	if (read_nointr(fd, g_buf, 1) != 1)
+		return NULL;
+
+	char op = g_buf[0];
+
+	if (op == 'c') {
+		ssize_t len = read_nointr(fd, g_buf, PATH_MAX);
+
+		if (len <= 0)
+			return NULL;
+
+		g_buf[len] = '\0'; /* Terminate the path read */
+		if (g_buf[0] == '/') {
+			nextpath = g_buf;
+			len = xstrlen(g_buf);
+			while (--len && (g_buf[len] == '/')) /* Trim all trailing '/' */
+				g_buf[len] = '\0';
 		}
+	} else if (op == 'l') {
+		nextpath = load_input(fd, *path);
+	} else if (op == 'p') {
+		free(selpath);
+		selpath = NULL;
+		clearselection();
+		g_state.picker = 0;
+		g_state.picked = 1;
 	}
 
-	mkpath(cfgpath, toks[TOK_SSN], ssnpath);
-	mkpath(ssnpath, sname, spath);
+	*ctxnum = ctx;
 
-	fd = open(spath, O_CREAT | O_WRONLY | O_TRUNC, S_IWUSR | S_IRUSR);
-	if (fd == -1) {
-		printwait(messages[MSG_SEL_MISSING], presel);
-		return;
+	return nextpath;
+}
+
+static bool run_plugin(char **path, const char *file, char *runfile, char **lastname, char **lastdir)
+{
+	pid_t p;
+	char ctx = 0;
+	char fltr[REGEX_MAX];
+	uchar_t flags = 0;
+	bool cmd_as_plugin = FALSE;
+	char *nextpath;
+
+	if (!g_state.pluginit) {
+		plctrl_init();
+		g_state.pluginit = 1;
 	}
 
-	if ((write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
-		|| (write(fd, &cfg, sizeof(cfg)) != (ssize_t)sizeof(cfg)))
-		goto END;
+	setexports(*path);
 
-	for (i = 0; i < CTX_MAX; ++i)
-		if ((write(fd, &g_ctx[i].c_cfg, sizeof(settings)) != (ssize_t)sizeof(settings))
-			|| (write(fd, &g_ctx[i].color, sizeof(uint_t)) != (ssize_t)sizeof(uint_t))
-			|| (header.nameln[i] > 0
-			    && write(fd, g_ctx[i].c_name, header.nameln[i]) != (ssize_t)header.nameln[i])
-			|| (header.lastln[i] > 0
-			    && write(fd, g_ctx[i].c_last, header.lastln[i]) != (ssize_t)header.lastln[i])
-			|| (header.fltrln[i] > 0
-			    && write(fd, g_ctx[i].c_fltr, header.fltrln[i]) != (ssize_t)header.fltrln[i])
-			|| (header.pathln[i] > 0
-			    && write(fd, g_ctx[i].c_path, header.pathln[i]) != (ssize_t)header.pathln[i]))
-			goto END;
+	/* Check for run-cmd-as-plugin mode */
+	if (*file == '!') {
+		flags = F_MULTI | F_CONFIRM;
+		++file;
+
+		if (*file == '|') { /* Check if output should be paged */
+			flags |= F_PAGE;
+			++file;
+		} else if (*file == '&') { /* Check if GUI flags are to be used */
+			flags = F_MULTI | F_NOTRACE | F_NOWAIT;
+			++file;
+		}
 
-	status = TRUE;
+		if (!*file)
+			return FALSE;
 
-END:
-	close(fd);
+		if ((flags & F_NOTRACE) || (flags & F_PAGE)) {
+			run_cmd_as_plugin(file, flags);
+			return TRUE;
+		}
 
-	if (!status)
-		printwait(messages[MSG_FAILED], presel);
-}
+		cmd_as_plugin = TRUE;
+	}
 
-static bool load_session(const char *sname, char **path, char **lastdir, char **lastname, bool restore)
-{
-	int fd, i = 0;
-	session_header_t header;
-	bool has_loaded_dynamically = !(sname || restore);
-	bool status = (sname && g_state.picker); /* Picker mode with session program option */
-	char ssnpath[PATH_MAX];
-	char spath[PATH_MAX];
+	if (mkfifo(g_pipepath, 0600) != 0)
+		return FALSE;
 
-	mkpath(cfgpath, toks[TOK_SSN], ssnpath);
+	exitcurses();
 
-	if (!restore) {
-		if (!sname || !sname[0])
-			sname = xreadline(NULL, messages[MSG_SSN_NAME]);
-		if (!sname[0])
-			return FALSE;
+	/*
+	 * A real fork: the child holds the write end until the plugin, which
+	 * it spawns, exits, so the reader gets EOF even if nothing is written.
+	 */
+	p = fork();
 
-		mkpath(ssnpath, sname, spath);
+	if (!p) { // In child
+		int wfd = open(g_pipepath, O_WRONLY | O_CLOEXEC);
 
-		/* If user is explicitly loading the "last session", skip auto-save */
-		if ((sname[0] == '@') && !sname[1])
-			has_loaded_dynamically = FALSE;
-	} else
-		mkpath(ssnpath, "@", spath);
+		if (wfd == -1)
+			_exit(EXIT_FAILURE);
 
-	if (has_loaded_dynamically)
-		save_session("@", NULL);
+		/* Restore sigpipe handler to default */
+		sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
 
-	fd = open(spath, O_RDONLY, S_IWUSR | S_IRUSR);
-	if (fd == -1) {
-		if (!status) {
-			printmsg(messages[MSG_SEL_MISSING]);
-			xdelay(XDELAY_INTERVAL_MS);
-		}
-		return FALSE;
-	}
+		if (!cmd_as_plugin) {
+			char *sel = NULL;
+			char std[2] = "-";
 
-	status = FALSE;
+			/* Generate absolute path to plugin */
+			mkpath(plgpath, file, g_buf);
 
-	if ((read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
-		|| (header.ver != SESSIONS_VERSION)
-		|| (read(fd, &cfg, sizeof(cfg)) != (ssize_t)sizeof(cfg)))
-		goto END;
+			if (g_state.picker)
+				sel = selpath ? selpath : std;
 
-	g_ctx[cfg.curctx].c_name[0] = g_ctx[cfg.curctx].c_last[0]
-		= g_ctx[cfg.curctx].c_fltr[0] = g_ctx[cfg.curctx].c_fltr[1] = '\0';
+			if (runfile && runfile[0]) {
+				xstrsncpy(*lastname, runfile, NAME_MAX);
+				spawn(g_buf, *lastname, *path, sel, 0);
+			} else
+				spawn(g_buf, NULL, *path, sel, 0);
+		} else
+			run_cmd_as_plugin(file, flags);
 
-	for (; i < CTX_MAX; ++i)
-		if ((read(fd, &g_ctx[i].c_cfg, sizeof(settings)) != (ssize_t)sizeof(settings))
-			|| (read(fd, &g_ctx[i].color, sizeof(uint_t)) != (ssize_t)sizeof(uint_t))
-			|| (header.nameln[i] > 0
-			    && read(fd, g_ctx[i].c_name, header.nameln[i]) != (ssize_t)header.nameln[i])
-			|| (header.lastln[i] > 0
-			    && read(fd, g_ctx[i].c_last, header.lastln[i]) != (ssize_t)header.lastln[i])
-			|| (header.fltrln[i] > 0
-			    && read(fd, g_ctx[i].c_fltr, header.fltrln[i]) != (ssize_t)header.fltrln[i])
-			|| (header.pathln[i] > 0
-			    && read(fd, g_ctx[i].c_path, header.pathln[i]) != (ssize_t)header.pathln[i]))
-			goto END;
+		close(wfd);
+		_exit(EXIT_SUCCESS);
+	}
 
-	*path = g_ctx[cfg.curctx].c_path;
-	*lastdir = g_ctx[cfg.curctx].c_last;
-	*lastname = g_ctx[cfg.curctx].c_name;
-	/* Set correct sort and filter options */
-	set_sort_flags('\0');
-	filterfn = cfg.regex ? &visible_re : &visible_str;
-	xstrsncpy(curssn, sname ? sname : "@", NAME_MAX);
-	status = TRUE;
+	int rfd;
 
-END:
-	close(fd);
+	do
+		rfd = open(g_pipepath, O_RDONLY);
+	while (rfd == -1 && errno == EINTR);
 
-	if (!status) {
-		printmsg(messages[MSG_FAILED]);
-		xdelay(XDELAY_INTERVAL_MS);
-	} else if (restore)
-		unlink(spath);
+	g_state.plugfltr = g_state.plugrfsh = 0;
+	nextpath = readpipe(rfd, &ctx, path, fltr);
+	if (nextpath)
+		set_smart_ctx(ctx, nextpath, path, runfile, lastname, lastdir);
 
-	return status;
-}
-#endif
+	/* Set after the context switch */
+	if (g_state.plugfltr)
+		memcpy(g_ctx[cfg.curctx].c_fltr, fltr, REGEX_MAX);
 
-static uchar_t get_free_ctx(void)
-{
-	uchar_t r = cfg.curctx;
+	close(rfd);
 
-	do
-		r = (r + 1) & ~CTX_MAX;
-	while (g_ctx[r].c_cfg.ctxactive && (r != cfg.curctx));
+	/* Leave a plugin streaming list input running, reaped when idle */
+	if (nextpath && nextpath == listroot && g_listrd.fd != -1 && ndetached < DETACHED_MAX)
+		detached[ndetached++] = p;
+	else /* wait for the child to finish. no zombies allowed */
+		waitpid(p, NULL, 0);
 
-	return r;
-}
+	refresh();
 
-/* ctx is absolute: 1 to 4, + for smart context */
-static void set_smart_ctx(int ctx, char *nextpath, char **path, char *file, char **lastname, char **lastdir)
-{
-	if (ctx == '+') /* Get smart context */
-		ctx = (int)(get_free_ctx() + 1);
+	unlink(g_pipepath);
 
-	if (ctx == 0 || ctx == cfg.curctx + 1) { /* Same context */
-		clearfilter();
-		xstrsncpy(*lastdir, *path, PATH_MAX);
-		xstrsncpy(*path, nextpath, PATH_MAX);
-	} else { /* New context */
-		--ctx;
-		/* Deactivate the new context and build from scratch */
-		g_ctx[ctx].c_cfg.ctxactive = 0;
-		DPRINTF_S(nextpath);
-		savecurctx(nextpath, file, ctx);
-		*path = g_ctx[ctx].c_path;
-		*lastdir = g_ctx[ctx].c_last;
-		*lastname = g_ctx[ctx].c_name;
-	}
+	return TRUE;
 }
 
-/*
- * This function does one of the following depending on the values of `fdout` and `page`:
- *  1) fdout == -1 && !page: Write up to CMD_LEN_MAX bytes of command output into g_buf
- *  2) fdout == -1 && page: Create a temp file, write full command output into it and show in pager.
- *  3) fdout != -1 && !page: Write full command output into the provided file.
- *  4) fdout != -1 && page: Don't use! Returns FALSE.
- *
- * g_buf is modified only in case 1.
- * g_tmpfpath is modified only in case 2.
- */
-static bool get_output(char *file, char *arg1, char *arg2, int fdout, bool page)
+/* Plugin run as a daemon, events go to its stdin, messages come from its stdout */
+typedef struct {
+	pid_t pid;
+	int evfd;        /* Non-blocking */
+	int msgfd;       /* Non-blocking */
+	uint_t outpos;   /* Bytes of the event in out written */
+	uint_t outlen;
+	uchar_t pending; /* Events to send, coalesced while the pipe is full */
+	bool started;    /* Version header read */
+	bool dead;       /* Ended after the poll, never while its messages are parsed */
+	size_t msglen;   /* Partial messages in msg */
+	size_t msgcap;
+	char *msg;
+	char out[PATH_MAX + 2];
+} plug_daemon;
+
+static plug_daemon daemons[DAEMON_MAX];
+static uint_t ndaemons;
+static char dmn_path[PATH_MAX];
+static char dmn_fltr[REGEX_MAX];
+static plug_session dmn_ses = {.pathbuf = dmn_path, .fltr = dmn_fltr};
+static bool dmn_pending; /* dmn_ses has ops for the browser */
+
+static void daemon_start(const char *name)
 {
+	plug_daemon *d = &daemons[ndaemons];
+	int evfds[2], msgfds[2];
 	pid_t pid;
-	int pipefd[2];
-	int index = 0, flags;
-	bool ret = FALSE;
-	bool have_file = fdout != -1;
-	int cmd_in_fd = -1;
-	int cmd_out_fd = -1;
-	ssize_t len;
 
-	/*
-	 * In this case the logic of the function dictates that we should write the output of the command
-	 * to `fd` and show it in the pager. But since we didn't open the file descriptor we have no right
-	 * to close it, the caller must do it. We don't even know the path to pass to the pager and
-	 * it's a real hassle to get it. In general this just invites problems so we are blocking it.
-	 */
-	if (have_file && page) {
-		DPRINTF_S("invalid get_ouptput() call");
-		return FALSE;
-	}
+	mkpath(plgpath, name, g_buf);
+	if (ndaemons == DAEMON_MAX || access(g_buf, X_OK))
+		return;
 
-	/* Setup file descriptors for child command */
-	if (!have_file && page) {
-		// Case 2
-		fdout = create_tmp_file();
-		if (fdout == -1)
-			return FALSE;
+	if (pipe(evfds) == -1)
+		return;
 
-		cmd_in_fd = STDIN_FILENO;
-		cmd_out_fd = fdout;
-	} else if (have_file) {
-		// Case 3
-		cmd_in_fd = STDIN_FILENO;
-		cmd_out_fd = fdout;
-	} else {
-		// Case 1
-		if (pipe(pipefd) == -1)
-			errexit();
+	if (pipe(msgfds) == -1) {
+		close(evfds[0]);
+		close(evfds[1]);
+		return;
+	}
 
-		for (index = 0; index < 2; ++index) {
-			/* Get previous flags */
-			flags = fcntl(pipefd[index], F_GETFL, 0);
+	/* Keep them from other children, the daemon gets dups */
+	for (int i = 0; i < 2; ++i) {
+		fcntl(evfds[i], F_SETFD, FD_CLOEXEC);
+		fcntl(msgfds[i], F_SETFD, FD_CLOEXEC);
+	}
 
-			/* Set bit for non-blocking flag */
-			flags |= O_NONBLOCK;
+	/* Off the terminal, stderr would garble the UI */
+	pid = xspawn((char *[]){g_buf, NULL}, F_NOWAIT | F_NOTRACE, evfds[0], msgfds[1]);
 
-			/* Change flags on fd */
-			fcntl(pipefd[index], F_SETFL, flags);
-		}
+	close(evfds[0]);
+	close(msgfds[1]);
 
-		cmd_in_fd = pipefd[0];
-		cmd_out_fd = pipefd[1];
+	if (pid == -1) {
+		close(evfds[1]);
+		close(msgfds[0]);
+		return;
 	}
 
-	pid = fork();
-	if (pid == 0) {
-		/* In child */
-		close(cmd_in_fd);
-		dup2(cmd_out_fd, STDOUT_FILENO);
-		dup2(cmd_out_fd, STDERR_FILENO);
-		close(cmd_out_fd);
-
-		spawn(file, arg1, arg2, NULL, F_MULTI);
-		_exit(EXIT_SUCCESS);
-	}
+	fcntl(evfds[1], F_SETFL, O_NONBLOCK);
+	fcntl(msgfds[0], F_SETFL, O_NONBLOCK);
 
-	/* In parent */
-	waitpid(pid, NULL, 0);
+	memset(d, 0, sizeof(*d));
+	d->pid = pid;
+	d->evfd = evfds[1];
+	d->msgfd = msgfds[0];
+	d->pending = DMN_EV_ALL;
+	++ndaemons;
+}
 
-	/* Do what each case should do */
-	if (!have_file && page) {
-		// Case 2
-		close(fdout);
+/* Starts the ;-separated plugins in NNN_DAEMON */
+static void daemon_init(void)
+{
+	char *env = getenv(env_cfg[NNN_DAEMON]), *names, *name, *next;
 
-		spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+	if (!env || !*env || !plgpath)
+		return;
 
-		unlink(g_tmpfpath);
-		return TRUE;
-	}
+	names = xstrdup(env);
+	if (!names)
+		return;
 
-	if (have_file)
-		// Case 3
-		return TRUE;
+	/* Get EPIPE when a daemon exits */
+	sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
 
-	// Case 1
-	len = read(pipefd[0], g_buf, CMD_LEN_MAX - 1);
-	if (len > 0)
-		ret = TRUE;
+	for (name = names; name; name = next) {
+		next = strchr(name, ';');
+		if (next)
+			*next++ = '\0';
+		if (*name)
+			daemon_start(name);
+	}
 
-	close(pipefd[0]);
-	close(pipefd[1]);
-	return ret;
+	free(names);
 }
 
-/*
- * Follows the stat(1) output closely
- */
-static bool show_stats(char *fpath)
-{
-	static char * const cmds[] = {
-#ifdef FILE_MIME_OPTS
-		("file " FILE_MIME_OPTS),
-#endif
-		"file -b",
-#if defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__) || defined(__DragonFly__)
-		"stat -x",
-#else
-		"stat",
-#endif
-	};
+static void daemon_end(uint_t i)
+{
+	plug_daemon *d = &daemons[i];
 
-	size_t r = ELEMENTS(cmds);
-	int fd = create_tmp_file();
-	if (fd == -1)
-		return FALSE;
+	close(d->evfd);
+	close(d->msgfd);
+	free(d->msg);
 
-	while (r)
-		get_output(cmds[--r], fpath, NULL, fd, FALSE);
+	kill(d->pid, SIGTERM);
+	if (waitpid(d->pid, NULL, WNOHANG) == 0 && ndetached < DETACHED_MAX)
+		detached[ndetached++] = d->pid;
 
-	close(fd);
+	daemons[i] = daemons[--ndaemons];
+}
 
-	spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
-	unlink(g_tmpfpath);
-	return TRUE;
+static void daemon_stop(void)
+{
+	while (ndaemons)
+		daemon_end(ndaemons - 1);
 }
 
-static bool xchmod(const char *fpath, mode_t *mode)
+/* Generates the next pending event "<type><data>\0" from the current state */
+static void daemon_fill(plug_daemon *d)
 {
-	/* (Un)set (S_IXUSR | S_IXGRP | S_IXOTH) */
-	(0100 & *mode) ? (*mode &= ~0111) : (*mode |= 0111);
+	const char *dir = g_ctx[cfg.curctx].c_path;
+	size_t len;
 
-	return (chmod(fpath, *mode) == 0);
+	if (d->pending & DMN_EV_CD) {
+		d->pending &= ~DMN_EV_CD;
+		d->out[0] = 'c';
+		len = xstrsncpy(d->out + 1, dir, PATH_MAX);
+	} else if (d->pending & DMN_EV_HOVER) {
+		d->pending &= ~DMN_EV_HOVER;
+		d->out[0] = 'h';
+		len = ndents ? mkpath(dir, pdents[cur].name, d->out + 1)
+			     : xstrsncpy(d->out + 1, dir, PATH_MAX);
+	} else {
+		d->pending &= ~DMN_EV_SEL;
+		d->out[0] = 's';
+		len = xstrsncpy(d->out + 1, xitoa(nselected), PATH_MAX);
+	}
+
+	d->outpos = 0;
+	d->outlen = (uint_t)len + 1;
 }
 
-static size_t get_fs_info(const char *path, uchar_t type)
+/* Writes pending events till the pipe is full, FALSE if the daemon is gone */
+static bool daemon_flush(plug_daemon *d)
 {
-	struct statvfs svb;
-
-	if (statvfs(path, &svb) == -1)
-		return 0;
+	ssize_t n;
 
-	if (type == VFS_AVAIL)
-		return (size_t)svb.f_bavail << ffs((int)(svb.f_frsize >> 1));
+	while (d->outpos < d->outlen || d->pending) {
+		if (d->outpos == d->outlen)
+			daemon_fill(d);
 
-	if (type == VFS_USED)
-		return ((size_t)svb.f_blocks - (size_t)svb.f_bfree) << ffs((int)(svb.f_frsize >> 1));
+		n = write(d->evfd, d->out + d->outpos, d->outlen - d->outpos);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR);
+		d->outpos += n;
+	}
 
-	return (size_t)svb.f_blocks << ffs((int)(svb.f_frsize >> 1)); /* VFS_SIZE */
+	return TRUE;
 }
 
-/* Create non-existent parents and a file or dir */
-static bool xmktree(char *path, bool dir)
+/* Queues events for the daemons, never blocks */
+static void daemon_event(uchar_t ev)
 {
-	char *p = path;
-	char *slash = path;
+	static char lastdir[PATH_MAX];
 
-	if (!p || !*p)
-		return FALSE;
+	if (!ndaemons)
+		return;
 
-	/* Skip the first '/' */
-	++p;
+	if ((ev & DMN_EV_HOVER) && strcmp(lastdir, g_ctx[cfg.curctx].c_path)) {
+		xstrsncpy(lastdir, g_ctx[cfg.curctx].c_path, PATH_MAX);
+		ev |= DMN_EV_CD;
+	}
 
-	while (*p != '\0') {
-		if (*p == '/') {
-			slash = p;
-			*p = '\0';
-		} else {
-			++p;
-			continue;
-		}
+	/* Sent from message handlers too, a daemon gone is only marked */
+	for (uint_t i = ndaemons; i--; ) {
+		daemons[i].pending |= ev;
+		if (!daemons[i].dead && !daemon_flush(&daemons[i]))
+			daemons[i].dead = TRUE;
+	}
+}
 
-		/* Create folder from path to '\0' inserted at p */
-		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
-#ifdef __HAIKU__
-			// XDG_CONFIG_HOME contains a directory
-			// that is read-only, but the full path
-			// is writeable.
-			// Try to continue and see what happens.
-			// TODO: Find a more robust solution.
-			if (errno == B_READ_ONLY_DEVICE)
-				goto next;
-#endif
-			DPRINTF_S("mkdir1!");
-			DPRINTF_S(strerror(errno));
-			*slash = '/';
-			return FALSE;
-		}
+/* Applies the complete messages read, FALSE if the daemon broke the protocol */
+static bool daemon_parse(plug_daemon *d)
+{
+	char *p, *data, *end = d->msg + d->msglen, c;
+	size_t len;
 
-#ifdef __HAIKU__
-next:
-#endif
-		/* Restore path */
-		*slash = '/';
-		++p;
+	p = d->msg;
+	if (!d->started) {
+		if (d->msglen < 2)
+			return TRUE;
+		if (p[0] != '#' || p[1] != PLUG_VERSION)
+			return FALSE;
+		d->started = TRUE;
+		p += 2;
 	}
 
-	if (dir) {
-		if (mkdir(path, 0777) == -1 && errno != EEXIST) {
-			DPRINTF_S("mkdir2!");
-			DPRINTF_S(strerror(errno));
-			return FALSE;
+	while (p < end) {
+		for (data = p + 1, len = 0; data < end && xisdigit(*data); ++data) {
+			len = len * 10 + (*data - '0');
+			if (len > PLUG_MSG_MAX)
+				return FALSE;
 		}
-	} else {
-		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR); /* Forced create mode for files */
 
-		if (fd == -1 && errno != EEXIST) {
-			DPRINTF_S("open!");
-			DPRINTF_S(strerror(errno));
+		if (data == end || (size_t)(end - data - 1) < len)
+			break; /* Incomplete */
+		if (*data != ':')
 			return FALSE;
-		}
 
-		close(fd);
+		/* Terminate in place, the byte after is the next op */
+		c = data[len + 1];
+		data[len + 1] = '\0';
+		if (*p == 'q') /* State events are the replies */
+			d->pending |= DMN_EV_ALL;
+		else {
+			plug_msg(&dmn_ses, *p, data + 1, len, g_ctx[cfg.curctx].c_path);
+			dmn_pending = TRUE;
+		}
+		data[len + 1] = c;
+		p = data + len + 1;
 	}
 
+	d->msglen = end - p;
+	memmove(d->msg, p, d->msglen);
 	return TRUE;
 }
 
-/* List or extract archive */
-static bool handle_archive(char *fpath /* in-out param */, char op)
+/* Reads the messages of a daemon, FALSE if it is gone */
+static bool daemon_read(plug_daemon *d)
 {
-	char arg[] = "-tvf"; /* options for tar/bsdtar to list files */
-	char *util, *outdir = NULL;
-	bool x_to = FALSE;
-	bool is_atool = (!g_state.usebsdtar && getutil(utils[UTIL_ATOOL]));
+	ssize_t n;
 
-	if (op == 'x') {
-		outdir = xreadline(is_atool ? "." : xbasename(fpath), messages[MSG_NEW_PATH]);
-		if (!outdir || !*outdir) { /* Cancelled */
-			printwait(messages[MSG_CANCEL], NULL);
-			return FALSE;
-		}
-		/* Do not create smart context for current dir */
-		if (!(*outdir == '.' && outdir[1] == '\0')) {
-			if (!xmktree(outdir, TRUE) || (chdir(outdir) == -1)) {
-				printwarn(NULL);
+	while (TRUE) {
+		if (d->msglen + 1 >= d->msgcap) { /* Room to terminate the data */
+			char *tmp;
+
+			if (d->msgcap > PLUG_MSG_MAX)
 				return FALSE;
-			}
-			/* Copy the new dir path to open it in smart context */
-			outdir = getcwd(NULL, 0); // NOLINT
-			x_to = TRUE;
+			tmp = xrealloc(d->msg, d->msgcap ? d->msgcap << 1 : 4096);
+			if (!tmp)
+				return FALSE;
+			d->msg = tmp;
+			d->msgcap = d->msgcap ? d->msgcap << 1 : 4096;
 		}
+
+		n = read(d->msgfd, d->msg + d->msglen, d->msgcap - d->msglen - 1);
+		if (n == 0)
+			return FALSE;
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR);
+
+		d->msglen += n;
+		if (!daemon_parse(d))
+			return FALSE;
 	}
+}
 
-	if (is_atool) {
-		util = utils[UTIL_ATOOL];
-		arg[1] = op;
-		arg[2] = '\0';
-	} else if (getutil(utils[UTIL_BSDTAR])) {
-		util = utils[UTIL_BSDTAR];
-		if (op == 'x')
-			arg[1] = op;
-	} else if (is_suffix(fpath, ".zip")) {
-		util = utils[UTIL_UNZIP];
-		arg[1] = (op == 'l') ? 'v' /* verbose listing */ : '\0';
-		arg[2] = '\0';
-	} else {
-		util = utils[UTIL_TAR];
-		if (op == 'x')
-			arg[1] = op;
+/* Services the daemons when idle, TRUE if they have ops for the browser */
+static bool daemon_poll(void)
+{
+	if (!dmn_pending) {
+		dmn_ses.nextpath = NULL;
+		dmn_ses.ctx = 0;
+		dmn_ses.list = FALSE;
+		g_state.plugfltr = g_state.plugrfsh = 0;
 	}
 
-	if (op == 'x') /* extract */
-		spawn(util, arg, fpath, NULL, F_NORMAL | F_MULTI);
-	else /* list */
-		get_output(util, arg, fpath, -1, TRUE);
+	for (uint_t i = ndaemons; i--; )
+		if (!daemons[i].dead && (!daemon_read(&daemons[i]) || !daemon_flush(&daemons[i])))
+			daemons[i].dead = TRUE;
 
-	if (x_to) {
-		if (chdir(xdirname(fpath)) == -1) {
-			printwarn(NULL);
-			free(outdir);
-			return FALSE;
-		}
-		xstrsncpy(fpath, outdir, PATH_MAX);
-		free(outdir);
-	} else if (op == 'x')
-		fpath[0] = '\0';
+	for (uint_t i = ndaemons; i--; )
+		if (daemons[i].dead)
+			daemon_end(i);
 
-	return TRUE;
+	return dmn_pending;
 }
 
-static char *visit_parent(char *path, char *newpath, int *presel)
+/* Shows the path or filter sent by a daemon */
+static void daemon_apply(char **path, char *file, char **lastname, char **lastdir)
 {
-	char *dir;
+	if (dmn_ses.nextpath)
+		set_smart_ctx(dmn_ses.ctx, dmn_ses.nextpath, path, file, lastname, lastdir);
 
-	/* There is no going back */
-	if (istopdir(path)) {
-		/* Continue in type-to-nav mode, if enabled */
-		if (cfg.filtermode && presel)
-			*presel = FILTER;
-		return NULL;
+	if (g_state.plugfltr)
+		memcpy(g_ctx[cfg.curctx].c_fltr, dmn_fltr, REGEX_MAX);
+
+	dmn_pending = FALSE;
+}
+
+static bool launch_app(char *newpath)
+{
+	int r = F_NORMAL;
+	char *tmp = newpath;
+
+	mkpath(plgpath, utils[UTIL_LAUNCH], newpath);
+
+	if (!getutil(utils[UTIL_FZF]) || access(newpath, X_OK) < 0) {
+		tmp = xreadline(NULL, messages[MSG_APP_NAME]);
+		r = F_NOWAIT | F_NOTRACE | F_MULTI;
 	}
 
-	/* Use a copy as xdirname() may change the string passed */
-	if (newpath)
-		xstrsncpy(newpath, path, PATH_MAX);
-	else
-		newpath = path;
+	if (tmp && *tmp) // NOLINT
+		spawn(tmp, (r == F_NORMAL) ? "0" : NULL, NULL, NULL, r);
+
+	return FALSE;
+}
+
+/* Returns TRUE if at least one command was run */
+static bool prompt_run(void)
+{
+	bool ret = FALSE;
+	char *cmdline, *next;
+	int cnt_j, cnt_J, cmd_ret;
+	size_t len;
+
+	const char *xargs_j = "xargs -0 -I{} %s < %s";
+	const char *xargs_J = "xargs -0 %s < %s";
+	char cmd[CMD_LEN_MAX + 32]; // 32 for xargs format strings
+
+
+	while (1) {
+		selcmdpos = INVALID_POS;
+#ifndef NORL
+		if (g_state.picker || g_state.xprompt) {
+#endif
+			cmdline = xreadline(NULL, PROMPT);
+#ifndef NORL
+		} else
+			cmdline = getreadline("\n"PROMPT);
+#endif
+		// Check for an empty command
+		if (!cmdline || !cmdline[0])
+			break;
+
+		addcmdtohist(cmdline);
+		ret = TRUE;
+		len = xstrlen(cmdline);
+
+		cnt_j = 0;
+		next = cmdline;
+		while ((next = strstr(next, "%j"))) {
+			++cnt_j;
+
+			// replace %j with {} for xargs later
+			next[0] = '{';
+			next[1] = '}';
+
+			++next;
+		}
+
+		cnt_J = 0;
+		next = cmdline;
+		while ((next = strstr(next, "%J"))) {
+			++cnt_J;
+
+			// %J should be the last thing in the command
+			if (next == cmdline + len - 2) {
+				cmdline[len - 2] = '\0';
+			}
+
+			++next;
+		}
+
+		// We can't handle both %j and %J in a single command
+		if (cnt_j && cnt_J)
+			break;
+
+		if (cnt_j)
+			snprintf(cmd, CMD_LEN_MAX + 32, xargs_j, cmdline, selpath);
+		else if (cnt_J)
+			snprintf(cmd, CMD_LEN_MAX + 32, xargs_J, cmdline, selpath);
+
+		cmd_ret = spawn(shell, "-c", (cnt_j || cnt_J) ? cmd : cmdline, NULL, F_CLI | F_CONFIRM);
+		if ((cnt_j || cnt_J) && cmd_ret == 0)
+			clearselection();
+	}
+
+	return ret;
+}
+
+static bool handle_cmd(enum action sel, char *path, char *newpath)
+{
+	endselection(FALSE);
+
+	if (sel == SEL_LAUNCH)
+		return launch_app(newpath);
 
-	dir = xdirname(newpath);
-	if (chdir(dir) == -1) {
-		printwarn(presel);
-		return NULL;
-	}
+	setexports(path);
 
-	return dir;
+	if (sel == SEL_PROMPT)
+		return prompt_run();
+
+	/* Set nnn nesting level */
+	char *tmp = getenv(env_cfg[NNNLVL]);
+	int r = tmp ? atoi(tmp) : 0;
+
+	setenv(env_cfg[NNNLVL], xitoa(r + 1), 1);
+	spawn(shell, NULL, NULL, NULL, F_CLI);
+	setenv(env_cfg[NNNLVL], xitoa(r), 1);
+	return TRUE;
 }
 
-static void valid_parent(char *path, char *lastname)
+static void dentfree(void)
 {
-	/* Save history */
-	xstrsncpy(lastname, xbasename(path), NAME_MAX + 1);
-
-	while (!istopdir(path))
-		if (visit_parent(path, NULL, NULL))
-			break;
+	free(pnamebuf);
+	free(pdents);
+	free(mark);
 
-	printwarn(NULL);
-	xdelay(XDELAY_INTERVAL_MS);
+	/* Thread data cleanup */
+	free(core_blocks);
+	free(core_data);
+	free(core_files);
+	free(core_brk);
 }
 
-static bool archive_mount(char *newpath)
+static du_ext *du_brk_slot(du_brk *brk, const char *ext)
 {
-	char *dir, *cmd = xgetenv("NNN_ARCHMNT", utils[UTIL_ARCHMNT]);
-	char *name = pdents[cur].name;
-	size_t len = pdents[cur].nlen;
-	char mntpath[PATH_MAX];
+	uint_t h = 5381, i, n;
 
-	if (!getutil(cmd)) {
-		printmsg("install utility");
-		return FALSE;
-	}
+	for (i = 0; ext[i]; ++i)
+		h = ((h << 5) + h) + (uchar_t)ext[i];
 
-	dir = xstrdup(name);
-	if (!dir) {
-		printmsg(messages[MSG_FAILED]);
-		return FALSE;
+	/* Linear probing, spill over to the catch-all slot when crowded */
+	for (n = 0, i = h & (DU_EXT_SLOTS - 1); n < DU_EXT_PROBE; ++n, i = (i + 1) & (DU_EXT_SLOTS - 1)) {
+		if (!brk->ext[i].ext[0]) {
+			xstrsncpy(brk->ext[i].ext, ext, DU_EXT_LEN);
+			return &brk->ext[i];
+		}
+
+		if (strcmp(brk->ext[i].ext, ext) == 0)
+			return &brk->ext[i];
 	}
 
-	while (len > 1)
-		if (dir[--len] == '.') {
-			dir[len] = '\0';
-			break;
-		}
+	return &brk->other;
+}
 
-	DPRINTF_S(dir);
+static void du_brk_add(du_brk *brk, const char *name, size_t len, time_t mtime, blkcnt_t blocks)
+{
+	static const time_t ages[DU_AGES - 1] = {86400, 86400 * 30, 86400 * 365};
+	char key[DU_EXT_LEN];
+	char *ext = xextension(name, len);
+	time_t age = gtimesecs - mtime;
+	du_ext *slot;
+	int i = 0;
 
-	/* Create the mount point */
-	mkpath(cfgpath, toks[TOK_MNT], mntpath);
-	mkpath(mntpath, dir, newpath);
-	free(dir);
+	while (i < DU_AGES - 1 && age >= ages[i])
+		++i;
 
-	if (!xmktree(newpath, TRUE)) {
-		printwarn(NULL);
-		return FALSE;
-	}
+	++brk->files[i];
+	brk->blocks[i] += blocks;
 
-	/* Mount archive */
-	DPRINTF_S(name);
-	DPRINTF_S(newpath);
-	if (spawn(cmd, name, newpath, NULL, F_NORMAL)) {
-		printmsg(messages[MSG_FAILED]);
-		return FALSE;
+	/* Dot files and names ending in '.' have no extension */
+	if (!ext || ext == name || !ext[1])
+		slot = &brk->noext;
+	else {
+		for (++ext, i = 0; ext[i] && i < DU_EXT_LEN - 1; ++i)
+			key[i] = (ext[i] >= 'A' && ext[i] <= 'Z') ? (ext[i] | 0x20) : ext[i];
+
+		if (ext[i])
+			slot = &brk->other;
+		else {
+			key[i] = '\0';
+			slot = du_brk_slot(brk, key);
+		}
 	}
 
-	return TRUE;
+	++slot->files;
+	slot->blocks += blocks;
 }
 
-static bool remote_mount(char *newpath)
+static void *du_thread(void *p_data)
 {
-	uchar_t flag = F_CLI;
-	int opt;
-	char *tmp, *env;
-	bool r = getutil(utils[UTIL_RCLONE]), s = getutil(utils[UTIL_SSHFS]);
-	char mntpath[PATH_MAX];
-
-	if (!(r || s)) {
-		printmsg("install sshfs/rclone");
-		return FALSE;
-	}
-
-	if (r && s)
-		opt = get_input(messages[MSG_REMOTE_OPTS]);
-	else
-		opt = (!s) ? 'r' : 's';
+	thread_data *pdata = (thread_data *)p_data;
+	char *path[2] = {pdata->path, NULL};
+	ullong_t tfiles = 0;
+	blkcnt_t tblocks = 0, blocks;
+	struct stat *sb;
+	du_brk *brk = pdata->mntpoint ? NULL : &core_brk[pdata->core];
+	FTS *tree = fts_open(path, FTS_PHYSICAL | FTS_XDEV | FTS_NOCHDIR, 0);
+	FTSENT *node;
 
-	if (opt == 's')
-		env = xgetenv("NNN_SSHFS", utils[UTIL_SSHFS]);
-	else if (opt == 'r') {
-		flag |= F_NOWAIT | F_NOTRACE;
-		env = xgetenv("NNN_RCLONE", "rclone mount");
-	} else {
-		printmsg(messages[MSG_INVALID_KEY]);
-		return FALSE;
-	}
+	while ((node = fts_read(tree))) {
+		if (node->fts_info & FTS_D) {
+			if (g_state.interrupt)
+				break;
+			continue;
+		}
 
-	tmp = xreadline(NULL, "host[:dir] > ");
-	if (!tmp[0]) {
-		printmsg(messages[MSG_CANCEL]);
-		return FALSE;
-	}
+		sb = node->fts_statp;
 
-	char *div = strchr(tmp, ':');
+		blocks = cfg.apparentsz ? sb->st_size : sb->st_blocks;
+		if (!(blocks && DU_TEST))
+			blocks = 0;
+		tblocks += blocks;
 
-	if (div)
-		*div = '\0';
+		if (brk && node->fts_info == FTS_F)
+			du_brk_add(brk, node->fts_name, node->fts_namelen, sb->st_mtime, blocks);
 
-	/* Create the mount point */
-	mkpath(cfgpath, toks[TOK_MNT], mntpath);
-	mkpath(mntpath, tmp, newpath);
-	if (!xmktree(newpath, TRUE)) {
-		printwarn(NULL);
-		return FALSE;
+		++tfiles;
 	}
 
-	if (!div) { /* Convert "host" to "host:" */
-		size_t len = xstrlen(tmp);
+	fts_close(tree);
 
-		tmp[len] = ':';
-		tmp[len + 1] = '\0';
+	if (pdata->entnum >= 0)
+		pdents[pdata->entnum].blocks = tblocks;
+
+	if (!pdata->mntpoint) {
+		core_blocks[pdata->core] += tblocks;
+		core_files[pdata->core] += tfiles;
 	} else
-		*div = ':';
+		core_files[pdata->core] += 1;
 
-	/* Connect to remote */
-	if (opt == 's') {
-		if (spawn(env, tmp, newpath, NULL, flag)) {
-			printmsg(messages[MSG_FAILED]);
-			return FALSE;
-		}
-	} else {
-		spawn(env, tmp, newpath, NULL, flag);
-		printmsg(messages[MSG_RCLONE_DELAY]);
-		xdelay(XDELAY_INTERVAL_MS << 2); /* Set 4 times the usual delay */
-	}
+	pthread_mutex_lock(&running_mutex);
+	threadbmp |= (1 << pdata->core);
+	--active_threads;
+	pthread_mutex_unlock(&running_mutex);
 
-	return TRUE;
+	return NULL;
 }
 
-/*
- * Unmounts if the directory represented by name is a mount point.
- * Otherwise, asks for hostname
- * Returns TRUE if directory needs to be refreshed *.
- */
-static bool unmount(char *name, char *newpath, int *presel, char *currentpath)
+static void dirwalk(char *path, int entnum, bool mountpoint)
 {
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
-	static char cmd[] = "umount";
-#else
-	static char cmd[] = "fusermount3"; /* Arch Linux utility */
-	static bool found = FALSE;
-#endif
-	char *tmp = name;
-	struct stat sb, psb;
-	bool child = FALSE;
-	bool parent = FALSE;
-	bool hovered = FALSE;
-	char mntpath[PATH_MAX];
+	/* Loop till any core is free */
+	while (active_threads == NUM_DU_THREADS);
 
-#if !defined(__APPLE__) && !defined(__FreeBSD__) && !defined(__DragonFly__)
-	/* On Ubuntu it's fusermount */
-	if (!found && !getutil(cmd)) {
-		cmd[10] = '\0';
-		found = TRUE;
-	}
-#endif
+	if (g_state.interrupt)
+		return;
 
-	mkpath(cfgpath, toks[TOK_MNT], mntpath);
+	pthread_mutex_lock(&running_mutex);
+	int core = ffs(threadbmp) - 1;
 
-	if (tmp && strcmp(mntpath, currentpath) == 0) {
-		mkpath(mntpath, tmp, newpath);
-		child = lstat(newpath, &sb) != -1;
-		parent = lstat(xdirname(newpath), &psb) != -1;
-		if (!child && !parent) {
-			*presel = MSGWAIT;
-			return FALSE;
-		}
-	}
+	threadbmp &= ~(1 << core);
+	++active_threads;
+	pthread_mutex_unlock(&running_mutex);
 
-	if (!tmp || !child || !S_ISDIR(sb.st_mode) || (child && parent && sb.st_dev == psb.st_dev)) {
-		tmp = xreadline(NULL, messages[MSG_HOSTNAME]);
-		if (!tmp[0])
-			return FALSE;
-		if (name && (tmp[0] == '-') && (tmp[1] == '\0')) {
-			mkpath(currentpath, name, newpath);
-			hovered = TRUE;
-		}
-	}
+	xstrsncpy(core_data[core].path, path, PATH_MAX);
+	core_data[core].entnum = entnum;
+	core_data[core].core = (ushort_t)core;
+	core_data[core].mntpoint = mountpoint;
 
-	if (!hovered)
-		mkpath(mntpath, tmp, newpath);
+	pthread_t tid = 0;
 
-	if (!xdiraccess(newpath)) {
-		*presel = MSGWAIT;
-		return FALSE;
-	}
+	pthread_create(&tid, NULL, du_thread, (void *)&(core_data[core]));
 
-#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__DragonFly__)
-	if (spawn(cmd, newpath, NULL, NULL, F_NORMAL)) {
-#else
-	if (spawn(cmd, "-qu", newpath, NULL, F_NORMAL)) {
-#endif
-		if (!xconfirm(get_input(messages[MSG_LAZY])))
-			return FALSE;
+	tolastln();
+	addstr(xbasename(path));
+	addstr(" [^C aborts]\n");
+	refresh();
+}
 
-#ifdef __APPLE__
-		if (spawn(cmd, "-l", newpath, NULL, F_NORMAL)) {
-#elif defined(__FreeBSD__) || defined(__DragonFly__)
-		if (spawn(cmd, "-f", newpath, NULL, F_NORMAL)) {
-#else
-		if (spawn(cmd, "-quz", newpath, NULL, F_NORMAL)) {
-#endif
-			printwait(messages[MSG_FAILED], presel);
-			return FALSE;
-		}
-	}
+static bool prep_threads(void)
+{
+	if (!g_state.duinit) {
+		/* drop MSB 1s */
+		threadbmp >>= (32 - NUM_DU_THREADS);
 
-	if (rmdir(newpath) == -1) {
-		printwarn(presel);
-		return FALSE;
-	}
+		if (!core_blocks)
+			core_blocks = calloc(NUM_DU_THREADS, sizeof(blkcnt_t));
+		if (!core_data)
+			core_data = calloc(NUM_DU_THREADS, sizeof(thread_data));
+		if (!core_files)
+			core_files = calloc(NUM_DU_THREADS, sizeof(ullong_t));
+		if (!core_brk)
+			core_brk = calloc(NUM_DU_THREADS + 1, sizeof(du_brk));
 
+		if (!core_blocks || !core_data || !core_files || !core_brk) {
+			printwarn(NULL);
+			return FALSE;
+		}
+#ifndef __APPLE__
+		/* Increase current open file descriptor limit */
+		max_openfds();
+#endif
+		g_state.duinit = TRUE;
+	} else {
+		memset(core_blocks, 0, NUM_DU_THREADS * sizeof(blkcnt_t));
+		memset(core_data, 0, NUM_DU_THREADS * sizeof(thread_data));
+		memset(core_files, 0, NUM_DU_THREADS * sizeof(ullong_t));
+		memset(core_brk, 0, (NUM_DU_THREADS + 1) * sizeof(du_brk));
+	}
 	return TRUE;
 }
 
-static void lock_terminal(void)
+static int du_ext_cmp(const void *va, const void *vb)
 {
-	spawn(xgetenv("NNN_LOCKER", utils[UTIL_LOCKER]), NULL, NULL, NULL, F_CLI);
-}
+	const du_ext *a = *(du_ext * const *)va, *b = *(du_ext * const *)vb;
 
-static void printkv(kv *kvarr, FILE *f, uchar_t max, uchar_t id)
-{
-	char *val = (id == NNN_BMS) ? bmstr : pluginstr;
+	if (a->blocks != b->blocks)
+		return (a->blocks < b->blocks) ? 1 : -1;
 
-	for (uchar_t i = 0; i < max && kvarr[i].key; ++i)
-		fprintf(f, " %c: %s\n", (char)kvarr[i].key, val + kvarr[i].off);
+	return (a->files < b->files) ? 1 : ((a->files > b->files) ? -1 : 0);
 }
 
-static void printkeys(kv *kvarr, char *buf, uchar_t max)
+static void du_ext_print(FILE *f, const char *ext, const du_ext *slot, blkcnt_t total)
 {
-	uchar_t i = 0;
+	fprintf(f, " %-15s %10llu %10s %3d%%\n", ext, slot->files,
+		coolsize(slot->blocks << blk_shift), total ? (int)(slot->blocks * 100 / total) : 0);
+}
 
-	for (; i < max && kvarr[i].key; ++i) {
-		buf[i << 1] = ' ';
-		buf[(i << 1) + 1] = kvarr[i].key;
+/*
+ * Summary of regular files by extension and age, collected
+ * by the last du walk of the current dir
+ */
+static bool show_dubrk(const char *path)
+{
+	static const char * const agestr[DU_AGES] = {"< 1 day", "< 30 days", "< 1 year", "older"};
+	du_ext *list[DU_EXT_SLOTS];
+	du_ext *slot;
+	du_brk *brk, *sum;
+	blkcnt_t total = 0;
+	int i, j, n = 0;
+
+	if (!core_brk) {
+		errno = ENODATA;
+		return FALSE;
 	}
 
-	buf[i << 1] = '\0';
-}
+	sum = calloc(1, sizeof(du_brk));
+	if (!sum)
+		return FALSE;
 
-static size_t handle_bookmark(const char *bmark, char *newpath)
-{
-	int fd = '\r';
-	size_t r;
+	for (i = 0, brk = core_brk; i <= NUM_DU_THREADS; ++i, ++brk) {
+		for (j = 0; j < DU_AGES; ++j) {
+			sum->files[j] += brk->files[j];
+			sum->blocks[j] += brk->blocks[j];
+		}
 
-	if (maxbm || bmark) {
-		r = xstrsncpy(g_buf, messages[MSG_KEYS], CMD_LEN_MAX);
+		sum->noext.files += brk->noext.files;
+		sum->noext.blocks += brk->noext.blocks;
+		sum->other.files += brk->other.files;
+		sum->other.blocks += brk->other.blocks;
 
-		if (bmark) { /* There is a marked directory */
-			g_buf[--r] = ' ';
-			g_buf[++r] = ',';
-			g_buf[++r] = '\0';
-			++r;
+		for (j = 0; j < DU_EXT_SLOTS; ++j) {
+			if (!brk->ext[j].ext[0])
+				continue;
+
+			slot = du_brk_slot(sum, brk->ext[j].ext);
+			slot->files += brk->ext[j].files;
+			slot->blocks += brk->ext[j].blocks;
 		}
-		printkeys(bookmark, g_buf + r - 1, maxbm);
-		printmsg(g_buf);
-		fd = get_input(NULL);
 	}
 
-	r = FALSE;
-	if (fd == ',') /* Visit marked directory */
-		bmark ? xstrsncpy(newpath, bmark, PATH_MAX) : (r = MSG_NOT_SET);
-	else if (fd == '\r') { /* Visit bookmarks directory */
-		mkpath(cfgpath, toks[TOK_BM], newpath);
-		g_state.selbm = 1;
-	} else if (!get_kv_val(bookmark, newpath, fd, maxbm, NNN_BMS))
-		r = MSG_INVALID_KEY;
+	for (j = 0; j < DU_EXT_SLOTS; ++j)
+		if (sum->ext[j].ext[0])
+			list[n++] = &sum->ext[j];
 
-	if (!r && chdir(newpath) == -1) {
-		r = MSG_ACCESS;
-		if (g_state.selbm)
-			g_state.selbm = 0;
+	qsort(list, n, sizeof(du_ext *), du_ext_cmp);
+
+	for (j = 0; j < DU_AGES; ++j)
+		total += sum->blocks[j];
+
+	int fd = create_tmp_file();
+	FILE *f = (fd == -1) ? NULL : fdopen(fd, "wb");
+
+	if (!f) {
+		if (fd != -1) {
+			close(fd);
+			unlink(g_tmpfpath);
+		}
+		free(sum);
+		return FALSE;
 	}
 
-	return r;
-}
+	fprintf(f, "%s usage of files in %s\n\n", cfg.apparentsz ? "Apparent" : "Disk", path);
 
-static void add_bookmark(char *path, char *newpath, int *presel)
-{
-	char *dir = xbasename(path);
+	fprintf(f, " %-15s %10s %10s %4s\n", "AGE", "FILES", "SIZE", "%");
+	for (j = 0; j < DU_AGES; ++j)
+		fprintf(f, " %-15s %10llu %10s %3d%%\n", agestr[j], sum->files[j],
+			coolsize(sum->blocks[j] << blk_shift),
+			total ? (int)(sum->blocks[j] * 100 / total) : 0);
 
-	dir = xreadline(dir[0] ? dir : NULL, messages[MSG_BM_NAME]);
-	if (dir && *dir) {
-		size_t r = mkpath(cfgpath, toks[TOK_BM], newpath);
+	fprintf(f, "\n %-15s %10s %10s %4s\n", "EXTENSION", "FILES", "SIZE", "%");
+	for (j = 0; j < n; ++j)
+		du_ext_print(f, list[j]->ext, list[j], total);
+	if (sum->noext.files)
+		du_ext_print(f, "(none)", &sum->noext, total);
+	if (sum->other.files)
+		du_ext_print(f, "(other)", &sum->other, total);
 
-		newpath[r - 1] = '/';
-		xstrsncpy(newpath + r, dir, PATH_MAX - r);
-		printwait((symlink(path, newpath) == -1) ? strerror(errno) : newpath, presel);
-	} else
-		printwait(messages[MSG_CANCEL], presel);
+	fclose(f); // also closes fd
+	free(sum);
+
+	spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
+	unlink(g_tmpfpath);
+	return TRUE;
+}
+
+static void dentsettime(struct entry *dentp, const struct stat *sb)
+{
+	if (cfg.timetype == T_MOD) {
+		dentp->sec = sb->st_mtime;
+#ifdef __APPLE__
+		dentp->nsec = (uint_t)sb->st_mtimespec.tv_nsec;
+#else
+		dentp->nsec = (uint_t)sb->st_mtim.tv_nsec;
+#endif
+	} else if (cfg.timetype == T_ACCESS) {
+		dentp->sec = sb->st_atime;
+#ifdef __APPLE__
+		dentp->nsec = (uint_t)sb->st_atimespec.tv_nsec;
+#else
+		dentp->nsec = (uint_t)sb->st_atim.tv_nsec;
+#endif
+	} else {
+		dentp->sec = sb->st_ctime;
+#ifdef __APPLE__
+		dentp->nsec = (uint_t)sb->st_ctimespec.tv_nsec;
+#else
+		dentp->nsec = (uint_t)sb->st_ctim.tv_nsec;
+#endif
+	}
 }
 
 /*
- * The help string tokens (each line) start with a HEX value which indicates
- * the number of spaces to print before the particular token. In the middle,
- * %NN can be used to insert a run of spaces, e.g %10 will print 10 spaces.
- * %NN MUST be 2 characters long, e.g %05 for 5 spaces.
+ * Virtual list mode
  *
- * This method was chosen instead of a flat string because the number of bytes
- * in help was increasing the binary size by around a hundred bytes. This would
- * only have increased as we keep adding new options.
+ * The input paths are kept in a prefix tree, one node per path component
+ * looked up by (parent, name) hash. The dirs from listroot down are shown
+ * from the tree in place of readdir(3). Only the entries of the dir shown
+ * are stat'ed, in threads for large dirs. Nothing is written to disk.
  */
-static void show_help(void)
+static inline uint_t list_slot(uint_t parent, const char *name, size_t len)
 {
-	static const char helpstr[] = {
-	"1NAVIGATION\n"
-	"bUp  Up%19PgUp  Page up\n"
-	"bDn  Down%17PgDn  Page down\n"
-	"bLt  Parent%12~ ` @ -  ~, /, start, prev\n"
-	"aRet  Open%20'  First file/match\n"
-	"9Home  Top%21j  Jump to entry/offset\n"
-	"aEnd  End%20^J  Toggle auto-advance on open\n"
-	"cB  Bookmark%16b  Select bookmark\n"
-	"a1-4  Context%11(Sh)Tab  Cycle/new context\n"
-	"62Esc ^Q  Quit%19^y  Next young\n"
-	"b^G  QuitCD%18Q  Pick/err, quit\n"
-	"cq  Quit context\n"
-	"0\n"
-	"1FILTER & PROMPT\n"
-	"c/  Filter%17^N  Toggle type-to-nav\n"
-	"aEsc  Exit prompt%12^L  Toggle last filter\n"
-	"c.  Toggle hidden%05Alt+Esc  Unfilter, quit context\n"
-	"0\n"
-	"1FILES\n"
-	"co  Open with%15n  Create new/link\n"
-	"cf  File stats%14d  Detail mode toggle\n"
-	"cr  Rename/dup%14R  Batch rename\n"
-	"cz  Archive%17e  Edit file\n"
-	"c*  Toggle exe%14>  Export list\n"
-	"4Space Del  (Un)select%12m-m  Select range/clear\n"
-	"ca  Select all%14A  Invert sel\n"
-	"cp  Copy here%15w  Cp/mv sel as\n"
-	"cv  Move here%15E  Edit sel list\n"
-	"cx  Delete or trash%09S  Listed sel size\n"
-	"cX  Delete (rm -rf)%07Esc  Send to FIFO\n"
-	"0\n"
-	"1MISC\n"
-	"8Alt ;  Select plugin%11=  Launch app\n"
-	"c!  Shell%19]  Cmd prompt\n"
-	"cc  Connect remote%10u  Unmount remote/archive\n"
-	"ct  Sort toggles%12s  Manage session\n"
-	"cT  Set time type%110  Lock\n"
-	"b^r  Redraw%18?  Help, conf\n"
-	};
-
-	int fd = create_tmp_file();
-	if (fd == -1)
-		return;
-	FILE *f = fdopen(fd, "wb");
-	if (f == NULL) {
-		close(fd);
-		unlink(g_tmpfpath);
-		return;
-	}
+	return (uint_t)selhash(SEL_HASH_INIT ^ parent, name, len) & (g_list.nslots - 1);
+}
 
-	char *prog = xgetenv(env_cfg[NNN_HELP], NULL);
-	if (prog)
-		get_output(prog, NULL, NULL, fd, FALSE);
+/* Child of parent named name as node + 1, 0 if none */
+static uint_t list_find(uint_t parent, const char *name, size_t len)
+{
+	const list_node *node;
+	uint_t k;
 
-	bool hex = true;
-	const char *end = helpstr + sizeof(helpstr) - 1;
+	if (!g_list.nslots)
+		return 0;
 
-	for (const char *s = helpstr; s < end; ++s) {
-		if (hex) {
-			for (int k = 0, n = xchartohex(*s); k < n; ++k)
-				fputc(' ', f);
-		} else if (*s == '%') {
-			int n = ((s[1] - '0') * 10) + (s[2] - '0');
-			for (int k = 0; k < n; ++k)
-				fputc(' ', f);
-			s += 2;
-		} else {
-			fputc(*s, f);
-		}
-		hex = (*s == '\n');
+	for (k = list_slot(parent, name, len); g_list.slots[k]; k = (k + 1) & (g_list.nslots - 1)) {
+		node = &g_list.nodes[g_list.slots[k] - 1];
+		if (node->parent == parent && node->len == len
+		    && !memcmp(g_list.names + node->name, name, len))
+			return g_list.slots[k];
 	}
 
-#ifndef NOSSN
-	if (curssn[0])
-		fprintf(f, "\nSESSION: %s\n", curssn);
-#endif
+	return 0;
+}
 
-	fprintf(f, "\nCONTEXTS\n");
-	for (uchar_t i = 0; i < CTX_MAX; ++i)
-		if (g_ctx[i].c_cfg.ctxactive)
-			fprintf(f, " %u%c %s\n", i + 1, (cfg.curctx == i) ? '*' : ' ', g_ctx[i].c_path);
+/* Room for one more node named with len chars */
+static bool list_grow(size_t len)
+{
+	const list_node *node;
+	uint_t i, k;
 
-	if (bookmark) {
-		fprintf(f, "\nBOOKMARKS\n");
-		printkv(bookmark, f, maxbm, NNN_BMS);
-		fprintf(f, "\n");
-	}
+	if (g_list.nnodes == g_list.cap) {
+		uint_t cap = g_list.cap ? g_list.cap << 1 : 1024;
+		list_node *nodes = xrealloc(g_list.nodes, cap * sizeof(list_node));
 
-	if (plug) {
-		fprintf(f, "\nPLUGIN KEYS\n");
-		printkv(plug, f, maxplug, NNN_PLUG);
-		fprintf(f, "\n");
+		if (!nodes)
+			return FALSE;
+		g_list.nodes = nodes;
+		g_list.cap = cap;
 	}
 
-	for (uchar_t i = NNN_OPENER; i <= NNN_TRASH; ++i) {
-		char *s = getenv(env_cfg[i]);
-		if (s)
-			fprintf(f, "%s: %s\n", env_cfg[i], s);
+	if (g_list.nameslen + len + 1 > g_list.namescap) {
+		size_t cap = (g_list.namescap + len + 1) << 1;
+		char *names = xrealloc(g_list.names, cap);
+
+		if (!names)
+			return FALSE;
+		g_list.names = names;
+		g_list.namescap = cap;
 	}
 
-	fclose(f); // also closes fd
+	if (((size_t)g_list.nnodes + 1) << 1 > g_list.nslots) {
+		uint_t *slots = calloc(g_list.nslots ? (size_t)g_list.nslots << 1 : 2048, sizeof(uint_t));
 
-	spawn(pager, g_tmpfpath, NULL, NULL, F_CLI | F_TTY);
-	unlink(g_tmpfpath);
+		if (!slots)
+			return FALSE;
+		free(g_list.slots);
+		g_list.slots = slots;
+		g_list.nslots = g_list.nslots ? g_list.nslots << 1 : 2048;
+
+		/* Rehash all but / */
+		for (i = 1; i < g_list.nnodes; ++i) {
+			node = &g_list.nodes[i];
+			for (k = list_slot(node->parent, g_list.names + node->name, node->len); slots[k];
+			     k = (k + 1) & (g_list.nslots - 1));
+			slots[k] = i + 1;
+		}
+	}
+
+	return TRUE;
 }
 
-static void setexports(const char *path)
+/* Add a child to parent, returns the node + 1 or 0 */
+static uint_t list_new(uint_t parent, const char *name, size_t len)
 {
-	char dvar[] = "d0";
-	char fvar[] = "f0";
+	list_node *node;
+	uint_t k;
 
-	if (ndents) {
-		setenv(envs[ENV_NCUR], pdents[cur].name, 1);
-		xstrsncpy(g_ctx[cfg.curctx].c_name, pdents[cur].name, NAME_MAX + 1);
-	} else if (g_ctx[cfg.curctx].c_name[0])
-		g_ctx[cfg.curctx].c_name[0] = '\0';
+	if (!list_grow(len))
+		return 0;
 
-	for (uchar_t i = 0; i < CTX_MAX; ++i) {
-		if (g_ctx[i].c_cfg.ctxactive) {
-			dvar[1] = fvar[1] = '1' + i;
-			setenv(dvar, g_ctx[i].c_path, 1);
+	node = &g_list.nodes[g_list.nnodes];
+	node->name = g_list.nameslen;
+	node->parent = parent;
+	node->child = node->next = 0;
+	node->len = (uchar_t)len;
+	node->flags = 0;
+	memcpy(g_list.names + g_list.nameslen, name, len);
+	g_list.names[g_list.nameslen + len] = '\0';
+	g_list.nameslen += len + 1;
+
+	if (g_list.nnodes) { /* / has no parent */
+		for (k = list_slot(parent, name, len); g_list.slots[k]; k = (k + 1) & (g_list.nslots - 1));
+		g_list.slots[k] = g_list.nnodes + 1;
+		node->next = g_list.nodes[parent].child;
+		g_list.nodes[parent].child = g_list.nnodes + 1;
+	}
 
-			if (g_ctx[i].c_name[0]) {
-				mkpath(g_ctx[i].c_path, g_ctx[i].c_name, g_buf);
-				setenv(fvar, g_buf, 1);
-			}
+	return ++g_list.nnodes;
+}
+
+/* Add an absolute path, the dirs leading to it become nodes too */
+static bool list_add(const char *path)
+{
+	uint_t node = 0, child;
+	size_t len;
+
+	if (!g_list.nnodes && !list_new(0, "", 0))
+		return FALSE;
+
+	while (*path) {
+		if (*path == '/') {
+			++path;
+			continue;
 		}
+
+		len = strcspn(path, "/");
+		if (len > NAME_MAX)
+			return TRUE;
+
+		child = list_find(node, path, len);
+		if (!child && !(child = list_new(node, path, len)))
+			return FALSE;
+
+		node = child - 1;
+		path += len;
 	}
-	setenv("NNN_INCLUDE_HIDDEN", xitoa(cfg.showhidden), 1);
-	setenv("NNN_PREFER_SELECTION", xitoa(cfg.prefersel), 1);
-	setenv("PWD", path, 1);
+
+	if (node && !(g_list.nodes[node].flags & LIST_INPUT)) {
+		g_list.nodes[node].flags |= LIST_INPUT;
+		++g_list.npaths;
+	}
+	return TRUE;
 }
 
-static void run_cmd_as_plugin(const char *file, uchar_t flags)
+/* Node + 1 of an absolute path, 0 if not in the tree */
+static uint_t list_lookup(const char *path)
 {
+	uint_t node = g_list.nnodes ? 1 : 0;
 	size_t len;
 
-	xstrsncpy(g_buf, file, PATH_MAX);
+	while (node && *path) {
+		if (*path == '/') {
+			++path;
+			continue;
+		}
 
-	len = xstrlen(g_buf);
-	if (len > 1 && g_buf[len - 1] == '*') {
-		flags &= ~F_CONFIRM; /* Skip user confirmation */
-		g_buf[len - 1] = '\0'; /* Get rid of trailing no confirmation symbol */
-		--len;
+		len = strcspn(path, "/");
+		node = list_find(node - 1, path, len);
+		path += len;
 	}
 
-	if (flags & F_PAGE)
-		get_output(utils[UTIL_SH_EXEC], g_buf, NULL, -1, TRUE);
-	else
-		spawn(utils[UTIL_SH_EXEC], g_buf, NULL, NULL, flags);
+	return node;
 }
 
-static bool plctrl_init(void)
+/* listroot or a dir under it with listed entries */
+static bool list_isdir(const char *path)
 {
 	size_t len;
+	uint_t node;
 
-	/* g_tmpfpath is used to generate tmp file names */
-	g_tmpfpath[tmpfplen - 1] = '\0';
-	len = xstrsncpy(g_pipepath, g_tmpfpath, TMP_LEN_MAX);
-	g_pipepath[len - 1] = '/';
-	len = xstrsncpy(g_pipepath + len, "nnn-pipe.", TMP_LEN_MAX - len) + len;
-	xstrsncpy(g_pipepath + len - 1, xitoa(getpid()), TMP_LEN_MAX - len);
-	setenv(env_cfg[NNN_PIPE], g_pipepath, TRUE);
+	if (!listroot)
+		return FALSE;
 
-	return EXIT_SUCCESS;
+	len = xstrlen(listroot);
+	if (len > 1 && (!is_prefix(path, listroot, len) || (path[len] && path[len] != '/')))
+		return FALSE;
+
+	node = list_lookup(path);
+	return node && g_list.nodes[node - 1].child;
 }
 
-static void rmlistpath(void)
+static void list_stop(void)
 {
-	if (listpath) {
-		DPRINTF_S(__func__);
-		DPRINTF_S(listpath);
-		spawn(utils[UTIL_RM_RF], listpath, NULL, NULL, F_NOTRACE | F_MULTI);
-		/* Do not free if program was started in list mode */
-		if (listpath != initpath)
-			free(listpath);
-		listpath = NULL;
-	}
+	if (g_listrd.fd != -1)
+		close(g_listrd.fd);
+	free(g_listrd.buf);
+	g_listrd.buf = NULL;
+	g_listrd.fd = -1;
 }
 
-static ssize_t read_nointr(int fd, void *buf, size_t count)
+static void list_free(void)
 {
-	ssize_t len;
-
-	do
-		len = read(fd, buf, count);
-	while (len == -1 && errno == EINTR);
-
-	return len;
+	list_stop();
+	free(g_list.nodes);
+	free(g_list.slots);
+	free(g_list.names);
+	memset(&g_list, 0, sizeof(list_tree));
+	free(listroot);
+	listroot = NULL;
 }
 
-static char *readpipe(int fd, char *ctxnum, char **path)
+/*
+ * Set listroot to the deepest dir all the paths are under. As more input
+ * is read it can only move up, to a prefix of the last one.
+ */
+static bool list_setroot(void)
 {
-	char ctx, *nextpath = NULL;
-
-	if (read_nointr(fd, g_buf, 1) != 1)
-		return NULL;
-
-	if (g_buf[0] == '-') { /* Clear selection on '-' */
-		clearselection();
-		if (read_nointr(fd, g_buf, 1) != 1)
-			return NULL;
-	}
+	const list_node *nodes = g_list.nodes;
+	uint_t node = 0, n;
+	size_t len = 0;
 
-	if (g_buf[0] == '+')
-		ctx = (char)(get_free_ctx() + 1);
-	else if (g_buf[0] < '0')
-		return NULL;
-	else {
-		ctx = g_buf[0] - '0';
-		if (ctx > CTX_MAX)
-			return NULL;
-	}
+	if (!g_list.nnodes || !nodes[0].child)
+		return FALSE;
 
-	if (read_nointr(fd, g_buf, 1) != 1)
-		return NULL;
+	while ((n = nodes[node].child) && !nodes[n - 1].next && !(nodes[n - 1].flags & LIST_INPUT))
+		node = n - 1;
 
-	char op = g_buf[0];
+	for (n = node; n; n = nodes[n].parent)
+		len += nodes[n].len + 1;
 
-	if (op == 'c') {
-		ssize_t len = read_nointr(fd, g_buf, PATH_MAX);
+	if (listroot) {
+		len = len ? len : 1;
+		if (listroot[len]) {
+			if (initpath && !strcmp(initpath, listroot))
+				initpath[len] = '\0';
+			listroot[len] = '\0';
+		}
+		return TRUE;
+	}
 
-		if (len <= 0)
-			return NULL;
+	listroot = malloc(len + 2);
+	if (!listroot)
+		return FALSE;
 
-		g_buf[len] = '\0'; /* Terminate the path read */
-		if (g_buf[0] == '/') {
-			nextpath = g_buf;
-			len = xstrlen(g_buf);
-			while (--len && (g_buf[len] == '/')) /* Trim all trailing '/' */
-				g_buf[len] = '\0';
-		}
-	} else if (op == 'l') {
-		rmlistpath(); /* Remove last list mode path, if any */
-		nextpath = load_input(fd, *path);
-	} else if (op == 'p') {
-		free(selpath);
-		selpath = NULL;
-		clearselection();
-		g_state.picker = 0;
-		g_state.picked = 1;
+	if (!len) {
+		xstrsncpy(listroot, "/", 2);
+		return TRUE;
 	}
 
-	*ctxnum = ctx;
+	listroot[len] = '\0';
+	for (n = node; n; n = nodes[n].parent) {
+		len -= nodes[n].len;
+		memcpy(listroot + len, g_list.names + nodes[n].name, nodes[n].len);
+		listroot[--len] = '/';
+	}
 
-	return nextpath;
+	return TRUE;
 }
 
-static bool run_plugin(char **path, const char *file, char *runfile, char **lastname, char **lastdir)
+static void list_statent(int fd, struct entry *dentp)
 {
-	pid_t p;
-	char ctx = 0;
-	uchar_t flags = 0;
-	bool cmd_as_plugin = FALSE;
-	char *nextpath;
+	struct stat sb;
 
-	if (!g_state.pluginit) {
-		plctrl_init();
-		g_state.pluginit = 1;
+	dentp->flags = 0;
+	if (fstatat(fd, dentp->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+		memset(&sb, 0, sizeof(struct stat));
+		dentp->flags = FILE_MISSING;
 	}
 
-	setexports(*path);
-
-	/* Check for run-cmd-as-plugin mode */
-	if (*file == '!') {
-		flags = F_MULTI | F_CONFIRM;
-		++file;
-
-		if (*file == '|') { /* Check if output should be paged */
-			flags |= F_PAGE;
-			++file;
-		} else if (*file == '&') { /* Check if GUI flags are to be used */
-			flags = F_MULTI | F_NOTRACE | F_NOWAIT;
-			++file;
-		}
+	dentsettime(dentp, &sb);
+	if ((gtimesecs - sb.st_mtime <= 300) || (gtimesecs - sb.st_ctime <= 300))
+		dentp->flags |= FILE_YOUNG;
 
-		if (!*file)
-			return FALSE;
+	dentp->mode = sb.st_mode;
+	dentp->size = sb.st_size;
+	dentp->blocks = cfg.apparentsz ? sb.st_size : sb.st_blocks;
+#ifndef NOUG
+	dentp->uid = sb.st_uid;
+	dentp->gid = sb.st_gid;
+#endif
 
-		if ((flags & F_NOTRACE) || (flags & F_PAGE)) {
-			run_cmd_as_plugin(file, flags);
-			return TRUE;
-		}
+	if (!S_ISDIR(sb.st_mode) && sb.st_nlink > 1)
+		dentp->flags |= HARD_LINK;
 
-		cmd_as_plugin = TRUE;
+	if (S_ISLNK(sb.st_mode) && fstatat(fd, dentp->name, &sb, 0) == -1) {
+		dentp->flags |= SYM_ORPHAN;
+		return;
 	}
 
-	if (mkfifo(g_pipepath, 0600) != 0)
-		return FALSE;
-
-	exitcurses();
+	if (S_ISDIR(sb.st_mode))
+		dentp->flags |= DIR_OR_DIRLNK;
+}
 
-	p = fork();
+static void *list_statrange(void *arg)
+{
+	list_stat_t *job = (list_stat_t *)arg;
 
-	if (!p) { // In child
-		int wfd = open(g_pipepath, O_WRONLY | O_CLOEXEC);
+	for (int i = 0; i < job->n; ++i)
+		list_statent(job->fd, job->ents + i);
 
-		if (wfd == -1)
-			_exit(EXIT_FAILURE);
+	return NULL;
+}
 
-		/* Restore sigpipe handler to default */
-		sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_DFL}, NULL);
+/* Stat the entries split among NUM_DU_THREADS threads if there are many */
+static void list_statall(int fd, struct entry *ents, int n)
+{
+	pthread_t tid[NUM_DU_THREADS];
+	bool started[NUM_DU_THREADS] = {FALSE};
+	list_stat_t jobs[NUM_DU_THREADS];
+	int i, nthreads = (n >= LIST_STAT_MIN) ? NUM_DU_THREADS : 1, chunk = (n + nthreads - 1) / nthreads;
+
+	for (i = 0; i < nthreads; ++i) {
+		jobs[i].ents = ents + i * chunk;
+		jobs[i].n = MIN(chunk, n - i * chunk);
+		jobs[i].fd = fd;
+		if (i && jobs[i].n > 0)
+			started[i] = !pthread_create(&tid[i], NULL, list_statrange, &jobs[i]);
+	}
 
-		if (!cmd_as_plugin) {
-			char *sel = NULL;
-			char std[2] = "-";
+	for (i = 0; i < nthreads; ++i) {
+		if (started[i])
+			pthread_join(tid[i], NULL);
+		else if (jobs[i].n > 0)
+			list_statrange(&jobs[i]);
+	}
+}
 
-			/* Generate absolute path to plugin */
-			mkpath(plgpath, file, g_buf);
+/* Fill the listing from the children of the dir in the tree */
+static int list_fill(const char *path, struct entry **ppdents)
+{
+	size_t off = 0, namebuflen = NAMEBUF_INCR;
+	const list_node *node;
+	uint_t i = list_lookup(path);
+	int fd = i ? open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
 
-			if (g_state.picker)
-				sel = selpath ? selpath : std;
+	if (fd == -1)
+		return 0;
 
-			if (runfile && runfile[0]) {
-				xstrsncpy(*lastname, runfile, NAME_MAX);
-				spawn(g_buf, *lastname, *path, sel, 0);
-			} else
-				spawn(g_buf, NULL, *path, sel, 0);
-		} else
-			run_cmd_as_plugin(file, flags);
+	for (i = g_list.nodes[i - 1].child; i; i = node->next) {
+		node = &g_list.nodes[i - 1];
+		if (!cfg.showhidden && g_list.names[node->name] == '.')
+			continue;
 
-		close(wfd);
-		_exit(EXIT_SUCCESS);
+		dentadd(ppdents, g_list.names + node->name, node->len, &off, &namebuflen);
+		++ndents;
 	}
 
-	int rfd;
-
-	do
-		rfd = open(g_pipepath, O_RDONLY);
-	while (rfd == -1 && errno == EINTR);
-
-	nextpath = readpipe(rfd, &ctx, path);
-	if (nextpath)
-		set_smart_ctx(ctx, nextpath, path, runfile, lastname, lastdir);
-
-	close(rfd);
+	list_statall(fd, *ppdents, ndents);
+	close(fd);
 
-	/* wait for the child to finish. no zombies allowed */
-	waitpid(p, NULL, 0);
+	if (cfg.blkorder) {
+		num_files = 0;
+		dir_blocks = 0;
+		for (int r = 0; r < ndents; ++r) {
+			if (!((*ppdents)[r].flags & DIR_OR_DIRLNK)) {
+				dir_blocks += (*ppdents)[r].blocks;
+				++num_files;
+			}
+		}
+	}
 
-	refresh();
+	return ndents;
+}
 
-	unlink(g_pipepath);
+#ifdef GITSTATUS
+/* An entry of the git index, the path is at off in the map or the pool */
+typedef struct {
+	uint_t off;
+	uint_t sec;
+	uint_t nsec;
+	uint_t ino;
+	uint_t size;
+	uint_t mode;
+	ushort_t flags; /* GIT_* */
+} git_ent;
+
+#define GIT_SKIP  0x01 /* Assume unchanged or not checked out */
+#define GIT_STAGE 0x02 /* Merge conflict */
+
+/* A repository with its index, reloaded if the index changes */
+typedef struct {
+	char root[PATH_MAX]; /* Work tree with a trailing '/' */
+	size_t rootlen;
+	dev_t idev;
+	ino_t iino;
+	off_t isize;
+	struct timespec imtim;
+	char *map;
+	size_t maplen;
+	char *pool; /* Paths of an index of version 4 */
+	const char *paths;
+	git_ent *ents;
+	uint_t nents;
+	struct timespec ignmtim[2]; /* .gitignore and info/exclude */
+	char *ign;
+	size_t ignlen;
+	uint_t used;
+} git_repo;
+
+static git_repo *g_repos[GIT_CACHE];
+static uint_t g_repoclock;
+
+/* State of the dir being listed */
+static struct {
+	git_repo *repo;
+	char rel[PATH_MAX]; /* Path in the work tree with a trailing '/' */
+	size_t rellen;
+	uint_t lo, hi; /* Index entries under rel */
+	bool ignored;  /* Untracked and ignored */
+	char *ign;     /* .gitignore of the dir */
+	size_t ignlen;
+} g_git;
+
+static inline uint_t git_be32(const uchar_t *p)
+{
+	return ((uint_t)p[0] << 24) | ((uint_t)p[1] << 16) | ((uint_t)p[2] << 8) | p[3];
+}
 
-	return TRUE;
+static void git_unload(git_repo *r)
+{
+	if (r->map)
+		munmap(r->map, r->maplen);
+	free(r->pool);
+	free(r->ents);
+	r->map = r->pool = NULL;
+	r->paths = NULL;
+	r->ents = NULL;
+	r->nents = 0;
 }
 
-static bool launch_app(char *newpath)
+/* Parses an index of version 2, 3 or 4, paths of the earlier versions stay in the map */
+static bool git_readindex(git_repo *r, int fd, size_t len)
 {
-	int r = F_NORMAL;
-	char *tmp = newpath;
+	const uchar_t *p, *end, *name;
+	size_t nlen, keep, poolcap = 0, poollen = 0, prevoff = 0, prevlen = 0;
+	uint_t ver, n, i, flags, hdr, strip;
+	uchar_t c;
 
-	mkpath(plgpath, utils[UTIL_LAUNCH], newpath);
+	if (len < 12)
+		return FALSE;
 
-	if (!getutil(utils[UTIL_FZF]) || access(newpath, X_OK) < 0) {
-		tmp = xreadline(NULL, messages[MSG_APP_NAME]);
-		r = F_NOWAIT | F_NOTRACE | F_MULTI;
+	r->map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (r->map == MAP_FAILED) {
+		r->map = NULL;
+		return FALSE;
 	}
+	r->maplen = len;
 
-	if (tmp && *tmp) // NOLINT
-		spawn(tmp, (r == F_NORMAL) ? "0" : NULL, NULL, NULL, r);
+	p = (uchar_t *)r->map;
+	end = p + len;
+	ver = git_be32(p + 4);
+	n = git_be32(p + 8);
+	if (memcmp(p, "DIRC", 4) || ver < 2 || ver > 4 || n > len / 62)
+		return FALSE;
 
-	return FALSE;
-}
+	r->ents = malloc(((size_t)n + 1) * sizeof(git_ent));
+	if (!r->ents)
+		return FALSE;
 
-/* Returns TRUE if at least one command was run */
-static bool prompt_run(void)
-{
-	bool ret = FALSE;
-	char *cmdline, *next;
-	int cnt_j, cnt_J, cmd_ret;
-	size_t len;
+	r->paths = r->map;
+	for (p += 12, i = 0; i < n; ++i) {
+		if (end - p < 63)
+			return FALSE;
 
-	const char *xargs_j = "xargs -0 -I{} %s < %s";
-	const char *xargs_J = "xargs -0 %s < %s";
-	char cmd[CMD_LEN_MAX + 32]; // 32 for xargs format strings
+		flags = ((uint_t)p[60] << 8) | p[61];
+		hdr = (ver >= 3 && (flags & 0x4000)) ? 64 : 62;
+		name = p + hdr;
+		if (name >= end)
+			return FALSE;
 
+		r->ents[i].sec = git_be32(p + 8);
+		r->ents[i].nsec = git_be32(p + 12);
+		r->ents[i].ino = git_be32(p + 20);
+		r->ents[i].mode = git_be32(p + 24);
+		r->ents[i].size = git_be32(p + 36);
+		r->ents[i].flags = ((flags & 0x8000) || (hdr == 64 && (p[62] & 0x40))) ? GIT_SKIP : 0;
+		if (flags & 0x3000)
+			r->ents[i].flags |= GIT_STAGE;
+
+		if (ver < 4) {
+			nlen = strnlen((char *)name, end - name);
+			if (name + nlen == end)
+				return FALSE;
+			r->ents[i].off = (uint_t)(name - (uchar_t *)r->map);
+			/* Entries are padded to 8 bytes */
+			p += (hdr + nlen + 8) & ~7;
+			continue;
+		}
 
-	while (1) {
-		selcmdpos = INVALID_POS;
-#ifndef NORL
-		if (g_state.picker || g_state.xprompt) {
-#endif
-			cmdline = xreadline(NULL, PROMPT);
-#ifndef NORL
-		} else
-			cmdline = getreadline("\n"PROMPT);
-#endif
-		// Check for an empty command
-		if (!cmdline || !cmdline[0])
-			break;
+		/* The path drops strip bytes of the previous one and adds a suffix */
+		c = *name++;
+		for (strip = c & 0x7f; (c & 0x80) && name < end;) {
+			c = *name++;
+			strip = ((strip + 1) << 7) | (c & 0x7f);
+		}
+		nlen = (name < end) ? strnlen((char *)name, end - name) : 0;
+		if (name + nlen >= end || strip > prevlen)
+			return FALSE;
 
-		addcmdtohist(cmdline);
-		ret = TRUE;
-		len = xstrlen(cmdline);
+		keep = prevlen - strip;
+		if (poolcap - poollen < keep + nlen + 1) {
+			char *tmp;
 
-		cnt_j = 0;
-		next = cmdline;
-		while ((next = strstr(next, "%j"))) {
-			++cnt_j;
+			poolcap = (poolcap << 1) + keep + nlen + PATH_MAX;
+			tmp = xrealloc(r->pool, poolcap);
+			if (!tmp)
+				return FALSE;
+			r->pool = tmp;
+		}
+		memmove(r->pool + poollen, r->pool + prevoff, keep);
+		memcpy(r->pool + poollen + keep, name, nlen + 1);
+		r->ents[i].off = (uint_t)poollen;
+		prevoff = poollen;
+		prevlen = keep + nlen;
+		poollen += prevlen + 1;
+		p = name + nlen + 1;
+	}
 
-			// replace %j with {} for xargs later
-			next[0] = '{';
-			next[1] = '}';
+	if (ver == 4) {
+		r->paths = r->pool;
+		munmap(r->map, r->maplen);
+		r->map = NULL;
+	}
+	r->nents = n;
+	return TRUE;
+}
+
+/* Reads ignore patterns, each stored as GIT_IGN_* flags, the pattern and a NUL */
+#define GIT_IGN_NEG  0x01
+#define GIT_IGN_DIR  0x02
+#define GIT_IGN_PATH 0x04
+
+static size_t git_readign(const char *path, char **pbuf, size_t buflen)
+{
+	struct stat sb;
+	char *buf, *line, *next, *out;
+	ssize_t len;
+	size_t n;
+	uchar_t flags;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
 
-			++next;
-		}
+	if (fd == -1)
+		return buflen;
 
-		cnt_J = 0;
-		next = cmdline;
-		while ((next = strstr(next, "%J"))) {
-			++cnt_J;
+	if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size > GIT_IGN_MAX) {
+		close(fd);
+		return buflen;
+	}
 
-			// %J should be the last thing in the command
-			if (next == cmdline + len - 2) {
-				cmdline[len - 2] = '\0';
-			}
+	/* The patterns are never longer than the file, with a flag byte per line */
+	buf = xrealloc(*pbuf, buflen + (sb.st_size << 1) + 2);
+	if (!buf) {
+		close(fd);
+		return buflen;
+	}
+	*pbuf = buf;
 
-			++next;
+	line = buf + buflen + sb.st_size + 1;
+	len = read_nointr(fd, line, sb.st_size);
+	close(fd);
+	if (len <= 0)
+		return buflen;
+	line[len] = '\0';
+
+	for (out = buf + buflen; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		n = xstrlen(line);
+		while (n && (line[n - 1] == ' ' || line[n - 1] == '\r'))
+			--n;
+		if (!n || line[0] == '#')
+			continue;
+
+		flags = 0;
+		if (line[0] == '!') {
+			flags |= GIT_IGN_NEG;
+			++line;
+			--n;
 		}
+		if (n && line[n - 1] == '/') {
+			flags |= GIT_IGN_DIR;
+			--n;
+		}
+		if (n && memchr(line, '/', n))
+			flags |= GIT_IGN_PATH;
+		if (n && line[0] == '/') {
+			++line;
+			--n;
+		}
+		if (!n)
+			continue;
 
-		// We can't handle both %j and %J in a single command
-		if (cnt_j && cnt_J)
-			break;
+		/* Never overtakes the line being read */
+		*out++ = (char)(flags | 0x80);
+		memmove(out, line, n);
+		out[n] = '\0';
+		out += n + 1;
+	}
 
-		if (cnt_j)
-			snprintf(cmd, CMD_LEN_MAX + 32, xargs_j, cmdline, selpath);
-		else if (cnt_J)
-			snprintf(cmd, CMD_LEN_MAX + 32, xargs_J, cmdline, selpath);
+	return out - buf;
+}
 
-		cmd_ret = spawn(shell, "-c", (cnt_j || cnt_J) ? cmd : cmdline, NULL, F_CLI | F_CONFIRM);
-		if ((cnt_j || cnt_J) && cmd_ret == 0)
-			clearselection();
+/* The last matching pattern decides, rel is the path under the dir of the patterns */
+static int git_ignmatch(const char *ign, size_t len, const char *rel, const char *name, bool dir)
+{
+	const char *end = ign + len;
+	int ret = -1;
+
+	for (uchar_t flags; ign < end; ign += xstrlen(ign) + 1) {
+		flags = (uchar_t)*ign++;
+		if ((flags & GIT_IGN_DIR) && !dir)
+			continue;
+
+		if (!fnmatch(ign, (flags & GIT_IGN_PATH) ? rel : name, (flags & GIT_IGN_PATH) ? FNM_PATHNAME : 0))
+			ret = !(flags & GIT_IGN_NEG);
 	}
 
 	return ret;
 }
 
-static bool handle_cmd(enum action sel, char *path, char *newpath)
+static bool git_ignored(const char *name, bool dir)
 {
-	endselection(FALSE);
-
-	if (sel == SEL_LAUNCH)
-		return launch_app(newpath);
-
-	setexports(path);
+	char rel[PATH_MAX];
+	int r = -1;
 
-	if (sel == SEL_PROMPT)
-		return prompt_run();
+	if (g_git.ignored)
+		return TRUE;
 
-	/* Set nnn nesting level */
-	char *tmp = getenv(env_cfg[NNNLVL]);
-	int r = tmp ? atoi(tmp) : 0;
+	if (g_git.ign)
+		r = git_ignmatch(g_git.ign, g_git.ignlen, name, name, dir);
+	if (r == -1 && g_git.repo->ign) {
+		xstrsncpy(rel, g_git.rel, PATH_MAX);
+		xstrsncpy(rel + g_git.rellen, name, PATH_MAX - g_git.rellen);
+		r = git_ignmatch(g_git.repo->ign, g_git.repo->ignlen, rel, name, dir);
+	}
 
-	setenv(env_cfg[NNNLVL], xitoa(r + 1), 1);
-	spawn(shell, NULL, NULL, NULL, F_CLI);
-	setenv(env_cfg[NNNLVL], xitoa(r), 1);
-	return TRUE;
+	return r == 1;
 }
 
-static void dentfree(void)
+/* First index entry from lo not sorted before key */
+static uint_t git_lbound(const git_repo *r, uint_t lo, uint_t hi, const char *key)
 {
-	free(pnamebuf);
-	free(pdents);
-	free(mark);
+	uint_t mid;
 
-	/* Thread data cleanup */
-	free(core_blocks);
-	free(core_data);
-	free(core_files);
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (strcmp(r->paths + r->ents[mid].off, key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
 }
 
-static void *du_thread(void *p_data)
+/* Finds the work tree above path and the git dir in it, may be a "gitdir:" file */
+static bool git_findroot(const char *path, char *root, char *gitdir)
 {
-	thread_data *pdata = (thread_data *)p_data;
-	char *path[2] = {pdata->path, NULL};
-	ullong_t tfiles = 0;
-	blkcnt_t tblocks = 0;
-	struct stat *sb;
-	FTS *tree = fts_open(path, FTS_PHYSICAL | FTS_XDEV | FTS_NOCHDIR, 0);
-	FTSENT *node;
+	char line[PATH_MAX];
+	struct stat sb;
+	size_t len = xstrsncpy(root, path, PATH_MAX) - 1;
+	ssize_t n;
+	int fd;
 
-	while ((node = fts_read(tree))) {
-		if (node->fts_info & FTS_D) {
-			if (g_state.interrupt)
+	while (TRUE) {
+		if (len + 6 < PATH_MAX) {
+			memcpy(root + len, "/.git", 6);
+			if (stat(root, &sb) == 0 && (S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode)))
 				break;
-			continue;
 		}
 
-		sb = node->fts_statp;
-
-		if (cfg.apparentsz) {
-			if (sb->st_size && DU_TEST)
-				tblocks += sb->st_size;
-		} else if (sb->st_blocks && DU_TEST)
-			tblocks += sb->st_blocks;
-
-		++tfiles;
+		while (len && root[len - 1] != '/')
+			--len;
+		if (len <= 1)
+			return FALSE;
+		--len;
 	}
 
-	fts_close(tree);
-
-	if (pdata->entnum >= 0)
-		pdents[pdata->entnum].blocks = tblocks;
-
-	if (!pdata->mntpoint) {
-		core_blocks[pdata->core] += tblocks;
-		core_files[pdata->core] += tfiles;
-	} else
-		core_files[pdata->core] += 1;
+	if (S_ISDIR(sb.st_mode))
+		xstrsncpy(gitdir, root, PATH_MAX);
+	else {
+		fd = open(root, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			return FALSE;
+		n = read_nointr(fd, line, PATH_MAX - 1);
+		close(fd);
+		if (n <= 8 || strncmp(line, "gitdir: ", 8))
+			return FALSE;
 
-	pthread_mutex_lock(&running_mutex);
-	threadbmp |= (1 << pdata->core);
-	--active_threads;
-	pthread_mutex_unlock(&running_mutex);
+		line[n] = '\0';
+		line[strcspn(line, "\r\n")] = '\0';
+		root[len] = '\0';
+		mkpath(root, line + 8, gitdir);
+		root[len] = '/';
+	}
 
-	return NULL;
+	root[len + 1] = '\0'; /* Keep the '/' */
+	return TRUE;
 }
 
-static void dirwalk(char *path, int entnum, bool mountpoint)
+/* Picks the repo of the dir and refreshes its index if it has changed */
+static bool git_prep(const char *path)
 {
-	/* Loop till any core is free */
-	while (active_threads == NUM_DU_THREADS);
+	char root[PATH_MAX], gitdir[PATH_MAX], tmp[PATH_MAX];
+	struct stat sb;
+	struct timespec ignmtim[2] = {{0, 0}, {0, 0}};
+	git_repo *r = NULL;
+	uint_t i;
+	int fd, ign;
 
-	if (g_state.interrupt)
-		return;
+	free(g_git.ign);
+	g_git.ign = NULL;
+	g_git.repo = NULL;
 
-	pthread_mutex_lock(&running_mutex);
-	int core = ffs(threadbmp) - 1;
+	if (!git_findroot(path, root, gitdir))
+		return FALSE;
 
-	threadbmp &= ~(1 << core);
-	++active_threads;
-	pthread_mutex_unlock(&running_mutex);
+	for (i = 0; i < GIT_CACHE && g_repos[i]; ++i)
+		if (!strcmp(g_repos[i]->root, root)) {
+			r = g_repos[i];
+			break;
+		}
 
-	xstrsncpy(core_data[core].path, path, PATH_MAX);
-	core_data[core].entnum = entnum;
-	core_data[core].core = (ushort_t)core;
-	core_data[core].mntpoint = mountpoint;
+	if (!r) { /* Take a free or the least recently used slot */
+		for (i = 0; i < GIT_CACHE && g_repos[i]; ++i);
+		if (i == GIT_CACHE) {
+			for (uint_t j = i = 0; j < GIT_CACHE; ++j)
+				if (g_repos[j]->used < g_repos[i]->used)
+					i = j;
+			git_unload(g_repos[i]);
+			free(g_repos[i]->ign);
+		} else {
+			g_repos[i] = malloc(sizeof(git_repo));
+			if (!g_repos[i])
+				return FALSE;
+		}
 
-	pthread_t tid = 0;
+		r = g_repos[i];
+		memset(r, 0, sizeof(git_repo));
+		r->rootlen = xstrsncpy(r->root, root, PATH_MAX) - 1;
+		r->idev = (dev_t)-1;
+	}
+	r->used = ++g_repoclock;
+
+	/* Stat data of the index decides if it is read again */
+	mkpath(gitdir, "index", tmp);
+	fd = open(tmp, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat(fd, &sb) == -1) {
+		if (r->idev || r->nents)
+			git_unload(r);
+		r->idev = 0;
+	} else if (sb.st_dev != r->idev || sb.st_ino != r->iino || sb.st_size != r->isize
+		   || FOP_MTIM(&sb).tv_sec != r->imtim.tv_sec || FOP_MTIM(&sb).tv_nsec != r->imtim.tv_nsec) {
+		git_unload(r);
+		r->idev = sb.st_dev;
+		r->iino = sb.st_ino;
+		r->isize = sb.st_size;
+		r->imtim = FOP_MTIM(&sb);
+		if (!git_readindex(r, fd, (size_t)sb.st_size)) {
+			git_unload(r);
+			r->idev = (dev_t)-1; /* Try again next time */
+		}
+	}
+	if (fd != -1)
+		close(fd);
 
-	pthread_create(&tid, NULL, du_thread, (void *)&(core_data[core]));
+	mkpath(root, ".gitignore", tmp);
+	if (stat(tmp, &sb) == 0)
+		ignmtim[0] = FOP_MTIM(&sb);
+	mkpath(gitdir, "info/exclude", gitdir);
+	if (stat(gitdir, &sb) == 0)
+		ignmtim[1] = FOP_MTIM(&sb);
+	if (memcmp(ignmtim, r->ignmtim, sizeof(ignmtim))) {
+		free(r->ign);
+		r->ign = NULL;
+		r->ignlen = git_readign(gitdir, &r->ign, 0);
+		r->ignlen = git_readign(tmp, &r->ign, r->ignlen);
+		memcpy(r->ignmtim, ignmtim, sizeof(ignmtim));
+	}
 
-	tolastln();
-	addstr(xbasename(path));
-	addstr(" [^C aborts]\n");
-	refresh();
+	g_git.repo = r;
+	g_git.rellen = xstrsncpy(g_git.rel, path + MIN(r->rootlen, xstrlen(path)), PATH_MAX - 1) - 1;
+	if (g_git.rellen)
+		g_git.rel[g_git.rellen++] = '/';
+	g_git.rel[g_git.rellen] = '\0';
+
+	/* Entries under rel, '0' sorts right after '/' */
+	g_git.lo = 0;
+	g_git.hi = r->nents;
+	if (g_git.rellen) {
+		g_git.lo = git_lbound(r, 0, r->nents, g_git.rel);
+		g_git.rel[g_git.rellen - 1] = '0';
+		g_git.hi = git_lbound(r, g_git.lo, r->nents, g_git.rel);
+		g_git.rel[g_git.rellen - 1] = '/';
+
+		mkpath(path, ".gitignore", tmp);
+		g_git.ignlen = git_readign(tmp, &g_git.ign, 0);
+	}
+
+	/* An untracked dir in an ignored one */
+	g_git.ignored = FALSE;
+	if (g_git.lo == g_git.hi && r->ign)
+		for (char *p = g_git.rel; (p = strchr(p, '/')); ++p) {
+			*p = '\0';
+			ign = git_ignmatch(r->ign, r->ignlen, g_git.rel, xbasename(g_git.rel), TRUE);
+			*p = '/';
+			if (ign == 1) {
+				g_git.ignored = TRUE;
+				break;
+			}
+		}
+
+	return TRUE;
 }
 
-static bool prep_threads(void)
+/*
+ * Status of an entry of the dir from the stat data of dentfill(),
+ * 'M' if it differs from the index, '?' if untracked, else ' '.
+ */
+static char git_status(const char *name, const struct stat *sb, mode_t mode)
 {
-	if (!g_state.duinit) {
-		/* drop MSB 1s */
-		threadbmp >>= (32 - NUM_DU_THREADS);
-
-		if (!core_blocks)
-			core_blocks = calloc(NUM_DU_THREADS, sizeof(blkcnt_t));
-		if (!core_data)
-			core_data = calloc(NUM_DU_THREADS, sizeof(thread_data));
-		if (!core_files)
-			core_files = calloc(NUM_DU_THREADS, sizeof(ullong_t));
+	const git_repo *r = g_git.repo;
+	const git_ent *e;
+	char key[PATH_MAX];
+	size_t len;
+	uint_t i;
+
+	if (!strcmp(name, ".git"))
+		return ' ';
+
+	len = g_git.rellen;
+	memcpy(key, g_git.rel, len);
+	len += xstrsncpy(key + len, name, PATH_MAX - len - 1) - 1;
+
+	i = git_lbound(r, g_git.lo, g_git.hi, key);
+	if (i < g_git.hi && !strcmp(r->paths + r->ents[i].off, key)) {
+		e = &r->ents[i];
+		if (e->flags & GIT_STAGE)
+			return 'U';
+		/* Submodules, symlinks (stat data of the target) */
+		if ((e->flags & GIT_SKIP) || (e->mode & S_IFMT) == 0160000 || S_ISLNK(mode))
+			return ' ';
+		if (e->size != (uint_t)sb->st_size || e->sec != (uint_t)sb->st_mtime
+		    || (e->nsec && e->nsec != (uint_t)FOP_MTIM(sb).tv_nsec)
+		    || (e->ino && e->ino != (uint_t)sb->st_ino))
+			return 'M';
+		return ' ';
+	}
 
-		if (!core_blocks || !core_data || !core_files) {
-			printwarn(NULL);
-			return FALSE;
-		}
-#ifndef __APPLE__
-		/* Increase current open file descriptor limit */
-		max_openfds();
-#endif
-		g_state.duinit = TRUE;
-	} else {
-		memset(core_blocks, 0, NUM_DU_THREADS * sizeof(blkcnt_t));
-		memset(core_data, 0, NUM_DU_THREADS * sizeof(thread_data));
-		memset(core_files, 0, NUM_DU_THREADS * sizeof(ullong_t));
+	if (S_ISDIR(sb->st_mode)) { /* Tracked files under it */
+		key[len] = '/';
+		key[len + 1] = '\0';
+		i = git_lbound(r, i, g_git.hi, key);
+		if (i < g_git.hi && !strncmp(r->paths + r->ents[i].off, key, len + 1))
+			return ' ';
 	}
-	return TRUE;
+
+	return git_ignored(name, S_ISDIR(sb->st_mode)) ? ' ' : '?';
 }
 
-/* Skip self and parent */
-static inline bool selforparent(const char *path)
+static void git_free(void)
 {
-	return path[0] == '.' && (path[1] == '\0' || (path[1] == '.' && path[2] == '\0'));
+	for (uint_t i = 0; i < GIT_CACHE && g_repos[i]; ++i) {
+		git_unload(g_repos[i]);
+		free(g_repos[i]->ign);
+		free(g_repos[i]);
+	}
+	free(g_git.ign);
 }
+#endif
 
 static int dentfill(char *path, struct entry **ppdents)
 {
@@ -5971,17 +13700,29 @@ static int dentfill(char *path, struct entry **ppdents)
 	struct entry *dentp;
 	size_t off = 0, namebuflen = NAMEBUF_INCR;
 	struct stat sb_path, sb;
-	DIR *dirp = opendir(path);
+	DIR *dirp;
 
 	ndents = 0;
 	gtimesecs = time(NULL);
 
 	DPRINTF_S(__func__);
 
+	if (cfg.listview && list_isdir(path))
+		return list_fill(path, ppdents);
+
+	/*
+	 * Only entering the dir is guarded by the watchdog, see xchdir(). The
+	 * readdir and stat pass runs here on the UI thread and still blocks
+	 * if the mount hangs after that.
+	 */
+	dirp = opendir(path);
 	if (!dirp)
-		return 0;
+		return (errno == ENOTDIR) ? arc_fill(path, ppdents) : 0;
 
 	int fd = dirfd(dirp);
+#ifdef GITSTATUS
+	bool git = cfg.gitstatus && git_prep(path);
+#endif
 
 	if (cfg.blkorder) {
 		num_files = 0;
@@ -6049,10 +13790,18 @@ static int dentfill(char *path, struct entry **ppdents)
 						goto exit;
 				}
 			} else {
+				blkcnt_t blocks = cfg.apparentsz ? sb.st_size : sb.st_blocks;
+
 				/* Do not recount hard links */
 				if (sb.st_nlink <= 1 || test_set_bit((uint_t)sb.st_ino))
-					dir_blocks += (cfg.apparentsz ? sb.st_size : sb.st_blocks);
+					dir_blocks += blocks;
+				else
+					blocks = 0;
 				++num_files;
+
+				if (S_ISREG(sb.st_mode))
+					du_brk_add(&core_brk[NUM_DU_THREADS], namep,
+						   xstrlen(namep), sb.st_mtime, blocks);
 			}
 
 			continue;
@@ -6119,28 +13868,7 @@ static int dentfill(char *path, struct entry **ppdents)
 		off += dentp->nlen;
 
 		/* Copy other fields */
-		if (cfg.timetype == T_MOD) {
-			dentp->sec = sb.st_mtime;
-#ifdef __APPLE__
-			dentp->nsec = (uint_t)sb.st_mtimespec.tv_nsec;
-#else
-			dentp->nsec = (uint_t)sb.st_mtim.tv_nsec;
-#endif
-		} else if (cfg.timetype == T_ACCESS) {
-			dentp->sec = sb.st_atime;
-#ifdef __APPLE__
-			dentp->nsec = (uint_t)sb.st_atimespec.tv_nsec;
-#else
-			dentp->nsec = (uint_t)sb.st_atim.tv_nsec;
-#endif
-		} else {
-			dentp->sec = sb.st_ctime;
-#ifdef __APPLE__
-			dentp->nsec = (uint_t)sb.st_ctimespec.tv_nsec;
-#else
-			dentp->nsec = (uint_t)sb.st_ctim.tv_nsec;
-#endif
-		}
+		dentsettime(dentp, &sb);
 
 		if ((gtimesecs - sb.st_mtime <= 300) || (gtimesecs - sb.st_ctime <= 300))
 			entflags |= FILE_YOUNG;
@@ -6149,7 +13877,7 @@ static int dentfill(char *path, struct entry **ppdents)
 		if (!flags && dp->d_type == DT_LNK) {
 			 /* Do not add sizes for links */
 			dentp->mode = (sb.st_mode & ~S_IFMT) | S_IFLNK;
-			dentp->size = listpath ? sb.st_size : 0;
+			dentp->size = 0;
 		} else {
 			dentp->mode = sb.st_mode;
 			dentp->size = sb.st_size;
@@ -6164,6 +13892,10 @@ static int dentfill(char *path, struct entry **ppdents)
 		dentp->gid = sb.st_gid;
 #endif
 
+#ifdef GITSTATUS
+		dentp->git = git ? git_status(namep, &sb, dentp->mode) : '\0';
+#endif
+
 		dentp->flags = S_ISDIR(sb.st_mode) ? 0 : ((sb.st_nlink > 1) ? HARD_LINK : 0);
 		if (entflags) {
 			dentp->flags |= entflags;
@@ -6182,8 +13914,14 @@ static int dentfill(char *path, struct entry **ppdents)
 			} else {
 				dentp->blocks = (cfg.apparentsz ? sb.st_size : sb.st_blocks);
 				/* Do not recount hard links */
-				if (sb.st_nlink <= 1 || test_set_bit((uint_t)sb.st_ino))
+				if (sb.st_nlink <= 1 || test_set_bit((uint_t)sb.st_ino)) {
 					dir_blocks += dentp->blocks;
+					if (S_ISREG(sb.st_mode))
+						du_brk_add(&core_brk[NUM_DU_THREADS], namep,
+							   dentp->nlen - 1, sb.st_mtime, dentp->blocks);
+				} else if (S_ISREG(sb.st_mode))
+					du_brk_add(&core_brk[NUM_DU_THREADS], namep,
+						   dentp->nlen - 1, sb.st_mtime, 0);
 				++num_files;
 			}
 		}
@@ -6250,27 +13988,95 @@ static void populate(char *path, char *lastname)
 	/* No NULL check for lastname, always points to an array */
 	move_cursor(*lastname ? dentfind(lastname, ndents) : 0, 0);
 
-	// Force full redraw
-	last_curscroll = -1;
+	// Force full redraw
+	last_curscroll = -1;
+}
+
+#ifndef NOFIFO
+static long long fifo_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static bool fifo_open(void)
+{
+	if (!fifopath)
+		return FALSE;
+
+	if (fifofd == -1) {
+		fifofd = open(fifopath, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
+		if (fifofd == -1) {
+			if (errno != ENXIO)
+				/* Unexpected error, the FIFO file might have been removed */
+				/* We give up FIFO notification */
+				fifopath = NULL;
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Writes the path of the hovered file tagged with type, FALSE if the pipe is full */
+static bool fifo_sendcur(char type)
+{
+	char path[PATH_MAX + 32];
+	const char *rel;
+	int off = 0;
+	size_t len;
+	ssize_t ret;
+
+	/* "<seq> <type> " tells previewers what is stale */
+	if (fifo_seq)
+		off = snprintf(path, 32, "%llu %c ", ++fifo_evid, type);
+
+	len = mkpath(g_ctx[cfg.curctx].c_path, ndents ? pdents[cur].name : "", path + off);
+
+	/* Previewers get a copy of an archive member */
+	if (ndents && S_ISREG(pdents[cur].mode) && arc_find(path + off, &rel) && arc_tmpfile(path + off, TRUE))
+		len = xstrlen(path + off) + 1;
+
+	len += off;
+	path[len - 1] = '\n';
+
+	ret = write(fifofd, path, len);
+	if (ret == -1 && errno == EAGAIN)
+		return FALSE;
+
+	if (ret != (ssize_t)len && !(ret == -1 && errno == EPIPE)) {
+		DPRINTF_S(strerror(errno));
+	}
+
+	return TRUE;
+}
+
+/* Sends the latest hover, retried when idle if the previewer is behind */
+static void fifo_hover(void)
+{
+	fifo_due = -1;
+	fifo_retry = !fifo_sendcur('h');
+}
+
+/* Milliseconds till a held hover notification is due, -1 if none is held */
+static int fifo_wait(void)
+{
+	long long left;
+
+	if (fifo_due < 0)
+		return -1;
+
+	left = fifo_due - fifo_now();
+	return left > 0 ? (int)left : 0;
 }
 
-#ifndef NOFIFO
 static void notify_fifo(bool force)
 {
-	if (!fifopath)
+	if (!fifo_open())
 		return;
 
-	if (fifofd == -1) {
-		fifofd = open(fifopath, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
-		if (fifofd == -1) {
-			if (errno != ENXIO)
-				/* Unexpected error, the FIFO file might have been removed */
-				/* We give up FIFO notification */
-				fifopath = NULL;
-			return;
-		}
-	}
-
 	static struct entry lastentry;
 
 	if (!force && !memcmp(&lastentry, &pdents[cur], sizeof(struct entry))) // NOLINT
@@ -6278,23 +14084,33 @@ static void notify_fifo(bool force)
 
 	lastentry = pdents[cur];
 
-	char path[PATH_MAX];
-	size_t len = mkpath(g_ctx[cfg.curctx].c_path, ndents ? pdents[cur].name : "", path);
-
-	path[len - 1] = '\n';
-
-	ssize_t ret = write(fifofd, path, len);
-
-	if (ret != (ssize_t)len && !(ret == -1 && (errno == EAGAIN || errno == EPIPE))) {
-		DPRINTF_S(strerror(errno));
+	/* Hold it till the cursor rests for NNN_FIFO_MS, the latest wins */
+	if (!force && fifo_ms) {
+		fifo_due = fifo_now() + fifo_ms;
+		return;
 	}
+
+	fifo_hover();
 }
 
 static void send_to_explorer(int *presel)
 {
 	if (nselected) {
 		int fd = open(fifopath, O_WRONLY|O_NONBLOCK|O_CLOEXEC, 0600);
-		if ((fd == -1) || (seltofile(fd, NULL, NEWLINE) != (size_t)(selbufpos)))
+
+		if (fd != -1 && fifo_seq) { /* The paths follow the header */
+			char hdr[48];
+			int len = snprintf(hdr, sizeof(hdr), "%llu s %d\n", ++fifo_evid, nselected);
+
+			if (write(fd, hdr, len) != len) {
+				close(fd);
+				fd = -1;
+			}
+		}
+
+		/* The last path is terminated too, the next record follows it */
+		if ((fd == -1) || !seltofile(fd, NULL, NEWLINE)
+		    || (fifo_seq && write(fd, "\n", 1) != 1))
 			printwarn(presel);
 		else {
 			resetselind();
@@ -6302,8 +14118,8 @@ static void send_to_explorer(int *presel)
 		}
 		if (fd > 1)
 			close(fd);
-	} else
-		notify_fifo(TRUE); /* Send opened path to NNN_FIFO */
+	} else if (fifo_open())
+		fifo_sendcur('o'); /* Send opened path to NNN_FIFO */
 }
 #endif
 
@@ -6336,6 +14152,7 @@ static void move_cursor(int target, int ignore_scrolloff)
 	if (!g_state.fifomode)
 		notify_fifo(FALSE); /* Send hovered path to NNN_FIFO */
 #endif
+	daemon_event(DMN_EV_HOVER);
 }
 
 static void handle_screen_move(enum action sel)
@@ -6654,10 +14471,18 @@ static void statusbar(char *path)
 {
 	int i = 0, len = 0;
 	char *ptr;
+	char desc[FTYPE_LEN];
 	pEntry pent = &pdents[cur];
 
 	if (!ndents) {
-		printmsg("0/0");
+		mnt_job *job = mnt_pending(path);
+
+		if (job) {
+			snprintf(desc, FTYPE_LEN, "%s %llds", messages[MSG_MOUNTING],
+				 (long long)(time(NULL) - job->start));
+			printmsg(desc);
+		} else
+			printmsg("0/0");
 		return;
 	}
 
@@ -6674,8 +14499,10 @@ static void statusbar(char *path)
 
 	attron(COLOR_PAIR(cfg.curctx + 1));
 
-	if (cfg.fileinfo && get_output("file", "-b", pdents[cur].name, -1, FALSE))
-		mvaddstr(xlines - 2, 2, g_buf);
+	if (cfg.fileinfo && ftype_hovered(desc)) {
+		mvaddstr(xlines - 2, 2, desc);
+		clrtoeol();
+	}
 
 	tolastln();
 
@@ -6695,6 +14522,20 @@ static void statusbar(char *path)
 		addch(' ');
 	}
 
+	if (g_listrd.fd != -1) { /* List input still being read */
+		attron(A_REVERSE);
+		addstr(" L");
+		addstr(xitoa(g_list.npaths));
+		addstr(" ");
+		attroff(A_REVERSE);
+		addch(' ');
+	}
+
+#ifndef NOFOPS
+	if (fop_njobs)
+		fop_indicator();
+#endif
+
 	if (cfg.blkorder) { /* du mode */
 		char buf[24];
 
@@ -6755,6 +14596,18 @@ static void statusbar(char *path)
 			}
 		}
 		clrtoeol();
+
+		if (g_state.fsinfo) { /* Right aligned, if there's room */
+			char avail[12], buf[32];
+			int x, y;
+
+			xstrsncpy(avail, coolsize(get_fs_info(path, VFS_AVAIL)), sizeof(avail));
+			len = snprintf(buf, sizeof(buf), "avail:%s used:%s",
+				       avail, coolsize(get_fs_info(path, VFS_USED)));
+			getyx(stdscr, y, x);
+			if (x + len + 2 < xcols)
+				mvaddstr(y, xcols - len - 1, buf);
+		}
 	}
 
 	attroff(COLOR_PAIR(cfg.curctx + 1));
@@ -6796,7 +14649,7 @@ static void draw_line(int ncols)
 {
 	bool dir = FALSE;
 
-	ncols = adjust_cols(ncols);
+	ncols = adjust_cols(ncols - pv_cols());
 
 	if (g_state.oldcolor && (pdents[last].flags & DIR_OR_DIRLNK)) {
 		attron(COLOR_PAIR(cfg.curctx + 1) | A_BOLD);
@@ -6825,6 +14678,7 @@ static void draw_line(int ncols)
 	if (dir)
 		attroff(COLOR_PAIR(cfg.curctx + 1) | A_BOLD);
 
+	pv_draw();
 	markhovered();
 }
 
@@ -6933,7 +14787,7 @@ static void redraw(char *path)
 	int onscreen = MIN(ONSCREEN + curscroll, ndents);
 	int len = scanselforpath(path, FALSE);
 
-	ncols = adjust_cols(ncols);
+	ncols = adjust_cols(ncols - pv_cols());
 
 	/* Print listing */
 	for (i = curscroll; i < onscreen; ++i) {
@@ -6961,11 +14815,18 @@ static void redraw(char *path)
 #endif
 	}
 
+	pv_draw();
 	markhovered();
 }
 
 static bool cdprep(char *lastdir, char *lastname, char *path, char *newpath)
 {
+	/* Stay in the list view in its dirs, '-' returns to it */
+	bool inlist = cfg.listview || (cfg.listlast && !strcmp(newpath, lastdir));
+
+	cfg.listlast = cfg.listview;
+	cfg.listview = inlist && list_isdir(newpath);
+
 	if (lastname)
 		lastname[0] =  '\0';
 
@@ -6986,7 +14847,7 @@ static void showselsize(const char *path)
 	int len = scanselforpath(path, FALSE);
 
 	for (int r = 0, selcount = nselected; (r < ndents) && selcount; ++r)
-		if (findinsel(findselpos, len + xstrsncpy(g_sel + len, pdents[r].name, pdents[r].nlen))) {
+		if (findinsel(len + xstrsncpy(g_sel + len, pdents[r].name, pdents[r].nlen))) {
 			sz += cfg.blkorder ? pdents[r].blocks : pdents[r].size;
 			--selcount;
 		}
@@ -7000,6 +14861,7 @@ static bool browse(char *ipath, int pkey)
 	alignas(max_align_t) char runfile[NAME_MAX + 1];
 	char *path, *lastdir, *lastname, *dir, *tmp;
 	pEntry pent;
+	open_rule *orule;
 	enum action sel;
 	struct stat sb;
 	int r = -1, presel, selstartid = 0, selendid = 0;
@@ -7075,7 +14937,7 @@ begin:
 	 * Can fail when permissions change while browsing.
 	 * It's assumed that path IS a directory when we are here.
 	 */
-	if (chdir(path) == -1) {
+	if (xchdir(path) == -1) {
 		DPRINTF_S("directory inaccessible");
 		valid_parent(path, lastname);
 		setdirwatch();
@@ -7157,7 +15019,7 @@ nochange:
 			_exit(EXIT_FAILURE);
 
 		/* If CWD is deleted or moved or perms changed, find an accessible parent */
-		if (chdir(path) == -1)
+		if (xchdir(path) == -1)
 			goto begin;
 
 		/* If STDIN is no longer a tty (closed) we should exit */
@@ -7319,7 +15181,7 @@ nochange:
 
 			/* Visit directory */
 			if (pent->flags & DIR_OR_DIRLNK) {
-				if (chdir(newpath) == -1) {
+				if (xchdir(newpath) == -1) {
 					printwarn(&presel);
 					goto nochange;
 				}
@@ -7329,7 +15191,8 @@ nochange:
 			}
 
 			/* Cannot use stale data in entry, file may be missing by now */
-			if (stat(newpath, &sb) == -1) {
+			if (stat(newpath, &sb) == -1
+			    && (errno != ENOTDIR || !arc_tmpfile(newpath, FALSE) || stat(newpath, &sb) == -1)) {
 				printwarn(&presel);
 				goto nochange;
 			}
@@ -7382,23 +15245,12 @@ nochange:
 			}
 
 			if (sel == SEL_NAV_IN) {
-				/* If in listing dir, go to target on `l` or Right on symlink */
-				if (listpath && S_ISLNK(pent->mode)
-				    && is_prefix(path, listpath, xstrlen(listpath))) {
-					if (!realpath(pent->name, newpath)) {
-						printwarn(&presel);
-						goto nochange;
-					}
-
-					xdirname(newpath);
-
-					if (chdir(newpath) == -1) {
-						printwarn(&presel);
-						goto nochange;
-					}
-
+				/* In a list dir, show all of the dir on `l` or Right on a file */
+				if (cfg.listview) {
+					xstrsncpy(newpath, path, PATH_MAX);
 					cdprep(lastdir, NULL, path, newpath)
 					       ? (presel = FILTER) : (watch = TRUE);
+					cfg.listview = 0;
 					xstrsncpy(lastname, pent->name, NAME_MAX + 1);
 					goto begin;
 				}
@@ -7431,26 +15283,19 @@ nochange:
 				continue;
 			}
 
-			/* Get the extension for regex match */
-			tmp = xextension(pent->name, pent->nlen - 1);
-#ifdef PCRE2
-			if (tmp) {
-				pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(archive_pcre2, NULL);
-
-				if (match_data) {
-					r = pcre2_match(archive_pcre2, (PCRE2_SPTR)tmp, pent->nlen - (tmp - pent->name) - 1, 0, 0, match_data, NULL);
-					pcre2_match_data_free(match_data);
-				}
-			} else
-				r = 0;
-
-			if (r > 0) {
-#else
-			if (tmp && !regexec(&archive_re, tmp, 0, NULL, 0)) {
-#endif
+			if (is_archive(pent->name, pent->nlen - 1)) {
 				r = get_input(messages[MSG_ARCHIVE_OPTS]);
 				if (r == '\r')
 					r = 'l';
+				/* Browse the members, list with a utility if the format is unknown */
+				if (r == 'l') {
+					mkpath(path, pent->name, newpath);
+					if (xchdir(newpath) == 0) {
+						cdprep(lastdir, lastname, path, newpath)
+						       ? (presel = FILTER) : (watch = TRUE);
+						goto begin;
+					}
+				}
 				if (r == 'l' || r == 'x') {
 					mkpath(path, pent->name, newpath);
 					if (!handle_archive(newpath, r)) {
@@ -7485,8 +15330,12 @@ nochange:
 				}
 			}
 
-			/* Invoke desktop opener as last resort */
-			spawn(opener, newpath, NULL, NULL, opener_flags);
+			/* Dispatch by the opener rules, else invoke desktop opener as last resort */
+			orule = open_rule_get(newpath, pent->name, pent->nlen - 1);
+			if (orule)
+				spawn(orule->cmd, newpath, NULL, NULL, orule->flag);
+			else
+				spawn(opener, newpath, NULL, NULL, opener_flags);
 
 			/* Move cursor to the next entry if not the last entry */
 			if (g_state.autonext && cur != ndents - 1)
@@ -7543,11 +15392,15 @@ nochange:
 				dir = lastdir; /* Go to last dir on home/root key repeat */
 			}
 
-			if (chdir(dir) == -1) {
+			if (xchdir(dir) == -1) {
 				presel = MSGWAIT;
 				goto nochange;
 			}
 
+			/* Started in list mode */
+			if (dir == ipath && listroot && !strcmp(dir, listroot))
+				cfg.listview = 1;
+
 			/* SEL_CDLAST: dir pointing to lastdir */
 			xstrsncpy(newpath, dir, PATH_MAX); // fallthrough
 		case SEL_BMOPEN:
@@ -7565,7 +15418,7 @@ nochange:
 			}
 
 			/* In list mode, retain the last file name to highlight it, if possible */
-			cdprep(lastdir, listpath && sel == SEL_CDLAST ? NULL : lastname, path, newpath)
+			cdprep(lastdir, listroot && sel == SEL_CDLAST ? NULL : lastname, path, newpath)
 			       ? (presel = FILTER) : (watch = TRUE);
 			goto begin;
 		case SEL_REMOTE:
@@ -7697,8 +15550,7 @@ nochange:
 		case SEL_STATS: // fallthrough
 		case SEL_CHMODX:
 			if (ndents) {
-				tmp = (listpath && xstrcmp(path, listpath) == 0) ? listroot : path;
-				mkpath(tmp, pdents[cur].name, newpath);
+				mkpath(path, pdents[cur].name, newpath);
 
 				if ((sel == SEL_STATS && !show_stats(newpath))
 				    || (lstat(newpath, &sb) == -1)
@@ -7711,6 +15563,27 @@ nochange:
 					pdents[cur].mode = sb.st_mode;
 			}
 			break;
+		case SEL_DUSTATS:
+			if (!cfg.blkorder) {
+				printwait(messages[MSG_DU_OFF], &presel);
+				goto nochange;
+			}
+
+			if (!show_dubrk(path)) {
+				printwarn(&presel);
+				goto nochange;
+			}
+			break;
+		case SEL_JOBS:
+#ifndef NOFOPS
+			fop_reap();
+			if (fop_njobs) {
+				show_jobs();
+				break;
+			}
+#endif
+			printwait(messages[MSG_NO_JOBS], &presel);
+			goto nochange;
 		case SEL_REDRAW: // fallthrough
 		case SEL_RENAMEMUL: // fallthrough
 		case SEL_HELP: // fallthrough
@@ -7733,7 +15606,7 @@ nochange:
 				endselection(TRUE);
 				setenv("NNN_INCLUDE_HIDDEN", xitoa(cfg.showhidden), 1);
 				setenv("NNN_PREFER_SELECTION", xitoa(cfg.prefersel), 1);
-				setenv("NNN_LIST", listpath ? listroot : "", 1);
+				setenv("NNN_LIST", cfg.listview ? listroot : "", 1);
 
 				if (!(getutil(utils[UTIL_BASH])
 				      && plugscript(utils[UTIL_NMV], F_CLI))
@@ -7787,13 +15660,17 @@ nochange:
 			if (g_state.rangesel)
 				g_state.rangesel = 0;
 
+			/* The mark is stale if the selection file was picked up */
+			if (!(pdents[cur].flags & FILE_SCANNED))
+				findmarkentry(scanselforpath(path, TRUE), &pdents[cur]);
+
 			/* Toggle selection status */
 			pdents[cur].flags ^= FILE_SELECTED;
 
 			if (pdents[cur].flags & FILE_SELECTED) {
 				++nselected;
 				appendfpath(newpath, mkpath(path, pdents[cur].name, newpath));
-				writesel(pselbuf, selbufpos - 1); /* Truncate NULL from end */
+				writesel();
 			} else {
 				--nselected;
 				rmfromselbuf(mkpath(path, pdents[cur].name, g_sel));
@@ -7867,7 +15744,7 @@ nochange:
 			}
 
 			r = scanselforpath(path, TRUE); /* Get path length suffixed by '/' */
-			((sel == SEL_SELINV) && findselpos)
+			((sel == SEL_SELINV) && selindir)
 				? invertselbuf(r) : addtoselbuf(r, selstartid, selendid);
 
 #ifndef NOX11
@@ -7902,13 +15779,11 @@ nochange:
 				}
 
 				if (r == 'c') {
-					tmp = (listpath && xstrcmp(path, listpath) == 0)
-					      ? listroot : path;
-					mkpath(tmp, pdents[cur].name, newpath);
+					mkpath(path, pdents[cur].name, newpath);
 					if (!xrm(newpath, trashcmd && sel == SEL_TRASH))
 						continue;
 
-					xrmfromsel(tmp, newpath);
+					xrmfromsel(path, newpath);
 
 					copynextname(lastname);
 
@@ -7920,7 +15795,7 @@ nochange:
 			}
 
 			(nselected == 1 && (sel == SEL_CP || sel == SEL_MV))
-				? mkpath(path, xbasename(pselbuf), newpath)
+				? mkpath(path, xbasename(selbuffirst()), newpath)
 				: (newpath[0] = '\0');
 
 			endselection(TRUE);
@@ -7934,12 +15809,6 @@ nochange:
 				presel = FILTER;
 			clearfilter();
 
-#ifndef NOX11
-			/* Show notification on operation complete */
-			if (cfg.x11)
-				plugscript(utils[UTIL_NTFY], F_NOWAIT | F_NOTRACE);
-#endif
-
 			if (newpath[0] && !access(newpath, F_OK))
 				xstrsncpy(lastname, xbasename(newpath), NAME_MAX+1);
 			else
@@ -8006,7 +15875,7 @@ nochange:
 				if (r == 'f' || r == 'd')
 					tmp = xreadline(tmp, messages[MSG_NEW_PATH]);
 				else if (r == 's' || r == 'h')
-					tmp = xreadline((nselected == 1 && cfg.prefersel) ? xbasename(pselbuf) : NULL,
+					tmp = xreadline((nselected == 1 && cfg.prefersel) ? xbasename(selbuffirst()) : NULL,
 						messages[nselected <= 1 ? MSG_NEW_PATH : MSG_LINK_PREFIX]);
 				else
 					tmp = NULL;
@@ -8189,7 +16058,9 @@ nochange:
 
 				copycurname();
 
-				if (!r) {
+				if (g_state.plugfltr)
+					presel = FILTER;
+				else if (!r && !g_state.plugrfsh) {
 					cfg.filtermode ? presel = FILTER : statusbar(path);
 					goto nochange;
 				}
@@ -8224,6 +16095,16 @@ nochange:
 			if (g_state.runplugin == 1) /* Allow filtering in plugins directory */
 				presel = FILTER;
 			goto begin;
+		case SEL_DAEMON:
+			daemon_apply(&path, (ndents ? pdents[cur].name : NULL), &lastname, &lastdir);
+			if (g_state.picked)
+				return EXIT_SUCCESS;
+
+			copycurname();
+			if (g_state.plugfltr)
+				presel = FILTER;
+			setdirwatch();
+			goto begin;
 		case SEL_SELSIZE:
 			showselsize(path);
 			goto nochange;
@@ -8246,6 +16127,28 @@ nochange:
 			cd = FALSE;
 			goto begin;
 		case SEL_UMOUNT:
+			/* Stop reading list input or cancel a pending mount */
+			if (g_listrd.fd != -1 && cfg.listview) {
+				list_stop();
+				statusbar(path);
+				goto nochange;
+			}
+
+			if (mnt_njobs) {
+				mnt_job *job = mnt_pending(path);
+
+				if (!job && ndents) {
+					mkpath(path, pdents[cur].name, newpath);
+					job = mnt_pending(newpath);
+				}
+
+				if (job) {
+					mnt_end(job, FALSE);
+					cd = FALSE;
+					goto begin;
+				}
+			}
+
 			presel = MSG_ZERO;
 			if (!unmount((ndents ? pdents[cur].name : NULL), newpath, &presel, path)) {
 				if (presel == MSG_ZERO)
@@ -8285,6 +16188,15 @@ nochange:
 				goto nochange;
 			cd = FALSE;
 			goto begin;
+#ifndef NOPREVIEW
+		case SEL_PREVIEW:
+			if (!g_state.preview && !pv_start()) {
+				printwarn(&presel);
+				goto nochange;
+			}
+			g_state.preview ^= 1;
+			continue;
+#endif
 		case SEL_QUITCTX: // fallthrough
 		case SEL_QUITCD: // fallthrough
 		case SEL_QUIT:
@@ -8322,19 +16234,29 @@ nochange:
 					break; // fallthrough
 			}
 
+#ifndef NOFOPS
+			if (fop_active()) {
+				if (!xconfirm(get_input(messages[MSG_JOBS_QUIT])))
+					break;
+				fop_cancelall();
+			}
+#endif
+
 			/* CD on Quit */
 			tmp = getenv("NNN_TMPFILE");
 			if ((sel == SEL_QUITCD) || tmp) {
 				write_lastdir(path, tmp);
 				/* ^G is a way to quit picker mode without picking anything */
-				if ((sel == SEL_QUITCD) && g_state.picker)
+				if ((sel == SEL_QUITCD) && g_state.picker) {
 					selbufpos = 0;
+					selidx_clear();
+				}
 			}
 
 			if (sel != SEL_QUITERR)
 				return EXIT_SUCCESS;
 
-			if (selbufpos && !g_state.picker) {
+			if (!selbufempty() && !g_state.picker) {
 				/* Pick files to stdout and exit */
 				g_state.picker = 1;
 				free(selpath);
@@ -8358,227 +16280,185 @@ nochange:
 	}
 }
 
-static char *make_tmp_tree(char **paths, ssize_t entries, const char *prefix)
+/* Add a path from the input, relative ones are under the cwd of the input */
+static bool list_inpath(const char *str, size_t len)
 {
-	/* tmpdir holds the full path */
-	/* tmp holds the path without the tmp dir prefix */
-	int err;
-	struct stat sb;
-	char *slash, *tmp;
-	ssize_t len = xstrlen(prefix);
-	char *tmpdir = malloc(PATH_MAX);
-
-	if (!tmpdir) {
-		DPRINTF_S(strerror(errno));
-		return NULL;
-	}
-
-	tmp = tmpdir + tmpfplen - 1;
-	xstrsncpy(tmpdir, g_tmpfpath, tmpfplen);
-	xstrsncpy(tmp, "/nnnXXXXXX", 11);
-
-	/* Points right after the base tmp dir */
-	tmp += 10;
-
-	/* handle the case where files are directly under / */
-	if (!prefix[1] && (prefix[0] == '/'))
-		len = 0;
+	char buf[(PATH_MAX << 1) + 2];
 
-	if (!mkdtemp(tmpdir)) {
-		free(tmpdir);
+	if (!len || len >= PATH_MAX || str[0] == '\n' || selforparent(str))
+		return TRUE;
 
-		DPRINTF_S(strerror(errno));
-		return NULL;
+	if (str[0] != '/' || strstr(str, "/.")) {
+		if (!abspath(str, g_listrd.cwd, buf) || xstrlen(buf) >= PATH_MAX)
+			return TRUE;
+		str = buf;
 	}
 
-	listpath = tmpdir;
-
-	for (ssize_t i = 0; i < entries; ++i) {
-		if (!paths[i])
-			continue;
-
-		err = stat(paths[i], &sb);
-		if (err && errno == ENOENT)
-			continue;
-
-		/* Don't copy the common prefix */
-		xstrsncpy(tmp, paths[i] + len, xstrlen(paths[i]) - len + 1);
+	return list_add(str);
+}
 
-		/* Get the dir containing the path */
-		slash = xmemrchr((uchar_t *)tmp, '/', xstrlen(paths[i]) - len);
-		if (slash)
-			*slash = '\0';
+/* Add len bytes from the ring head as a path, copied if it wraps around */
+static bool list_ringpath(size_t len)
+{
+	list_reader *rd = &g_listrd;
+	char path[PATH_MAX];
+	size_t part = LIST_CHUNK - rd->head;
 
-		if (access(tmpdir, F_OK)) /* Create directory if it doesn't exist */
-			xmktree(tmpdir, TRUE);
+	if (rd->skip) {
+		rd->skip = FALSE;
+		return TRUE;
+	}
 
-		if (slash)
-			*slash = '/';
+	if (len < part) /* NUL-terminated in place */
+		return list_inpath(rd->buf + rd->head, len);
 
-		if (symlink(paths[i], tmpdir)) {
-			DPRINTF_S(paths[i]);
-			DPRINTF_S(strerror(errno));
-		}
-	}
+	if (len >= PATH_MAX)
+		return TRUE;
 
-	/* Get the dir in which to start */
-	*tmp = '\0';
-	return tmpdir;
+	memcpy(path, rd->buf + rd->head, part);
+	memcpy(path + part, rd->buf, len - part);
+	path[len] = '\0';
+	return list_inpath(path, len);
 }
 
-static char *load_input(int fd, const char *path)
+/*
+ * Read into the free space after the ring data and add the paths it
+ * completes, scanning only the new bytes. FALSE at the end of the input.
+ */
+static bool list_readchunk(void)
 {
-	size_t i, chunk_count = 1, chunk = 512UL * 1024 /* 512 KiB chunk size */, entries = 0;
-	char *input = malloc(sizeof(char) * chunk), *tmpdir = NULL;
-	char cwd[PATH_MAX], *next;
-	size_t offsets[LIST_FILES_MAX];
-	char **paths = NULL;
-	ssize_t input_read, total_read = 0, off = 0;
-	int msgnum = 0;
-
-	if (!input) {
-		DPRINTF_S(strerror(errno));
-		return NULL;
+	list_reader *rd = &g_listrd;
+	char *nul, *end;
+	size_t tail, len;
+	ssize_t n;
+
+	if (rd->len == LIST_CHUNK) { /* No NUL in a full ring, not a path */
+		rd->len = 0;
+		rd->skip = TRUE;
 	}
 
-	if (!path) {
-		if (!getcwd(cwd, PATH_MAX)) {
-			free(input);
-			return NULL;
-		}
-	} else
-		xstrsncpy(cwd, path, PATH_MAX);
+	if (!rd->len)
+		rd->head = 0;
 
-	while (chunk_count < LIST_INPUT_MAX / chunk && !msgnum) {
-		input_read = read(fd, input + total_read, chunk);
-		if (input_read < 0) {
-			if (errno == EINTR)
-				continue;
+	tail = (rd->head + rd->len) % LIST_CHUNK;
+	n = read(rd->fd, rd->buf + tail, (tail < rd->head ? rd->head : LIST_CHUNK) - tail);
+	if (n <= 0) {
+		if (n < 0 && (errno == EINTR || errno == EAGAIN))
+			return TRUE;
 
-			DPRINTF_S(strerror(errno));
-			goto malloc_1;
+		/* The last path may be unterminated */
+		if (n == 0 && rd->len && rd->len < LIST_CHUNK) {
+			tail = (rd->head + rd->len) % LIST_CHUNK;
+			rd->buf[tail] = '\0';
+			list_ringpath(rd->len);
 		}
+		return FALSE;
+	}
 
-		if (input_read == 0)
-			break;
-
-		total_read += input_read;
-
-		while (off < total_read) {
-			next = memchr(input + off, '\0', total_read - off);
-			if (!next)
-				break;
-			++next;
+	rd->len += n;
+	for (nul = rd->buf + tail, end = nul + n; (nul = memchr(nul, '\0', end - nul)); ++nul) {
+		len = (size_t)(nul - rd->buf + LIST_CHUNK - rd->head) % LIST_CHUNK;
+		if (!list_ringpath(len))
+			return FALSE;
 
-			if (next - input == off + 1) {
-				off = next - input;
-				continue;
-			}
+		rd->head = (size_t)(nul + 1 - rd->buf) % LIST_CHUNK;
+		rd->len -= len + 1;
+	}
 
-			if (entries == LIST_FILES_MAX) {
-				msgnum = MSG_FILE_LIMIT;
-				break;
-			}
+	return TRUE;
+}
 
-			offsets[entries++] = off;
-			off = next - input;
-		}
+/* Add the input that arrives within LIST_READ_MS, FALSE at its end */
+static bool list_read(bool wait)
+{
+	struct pollfd pfd = {.fd = g_listrd.fd, .events = POLLIN};
+	struct timespec ts;
+	long long start, left = LIST_READ_MS;
+	int r;
 
-		/* We don't need to allocate another chunk */
-		if (chunk_count > (total_read + chunk - 1) / chunk)
-			continue;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 
-		/* We can never need more than one additional chunk */
-		++chunk_count;
-		if (chunk_count > LIST_INPUT_MAX / chunk) {
-			msgnum = MSG_SIZE_LIMIT;
+	while (left > 0) {
+		r = poll(&pfd, 1, wait ? (int)left : 0);
+		if (r == 0)
 			break;
-		}
-
-		input = xrealloc(input, chunk_count * chunk);
-		if (!input)
-			goto malloc_1;
-	}
-
-	/* We close fd outside this function. Any extra data is left to the kernel to handle */
 
-	if (off != total_read) {
-		if (entries == LIST_FILES_MAX)
-			msgnum = MSG_FILE_LIMIT;
-		else
-			offsets[entries++] = off;
-	}
-
-	DPRINTF_D(entries);
-	DPRINTF_D(total_read);
-	DPRINTF_D(chunk_count);
+		if ((r < 0 && errno != EINTR) || (r > 0 && !list_readchunk()))
+			return FALSE;
 
-	if (!entries) {
-		msgnum = MSG_0_ENTRIES;
-		goto malloc_1;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		left = LIST_READ_MS - (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 - start);
 	}
 
-	input[total_read] = '\0';
-
-	paths = malloc(entries * sizeof(char *));
-	if (!paths)
-		goto malloc_1;
-
-	for (i = 0; i < entries; ++i)
-		paths[i] = input + offsets[i];
-
-	listroot = malloc(sizeof(char) * PATH_MAX);
-	if (!listroot)
-		goto malloc_1;
-	listroot[0] = '\0';
+	return TRUE;
+}
 
-	DPRINTF_S(paths[0]);
+/* Read more list input when idle, TRUE if the dir shown has new entries */
+static bool list_poll(void)
+{
+	uint_t node = cfg.listview ? list_lookup(g_ctx[cfg.curctx].c_path) : 0;
+	uint_t first = node ? g_list.nodes[node - 1].child : 0;
 
-	for (i = 0; i < entries; ++i) {
-		if (paths[i][0] == '\n' || selforparent(paths[i])) {
-			paths[i] = NULL;
-			continue;
-		}
+	if (!list_read(FALSE))
+		list_stop();
+	list_setroot();
 
-		paths[i] = abspath(paths[i], cwd, NULL);
-		if (!paths[i]) {
-			entries = i; // free from the previous entry
-			goto malloc_2;
-		}
+	return node && g_list.nodes[node - 1].child != first;
+}
 
-		DPRINTF_S(paths[i]);
+/*
+ * Start reading NUL-separated paths from fd into the list mode tree.
+ * Returns listroot once the first paths are in, the rest of the input
+ * is read when idle.
+ */
+static char *load_input(int fd, const char *path)
+{
+	bool more;
 
-		xstrsncpy(g_buf, paths[i], PATH_MAX);
-		if (!common_prefix(xdirname(g_buf), listroot)) {
-			entries = i + 1; // free from the current entry
-			goto malloc_2;
-		}
+	list_free();
 
-		DPRINTF_S(listroot);
+	if (!path) {
+		if (!getcwd(g_listrd.cwd, PATH_MAX))
+			return NULL;
+	} else
+		xstrsncpy(g_listrd.cwd, path, PATH_MAX);
+
+	/* The caller closes fd, reading goes on from a dup */
+	g_listrd.buf = malloc(LIST_CHUNK);
+	g_listrd.fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	g_listrd.head = g_listrd.len = 0;
+	g_listrd.skip = FALSE;
+	if (!g_listrd.buf || g_listrd.fd == -1) {
+		list_stop();
+		return NULL;
 	}
 
-	DPRINTF_S(listroot);
+	do
+		more = list_read(TRUE);
+	while (more && !g_list.npaths);
 
-	if (listroot[0])
-		tmpdir = make_tmp_tree(paths, entries, listroot);
+	if (!more)
+		list_stop();
 
-malloc_2:
-	for (i = 0; i < entries; ++i)
-		free(paths[i]);
-malloc_1:
-	if (msgnum) { /* Check if we are past init stage and show msg */
+	DPRINTF_U(g_list.npaths);
+
+	if (!list_setroot()) {
+		/* Check if we are past init stage and show msg */
 		if (home) {
-			printmsg(messages[msgnum]);
+			printmsg(messages[MSG_0_ENTRIES]);
 			xdelay(XDELAY_INTERVAL_MS << 2);
 		} else {
-			msg(messages[msgnum]);
+			msg(messages[MSG_0_ENTRIES]);
 			usleep(XDELAY_INTERVAL_MS << 2);
 		}
+
+		list_free();
+		return NULL;
 	}
 
-	free(input);
-	free(paths);
-	return tmpdir;
+	DPRINTF_S(listroot);
+	return listroot;
 }
 
 static void check_key_collision(void)
@@ -8621,11 +16501,15 @@ static void usage(void)
 		" -F val  fifo mode [0:preview 1:explore]\n"
 #endif
 		" -g      regex filters\n"
+#ifdef GITSTATUS
+		" -G      git status in detail mode\n"
+#endif
 		" -H      show hidden files\n"
 		" -i      show current file info\n"
 		" -J      no auto-advance on selection\n"
 		" -K      detect key collision and exit\n"
 		" -l val  set scroll lines\n"
+		" -m      show free and used space\n"
 		" -n      type-to-nav mode\n"
 #ifndef NORL
 		" -N      use native prompt\n"
@@ -8756,6 +16640,55 @@ static bool set_tmp_path(void)
 	return TRUE;
 }
 
+/* Compressor for a pick file named *.gz, *.bz2, *.xz or *.zst, NULL if none */
+static char *pickcompressor(const char *path)
+{
+	static char * const exts[][2] = {
+		{".gz", "gzip"}, {".bz2", "bzip2"}, {".xz", "xz"}, {".zst", "zstd"},
+	};
+	size_t len = xstrlen(path), extlen;
+
+	for (size_t i = 0; i < ELEMENTS(exts); ++i) {
+		extlen = xstrlen(exts[i][0]);
+		if (len > extlen && !strcmp(path + len - extlen, exts[i][0]))
+			return exts[i][1];
+	}
+
+	return NULL;
+}
+
+/* Spawns cmd -c writing to fd, returns the write end of its input or -1 */
+static int pickcompress(char *cmd, int fd, pid_t *ppid)
+{
+	char *argv[] = {cmd, "-c", NULL};
+	posix_spawn_file_actions_t actions;
+	int pipefd[2];
+
+	if (pipe(pipefd) == -1)
+		return -1;
+
+	if (posix_spawn_file_actions_init(&actions)) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return -1;
+	}
+
+	posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+	posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+	if (posix_spawnp(ppid, cmd, &actions, NULL, argv, environ))
+		*ppid = -1;
+	posix_spawn_file_actions_destroy(&actions);
+
+	close(pipefd[0]);
+	if (*ppid == -1) {
+		close(pipefd[1]);
+		return -1;
+	}
+
+	return pipefd[1];
+}
+
 static void cleanup(void)
 {
 #ifndef NOX11
@@ -8770,10 +16703,12 @@ static void cleanup(void)
 	free(initpath);
 	free(bmstr);
 	free(pluginstr);
-	free(listroot);
+	list_free();
 	free(ihashbmp);
 	free(bookmark);
 	free(plug);
+	for (uchar_t r = 0; r < nopen_rules; ++r)
+		free(open_rules[r].cmd);
 	if (lastcmdpos != INVALID_POS)
 		for (uchar_t pos = 0; pos <= lastcmdpos; ++pos)
 			free(cmd_hist[pos]);
@@ -8781,8 +16716,22 @@ static void cleanup(void)
 	if (g_state.autofifo)
 		unlink(fifopath);
 #endif
-	if (g_state.pluginit)
+#ifndef NOFOPS
+	fop_cancelall();
+#endif
+	arc_rmtmp();
+	daemon_stop();
+#ifndef NOPREVIEW
+	pv_stop();
+#endif
+#ifdef GITSTATUS
+	git_free();
+#endif
+	if (g_state.pluginit) {
 		unlink(g_pipepath);
+		if (g_replypath[0])
+			unlink(g_replypath);
+	}
 #ifdef DEBUG
 	disabledbg();
 #endif
@@ -8808,7 +16757,7 @@ int main(int argc, char *argv[])
 
 	while ((opt = (env_opts_id > 0
 		       ? env_opts[--env_opts_id]
-		       : getopt(argc, argv, "aAb:BcCdDeEfF:gHiJKl:nNop:P:QrRs:St:T:uUVx0h"))) != -1) {
+		       : getopt(argc, argv, "aAb:BcCdDeEfF:gGHiJKl:mnNop:P:QrRs:St:T:uUVx0h"))) != -1) {
 		switch (opt) {
 #ifndef NOFIFO
 		case 'a':
@@ -8860,6 +16809,11 @@ int main(int argc, char *argv[])
 			cfg.regex = 1;
 			filterfn = &visible_re;
 			break;
+#ifdef GITSTATUS
+		case 'G':
+			cfg.gitstatus = 1;
+			break;
+#endif
 		case 'H':
 			cfg.showhidden = 0;
 			break;
@@ -8876,6 +16830,9 @@ int main(int argc, char *argv[])
 			if (env_opts_id < 0)
 				scroll_lines = atoi(optarg);
 			break;
+		case 'm':
+			g_state.fsinfo = 1;
+			break;
 		case 'n':
 			cfg.filtermode = 1;
 			break;
@@ -8920,6 +16877,7 @@ int main(int argc, char *argv[])
 #ifdef __linux__
 			memcpy(cp, PROGRESS_CP, sizeof PROGRESS_CP);
 			memcpy(mv, PROGRESS_MV, sizeof PROGRESS_MV);
+			g_state.extcpmv = 1;
 #endif
 			break;
 		case 'R':
@@ -8985,14 +16943,21 @@ int main(int argc, char *argv[])
 	if (!set_tmp_path())
 		return EXIT_FAILURE;
 
+#ifdef SPAWNHELPER
+	/* Fork while the process is still small */
+	helper_start();
+#endif
 	atexit(cleanup);
 
 	/* Check if we are in path list mode */
 	if (!isatty(STDIN_FILENO)) {
-		/* This is the same as listpath */
-		initpath = load_input(STDIN_FILENO, NULL);
+		if (!load_input(STDIN_FILENO, NULL))
+			return EXIT_FAILURE;
+
+		initpath = xstrdup(listroot);
 		if (!initpath)
 			return EXIT_FAILURE;
+		cfg.listview = 1;
 
 		/* We return to tty */
 		if (!isatty(STDOUT_FILENO)) {
@@ -9022,6 +16987,7 @@ int main(int argc, char *argv[])
 	/* Get custom opener, if set */
 	opener = xgetenv(env_cfg[NNN_OPENER], utils[UTIL_OPENER]);
 	DPRINTF_S(opener);
+	open_rules_load();
 
 	/* Parse bookmarks string */
 	if (!parsekvpair(&bookmark, &bmstr, NNN_BMS, &maxbm)) {
@@ -9167,6 +17133,10 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 
+		opt = atoi(xgetenv("NNN_FIFO_MS", "0"));
+		fifo_ms = MAX(opt, 0);
+		fifo_seq = atoi(xgetenv("NNN_FIFO_SEQ", "0")) == 1;
+
 		sigaction(SIGPIPE, &(struct sigaction){.sa_handler = SIG_IGN}, NULL);
 	}
 #endif
@@ -9202,6 +17172,13 @@ int main(int argc, char *argv[])
 	} else
 		trashcmd = utils[UTIL_GIO_TRASH];
 
+#ifndef NOFOPS
+	/* Worker threads per copy/remove job */
+	opt = atoi(xgetenv(env_cfg[NNN_WORKERS], "0"));
+	if (opt > 0)
+		fop_nworkers = MIN(opt, FOP_WORKERS_MAX);
+#endif
+
 	/* Ignore/handle certain signals */
 	struct sigaction act = {.sa_handler = sigint_handler};
 
@@ -9278,6 +17255,8 @@ int main(int argc, char *argv[])
 	if (sort)
 		set_sort_flags(sort);
 
+	daemon_init();
+
 	opt = browse(initpath, pkey);
 
 #ifndef NOSSN
@@ -9305,20 +17284,27 @@ int main(int argc, char *argv[])
 #endif
 
 	if (g_state.picker) {
-		if (selbufpos) {
+		if (!selbufempty()) {
 			fd = selpath ? open(selpath, O_WRONLY | O_CREAT | O_TRUNC, 0600) : STDOUT_FILENO;
-			if ((fd == -1) || (seltofile(fd, NULL, sepnul ? "\0" : NEWLINE) != (size_t)(selbufpos)))
+
+			/* Compress huge picks on the way if the file is named so */
+			char *zcmd = (fd > 1) ? pickcompressor(selpath) : NULL;
+			pid_t zpid;
+			int zfd = zcmd ? pickcompress(zcmd, fd, &zpid) : -1;
+
+			if ((fd == -1) || !seltofile((zfd != -1) ? zfd : fd, NULL, sepnul ? "\0" : NEWLINE))
 				xerror();
 
+			if (zfd != -1) {
+				close(zfd);
+				waitpid(zpid, NULL, 0);
+			}
 			if (fd > 1)
 				close(fd);
 		}
 	} else if (selpath)
 		unlink(selpath);
 
-	/* Remove tmp dir in list mode */
-	rmlistpath();
-
 	/* Free the regex */
 #ifdef PCRE2
 	pcre2_code_free(archive_pcre2);
@@ -9328,6 +17314,9 @@ int main(int argc, char *argv[])
 
 	/* Free the selection buffer */
 	free(pselbuf);
+	free(selpaths);
+	free(selrecs);
+	free(seldirs);
 
 #ifdef LINUX_INOTIFY
 	/* Shutdown inotify */
@@ -9343,8 +17332,11 @@ int main(int argc, char *argv[])
 #endif
 
 #ifndef NOFIFO
-	if (!g_state.fifomode)
+	if (!g_state.fifomode) {
 		notify_fifo(FALSE);
+		if (fifo_due >= 0) /* Do not leave the previewer behind */
+			fifo_hover();
+	}
 	if (fifofd != -1)
 		close(fifofd);
 #endif
@@ -84,6 +84,8 @@ enum action {
 	SEL_HIDDEN,
 	SEL_DETAIL,
 	SEL_STATS,
+	SEL_DUSTATS,
+	SEL_JOBS,
 	SEL_CHMODX,
 	SEL_ARCHIVE,
 	SEL_SORT,
@@ -115,6 +117,9 @@ enum action {
 	SEL_SESSIONS,
 	SEL_EXPORT,
 	SEL_TIMETYPE,
+#ifndef NOPREVIEW
+	SEL_PREVIEW,
+#endif
 	SEL_QUITCTX,
 	SEL_QUITCD,
 	SEL_QUIT,
@@ -122,6 +127,7 @@ enum action {
 #ifndef NOMOUSE
 	SEL_CLICK,
 #endif
+	SEL_DAEMON, /* Messages from a plugin daemon, no key */
 };
 
 /* Associate a pressed key to an action */
@@ -196,6 +202,10 @@ static struct key bindings[] = {
 	{ 'd',            SEL_DETAIL },
 	/* File details */
 	{ 'f',            SEL_STATS },
+	/* Disk usage breakdown */
+	{ 'D',            SEL_DUSTATS },
+	/* Background jobs */
+	{ 'i',            SEL_JOBS },
 	/* Toggle executable status */
 	{ '*',            SEL_CHMODX },
 	/* Create archive */
@@ -258,6 +268,10 @@ static struct key bindings[] = {
 	{ '>',            SEL_EXPORT },
 	/* Set time type */
 	{ 'T',            SEL_TIMETYPE },
+#ifndef NOPREVIEW
+	/* Toggle preview pane */
+	{ 'P',            SEL_PREVIEW },
+#endif
 	/* Quit a context */
 	{ 'q',            SEL_QUITCTX },
 	/* Change dir on quit */